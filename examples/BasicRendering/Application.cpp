@@ -2,10 +2,17 @@
 
 #define GLFW_INCLUDE_NONE
 
+#include "Culling.hpp"
+#include "GBuffer.hpp"
+#include "LightBuffer.hpp"
+#include "LightCulling.hpp"
+#include "OcclusionBuffer.hpp"
 #include "RenderContext.hpp"
+#include "RenderQueue.hpp"
 #include "Renderer.hpp"
 #include "ShaderProgram.hpp"
 #include "SpatialComponent.hpp"
+#include "TextureStreamer.hpp"
 
 #include <GLFW/glfw3.h>
 #include <glbinding\gl\gl.h>
@@ -79,26 +86,88 @@ int main(int argc, char** argv) {
 	// Initialize rendering pipeline
 	auto frame_buffer = make_unique<PD::Framebuffer>(INIT_WIDTH, INIT_HEIGHT);
 
-	auto vertex_shader = make_shared<VertexShaderProgram>("sample_vs.glsl");
-	auto ambient_shader =
-	  make_shared<FragmentShaderProgram>("sample_ambient_fs.glsl");
-	auto highlight_shader =
-	  make_shared<FragmentShaderProgram>("sample_highlight_fs.glsl");
-
-	auto ambient_pipeline =
-	  make_unique<PD::ShaderPipeline>(vertex_shader, ambient_shader);
-
-	auto highlight_pipeline =
-	  make_unique<PD::ShaderPipeline>(vertex_shader, highlight_shader);
-
-	auto context = make_unique<PD::RenderContext>(
-	  move(frame_buffer), move(ambient_pipeline), move(highlight_pipeline));
+	// Multi-pass forward shading draws each object once per light. Single
+	// pass shading loops over an object's lights in one draw instead, and
+	// deferred shading draws the geometry once however many lights there
+	// are, at the cost of a G-buffer the size of the screen.
+	enum class shading { multi_pass, single_pass, deferred };
+	const shading path = shading::multi_pass;
+
+	std::unique_ptr<PD::RenderContext> context;
+	if(path == shading::single_pass) {
+		auto lit_pipeline = make_unique<PD::ShaderPipeline>(
+		  make_shared<VertexShaderProgram>("standard-pbr.vert.glsl"),
+		  make_shared<FragmentShaderProgram>("forward-plus.frag.glsl"));
+
+		context = make_unique<PD::RenderContext>(move(frame_buffer),
+		                                         move(lit_pipeline),
+		                                         make_unique<PD::LightBuffer>());
+	} else if(path == shading::deferred) {
+		auto geometry_pipeline = make_unique<PD::ShaderPipeline>(
+		  make_shared<VertexShaderProgram>("standard-pbr.vert.glsl"),
+		  make_shared<FragmentShaderProgram>("deferred-geometry.frag.glsl"));
+		auto lighting_pipeline = make_unique<PD::ShaderPipeline>(
+		  make_shared<VertexShaderProgram>("fullscreen.vert.glsl"),
+		  make_shared<FragmentShaderProgram>("deferred-lighting.frag.glsl"));
+
+		context = make_unique<PD::RenderContext>(
+		  move(frame_buffer),
+		  move(geometry_pipeline),
+		  move(lighting_pipeline),
+		  make_unique<PD::GBuffer>(INIT_WIDTH, INIT_HEIGHT));
+	} else {
+		// Queued draws are instanced, which the engine's vertex shader reads
+		// its transforms for from per-instance attributes
+		auto vertex_shader =
+		  make_shared<VertexShaderProgram>("standard-pbr.vert.glsl");
+		auto ambient_shader =
+		  make_shared<FragmentShaderProgram>("sample_ambient_fs.glsl");
+		auto highlight_shader =
+		  make_shared<FragmentShaderProgram>("sample_highlight_fs.glsl");
+
+		auto ambient_pipeline =
+		  make_unique<PD::ShaderPipeline>(vertex_shader, ambient_shader);
+
+		auto highlight_pipeline =
+		  make_unique<PD::ShaderPipeline>(vertex_shader, highlight_shader);
+
+		context = make_unique<PD::RenderContext>(
+		  move(frame_buffer), move(ambient_pipeline), move(highlight_pipeline));
+
+		// Every light pass shades the whole mesh, so lay down depth first and
+		// only shade what ends up visible. The depth-only shader matches the
+		// invariant position of standard-pbr.vert.glsl, so only pipelines
+		// built on that vertex shader may use it.
+		context->set_depth_prepass(make_unique<PD::ShaderPipeline>(
+		  make_shared<VertexShaderProgram>("depth-only.vert.glsl"),
+		  make_shared<FragmentShaderProgram>("depth-only.frag.glsl")));
+	}
 
-	// Load model assets
-	Geometry         geometry("model.mdl");
-	auto             albedo = PD::load_texture("albedo.dds");
-	const int        id     = 0;
-	SpatialComponent spatial;
+	// Load model assets. The albedo starts out with its mip tail and streams
+	// in finer levels as the model needs them on screen.
+	PD::TextureStreamer textures;
+	Geometry            geometry("model.mdl");
+	auto                albedo = textures.add(PD::decode_texture("albedo.dds"));
+	TransformStore      transforms;
+	SpatialComponent    spatial(transforms);
+	std::size_t         lod = 0;
+
+	// World-space bounds of everything drawn, culled against the view and
+	// then against occluders every frame
+	PD::box_set                bounds;
+	std::vector<std::uint32_t> visible;
+	PD::OcclusionBuffer        occlusion;
+	PD::light_lists            lists;
+	PD::RenderQueue            queue;
+	bounds.resize(1);
+
+	// A floor below the model occludes what sinks through it. The model is no
+	// occluder itself: its own triangles would decide whether it is visible.
+	const std::vector<glm::vec3> floor_vertices = {{-20.0f, -2.0f, -5.0f},
+	                                               {-20.0f, -2.0f, 50.0f},
+	                                               {20.0f, -2.0f, 50.0f},
+	                                               {20.0f, -2.0f, -5.0f}};
+	const std::vector<std::uint32_t> floor_indices = {0, 1, 2, 0, 2, 3};
 
 	// Define scene parameters
 	const double ambience = 1.0;
@@ -129,14 +198,40 @@ int main(int argc, char** argv) {
 
 	while(!glfwWindowShouldClose(window)) {
 		glfwPollEvents();
-		context->draw({albedo.get()},
-		              geometry,
-		              id,
-		              {spatial.matrix(), view, projection},
-		              eye,
-		              ambience,
-		              lights.begin(),
-		              lights.end());
+		textures.update();
+		const auto frustum = PD::frustum::from_matrix(projection * view);
+		bounds.set(0, geometry.meshBounds(), spatial.matrix());
+		visible.clear();
+		bounds.cull(frustum, visible);
+
+		occlusion.begin(projection * view);
+		occlusion.add_occluder(floor_vertices, floor_indices, glm::mat4(1.0f));
+		occlusion.render();
+		std::erase_if(visible, [&](std::uint32_t) {
+			return !occlusion.visible(
+			  PD::world_box(geometry.meshBounds(), spatial.matrix()));
+		});
+
+		// There is only one object so far, so anything visible is it
+		context->begin_frame(lights);
+		queue.begin(view);
+		if(!visible.empty()) {
+			const PD::aabb box =
+			  PD::world_box(geometry.meshBounds(), spatial.matrix());
+			PD::assign_lights(lights, std::span(&box, 1), lists);
+
+			const float radius = geometry.projectedRadius(
+			  view * spatial.matrix(), projection, INIT_HEIGHT);
+			lod = geometry.selectLod(radius, lod);
+			textures.request(*albedo, radius);
+			queue.submit(albedo.get(), geometry, lod, spatial.matrix(), lists.of(0));
+		}
+		queue.sort();
+		context->execute(queue, view, projection, eye, ambience, lights);
+		context->end_frame(lights, view, projection, eye, ambience);
+		const PD::StateCache::statistics& state = context->state_statistics();
+		LOG(verbose) << "GL calls elided: " << state.elided << " of "
+		             << state.issued + state.elided;
 		glfwSwapBuffers(window);
 	}
 
@@ -60,7 +60,9 @@ void main() {
 	vec3 halfVec = normalize(toLight + normalize(eyePos - frag_position));
 	float distanceToLight = abs(distance(lightPos, frag_position));
 	float falloff = 1.0 / (pow(light.radius, 2) * 0.05);
-	float attenuation = 1.0 / (1.0 + falloff * pow(distanceToLight, 2));
+	float window = clamp(1.0 - pow(distanceToLight / light.radius, 4), 0.0, 1.0);
+	float attenuation =
+	  window * window / (1.0 + falloff * pow(distanceToLight, 2));
 
 	// Ambient only
 	if(useAmbient) {
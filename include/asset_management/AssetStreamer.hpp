@@ -0,0 +1,151 @@
+#ifndef PD_ASSETSTREAMER_HPP
+#define PD_ASSETSTREAMER_HPP
+
+#include "Geometry.hpp"
+#include "Renderer.hpp"
+#include "ResourceCache.hpp"
+#include "StagingRing.hpp"
+#include "TextureStreamer.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <globjects/Texture.h>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace PD {
+
+	// Handle to an asset that may still be streaming in. Until the real
+	// resource is resident, get() returns the placeholder it was created with.
+	// Handles are only read and updated on the render thread.
+	template <typename T>
+	class StreamedAsset final {
+		std::shared_ptr<T> m_resource;
+		bool               m_resident;
+
+		friend class AssetStreamer;
+
+		public:
+		StreamedAsset(std::shared_ptr<T> resource, bool resident)
+		  : m_resource(std::move(resource)), m_resident(resident) {}
+
+		const T& get() const { return *m_resource; }
+		bool     resident() const { return m_resident; }
+	};
+
+	// Loads assets in the background. Worker threads read and decode files
+	// into staging memory; pump() then uploads finished assets on the render
+	// thread, no more than a fixed number of bytes per frame, so that actors
+	// entering a scene never stall the frame on disk or driver work.
+	//
+	// Resident assets are kept in per-type ResourceCaches, and requests for an
+	// asset that is already resident or in flight share the same handle.
+	class AssetStreamer final {
+		public:
+		static constexpr std::size_t DEFAULT_UPLOAD_BUDGET = 4 << 20;
+
+		AssetStreamer(std::shared_ptr<Geometry>           placeholder_geometry,
+		              std::shared_ptr<globjects::Texture> placeholder_texture,
+		              std::size_t upload_budget = DEFAULT_UPLOAD_BUDGET,
+		              unsigned    workers       = default_workers());
+		~AssetStreamer();
+
+		AssetStreamer(const AssetStreamer&)            = delete;
+		AssetStreamer& operator=(const AssetStreamer&) = delete;
+
+		// For a file not yet resident, the vertex format applies to version 1
+		// files as in the Geometry constructor.
+		std::shared_ptr<StreamedAsset<Geometry>> request_geometry(
+		  const std::string& name,
+		  PMDL::VertexFormat format = PMDL::VertexFormat::Float32);
+		std::shared_ptr<StreamedAsset<globjects::Texture>>
+		request_texture(const std::string& name);
+
+		// Uploads staged assets until this frame's budget is spent. At least one
+		// asset is uploaded per call, so assets larger than the budget still get
+		// through. Call once per frame on the render thread.
+		void pump();
+
+		// Number of requested assets that are not resident yet
+		std::size_t pending() const;
+
+		void set_upload_budget(std::size_t bytes);
+
+		// Geometry uploaded from now on is suballocated from arena, which must
+		// outlive every mesh placed in it. Null gives each mesh its own buffers.
+		void set_geometry_arena(GeometryArena* arena);
+
+		// Textures uploaded from now on start with their mip tail and have
+		// their finer levels streamed by streamer, which must outlive them.
+		// Null uploads every level at once.
+		void set_texture_streamer(TextureStreamer* streamer);
+
+		// Assets requested from now on are staged in ring by the worker that
+		// decodes them, so uploading them only issues copies on the GPU. The
+		// ring must outlive their uploads. Assets larger than the ring, and
+		// every asset with a null ring, upload from client memory, as do
+		// textures while a texture streamer specifies their levels.
+		void set_staging_ring(StagingRing* ring);
+
+		ResourceCache<Geometry>&           geometry_cache();
+		ResourceCache<globjects::Texture>& texture_cache();
+
+		static unsigned default_workers();
+
+		private:
+		// A decoded asset waiting for the render thread
+		struct staged {
+			std::size_t           bytes;
+			std::function<void()> upload;
+		};
+
+		template <typename T>
+		using handle_map =
+		  std::unordered_map<std::string, std::weak_ptr<StreamedAsset<T>>>;
+
+		std::shared_ptr<Geometry>           m_placeholder_geometry;
+		std::shared_ptr<globjects::Texture> m_placeholder_texture;
+		std::size_t                         m_upload_budget;
+		std::size_t                         m_pending;
+		GeometryArena*                      m_geometry_arena;
+		TextureStreamer*                    m_texture_streamer;
+		StagingRing*                        m_staging_ring;
+
+		ResourceCache<Geometry>           m_geometry_cache;
+		ResourceCache<globjects::Texture> m_texture_cache;
+		handle_map<Geometry>              m_geometry_handles;
+		handle_map<globjects::Texture>    m_texture_handles;
+
+		std::mutex                                         m_jobs_mutex;
+		std::condition_variable_any                        m_jobs_available;
+		std::deque<std::function<staged(std::stop_token)>> m_jobs;
+
+		std::mutex         m_staged_mutex;
+		std::deque<staged> m_staged;
+
+		std::vector<std::jthread> m_workers;
+
+		// The worker stages the decoded asset in ring unless it is null
+		template <typename T, typename Decode, typename Upload>
+		std::shared_ptr<StreamedAsset<T>>
+		request(handle_map<T>&            handles,
+		        ResourceCache<T>&         cache,
+		        const std::shared_ptr<T>& placeholder,
+		        const std::string&        name,
+		        Decode                    decode,
+		        Upload                    upload,
+		        StagingRing*              ring);
+
+		void work(std::stop_token stop);
+	};
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef PD_CONCURRENTRESOURCECACHE_HPP
+#define PD_CONCURRENTRESOURCECACHE_HPP
+
+#include "ResourceCache.hpp"
+
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace PD {
+
+	// Thread-safe ResourceCache for use from loader threads. Keys are spread
+	// over independently locked shards, so lookups only ever wait on requests
+	// that hash to the same shard, and only for the length of a map lookup.
+	//
+	// get_or_load() deduplicates loads: the first caller for a missing key
+	// runs the loader on its own thread, and everyone asking for the same key
+	// in the meantime receives the same future. A failed load is reported
+	// through that future and is not cached, so the next request retries.
+	//
+	// The byte budget holds for the cache as a whole. Going over it evicts
+	// unreferenced entries round the shards, the least recently used of each
+	// shard first, so one asset may take up most of the budget.
+	template <typename T, typename Size = ResourceSize<T>>
+	class ConcurrentResourceCache {
+		public:
+		using future = std::shared_future<std::shared_ptr<T>>;
+
+		private:
+		struct Shard {
+			std::mutex                              mutex;
+			ResourceCache<T, Size>                  cache;
+			std::unordered_map<std::string, future> loading;
+			std::size_t                             joined = 0;
+			std::size_t                             loads  = 0;
+		};
+
+		std::vector<Shard>       m_shards;
+		std::atomic<std::size_t> m_budget;
+		std::atomic<std::size_t> m_bytes; // Over all shards
+
+		Shard& shard(const std::string& key);
+
+		// Puts resource into target, whose mutex must be held
+		void insert(Shard&             target,
+		            const std::string& key,
+		            std::shared_ptr<T> resource);
+
+		// Evicts until the cache fits its budget. Must be called with no shard
+		// locked.
+		void enforce_budget();
+
+		public:
+		explicit ConcurrentResourceCache(
+		  std::size_t budget = std::numeric_limits<std::size_t>::max(),
+		  std::size_t shards = 16);
+
+		// Returns the cached resource, or nullptr if it is absent or still
+		// loading. Never waits for a load.
+		std::shared_ptr<T> get(const std::string& key);
+
+		template <typename Loader>
+		  requires std::convertible_to<std::invoke_result_t<Loader>,
+		                               std::shared_ptr<T>>
+		future get_or_load(const std::string& key, Loader&& loader);
+
+		void put(const std::string& key, std::shared_ptr<T> resource);
+
+		void set_budget(std::size_t budget);
+
+		// Evicts entries whose last outside reference has gone since they
+		// were put, until the cache fits its budget again
+		void trim();
+
+		std::size_t bytes() const;
+
+		// Hits include requests that joined a load already in flight; misses
+		// are the loads actually started.
+		ResourceCacheStatistics statistics();
+	};
+
+	template <typename T, typename Size>
+	ConcurrentResourceCache<T, Size>::ConcurrentResourceCache(std::size_t budget,
+	                                                          std::size_t shards)
+	  : m_shards(shards)
+	  , m_budget(budget)
+	  , m_bytes(0) {
+		if(shards == 0) {
+			throw std::runtime_error("resource cache needs at least one shard");
+		}
+	}
+
+	template <typename T, typename Size>
+	typename ConcurrentResourceCache<T, Size>::Shard&
+	ConcurrentResourceCache<T, Size>::shard(const std::string& key) {
+		return m_shards[std::hash<std::string>{}(key) % m_shards.size()];
+	}
+
+	template <typename T, typename Size>
+	void ConcurrentResourceCache<T, Size>::insert(Shard&             target,
+	                                              const std::string& key,
+	                                              std::shared_ptr<T> resource) {
+		// Shards never evict on their own, so only the entry put changes
+		const std::size_t before = target.cache.bytes();
+		target.cache.put(key, std::move(resource));
+		m_bytes += target.cache.bytes();
+		m_bytes -= before;
+	}
+
+	template <typename T, typename Size>
+	void ConcurrentResourceCache<T, Size>::enforce_budget() {
+		bool evicted = true;
+		while(evicted && m_bytes > m_budget) {
+			evicted = false;
+			for(Shard& target: m_shards) {
+				if(m_bytes <= m_budget) { return; }
+				const std::scoped_lock lock(target.mutex);
+				const std::size_t      before = target.cache.bytes();
+				if(target.cache.evictOldest()) {
+					m_bytes -= before - target.cache.bytes();
+					evicted = true;
+				}
+			}
+		}
+	}
+
+	template <typename T, typename Size>
+	std::shared_ptr<T> ConcurrentResourceCache<T, Size>::get(
+	  const std::string& key) {
+		Shard&                 target = shard(key);
+		const std::scoped_lock lock(target.mutex);
+		return target.cache.get(key);
+	}
+
+	template <typename T, typename Size>
+	template <typename Loader>
+	  requires std::convertible_to<std::invoke_result_t<Loader>,
+	                               std::shared_ptr<T>>
+	typename ConcurrentResourceCache<T, Size>::future
+	ConcurrentResourceCache<T, Size>::get_or_load(const std::string& key,
+	                                              Loader&&           loader) {
+		Shard&                           target = shard(key);
+		std::promise<std::shared_ptr<T>> promise;
+		future                           result;
+		{
+			const std::scoped_lock lock(target.mutex);
+			if(std::shared_ptr<T> resource = target.cache.get(key)) {
+				promise.set_value(std::move(resource));
+				return promise.get_future().share();
+			}
+
+			const auto in_flight = target.loading.find(key);
+			if(in_flight != target.loading.end()) {
+				++target.joined;
+				return in_flight->second;
+			}
+
+			++target.loads;
+			result = promise.get_future().share();
+			target.loading.emplace(key, result);
+		}
+
+		// The load runs unlocked; other keys in this shard stay available
+		try {
+			std::shared_ptr<T> resource = std::invoke(std::forward<Loader>(loader));
+			if(!resource) { throw std::runtime_error("failed to load " + key); }
+			{
+				// Publish to the cache before retiring the in-flight entry, so
+				// there is no window in which a second load could start
+				const std::scoped_lock lock(target.mutex);
+				insert(target, key, resource);
+				target.loading.erase(key);
+			}
+			enforce_budget();
+			promise.set_value(std::move(resource));
+		} catch(...) {
+			{
+				const std::scoped_lock lock(target.mutex);
+				target.loading.erase(key);
+			}
+			promise.set_exception(std::current_exception());
+		}
+		return result;
+	}
+
+	template <typename T, typename Size>
+	void ConcurrentResourceCache<T, Size>::put(const std::string& key,
+	                                           std::shared_ptr<T> resource) {
+		Shard& target = shard(key);
+		{
+			const std::scoped_lock lock(target.mutex);
+			insert(target, key, std::move(resource));
+		}
+		enforce_budget();
+	}
+
+	template <typename T, typename Size>
+	void ConcurrentResourceCache<T, Size>::set_budget(std::size_t budget) {
+		m_budget = budget;
+		enforce_budget();
+	}
+
+	template <typename T, typename Size>
+	void ConcurrentResourceCache<T, Size>::trim() {
+		enforce_budget();
+	}
+
+	template <typename T, typename Size>
+	std::size_t ConcurrentResourceCache<T, Size>::bytes() const {
+		return m_bytes;
+	}
+
+	template <typename T, typename Size>
+	ResourceCacheStatistics ConcurrentResourceCache<T, Size>::statistics() {
+		ResourceCacheStatistics total;
+		for(Shard& target: m_shards) {
+			const std::scoped_lock         lock(target.mutex);
+			const ResourceCacheStatistics& shard_statistics =
+			  target.cache.statistics();
+			total.hits += shard_statistics.hits + target.joined;
+			total.misses += target.loads;
+			total.evictions += shard_statistics.evictions;
+		}
+		return total;
+	}
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PD_MAPPEDFILE_HPP
+#define PD_MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <span>
+#include <string>
+
+namespace PD {
+
+	// MappedFile maps a whole file read-only into the address space for as long
+	// as the object lives. Pages are brought in by the OS on first touch, so
+	// handing bytes() to the driver does not require an intermediate copy.
+	class MappedFile final {
+		const std::byte* m_data;
+		std::size_t      m_size;
+#ifdef _WIN32
+		void* m_file;
+		void* m_mapping;
+#else
+		int m_descriptor;
+#endif
+
+		public:
+		explicit MappedFile(const std::string& filename);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		std::span<const std::byte> bytes() const { return {m_data, m_size}; }
+
+		// Faults every page in on the calling thread, so that a later reader,
+		// such as the driver on the render thread, does not stall on disk I/O
+		void prefetch() const;
+		void prefetch(std::span<const std::byte> range) const;
+
+		// Asks the OS to start reading range in, without waiting for it
+		void readAhead(std::span<const std::byte> range) const;
+
+		// Lets the OS drop the pages lying wholly inside range. They are read
+		// back from the file if touched again.
+		void discard(std::span<const std::byte> range) const;
+	};
+
+} // namespace PD
+
+#endif
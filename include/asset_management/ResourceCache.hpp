@@ -1,44 +1,220 @@
 #ifndef PD_RESOURCECACHE_HPP
 #define PD_RESOURCECACHE_HPP
 
-#include <chrono>
+#include <cstddef>
+#include <limits>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 
+// Number of bytes a cached resource accounts for against its cache's budget.
+// Types with a gpuBytes() member report that; anything else counts as its
+// object size. Specialize for types that cannot carry the member themselves.
 template <typename T>
+struct ResourceSize {
+	std::size_t operator()(const T& resource) const {
+		if constexpr(requires { resource.gpuBytes(); }) {
+			return static_cast<std::size_t>(resource.gpuBytes());
+		} else {
+			return sizeof(T);
+		}
+	}
+};
+
+struct ResourceCacheStatistics {
+	std::size_t hits      = 0;
+	std::size_t misses    = 0;
+	std::size_t evictions = 0;
+};
+
+// Byte-budgeted cache with least recently used eviction. Entries form an
+// intrusive list ordered by last access, most recent first, so get() and
+// put() are O(1) apart from the eviction they may trigger.
+//
+// An entry whose resource is still referenced outside the cache is never
+// evicted; the cache may then stay over budget until those references are
+// dropped and trim() runs again.
+template <typename T, typename Size = ResourceSize<T>>
 class ResourceCache {
 	struct CacheEntry {
-		std::shared_ptr<T>                                 resource;
-		std::chrono::time_point<std::chrono::system_clock> accessed;
+		std::shared_ptr<T> resource;
+		std::size_t        bytes;
+		const std::string* key;
+		CacheEntry*        newer;
+		CacheEntry*        older;
 	};
 
 	private:
+	// Node-based, so entry addresses survive rehashing
 	std::unordered_map<std::string, CacheEntry> m_map;
+	CacheEntry*                                 m_newest;
+	CacheEntry*                                 m_oldest;
+	std::size_t                                 m_budget;
+	std::size_t                                 m_bytes;
+	ResourceCacheStatistics                     m_statistics;
 
-	void removeExpiredEntries();
+	void link(CacheEntry& entry);
+	void unlink(CacheEntry& entry);
+	void touch(CacheEntry& entry);
 
 	public:
 	// TODO: Construct with default/placeholder resource
+	explicit ResourceCache(
+	  std::size_t budget = std::numeric_limits<std::size_t>::max());
+	ResourceCache(const ResourceCache&)            = delete;
+	ResourceCache& operator=(const ResourceCache&) = delete;
+
 	std::shared_ptr<T> get(const std::string& key);
 	void               put(const std::string& key, std::shared_ptr<T> resource);
+
+	// Evicts unreferenced entries, least recently used first, until the cache
+	// fits its budget again. put() calls this itself; call it periodically as
+	// well to reclaim entries whose last outside reference has since gone.
+	void trim();
+
+	// Evicts the least recently used entry not referenced outside the cache,
+	// whatever the budget. False if every entry is still referenced.
+	bool evictOldest();
+
+	void        setBudget(std::size_t budget);
+	std::size_t budget() const;
+	std::size_t bytes() const;
+	std::size_t size() const;
+
+	const ResourceCacheStatistics& statistics() const;
 };
 
-template <typename T>
-void ResourceCache<T>::removeExpiredEntries() {}
+template <typename T, typename Size>
+ResourceCache<T, Size>::ResourceCache(std::size_t budget)
+  : m_map()
+  , m_newest(nullptr)
+  , m_oldest(nullptr)
+  , m_budget(budget)
+  , m_bytes(0)
+  , m_statistics() {}
 
-template <typename T>
-std::shared_ptr<T> ResourceCache<T>::get(const std::string& key) {
+template <typename T, typename Size>
+void ResourceCache<T, Size>::link(CacheEntry& entry) {
+	entry.newer = nullptr;
+	entry.older = m_newest;
+	if(m_newest) { m_newest->newer = &entry; }
+	m_newest = &entry;
+	if(!m_oldest) { m_oldest = &entry; }
+}
+
+template <typename T, typename Size>
+void ResourceCache<T, Size>::unlink(CacheEntry& entry) {
+	if(entry.newer) {
+		entry.newer->older = entry.older;
+	} else {
+		m_newest = entry.older;
+	}
+	if(entry.older) {
+		entry.older->newer = entry.newer;
+	} else {
+		m_oldest = entry.newer;
+	}
+}
+
+template <typename T, typename Size>
+void ResourceCache<T, Size>::touch(CacheEntry& entry) {
+	if(m_newest == &entry) { return; }
+	unlink(entry);
+	link(entry);
+}
+
+template <typename T, typename Size>
+std::shared_ptr<T> ResourceCache<T, Size>::get(const std::string& key) {
 	auto it = m_map.find(key);
-	if(it != m_map.end()) { return it->second.resource; }
-	return nullptr;
+	if(it == m_map.end()) {
+		++m_statistics.misses;
+		return nullptr;
+	}
+
+	++m_statistics.hits;
+	touch(it->second);
+	return it->second.resource;
 }
 
-template <typename T>
-void ResourceCache<T>::put(const std::string& key,
-                           std::shared_ptr<T> resource) {
-	CacheEntry entry{resource, std::chrono::system_clock::now()};
-	m_map.insert({key, entry});
+template <typename T, typename Size>
+void ResourceCache<T, Size>::put(const std::string& key,
+                                 std::shared_ptr<T> resource) {
+	if(!resource) {
+		throw std::runtime_error("cannot cache null resource " + key);
+	}
+
+	const std::size_t bytes = Size{}(*resource);
+
+	auto [it, inserted] = m_map.try_emplace(key);
+	CacheEntry& entry   = it->second;
+	if(inserted) {
+		entry.key = &it->first;
+		link(entry);
+	} else {
+		m_bytes -= entry.bytes;
+		touch(entry);
+	}
+	entry.resource = std::move(resource);
+	entry.bytes    = bytes;
+	m_bytes += bytes;
+
+	trim();
+}
+
+template <typename T, typename Size>
+void ResourceCache<T, Size>::trim() {
+	CacheEntry* entry = m_oldest;
+	while(m_bytes > m_budget && entry) {
+		CacheEntry* newer = entry->newer;
+		if(entry->resource.use_count() == 1) {
+			unlink(*entry);
+			m_bytes -= entry->bytes;
+			++m_statistics.evictions;
+			m_map.erase(m_map.find(*entry->key));
+		}
+		entry = newer;
+	}
+}
+
+template <typename T, typename Size>
+bool ResourceCache<T, Size>::evictOldest() {
+	for(CacheEntry* entry = m_oldest; entry; entry = entry->newer) {
+		if(entry->resource.use_count() == 1) {
+			unlink(*entry);
+			m_bytes -= entry->bytes;
+			++m_statistics.evictions;
+			m_map.erase(m_map.find(*entry->key));
+			return true;
+		}
+	}
+	return false;
+}
+
+template <typename T, typename Size>
+void ResourceCache<T, Size>::setBudget(std::size_t budget) {
+	m_budget = budget;
+	trim();
+}
+
+template <typename T, typename Size>
+std::size_t ResourceCache<T, Size>::budget() const {
+	return m_budget;
+}
+
+template <typename T, typename Size>
+std::size_t ResourceCache<T, Size>::bytes() const {
+	return m_bytes;
+}
+
+template <typename T, typename Size>
+std::size_t ResourceCache<T, Size>::size() const {
+	return m_map.size();
+}
+
+template <typename T, typename Size>
+const ResourceCacheStatistics& ResourceCache<T, Size>::statistics() const {
+	return m_statistics;
 }
 
 #endif
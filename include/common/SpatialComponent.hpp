@@ -1,21 +1,31 @@
 #ifndef PD_SPATIALCOMPONENT_HPP
 #define PD_SPATIALCOMPONENT_HPP
 
+#include "TransformStore.hpp"
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+// Handle to an entity in a TransformStore. The entity is created with the
+// handle and destroyed with it; the store must outlive all of its handles.
 class SpatialComponent final {
 	private:
-	glm::quat m_orientation;
-	glm::vec4 m_position;
+	TransformStore*    m_store;
+	TransformStore::Id m_id;
 
 	public:
 	static const glm::vec4 canonicalForward;
 	static const glm::vec4 canonicalUp;
 	static const glm::vec4 canonicalLeft;
 
-	SpatialComponent();
+	explicit SpatialComponent(TransformStore& store);
+	~SpatialComponent();
+
+	SpatialComponent(SpatialComponent&& other) noexcept;
+	SpatialComponent& operator=(SpatialComponent&& other) noexcept;
+	SpatialComponent(const SpatialComponent&)            = delete;
+	SpatialComponent& operator=(const SpatialComponent&) = delete;
 
 	void translate(float longitude, float latitude, float altitude);
 	void rotate(float roll, float pitch, float yaw);
@@ -23,9 +33,16 @@ class SpatialComponent final {
 	void setOrientation(float deg, float x, float y, float z);
 	void setPosition(float x, float y, float z);
 
-	const glm::vec4& position() const;
-	const glm::quat& orientation() const;
-	const glm::mat4  matrix() const;
+	// Position and orientation become relative to the parent, which must
+	// belong to the same store. Throws if the parent is a descendant.
+	void attachTo(const SpatialComponent& parent);
+	void detach();
+
+	const glm::vec4 position() const;
+	const glm::quat orientation() const;
+	const glm::mat4 matrix() const;
+
+	TransformStore::Id id() const;
 };
 
 #endif
@@ -0,0 +1,103 @@
+#ifndef PD_TRANSFORMSTORE_HPP
+#define PD_TRANSFORMSTORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <limits>
+#include <span>
+#include <vector>
+
+namespace PD {
+	class JobSystem;
+}
+
+// Positions and orientations of every spatial entity, stored as one array per
+// component so that local matrices can be computed four entities at a time.
+// Entities may have a parent, in whose space their position and orientation
+// are given. Ids stay valid while other entities are destroyed.
+//
+// Every entity links to its first child and its siblings, so structural
+// changes only touch the entities involved. The arrays are kept in
+// breadth-first order of the hierarchy, every parent ahead of its children
+// and the children of an entity next to each other; changes may leave
+// entities out of place, and update() sorts the arrays again once enough of
+// them are. Each update recomputes only entities that changed and the
+// subtrees below them, so the cost of a frame follows what moved rather than
+// the scene size.
+class TransformStore final {
+	public:
+	using Id = std::uint32_t;
+
+	static constexpr Id NONE = std::numeric_limits<Id>::max();
+
+	private:
+	std::vector<float> m_positionX;
+	std::vector<float> m_positionY;
+	std::vector<float> m_positionZ;
+	std::vector<float> m_orientationX;
+	std::vector<float> m_orientationY;
+	std::vector<float> m_orientationZ;
+	std::vector<float> m_orientationW;
+
+	std::vector<glm::mat4>     m_locals;
+	std::vector<glm::mat4>     m_worlds;
+	std::vector<std::uint32_t> m_parents; // Dense index, or NONE for roots
+	std::vector<std::uint32_t> m_firstChildren; // Dense index, or NONE
+	std::vector<std::uint32_t> m_nextSiblings;
+	std::vector<std::uint32_t> m_previousSiblings;
+	std::vector<std::uint8_t>  m_dirty;
+	std::vector<Id>            m_dirtyIds;
+	std::size_t                m_outOfOrder; // Moves since the last sort
+
+	std::vector<std::uint32_t> m_denseToId;
+	std::vector<std::uint32_t> m_idToDense;
+	std::vector<Id>            m_freeIds;
+	std::size_t                m_size;
+
+	void resize(std::size_t size);
+	void markDirty(std::size_t index);
+	void link(std::uint32_t index, std::uint32_t parentIndex);
+	void unlink(std::uint32_t index);
+	void restoreOrder();
+	void computeLocals(std::size_t first, std::size_t last);
+	void propagate(std::span<const std::uint32_t> dirty);
+
+	std::vector<std::uint32_t> collectDirty();
+
+	public:
+	TransformStore();
+
+	Id   create();
+	void destroy(Id id); // Children of a destroyed entity become roots
+
+	glm::vec3 position(Id id) const;
+	glm::quat orientation(Id id) const;
+	Id        parent(Id id) const;
+	void      setPosition(Id id, const glm::vec3& position);
+	void      setOrientation(Id id, const glm::quat& orientation);
+
+	// Makes id a child of parent, or a root if parent is NONE. Position and
+	// orientation are then relative to the parent. Throws on cycles.
+	void setParent(Id id, Id parent);
+
+	// Current world matrix of a single entity, computed on demand from its
+	// ancestors if any of them changed since the last update()
+	glm::mat4 matrix(Id id) const;
+
+	// Brings all world matrices up to date
+	void update();
+	void update(PD::JobSystem& jobs);
+
+	std::size_t size() const;
+
+	// Position of an entity in the dense arrays. Changes when the hierarchy
+	// changes.
+	std::size_t indexOf(Id id) const;
+
+	// World matrices in dense order, valid after update()
+	std::span<const glm::mat4> matrices() const;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef PD_SIMD_HPP
+#define PD_SIMD_HPP
+
+// Four-wide float vectors for the engine's batch kernels. SSE is used where
+// the target guarantees it (every x86-64 build); elsewhere the same code runs
+// on a plain array, which compilers still auto-vectorize reasonably well.
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PD_SIMD_SSE 1
+#include <xmmintrin.h>
+#else
+#define PD_SIMD_SSE 0
+#include <bit>
+#include <cstdint>
+#endif
+
+namespace PD::simd {
+
+	constexpr int WIDTH = 4;
+
+#if PD_SIMD_SSE
+
+	struct float4 {
+		__m128 v;
+	};
+
+	inline float4 load(const float* p) { return {_mm_loadu_ps(p)}; }
+	inline void   store(float* p, float4 a) { _mm_storeu_ps(p, a.v); }
+	inline float4 broadcast(float s) { return {_mm_set1_ps(s)}; }
+
+	inline float4 operator+(float4 a, float4 b) { return {_mm_add_ps(a.v, b.v)}; }
+	inline float4 operator-(float4 a, float4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+	inline float4 operator*(float4 a, float4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+
+	// Comparisons give all bits set in lanes where they hold, which can be
+	// combined with | and read back one bit per lane with movemask
+	inline float4 less(float4 a, float4 b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+	inline float4 operator|(float4 a, float4 b) { return {_mm_or_ps(a.v, b.v)}; }
+	inline int    movemask(float4 a) { return _mm_movemask_ps(a.v); }
+
+	inline float4 min(float4 a, float4 b) { return {_mm_min_ps(a.v, b.v)}; }
+	inline float4 max(float4 a, float4 b) { return {_mm_max_ps(a.v, b.v)}; }
+
+	// Lanes of a where mask is set, of b elsewhere
+	inline float4 select(float4 mask, float4 a, float4 b) {
+		return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+	}
+
+	// Rows become columns: afterwards a holds the first element of each input
+	inline void transpose(float4& a, float4& b, float4& c, float4& d) {
+		const __m128 ab_low  = _mm_unpacklo_ps(a.v, b.v);
+		const __m128 cd_low  = _mm_unpacklo_ps(c.v, d.v);
+		const __m128 ab_high = _mm_unpackhi_ps(a.v, b.v);
+		const __m128 cd_high = _mm_unpackhi_ps(c.v, d.v);
+		a.v                  = _mm_movelh_ps(ab_low, cd_low);
+		b.v                  = _mm_movehl_ps(cd_low, ab_low);
+		c.v                  = _mm_movelh_ps(ab_high, cd_high);
+		d.v                  = _mm_movehl_ps(cd_high, ab_high);
+	}
+
+#else
+
+	struct float4 {
+		float v[WIDTH];
+	};
+
+	inline float4 load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+
+	inline void store(float* p, float4 a) {
+		for(int i = 0; i < WIDTH; ++i) { p[i] = a.v[i]; }
+	}
+
+	inline float4 broadcast(float s) { return {{s, s, s, s}}; }
+
+	inline float4 operator+(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) { a.v[i] += b.v[i]; }
+		return a;
+	}
+
+	inline float4 operator-(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) { a.v[i] -= b.v[i]; }
+		return a;
+	}
+
+	inline float4 operator*(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) { a.v[i] *= b.v[i]; }
+		return a;
+	}
+
+	inline float4 less(float4 a, float4 b) {
+		const float set = std::bit_cast<float>(~std::uint32_t(0));
+		for(int i = 0; i < WIDTH; ++i) { a.v[i] = a.v[i] < b.v[i] ? set : 0.0f; }
+		return a;
+	}
+
+	inline float4 operator|(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) {
+			a.v[i] = std::bit_cast<float>(std::bit_cast<std::uint32_t>(a.v[i]) |
+			                              std::bit_cast<std::uint32_t>(b.v[i]));
+		}
+		return a;
+	}
+
+	inline int movemask(float4 a) {
+		int mask = 0;
+		for(int i = 0; i < WIDTH; ++i) {
+			mask |= static_cast<int>(std::bit_cast<std::uint32_t>(a.v[i]) >> 31) << i;
+		}
+		return mask;
+	}
+
+	inline float4 min(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) {
+			a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+		}
+		return a;
+	}
+
+	inline float4 max(float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) {
+			a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+		}
+		return a;
+	}
+
+	inline float4 select(float4 mask, float4 a, float4 b) {
+		for(int i = 0; i < WIDTH; ++i) {
+			a.v[i] = std::bit_cast<std::uint32_t>(mask.v[i]) ? a.v[i] : b.v[i];
+		}
+		return a;
+	}
+
+	inline void transpose(float4& a, float4& b, float4& c, float4& d) {
+		float4* rows[WIDTH] = {&a, &b, &c, &d};
+		for(int i = 0; i < WIDTH; ++i) {
+			for(int j = i + 1; j < WIDTH; ++j) {
+				const float swapped = rows[i]->v[j];
+				rows[i]->v[j]       = rows[j]->v[i];
+				rows[j]->v[i]       = swapped;
+			}
+		}
+	}
+
+#endif
+
+} // namespace PD::simd
+
+#endif
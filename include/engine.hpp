@@ -0,0 +1,44 @@
+#ifndef PD_ENGINE_HPP
+#define PD_ENGINE_HPP
+
+#include "job_system.hpp"
+#include "subsystem.hpp"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace PD {
+
+	// Owns the job system and the subsystems, and runs their frame tasks.
+	class Engine final {
+		JobSystem                               m_jobs;
+		FrameGraph                              m_graph;
+		std::vector<std::unique_ptr<Subsystem>> m_subsystems;
+
+		public:
+		explicit Engine(unsigned workers = JobSystem::default_workers());
+
+		// Constructs a subsystem in place and adds its tasks to the frame graph
+		template <typename T, typename... Args>
+		T& add(Args&&... args);
+
+		// Runs one frame's worth of subsystem tasks and returns once all of
+		// them have finished
+		void update(double delta);
+
+		JobSystem& jobs();
+	};
+
+	template <typename T, typename... Args>
+	T& Engine::add(Args&&... args) {
+		auto subsystem = std::make_unique<T>(std::forward<Args>(args)...);
+		T&   added     = *subsystem;
+		added.schedule(m_graph);
+		m_subsystems.push_back(std::move(subsystem));
+		return added;
+	}
+
+} // namespace PD
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "RenderComponent.hpp"
 #include "SpatialComponent.hpp"
+#include "TransformStore.hpp"
 
 #include <memory>
 #include <string>
@@ -12,11 +13,11 @@ class Event;
 class Actor final {
 	const std::string ACTOR_DIR = "Actors/";
 
-	std::unique_ptr<RenderComponent>  m_renderComponent;
-	std::unique_ptr<SpatialComponent> m_spatialComponent;
+	std::unique_ptr<RenderComponent> m_renderComponent;
+	SpatialComponent                 m_spatialComponent;
 
 	public:
-	explicit Actor(const std::string& name);
+	Actor(const std::string& name, TransformStore& transforms);
 	Event onNotify(const Actor& source, Event event);
 };
 
@@ -0,0 +1,107 @@
+#ifndef PD_DYNAMICBVH_HPP
+#define PD_DYNAMICBVH_HPP
+
+#include "Culling.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <glm/glm.hpp>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace PD {
+
+	struct ray {
+		glm::vec3 origin;
+		glm::vec3 direction; // Need not be normalized; distances scale with it
+	};
+
+	struct ray_hit {
+		std::uint32_t user;
+		float         distance; // In multiples of the ray direction
+	};
+
+	// Bounding volume hierarchy over objects that move, such as the actors of
+	// a scene. Each object is a leaf whose box is fattened by a margin, so an
+	// object moving within its fat box costs nothing; one leaving it is taken
+	// out and reinserted, which refits only the boxes on its path to the root.
+	// Insertion picks the sibling with the least added surface area, and
+	// rotations on the way back up keep the tree balanced, so queries stay
+	// logarithmic however objects are added and moved.
+	//
+	// Queries test the fat boxes on the way down and the exact boxes at the
+	// leaves. user is whatever the owner wants reported back, e.g. an index.
+	class DynamicBvh final {
+		public:
+		using proxy = std::uint32_t;
+
+		static constexpr proxy NONE = std::numeric_limits<proxy>::max();
+
+		explicit DynamicBvh(float margin = 0.1f);
+
+		proxy insert(const aabb& box, std::uint32_t user);
+		void  remove(proxy leaf);
+
+		// Updates the box of a leaf. The fat box is additionally stretched
+		// along displacement, the expected movement until the next update, so
+		// objects moving steadily are reinserted less often. Returns whether
+		// the leaf had to be reinserted.
+		bool move(proxy            leaf,
+		          const aabb&      box,
+		          const glm::vec3& displacement = glm::vec3(0.0f));
+
+		std::uint32_t user(proxy leaf) const;
+		const aabb&   box(proxy leaf) const;
+
+		// Appends the users of leaves at least partly inside the frustum.
+		// Subtrees entirely inside are reported without testing their leaves.
+		void query(const frustum& frustum, std::vector<std::uint32_t>& found) const;
+
+		// Appends the users of leaves overlapping the sphere
+		void query(const glm::vec3&            center,
+		           float                       radius,
+		           std::vector<std::uint32_t>& found) const;
+
+		// Nearest leaf the ray hits within max_distance. Without exact, the
+		// leaf's box is the hit; otherwise exact is asked for the distance to
+		// the object itself once its box is hit, and returns nothing on a miss.
+		using exact_test = std::function<std::optional<float>(std::uint32_t user)>;
+		std::optional<ray_hit>
+		raycast(const ray&        ray,
+		        float             max_distance = std::numeric_limits<float>::max(),
+		        const exact_test& exact        = nullptr) const;
+
+		std::size_t size() const;
+		int         height() const; // Of the root; 0 for a single leaf
+
+		private:
+		struct node {
+			aabb          box;   // Fattened for leaves, the union for branches
+			aabb          exact; // Leaves only
+			proxy         parent; // Or the next free node
+			proxy         children[2];
+			int           height; // -1 for free nodes
+			std::uint32_t user;
+
+			bool leaf() const { return children[0] == NONE; }
+		};
+
+		std::vector<node> m_nodes{};
+		proxy             m_root = NONE;
+		proxy             m_free = NONE;
+		std::size_t       m_size = 0;
+		float             m_margin;
+
+		proxy allocate();
+		void  release(proxy index);
+		void  insert_leaf(proxy leaf);
+		void  remove_leaf(proxy leaf);
+		proxy balance(proxy index);
+		void  refit(proxy index); // Walks up from index to the root
+	};
+
+} // namespace PD
+
+#endif
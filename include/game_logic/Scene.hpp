@@ -2,6 +2,7 @@
 #define PD_SCENE_HPP
 
 #include "Actor.hpp"
+#include "DynamicBvh.hpp"
 #include "Light.hpp"
 
 #include <cstddef>
@@ -19,6 +20,13 @@ class Scene final {
 	//std::unordered_set<Actor> m_actors;
 	// TODO: Manage Actors
 
+	// World-space bounds of the actors, for visibility, picking and proximity
+	// queries. Nothing maintains it on its own yet: until the scene manages
+	// its actors, whoever places them inserts their bounds through
+	// actorIndex(), moves them after their transforms change and removes them
+	// before they are destroyed.
+	PD::DynamicBvh m_actorIndex;
+
 	// Lights
 	std::vector<std::unique_ptr<Light>> m_pointLights;
 	float                               m_ambience;
@@ -31,6 +39,9 @@ class Scene final {
 	explicit Scene(const std::string& name);
 	void queue(Event event);
 	void update();
+
+	PD::DynamicBvh&       actorIndex();
+	const PD::DynamicBvh& actorIndex() const;
 };
 
 #endif
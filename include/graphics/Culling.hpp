@@ -0,0 +1,71 @@
+#ifndef PD_CULLING_HPP
+#define PD_CULLING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <span>
+#include <vector>
+
+namespace PD {
+
+	// Axis-aligned box and bounding sphere of a mesh, or of one of its levels
+	// of detail, in model space. The sphere is centered on the box.
+	struct bounds {
+		glm::vec3 min;
+		glm::vec3 max;
+		glm::vec3 center;
+		float     radius;
+
+		// An empty set of points gives an empty box at the origin
+		static bounds fit(std::span<const glm::vec3> points);
+	};
+
+	// Axis-aligned box in world space
+	struct aabb {
+		glm::vec3 min;
+		glm::vec3 max;
+	};
+
+	// Encloses the box of local once transformed by world
+	aabb world_box(const bounds& local, const glm::mat4& world);
+
+	// Planes of a view frustum, normalized and facing inwards: a point p lies
+	// on the inner side of plane q when dot(q.xyz, p) + q.w >= 0.
+	struct frustum {
+		glm::vec4 planes[6];
+
+		// Extracts the planes of the clip volume of an OpenGL projection, in
+		// whatever space the matrix transforms from
+		static frustum from_matrix(const glm::mat4& view_projection);
+	};
+
+	// World-space boxes of many objects, kept as one array per component so
+	// that cull() tests four of them against a plane at a time. Boxes are
+	// stored as center and half extent.
+	class box_set final {
+		std::vector<float> m_center_x{};
+		std::vector<float> m_center_y{};
+		std::vector<float> m_center_z{};
+		std::vector<float> m_extent_x{};
+		std::vector<float> m_extent_y{};
+		std::vector<float> m_extent_z{};
+		std::size_t        m_size = 0;
+
+		public:
+		void        resize(std::size_t size);
+		std::size_t size() const;
+
+		// Stores the box enclosing the model-space box of local under world
+		void set(std::size_t index, const bounds& local, const glm::mat4& world);
+
+		// Appends the indices of boxes that are at least partly inside the
+		// frustum to visible, in ascending order. Boxes near a corner of the
+		// frustum may be reported visible although they are just outside.
+		void cull(const frustum&              frustum,
+		          std::vector<std::uint32_t>& visible) const;
+	};
+
+} // namespace PD
+
+#endif
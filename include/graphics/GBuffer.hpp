@@ -0,0 +1,50 @@
+#ifndef PD_GBUFFER_HPP
+#define PD_GBUFFER_HPP
+
+#include <glbinding/gl/gl.h>
+#include <globjects/Framebuffer.h>
+#include <globjects/Texture.h>
+#include <memory>
+
+namespace PD {
+
+	// Surfaces written by the geometry pass of deferred shading, then read
+	// back as textures while lights are accumulated:
+	//   albedo:   RGBA8, albedo (rgb) and ambient occlusion (a)
+	//   material: RGBA16F, octahedral view-space normal (rg), roughness (b)
+	//             and metalness (a)
+	//   depth:    DEPTH24_STENCIL8, from which positions are reconstructed
+	class GBuffer final {
+		using texture_ptr     = std::unique_ptr<globjects::Texture>;
+		using framebuffer_ptr = std::unique_ptr<globjects::Framebuffer>;
+
+		texture_ptr     albedo_texture;
+		texture_ptr     material_texture;
+		texture_ptr     depth_texture;
+		framebuffer_ptr frame_buffer;
+
+		public:
+		// Follow the material units of FragmentShaderProgram, so the G-buffer
+		// can stay bound while materials change
+		static const gl::GLuint ALBEDO_TEXTURE_UNIT;
+		static const gl::GLuint MATERIAL_TEXTURE_UNIT;
+		static const gl::GLuint DEPTH_TEXTURE_UNIT;
+
+		const int width;
+		const int height;
+
+		GBuffer(int width, int height);
+
+		// Binds the G-buffer as the draw target and clears it
+		void begin() const;
+
+		void bind_textures() const;
+
+		constexpr globjects::Framebuffer* raw() const { return frame_buffer.get(); }
+
+		constexpr operator globjects::Framebuffer*() const { return raw(); }
+	};
+
+} // namespace PD
+
+#endif
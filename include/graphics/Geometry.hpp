@@ -1,19 +1,178 @@
 #ifndef PD_GEOMETRY_HPP
 #define PD_GEOMETRY_HPP
 
+#include "Culling.hpp"
+#include "GeometryArena.hpp"
+#include "MappedFile.hpp"
+#include "PMDL.hpp"
+#include "StagingRing.hpp"
+
+#include <cstddef>
+#include <glm/glm.hpp>
 #include <globjects/globjects.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stop_token>
 #include <string>
+#include <vector>
+
+// CPU-side copy of a mesh, ready for upload. Loading touches no GL state, so
+// it may run on any thread. Version 2 files stay memory-mapped and are only
+// prefetched; version 1 files are parsed (and quantized, if requested) into
+// owned storage. Copies share whichever of the two backs the blobs.
+//
+// The position blob is the position-only stream of depth passes. Meshes
+// bound for a GeometryArena leave it out, as they draw depth from their full
+// vertices.
+//
+// Once staged, the vertex, index and position blobs also lie back to back
+// in a StagingRing, and uploading copies them from there on the GPU.
+struct GeometryData {
+	std::shared_ptr<const PD::MappedFile>         mapping;
+	std::shared_ptr<const std::vector<std::byte>> storage;
+	std::span<const std::byte>                    vertexData;
+	std::span<const std::byte>                    indexData;
+	gl::GLenum                                    indexType;
+	PMDL::VertexFormat                            format;
+	glm::vec3                                     positionScale;
+	glm::vec3                                     positionOffset;
+	std::vector<PMDL::Lod>                        lods;
+	PD::bounds                                    meshBounds;
+	std::vector<PD::bounds>                       lodBounds; // One per level
+	std::span<const std::byte>                    positionData; // For depth
+	std::optional<PD::staging_block>              staged;
+
+	static GeometryData
+	load(const std::string& name,
+	     PMDL::VertexFormat format         = PMDL::VertexFormat::Float32,
+	     bool               positionStream = true);
+
+	// Copies the blobs into ring, waiting for room. Leaves the data unstaged
+	// if it is larger than the ring or stop is requested meanwhile. May run
+	// on any thread.
+	void stage(PD::StagingRing& ring, std::stop_token stop);
+
+	// Bytes that uploading this mesh sends to the driver
+	std::size_t bytes() const;
+};
 
+// Per-instance vertex attributes of instanced draws: the model matrix and
+// the matrix normals are transformed by, as VertexShaderProgram computes
+// them for single draws
+struct InstanceData {
+	glm::mat4 model;
+	glm::mat4 normal;
+};
+
+// Geometry uploads a PMDL mesh and describes its vertex layout. Version 2
+// files choose their own vertex format; for version 1 files the format
+// requested at construction is applied at load time.
+//
+// A mesh either owns its buffers and vertex array, or lives in a
+// GeometryArena, sharing the arena's buffers and vertex array with every
+// other mesh of its format. The arena must outlive the mesh.
 class Geometry final {
 	std::unique_ptr<globjects::VertexArray> m_vertexArray;
 	std::unique_ptr<globjects::Buffer>      m_vertexBuffer;
 	std::unique_ptr<globjects::Buffer>      m_indexBuffer;
+	std::unique_ptr<globjects::Buffer>      m_positionBuffer;
+	std::unique_ptr<globjects::VertexArray> m_depthArray;
 	int                                     m_elementCount;
+	gl::GLenum                              m_indexType;
+	PMDL::VertexFormat                      m_format;
+	glm::vec3                               m_positionScale;
+	glm::vec3                               m_positionOffset;
+	std::vector<PMDL::Lod>                  m_lods;
+	PD::bounds                              m_meshBounds;
+	std::vector<PD::bounds>                 m_lodBounds;
+	std::size_t                             m_gpuBytes;
+	PD::GeometryArena*                      m_arena;
+	PD::GeometryArena::handle               m_arenaMesh;
+
+	void bindAttributes();
 
 	public:
-	explicit Geometry(const std::string& name);
+	explicit Geometry(const std::string& name,
+	                  PMDL::VertexFormat format = PMDL::VertexFormat::Float32);
+	explicit Geometry(const GeometryData& data);
+	Geometry(const GeometryData& data, PD::GeometryArena& arena);
+	~Geometry();
+
+	Geometry(const Geometry&)            = delete;
+	Geometry& operator=(const Geometry&) = delete;
+
+	// Bytes per vertex of a vertex format, and of the position-only stream
+	// split out of it for depth passes: the position attribute alone,
+	// encoded as in the full vertex
+	static std::size_t vertexStride(PMDL::VertexFormat format);
+	static std::size_t positionStride(PMDL::VertexFormat format);
+
+	// Points attributes 0 to 2 of vao at vertices, laid out in format, and
+	// makes indices its element buffer. Also sets up the per-instance
+	// attributes for bindInstances().
+	static void bindVertexFormat(globjects::VertexArray&  vao,
+	                             PMDL::VertexFormat       format,
+	                             const globjects::Buffer& vertices,
+	                             const globjects::Buffer& indices);
+
 	globjects::VertexArray& vao() const;
-	int                     elements() const;
+
+	// Sources only attribute 0, the position, from the position-only
+	// stream, so depth passes fetch a fraction of the vertex data. Arena
+	// meshes, and meshes loaded without the stream, return vao().
+	globjects::VertexArray& depthVao() const;
+	int                     elements() const; // Of the finest level
+	gl::GLenum              indexType() const;
+	PMDL::VertexFormat      format() const;
+
+	// Transform from decoded snorm positions back to model space. Identity for
+	// Float32 meshes.
+	const glm::vec3& positionScale() const;
+	const glm::vec3& positionOffset() const;
+
+	std::size_t lodCount() const;
+
+	// Model-space bounds of the whole mesh, and of the triangles of one level
+	// of detail. Coarser levels may end up slightly smaller.
+	const PD::bounds& meshBounds() const;
+	const PD::bounds& lodBounds(std::size_t lod) const;
+
+	// Size of the vertex and index buffers in video memory
+	std::size_t gpuBytes() const;
+
+	// Radius of the mesh's bounding sphere on screen, in pixels
+	float projectedRadius(const glm::mat4& modelView,
+	                      const glm::mat4& projection,
+	                      float            viewportHeight) const;
+
+	// Picks the coarsest level of detail whose simplification error stays
+	// under pixelError on screen. Switching to a coarser level additionally
+	// requires a margin below pixelError, so objects hovering around a
+	// threshold do not flicker between levels every frame.
+	std::size_t selectLod(float       projectedRadius,
+	                      std::size_t current,
+	                      float       pixelError = 1.0f) const;
+
+	// Attribute locations of InstanceData, four consecutive ones per matrix,
+	// and the vertex buffer binding point all of them read from
+	static constexpr gl::GLuint INSTANCE_MODEL_LOCATION  = 3;
+	static constexpr gl::GLuint INSTANCE_NORMAL_LOCATION = 7;
+	static constexpr gl::GLuint INSTANCE_BINDING         = 3;
+
+	// Sources the per-instance attributes of the bound vertex array from an
+	// array of InstanceData in buffer, starting offset bytes in. Every vertex
+	// array of a Geometry or GeometryArena has the attribute formats and
+	// divisor set up once, so this only binds the buffer.
+	static void bindInstances(const globjects::Buffer& buffer,
+	                          std::size_t              offset);
+
+	// Issues the indexed draw call with whichever of vao() and depthVao() is
+	// bound; binding is left to the StateCache, so it can skip redundant
+	// binds. With instances above zero, that many copies are drawn in one
+	// instanced call, reading their transforms from the bound instance
+	// attributes.
+	void draw(std::size_t lod = 0, int instances = 0) const;
 };
 
 #endif
@@ -0,0 +1,127 @@
+#ifndef PD_GEOMETRYARENA_HPP
+#define PD_GEOMETRYARENA_HPP
+
+#include "PMDL.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <glbinding/gl/gl.h>
+#include <globjects/Buffer.h>
+#include <globjects/VertexArray.h>
+#include <limits>
+#include <map>
+#include <memory>
+#include <vector>
+
+struct GeometryData;
+
+namespace PD {
+
+	// First-fit free list over a range of abstract units. Freed blocks merge
+	// with free neighbours, so the list stays as short as the number of gaps.
+	class RangeAllocator final {
+		public:
+		static constexpr std::size_t NONE =
+		  std::numeric_limits<std::size_t>::max();
+
+		explicit RangeAllocator(std::size_t capacity = 0);
+
+		// Offset of a block of size units starting at a multiple of
+		// alignment, or NONE if no free block fits
+		std::size_t allocate(std::size_t size, std::size_t alignment = 1);
+
+		void free(std::size_t offset, std::size_t size);
+
+		// Extends the range; the new space is free
+		void grow(std::size_t capacity);
+
+		std::size_t capacity() const;
+		std::size_t used() const;
+		std::size_t largest_free() const;
+
+		private:
+		std::map<std::size_t, std::size_t> m_free{}; // Offset to size
+		std::size_t                        m_capacity;
+		std::size_t                        m_used;
+	};
+
+	// Vertex and index data of many meshes in a few large buffers: one
+	// vertex buffer and vertex array per vertex format, and one index buffer
+	// all vertex arrays share. Meshes are suballocations drawn with a base
+	// vertex, so switching between meshes of one format binds nothing.
+	//
+	// Buffers grow when full. Removing meshes leaves gaps, which
+	// defragment() closes by copying live meshes together on the GPU. It
+	// runs by itself once a removal takes fragmentation() past
+	// DEFRAGMENT_THRESHOLD; as this moves meshes, draws look their placement
+	// up every time.
+	class GeometryArena final {
+		public:
+		using handle = std::uint32_t;
+
+		static constexpr float DEFRAGMENT_THRESHOLD = 0.5f;
+
+		// Where a mesh's data currently is
+		struct placement {
+			gl::GLint   base_vertex;
+			std::size_t index_offset; // In bytes
+		};
+
+		explicit GeometryArena(std::size_t vertex_bytes = 32 << 20,
+		                       std::size_t index_bytes  = 16 << 20);
+
+		GeometryArena(const GeometryArena&)            = delete;
+		GeometryArena& operator=(const GeometryArena&) = delete;
+
+		// Uploads a mesh in data's vertex format, growing buffers if needed.
+		// Staged data is copied from its staging block. Meshes without
+		// vertices or indices are rejected.
+		handle add(const GeometryData& data);
+		void   remove(handle mesh);
+
+		placement               where(handle mesh) const;
+		globjects::VertexArray& vao(PMDL::VertexFormat format) const;
+
+		// Packs live meshes to the start of each buffer
+		void defragment();
+
+		// Share of free space not in the largest free block, over all
+		// buffers: 0 when free space is contiguous
+		float fragmentation() const;
+
+		private:
+		struct pool {
+			std::unique_ptr<globjects::Buffer>      vertices{};
+			std::unique_ptr<globjects::VertexArray> vao{};
+			RangeAllocator                          allocator{};
+			std::size_t                             stride = 0;
+		};
+
+		struct allocation {
+			PMDL::VertexFormat format;
+			std::size_t        first_vertex;
+			std::size_t        vertex_count;
+			std::size_t        index_offset;
+			std::size_t        index_bytes;
+			bool               live;
+		};
+
+		std::array<pool, 2>                m_pools;
+		std::unique_ptr<globjects::Buffer> m_indices;
+		RangeAllocator                     m_index_allocator;
+		std::vector<allocation>            m_meshes{};
+		std::vector<handle>                m_free_handles{};
+
+		pool& pool_of(PMDL::VertexFormat format);
+
+		// Copies live meshes, packed, into new buffers of the given sizes
+		void relocate(std::size_t float32_vertices,
+		              std::size_t quantized_vertices,
+		              std::size_t index_bytes);
+		void bind_buffers();
+	};
+
+} // namespace PD
+
+#endif
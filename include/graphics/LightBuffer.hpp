@@ -0,0 +1,59 @@
+#ifndef PD_LIGHTBUFFER_HPP
+#define PD_LIGHTBUFFER_HPP
+
+#include "Light.hpp"
+
+#include <cstddef>
+#include <glbinding/gl/gl.h>
+#include <glm/glm.hpp>
+#include <globjects/Buffer.h>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace PD {
+
+	// Every light of a frame in one uniform buffer, laid out as the std140
+	// block
+	//
+	//   layout(std140) uniform Lights {
+	//     PackedLight lights[LightBuffer::CAPACITY];
+	//   };
+	//
+	// where PackedLight is three vec4s: position and radius, direction and
+	// angle, color and intensity. Shaders then pick their lights by index
+	// instead of receiving each light through named uniforms.
+	class LightBuffer final {
+		public:
+		static constexpr std::size_t CAPACITY = 256;
+
+		// Uniform buffer binding point the block is read from
+		static const gl::GLuint BINDING;
+
+		struct packed_light {
+			glm::vec4 position_radius;
+			glm::vec4 direction_angle;
+			glm::vec4 color_intensity;
+		};
+
+		static packed_light pack(const Light& light);
+
+		LightBuffer();
+
+		// Uploads the lights of a frame, replacing the previous ones. Throws
+		// std::length_error for more than CAPACITY lights.
+		void update(std::span<const Light> lights);
+
+		// Binds the buffer to BINDING
+		void bind() const;
+
+		std::size_t size() const;
+
+		private:
+		std::unique_ptr<globjects::Buffer> m_buffer;
+		std::vector<packed_light>          m_staging{};
+	};
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PD_LIGHTCULLING_HPP
+#define PD_LIGHTCULLING_HPP
+
+#include "Culling.hpp"
+#include "Light.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <span>
+#include <vector>
+
+namespace PD {
+
+	// The lights affecting each object, all lists sharing one array: the
+	// lights of object i are indices[offsets[i]] up to indices[offsets[i + 1]].
+	struct light_lists {
+		std::vector<std::uint32_t> offsets{};
+		std::vector<std::uint32_t> indices{};
+
+		std::span<const std::uint32_t> of(std::size_t object) const;
+	};
+
+	// Rebuilds lists for the given world-space object boxes. A light reaches
+	// the sphere of its radius around its position; lights with an angle
+	// under pi and a direction are narrowed further to their cone, whose
+	// aperture is the angle. Tests are conservative, so a listed light may
+	// still fall just short of the object. The light shaders window their
+	// attenuation to reach zero at the radius, so culling there cuts nothing off.
+	void assign_lights(std::span<const Light> lights,
+	                   std::span<const aabb>  objects,
+	                   light_lists&           lists);
+
+	// Smallest sphere around the region a light reaches, cone and all
+	struct light_sphere {
+		glm::vec3 center;
+		float     radius;
+	};
+
+	light_sphere light_reach(const Light& light);
+
+	// Window-space region a light can reach: a scissor rectangle in pixels,
+	// origin at the bottom left, and a range of window depth for the
+	// depth-bounds test
+	struct light_extent {
+		int   x;
+		int   y;
+		int   width;
+		int   height;
+		float min_depth;
+		float max_depth;
+
+		bool empty() const;
+	};
+
+	// Projects the box around a light's sphere, or around its cone for spot
+	// lights, onto a viewport of the given size. Lights straddling the near
+	// plane cover the whole viewport and depth range; lights entirely off
+	// screen come back empty. Like assign_lights, this clips at the radius,
+	// where the light shaders' attenuation has reached zero.
+	light_extent project_light(const Light&     light,
+	                           const glm::mat4& view_projection,
+	                           int              width,
+	                           int              height);
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef PD_MESHOPTIMIZER_HPP
+#define PD_MESHOPTIMIZER_HPP
+
+#include "PMDL.hpp"
+
+#include <cstddef>
+#include <vector>
+
+// Offline mesh cooking for PMDL bodies. None of these are meant to run at load
+// time; they are applied once by the mdlcook tool and the result is written
+// back to disk. Indices past the last vertex throw std::out_of_range.
+namespace PMDL {
+
+	// Average cache miss ratio (misses per triangle) and average transformed
+	// vertex ratio (misses per referenced vertex) for a FIFO post-transform
+	// cache. 0.5 ACMR and 1.0 ATVR are the theoretical best for large meshes.
+	struct VertexCacheStatistics {
+		float acmr;
+		float atvr;
+	};
+
+	constexpr std::size_t DEFAULT_CACHE_SIZE = 16;
+
+	VertexCacheStatistics
+	analyzeVertexCache(const std::vector<Index>& indices,
+	                   std::size_t               vertexCount,
+	                   std::size_t               cacheSize = DEFAULT_CACHE_SIZE);
+
+	// Reorders triangles for post-transform cache locality using Tom Forsyth's
+	// linear-speed vertex cache optimisation.
+	void optimizeVertexCache(std::vector<Index>& indices, std::size_t vertexCount);
+
+	// Splits a cache-optimized index buffer into clusters at cache restarts and
+	// sorts the clusters so that outward-facing ones are drawn first. The new
+	// order is kept only if ACMR grows by no more than threshold.
+	void optimizeOverdraw(std::vector<Index>&        indices,
+	                      const std::vector<Vertex>& vertices,
+	                      float                      threshold = 1.05f);
+
+	// Reorders vertices into first-use order, remapping indices and dropping
+	// vertices that no triangle references.
+	void optimizeVertexFetch(Body& body);
+
+	// Runs all three passes in the order they depend on each other, ordering
+	// the triangles of every level of detail separately.
+	void optimize(Body& body);
+
+} // namespace PMDL
+
+#endif
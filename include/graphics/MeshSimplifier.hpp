@@ -0,0 +1,35 @@
+#ifndef PD_MESHSIMPLIFIER_HPP
+#define PD_MESHSIMPLIFIER_HPP
+
+#include "PMDL.hpp"
+
+#include <cstddef>
+#include <vector>
+
+// Offline level of detail generation for PMDL bodies.
+namespace PMDL {
+
+	struct Simplification {
+		std::vector<Index> indices;
+		float              error; // Object-space deviation, in model units
+	};
+
+	// Quadric error edge-collapse simplification (Garland & Heckbert). Vertices
+	// are only ever collapsed onto other existing vertices, so the result is an
+	// index buffer for the unchanged vertex buffer. Vertices on open borders
+	// and UV or normal seams are never moved, which keeps the silhouette and
+	// texture layout intact at the cost of stopping early on heavily split
+	// meshes.
+	Simplification simplify(const std::vector<Index>&  indices,
+	                        const std::vector<Vertex>& vertices,
+	                        std::size_t                targetIndexCount);
+
+	// Replaces body.lods with up to count levels, each with roughly reduction
+	// times the triangles of the previous one. Every level is simplified from
+	// the full-detail mesh. Generation stops early once a level no longer gets
+	// any smaller.
+	void generateLods(Body& body, std::size_t count, float reduction = 0.5f);
+
+} // namespace PMDL
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef PD_OCCLUSIONBUFFER_HPP
+#define PD_OCCLUSIONBUFFER_HPP
+
+#include "Culling.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace PD {
+
+	class JobSystem;
+
+	// Triangles of an occluder, authored as a mesh of its own. An occluder
+	// has to lie within the object it stands for, or it hides what is really
+	// visible past that object's silhouette; simplified levels of detail may
+	// bulge out, so none is extracted from the meshes drawn.
+	struct occluder_mesh {
+		std::vector<glm::vec3>     vertices{};
+		std::vector<std::uint32_t> indices{};
+
+		// Positions and finest level of a PMDL file of either version. Throws
+		// on indices past the last vertex.
+		static occluder_mesh load(const std::string& name);
+	};
+
+	// Low-resolution depth buffer that occluders are rasterized into on the
+	// CPU, so that objects hidden behind them can be skipped before anything
+	// is submitted to the GPU. Occluders are meant to be low-polygon meshes
+	// such as walls and floors, see occluder_mesh.
+	//
+	// Each frame: begin() with the camera, add_occluder() for every occluder,
+	// render(), then ask visible() about each object that passed frustum
+	// culling. The screen is split into bands of tile rows which are
+	// rasterized independently, four pixels at a time. Each tile also keeps
+	// its farthest depth, so most tests are answered without touching pixels.
+	//
+	// Depth is window depth, 0 at the near plane and 1 at the far plane.
+	class OcclusionBuffer final {
+		public:
+		static constexpr std::size_t TILE_WIDTH  = 8;
+		static constexpr std::size_t TILE_HEIGHT = 8;
+
+		// Rounded up to whole tiles
+		explicit OcclusionBuffer(std::size_t width  = 320,
+		                         std::size_t height = 192);
+
+		// Clears the buffer and the queued occluders
+		void begin(const glm::mat4& view_projection);
+
+		// Queues the triangles of an occluder for render(). Back faces, with
+		// clockwise winding on screen, are skipped.
+		void add_occluder(std::span<const glm::vec3>     vertices,
+		                  std::span<const std::uint32_t> indices,
+		                  const glm::mat4&               model);
+
+		void render();
+		void render(JobSystem& jobs);
+
+		// False if the box is entirely hidden behind occluders or entirely
+		// off-screen. Boxes reaching behind the near plane are always visible.
+		bool visible(const aabb& box) const;
+
+		std::size_t width() const;
+		std::size_t height() const;
+		float       depth(std::size_t x, std::size_t y) const; // y points up
+
+		private:
+		// Screen-space triangle, counter-clockwise. Edge i runs from vertex i
+		// to vertex i + 1; depth is a plane over the screen.
+		struct triangle {
+			glm::vec2 vertices[3];
+			glm::vec3 depth_plane; // depth = x * a + y * b + c
+			float     min_y;
+			float     max_y;
+		};
+
+		std::size_t           m_width;
+		std::size_t           m_height;
+		glm::mat4             m_view_projection;
+		std::vector<float>    m_depth{};
+		std::vector<float>    m_tile_depth{}; // Farthest depth in each tile
+		std::vector<triangle> m_triangles{};
+
+		std::size_t tile_columns() const;
+		std::size_t band_count() const;
+
+		void add_triangle(const glm::vec4 (&clip)[3]);
+		void rasterize(std::size_t band);
+	};
+
+} // namespace PD
+
+#endif
@@ -1,10 +1,15 @@
 #ifndef PD_PMDL_HPP
 #define PD_PMDL_HPP
 
+#include <bit>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <fstream>
 #include <limits>
+#include <span>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 namespace PMDL {
@@ -15,9 +20,14 @@ namespace PMDL {
 
 	using uint8 = std::uint8_t;
 
+	using uint16 = std::uint16_t;
+	using int16  = std::int16_t;
+
 	using uint32 = std::uint32_t;
 	using int32  = std::int32_t;
 
+	using uint64 = std::uint64_t;
+
 	using float32 = float;
 
 	// Using basic floating point types relies on them having fixed precision
@@ -70,12 +80,82 @@ namespace PMDL {
 		}
 	};
 
+	// Vertex doubles as the GPU vertex layout, which is what lets version 2
+	// files be uploaded straight from the mapped file.
+	static_assert(sizeof(Vertex) == 32, "Vertex must be tightly packed");
+	static_assert(std::is_standard_layout_v<Vertex>,
+	              "Vertex must be standard layout");
+
 	using Index = uint32;
 
+	// PackedVertex is the compact 16-byte GPU layout. Positions are 16-bit snorm
+	// relative to the mesh bounds (see Quantization), normals are octahedral
+	// 2x16-bit snorm and texture coordinates are half floats.
+	struct PackedVertex {
+		int16  position[4]; // w is padding
+		int16  normal[2];
+		uint16 texCoord[2];
+	};
+
+	static_assert(sizeof(PackedVertex) == 16, "PackedVertex must be 16 bytes");
+
+	enum class VertexFormat : uint32 { Float32 = 0, Quantized = 1 };
+
+	// Bytes per vertex of the position-only stream depth passes read: the
+	// position attribute alone, encoded as in the full vertex
+	constexpr std::size_t positionStride(VertexFormat format) {
+		return format == VertexFormat::Quantized ? sizeof(PackedVertex::position)
+		                                         : sizeof(Vertex::position);
+	}
+
+	// Quantization maps a decoded snorm position back to model space:
+	// position = snorm * scale + offset.
+	struct Quantization {
+		Vec3f scale;
+		Vec3f offset;
+
+		static Quantization fit(const std::vector<Vertex>& vertices);
+	};
+
+	PackedVertex pack(const Vertex& vertex, const Quantization& quantization);
+	Vertex       unpack(const PackedVertex& vertex, const Quantization& quantization);
+
+	// A level of detail is a range of the shared index buffer. error is the
+	// object-space deviation from the full-detail mesh, in model units.
+	struct Lod {
+		uint32  indexOffset;
+		uint32  indexCount;
+		float32 error;
+	};
+
+	static_assert(sizeof(Lod) == 12, "Lod must be tightly packed");
+
+	// Model-space box around the positions of a mesh or level of detail, and
+	// the sphere around the box's centre enclosing the same positions
+	struct Bounds {
+		Vec3f   min;
+		Vec3f   max;
+		Vec3f   center;
+		float32 radius;
+	};
+
+	static_assert(sizeof(Bounds) == 40, "Bounds must be tightly packed");
+
+	// Indices are narrowed to 16 bits when the mesh has fewer than 65536
+	// vertices. 0xFFFF is left unused so it stays free for primitive restart.
+	constexpr bool fitsShortIndices(std::size_t vertexCount) {
+		return vertexCount < std::numeric_limits<uint16>::max();
+	}
+
 	// -----------------------------------------------------------------------------
 	//  File structures
 	// -----------------------------------------------------------------------------
 
+	// What version 1 headers hold. Written by cereal, the signature reads as
+	// "LDMP" on disk.
+	constexpr uint32 SIGNATURE = 0x504D444C;
+	constexpr uint32 VERSION   = 1;
+
 	struct Header {
 		uint32 signature;
 		uint32 version;
@@ -90,13 +170,19 @@ namespace PMDL {
 		}
 	};
 
+	// indices holds every level of detail back to back, finest first. lods is
+	// empty for single-LOD meshes and is not part of the version 1 archive.
 	struct Body {
 		std::vector<Vertex> vertices;
 		std::vector<Index>  indices;
+		std::vector<Lod>    lods;
 
-		Body() : vertices(), indices(){};
+		Body() : vertices(), indices(), lods(){};
 		Body(const std::vector<Vertex>& vert, const std::vector<Index>& ind)
-		  : vertices(vert), indices(ind) {}
+		  : vertices(vert), indices(ind), lods() {}
+
+		// The LOD table with the implicit single level filled in
+		std::vector<Lod> levels() const;
 
 		template <typename Archive>
 		void serialize(Archive& archive) {
@@ -112,14 +198,84 @@ namespace PMDL {
 		File(const Header& head, const Body& bod) : header(head), body(bod) {}
 
 		void write(const std::string& filename);
+		void writeMapped(const std::string& filename,
+		                 VertexFormat       format = VertexFormat::Float32) const;
+		void writeMapped(std::ostream& of,
+		                 VertexFormat  format = VertexFormat::Float32) const;
 
+		// Throws on indices past the last vertex, as does read()
 		static File parse(std::istream& fileContents);
 
+		// Reads either file version from disk. Version 2 files are decoded back
+		// to full-precision vertices and 32-bit indices.
+		static File read(const std::string& filename);
+
 		template <typename Archive>
 		void serialize(Archive& archive) {
 			archive(header, body);
 		}
 	};
+
+	// -----------------------------------------------------------------------------
+	//  Version 2: memory-mappable layout
+	// -----------------------------------------------------------------------------
+
+	// Version 2 files are not cereal archives. They start with a fixed-size
+	// header holding the offsets and counts of the vertex and index blobs, which
+	// are stored little-endian in exactly the layout uploaded to the GPU. Blobs
+	// are aligned to BLOB_ALIGNMENT from the start of the file. The bounds of
+	// the mesh, and of every level of detail in a blob next to the LOD table,
+	// are those of the positions as the GPU decodes them, so loading never
+	// has to read the vertices. The position-only stream for depth passes is
+	// split out of the vertices when cooking, for the same reason.
+	//
+	// Version 1 files always begin with cereal's one-byte endianness tag (0 or
+	// 1), so the signature below can never be mistaken for one.
+
+	static_assert(std::endian::native == std::endian::little,
+	              "PMDL v2 blobs are stored little-endian");
+
+	constexpr uint32      MAPPED_SIGNATURE = 0x4C444D50; // "PMDL"
+	constexpr uint32      MAPPED_VERSION   = 2;
+	constexpr std::size_t BLOB_ALIGNMENT   = 16;
+
+	struct alignas(BLOB_ALIGNMENT) MappedHeader {
+		uint32       signature;
+		uint32       version;
+		VertexFormat vertexFormat;
+		uint32       vertexStride;
+		uint32       indexSize;
+		uint32       reserved;
+		Vec3f        positionScale;
+		Vec3f        positionOffset;
+		Bounds       bounds;
+		uint64       vertexOffset;
+		uint64       vertexCount;
+		uint64       indexOffset;
+		uint64       indexCount;
+		uint64       lodOffset;
+		uint64       lodCount;
+		uint64       lodBoundsOffset;      // lodCount entries
+		uint64       positionStreamOffset; // vertexCount entries
+	};
+
+	static_assert(sizeof(MappedHeader) % BLOB_ALIGNMENT == 0,
+	              "MappedHeader must keep the first blob aligned");
+
+	// MappedView is a non-owning, validated view of a version 2 file. The spans
+	// point into the memory handed to map() and share its lifetime. Mapping
+	// reads every index once, to reject any past the last vertex.
+	struct MappedView {
+		const MappedHeader*        header;
+		std::span<const std::byte> vertexData;
+		std::span<const std::byte> indexData;
+		std::span<const Lod>       lods;
+		std::span<const Bounds>    lodBounds;
+		std::span<const std::byte> positionData;
+
+		static bool       isMapped(std::span<const std::byte> fileContents);
+		static MappedView map(std::span<const std::byte> fileContents);
+	};
 } // namespace PMDL
 
 #endif
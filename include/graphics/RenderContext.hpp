@@ -2,63 +2,243 @@
 #define PD_RENDERCONTEXT_HPP
 
 #include "Framebuffer.hpp"
+#include "GBuffer.hpp"
 #include "Geometry.hpp"
 #include "Light.hpp"
+#include "LightBuffer.hpp"
+#include "LightCulling.hpp"
+#include "RenderQueue.hpp"
 #include "Renderer.hpp"
 #include "ShaderPipeline.hpp"
+#include "StateCache.hpp"
+#include "TransformBuffer.hpp"
 
 #include <glbinding/gl/gl.h>
 #include <globjects/ProgramPipeline.h>
 #include <globjects\VertexArray.h>
+#include <cstdint>
 #include <iterator>
 #include <memory>
+#include <ranges>
+#include <span>
 
 namespace PD {
 
 	class RenderContext final {
 		using framebuffer_ptr = std::unique_ptr<Framebuffer>;
 		using pipeline_ptr    = std::unique_ptr<ShaderPipeline>;
+		using g_buffer_ptr    = std::unique_ptr<GBuffer>;
+		using lights_ptr      = std::unique_ptr<LightBuffer>;
 
 		std::unique_ptr<Framebuffer>    m_frame_buffer;
 		std::unique_ptr<ShaderPipeline> m_ambient_pipeline;
 		std::unique_ptr<ShaderPipeline> m_highlight_pipeline;
 
-		void ambient_pass(const globjects::VertexArray& vao,
-		                  const int                     elements,
-		                  const float                   ambience);
+		// Optional: draws a queue's depth before it is shaded
+		std::unique_ptr<ShaderPipeline> m_depth_pipeline;
 
+		// Deferred shading only: surfaces of the frame, and an empty vertex
+		// array for fullscreen passes
+		std::unique_ptr<GBuffer>                m_g_buffer;
+		std::unique_ptr<globjects::VertexArray> m_fullscreen;
+
+		// Single-pass forward shading only: the lights of the frame, and the
+		// index of each of them for draws that take every light
+		std::unique_ptr<LightBuffer> m_light_buffer;
+		std::vector<std::uint32_t>   m_every_light{};
+
+		// Transforms of the instances of every batch in a queue
+		std::unique_ptr<globjects::Buffer> m_instance_buffer;
+
+		// Transforms of objects drawn one at a time, shared by their passes
+		std::unique_ptr<TransformBuffer> m_transform_buffer;
+
+		// Whether the driver can reject pixels by their stored depth, letting
+		// light passes skip pixels in front of or behind a light
+		bool m_depth_bounds;
+
+		// Without depth bounds, large lights get their depth rejection from
+		// the stencil buffer instead: this mesh around the unit sphere is
+		// scaled over the light, drawn by the depth pipeline with the
+		// transform in the instance buffer beside it, and marks the pixels
+		// whose surface lies inside. Null while there is no depth pipeline.
+		std::unique_ptr<Geometry>          m_light_volume;
+		std::unique_ptr<globjects::Buffer> m_volume_instance;
+
+		// Share of the frame a light's scissor rectangle has to cover before
+		// its volume is worth drawing
+		static constexpr float LARGE_LIGHT_SHARE = 0.25f;
+
+		// Every GL state change and uniform upload below goes through here
+		StateCache m_state{};
+
+		// Binds the object's vertex array, textures and transforms and sets up
+		// the ambient pipeline to draw it. The transforms stay bound for the
+		// passes that follow.
+		void prepare(const textures       textures,
+		             const Geometry&      geometry,
+		             const mvp_transforms transforms,
+		             const glm::vec3      eye);
+
+		// Lays down the depth of every batch in the queue from position-only
+		// vertex arrays, with color writes off, and leaves depth testing for
+		// equality with depth writes off for the passes that shade
+		void depth_prepass(const RenderQueue& queue,
+		                   const glm::mat4&   view,
+		                   const glm::mat4&   projection);
+
+		// Instances, if above zero, draw that many copies with instanced
+		// transforms; see Geometry::draw
+		void ambient_pass(const Geometry&   geometry,
+		                  const std::size_t lod,
+		                  const float       ambience,
+		                  const int         instances = 0);
+
+		// Ambience and the affecting lights in one draw, or in one more draw
+		// blended on top per MAX_LIGHTS_PER_DRAW lights beyond the first
+		void lit_pass(const Geometry&                geometry,
+		              const std::size_t              lod,
+		              const float                    ambience,
+		              std::span<const std::uint32_t> affecting,
+		              const int                      instances = 0);
+
+		// Marks the pixels of the frame buffer whose depth lies inside the
+		// light's volume with a non-zero stencil value, and everything else
+		// inside the scissor rectangle with zero. Leaves the stencil test
+		// passing only the marked pixels, and depth, culling and color state
+		// as it found them.
+		void mark_light_volume(const Light&     light,
+		                       const glm::mat4& view_projection);
+
+		// Additive pass per light, clipped to the pixels and depth range the
+		// light can reach so small lights on large meshes stay cheap. Where
+		// the driver cannot test depth bounds, the volumes of large lights
+		// are marked in the stencil buffer first. draw issues the geometry
+		// that is shaded: the object itself when shading forward, a
+		// fullscreen triangle when shading deferred. It binds its own vertex
+		// array, as marking binds the light volume's.
 		//template <std::input_iterator Iterator>
-		template <typename Iterator>
-		void highlight_pass(Iterator                      begin,
-		                    Iterator                      end,
-		                    const globjects::VertexArray& vao,
-		                    const int                     elements) {
-			glEnable(gl::GL_BLEND);
-			glBlendEquation(gl::GL_FUNC_ADD);
-			glBlendFunc(gl::GL_ONE, gl::GL_ONE);
-			m_highlight_pipeline->raw()->use();
-			globjects::Program& fragment_shader =
+		template <typename Iterator, typename Draw>
+		void highlight_pass(Iterator         begin,
+		                    Iterator         end,
+		                    const glm::mat4& view_projection,
+		                    Draw             draw) {
+			if(begin == end) { return; }
+			m_state.enable(gl::GL_BLEND, true);
+			m_state.blend(gl::GL_FUNC_ADD, gl::GL_ONE, gl::GL_ONE);
+			m_state.enable(gl::GL_SCISSOR_TEST, true);
+			if(m_depth_bounds) {
+				m_state.enable(gl::GL_DEPTH_BOUNDS_TEST_EXT, true);
+			}
+			const globjects::Program& fragment_shader =
 			  *m_highlight_pipeline->fragment_shader();
+			const float large = LARGE_LIGHT_SHARE *
+			                    static_cast<float>(m_frame_buffer->width) *
+			                    static_cast<float>(m_frame_buffer->height);
 			while(begin != end) {
 				auto light = *begin;
-				fragment_shader.setUniform("light.position", light.position);
-				fragment_shader.setUniform("light.direction", light.direction);
-				fragment_shader.setUniform("light.color", light.color);
-				fragment_shader.setUniform("light.intensity", light.intensity);
-				fragment_shader.setUniform("light.angle", light.angle);
-				fragment_shader.setUniform("light.radius", light.radius);
-
-				vao.drawElements(gl::GL_TRIANGLES, elements, gl::GL_UNSIGNED_INT);
 				++begin;
+
+				const light_extent extent = project_light(light,
+				                                          view_projection,
+				                                          m_frame_buffer->width,
+				                                          m_frame_buffer->height);
+				if(extent.empty()) { continue; }
+				m_state.scissor(extent.x, extent.y, extent.width, extent.height);
+				if(m_depth_bounds) {
+					m_state.depth_bounds(extent.min_depth, extent.max_depth);
+				}
+				const bool marked =
+				  m_light_volume &&
+				  static_cast<float>(extent.width) *
+				      static_cast<float>(extent.height) >=
+				    large;
+				if(marked) {
+					mark_light_volume(light, view_projection);
+				}
+				m_state.enable(gl::GL_STENCIL_TEST, marked);
+				m_state.use(*m_highlight_pipeline->raw());
+
+				m_state.uniform(fragment_shader, "light.position", light.position);
+				m_state.uniform(fragment_shader, "light.direction", light.direction);
+				m_state.uniform(fragment_shader, "light.color", light.color);
+				m_state.uniform(fragment_shader, "light.intensity", light.intensity);
+				m_state.uniform(fragment_shader, "light.angle", light.angle);
+				m_state.uniform(fragment_shader, "light.radius", light.radius);
+
+				draw();
+			}
+			m_state.enable(gl::GL_STENCIL_TEST, false);
+			if(m_depth_bounds) {
+				m_state.enable(gl::GL_DEPTH_BOUNDS_TEST_EXT, false);
 			}
-			glDisable(gl::GL_BLEND);
+			m_state.enable(gl::GL_SCISSOR_TEST, false);
+			m_state.enable(gl::GL_BLEND, false);
 		}
 
 		public:
+		// Lights the single-pass shader loops over in one draw
+		static constexpr std::size_t MAX_LIGHTS_PER_DRAW = 16;
+
+		// Forward shading: every object is drawn once with ambience, then once
+		// more for each light that reaches it
 		RenderContext(framebuffer_ptr frame_buffer,
 		              pipeline_ptr    ambient_pipeline,
 		              pipeline_ptr    highlight_pipeline);
 
+		// Deferred shading: objects are drawn once into the G-buffer by the
+		// ambient pipeline, whose fragment shader writes the surfaces GBuffer
+		// describes. end_frame() then shades with the highlight pipeline, a
+		// fullscreen pass for ambience and one more per light. The G-buffer
+		// must match the size of the frame buffer.
+		RenderContext(framebuffer_ptr frame_buffer,
+		              pipeline_ptr    ambient_pipeline,
+		              pipeline_ptr    highlight_pipeline,
+		              g_buffer_ptr    g_buffer);
+
+		// Single-pass forward shading: the ambient pipeline shades ambience and
+		// every light reaching an object in one draw. Lights are uploaded once
+		// per frame to the light buffer, whose block the fragment shader
+		// declares as Lights, and each draw passes the indices of its lights
+		// in light_count and light_indices. There is no highlight pipeline.
+		RenderContext(framebuffer_ptr frame_buffer,
+		              pipeline_ptr    lit_pipeline,
+		              lights_ptr      light_buffer);
+
+		// Makes execute() draw the depth of the whole queue first, with a
+		// pipeline transforming positions exactly like the ambient and
+		// highlight pipelines (see depth-only.vert.glsl). Every pass after
+		// that only shades the visible surface, so occluded fragments are
+		// not lit once per light. Deferred shading, whose light passes already
+		// shade each pixel once, draws no prepass. Null turns it off again.
+		//
+		// Without GL_EXT_depth_bounds_test, the pipeline also draws the light
+		// volumes that limit large lights to the surfaces they reach, when
+		// shading forward or deferred.
+		//
+		// The later passes test depth for equality, so their vertex shader
+		// must compute gl_Position with the same expression and declare it
+		// invariant, as standard-pbr.vert.glsl does; any other shader leaves
+		// fragments flickering in and out.
+		void set_depth_prepass(pipeline_ptr depth_pipeline);
+
+		constexpr bool deferred() const { return m_g_buffer != nullptr; }
+		constexpr bool single_pass() const { return m_light_buffer != nullptr; }
+
+		// Brackets the draws of a frame, and with them the use of a region of
+		// the transform buffer. When shading deferred, begin_frame()
+		// binds and clears the G-buffer, and end_frame() lights what was drawn
+		// into the frame buffer with every light given. When shading in a
+		// single pass, begin_frame() uploads the lights of the frame, which
+		// draw() then refers to by index. Otherwise both do nothing and draw()
+		// receives the lights instead.
+		void begin_frame(std::span<const Light> lights = {});
+		void end_frame(std::span<const Light> lights,
+		               const glm::mat4&       view,
+		               const glm::mat4&       projection,
+		               const glm::vec3&       eye,
+		               float                  ambience);
+
 		constexpr Framebuffer&    frame_buffer() const { return *m_frame_buffer; }
 		constexpr ShaderPipeline& ambient_pipeline() const {
 			return *m_ambient_pipeline;
@@ -67,32 +247,105 @@ namespace PD {
 			return *m_highlight_pipeline;
 		}
 
+		// GL calls made and skipped as redundant since begin_frame()
+		const StateCache::statistics& state_statistics() const {
+			return m_state.frame_statistics();
+		}
+
+		// Draws one object with every light. Callers cull first (see box_set),
+		// so this only runs for objects that can end up on screen. When
+		// shading deferred the lights are ignored in favour of end_frame's;
+		// when shading in a single pass, begin_frame's are used.
 		//template <std::input_iterator Iterator>
 		template <typename Iterator>
 		void draw(const textures       textures,
 		          const Geometry&      geometry,
+		          const std::size_t    lod,
 		          const int            id,
 		          const mvp_transforms transforms,
 		          const glm::vec3      eye,
 		          const float          ambience,
 		          Iterator             lights_begin,
 		          Iterator             lights_end) {
-			geometry.vao().bind();
-			textures.albedo->bindActive(FragmentShaderProgram::ALBEDO_TEXTURE_UNIT);
-			// TODO: Bind other texture units
-
-			m_ambient_pipeline->vertex_shader().transforms(
-			  transforms.model, transforms.view, transforms.projection);
-			m_ambient_pipeline->fragment_shader().camera(transforms.view, eye);
-			ambient_pass(geometry.vao(), geometry.elements(), ambience);
-
-			m_highlight_pipeline->vertex_shader().transforms(
-			  transforms.model, transforms.view, transforms.projection);
-			m_highlight_pipeline->fragment_shader().camera(transforms.view, eye);
-			highlight_pass(
-			  lights_begin, lights_end, geometry.vao(), geometry.elements());
+			prepare(textures, geometry, transforms, eye);
+			if(deferred()) {
+				m_state.use(*m_ambient_pipeline->raw());
+				geometry.draw(lod);
+				return;
+			}
+			if(single_pass()) {
+				lit_pass(geometry, lod, ambience, m_every_light);
+				return;
+			}
+			ambient_pass(geometry, lod, ambience);
+
+			const bool octahedral_normals =
+			  geometry.format() == PMDL::VertexFormat::Quantized;
+			VertexShaderProgram& vertex_shader =
+			  m_highlight_pipeline->vertex_shader();
+			vertex_shader.camera_transforms(
+			  m_state, transforms.view, transforms.projection);
+			vertex_shader.vertex_format(m_state,
+			                            geometry.positionScale(),
+			                            geometry.positionOffset(),
+			                            octahedral_normals);
+			m_highlight_pipeline->fragment_shader().camera(
+			  m_state, transforms.view, eye);
+			highlight_pass(lights_begin,
+			               lights_end,
+			               transforms.projection * transforms.view,
+			               [&] {
+				               m_state.bind(geometry.vao());
+				               geometry.draw(lod);
+			               });
 			// TODO: return ID map
 		}
+
+		// Draws one object with only the lights listed as affecting it, such
+		// as its entry in light_lists, so unaffected lights cost nothing. When
+		// shading in a single pass, indices refer to begin_frame's lights,
+		// which must be the lights given here.
+		void draw(const textures                 textures,
+		          const Geometry&                geometry,
+		          const std::size_t              lod,
+		          const int                      id,
+		          const mvp_transforms           transforms,
+		          const glm::vec3                eye,
+		          const float                    ambience,
+		          std::span<const Light>         lights,
+		          std::span<const std::uint32_t> affecting) {
+			if(single_pass()) {
+				prepare(textures, geometry, transforms, eye);
+				lit_pass(geometry, lod, ambience, affecting);
+				return;
+			}
+			auto listed = std::views::transform(
+			  affecting, [&](std::uint32_t index) -> const Light& {
+				  return lights[index];
+			  });
+			draw(textures,
+			     geometry,
+			     lod,
+			     id,
+			     transforms,
+			     eye,
+			     ambience,
+			     listed.begin(),
+			     listed.end());
+		}
+
+		// Draws a queue in its current order, normally after sort(), with one
+		// instanced draw per batch. Camera uniforms are set once and instance
+		// transforms uploaded once; as the queue groups batches by state, most
+		// vertex array, vertex format and texture changes are elided.
+		// Packets' light indices refer to lights, which when shading in a
+		// single pass must be begin_frame's.
+		void execute(const RenderQueue&     queue,
+		             const glm::mat4&       view,
+		             const glm::mat4&       projection,
+		             const glm::vec3&       eye,
+		             float                  ambience,
+		             std::span<const Light> lights);
 	};
 
 } // namespace PD
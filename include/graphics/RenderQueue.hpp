@@ -0,0 +1,131 @@
+#ifndef PD_RENDERQUEUE_HPP
+#define PD_RENDERQUEUE_HPP
+
+#include "Geometry.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <globjects/Texture.h>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace PD {
+
+	// Sort key of a draw, most significant field first:
+	//
+	//   pass:4 | pipeline:4 | material:16 | geometry:16 | lod:4 | depth:20
+	//
+	// Sorting by key runs passes in order and, within a pass, groups draws
+	// sharing a pipeline, then a material, then a mesh and its level of
+	// detail, so that state only changes between groups and draws of the same
+	// level end up next to each other to be instanced. Depth comes last and
+	// sorts front to back.
+	namespace render_key {
+		constexpr int PASS_SHIFT     = 60;
+		constexpr int PIPELINE_SHIFT = 56;
+		constexpr int MATERIAL_SHIFT = 40;
+		constexpr int GEOMETRY_SHIFT = 24;
+		constexpr int LOD_SHIFT      = 20;
+
+		// Non-negative floats order like their bit patterns, so the top 20
+		// bits keep the order of distances at reduced precision. Negative
+		// depths, behind the eye, become 0.
+		std::uint32_t quantize_depth(float depth);
+
+		std::uint64_t make(std::uint32_t pass,
+		                   std::uint32_t pipeline,
+		                   std::uint32_t material,
+		                   std::uint32_t geometry,
+		                   std::uint32_t lod,
+		                   float         depth);
+	} // namespace render_key
+
+	// Key of a packet and where the packet is, which is what gets sorted
+	struct sort_entry {
+		std::uint64_t key;
+		std::uint32_t index;
+	};
+
+	// Sorts entries by key, keeping the order of equal keys, with a
+	// least-significant-digit radix sort over bytes. Bytes that every key
+	// shares are skipped. scratch is resized as needed.
+	void radix_sort(std::vector<sort_entry>& entries,
+	                std::vector<sort_entry>& scratch);
+
+	// One object to draw, as recorded by RenderQueue
+	struct draw_packet {
+		const globjects::Texture*      albedo;
+		const Geometry*                geometry;
+		std::size_t                    lod;
+		glm::mat4                      model;
+		std::span<const std::uint32_t> lights; // Indices of affecting lights
+	};
+
+	// Consecutive packets drawn as instances of one draw call
+	struct draw_batch {
+		std::uint32_t first;
+		std::uint32_t count;
+	};
+
+	// Splits packets into runs that only differ in their model matrix: same
+	// mesh, level of detail, material and affecting lights
+	void batch_packets(std::span<const draw_packet> packets,
+	                   std::vector<draw_batch>&     batches);
+
+	// Retained list of draws for one frame. Objects are submitted in any
+	// order, then sort() orders them by render_key so RenderContext can run
+	// the whole queue while only changing state between groups.
+	//
+	// Materials and meshes are numbered in the order they are first seen, so
+	// up to 65536 of each can be told apart per frame; pointers do not need
+	// to stay stable across frames.
+	class RenderQueue final {
+		public:
+		static constexpr std::uint32_t PASSES = 16;
+
+		// Forgets every packet; view places objects for the depth field
+		void begin(const glm::mat4& view);
+
+		// Objects in lower passes are drawn first. Light indices must stay
+		// valid until the queue has been executed.
+		void submit(const globjects::Texture*      albedo,
+		            const Geometry&                geometry,
+		            std::size_t                    lod,
+		            const glm::mat4&               model,
+		            std::span<const std::uint32_t> lights,
+		            std::uint32_t                  pass = 0);
+
+		// Radix-sorts the packets by key, then batches them for instancing
+		void sort();
+
+		// Packets in submission order until sort(), in key order after
+		std::span<const draw_packet> packets() const;
+
+		// After sort(): batches of packets(), and per-instance transforms in
+		// the same order as packets()
+		std::span<const draw_batch>   batches() const;
+		std::span<const InstanceData> instances() const;
+
+		std::size_t size() const;
+
+		private:
+		template <typename T>
+		using numbering = std::unordered_map<const T*, std::uint32_t>;
+
+		glm::mat4                     m_view{1.0f};
+		std::vector<draw_packet>      m_packets{};
+		std::vector<draw_packet>      m_sorted{};
+		std::vector<sort_entry>       m_entries{};
+		std::vector<sort_entry>       m_scratch{};
+		std::vector<draw_batch>       m_batches{};
+		std::vector<InstanceData>     m_instances{};
+		numbering<globjects::Texture> m_materials{};
+		numbering<Geometry>           m_geometries{};
+		bool                          m_is_sorted = false;
+	};
+
+} // namespace PD
+
+#endif
@@ -6,16 +6,25 @@
 #include "Framebuffer.hpp"
 #include "Geometry.hpp"
 #include "Light.hpp"
+#include "MappedFile.hpp"
+#include "ResourceCache.hpp"
 #include "ShaderPipeline.hpp"
 #include "ShaderProgram.hpp"
+#include "StagingRing.hpp"
 
 #include <GLFW\glfw3.h>
+#include <cstddef>
+#include <gli\gli.hpp>
 #include <glm\glm.hpp>
 #include <globjects\Program.h>
 #include <globjects\Texture.h>
 #include <globjects\VertexArray.h>
 #include <iterator>
 #include <memory>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <vector>
 
 namespace PD {
 
@@ -37,8 +46,62 @@ namespace PD {
 
 	void commit_frame(Framebuffer& framebuffer, GLFWwindow* window);
 
+	// Mip chain of a 2D texture, finest level first, lying either in a
+	// mapped file or in a decoded image
+	struct texture_levels {
+		std::shared_ptr<const MappedFile>       file;
+		gli::texture                            image;
+		gli::format                             format;
+		gli::swizzles                           swizzles;
+		glm::ivec2                              extent;
+		std::vector<std::span<const std::byte>> levels;
+	};
+
+	texture_levels levels_of(const gli::texture& image);
+
+	// Decoded image with its full mip chain, not yet known to GL. Once
+	// staged, a copy of the image also lies in a StagingRing, which uploads
+	// unpack from instead of client memory. Textures from map_texture()
+	// leave the image empty and only hold the mapped levels.
+	struct texture_data {
+		gli::texture                  image;
+		std::optional<staging_block>  staged{};
+		std::optional<texture_levels> mapped{};
+
+		// Bytes uploaded up front, just the mip tail of mapped levels
+		std::size_t bytes() const;
+
+		// Copies the image into ring, waiting for room. Leaves the data
+		// unstaged if it is larger than the ring or stop is requested
+		// meanwhile, and mapped data is never staged. May run on any thread.
+		void stage(StagingRing& ring, std::stop_token stop);
+	};
+
+	// Reads and validates a DDS/KTX file. Touches no GL state, so it may run
+	// on any thread.
+	texture_data decode_texture(const std::string& name);
+
+	// Maps a DDS file and locates its levels in place, reading in just the
+	// mip tail TextureStreamer uploads up front. Other files, and DDS
+	// layouts it cannot read in place, are decoded instead. May run on any
+	// thread.
+	texture_data map_texture(const std::string& name);
+
+	std::unique_ptr<globjects::Texture> upload_texture(const texture_data& data);
+
 	std::unique_ptr<globjects::Texture> load_texture(const std::string& name);
 
+	// Video memory held by the mip levels of a 2D texture from its base level
+	// on, as reported by the driver
+	std::size_t texture_bytes(const globjects::Texture& texture);
+
 } // namespace PD
 
+template <>
+struct ResourceSize<globjects::Texture> {
+	std::size_t operator()(const globjects::Texture& texture) const {
+		return PD::texture_bytes(texture);
+	}
+};
+
 #endif
@@ -1,6 +1,8 @@
 #ifndef PD_SHADERPROGRAM_HPP
 #define PD_SHADERPROGRAM_HPP
 
+#include "StateCache.hpp"
+
 #include <globjects/base/File.h>
 #include <globjects/globjects.h>
 #include <memory>
@@ -39,9 +41,24 @@ class VertexShaderProgram final : public ShaderProgram {
 
 	void update_camera(const glm::mat4 view, const glm::vec3 eye);
 
-	void transforms(const glm::mat4 model,
-	                const glm::mat4 view,
-	                const glm::mat4 projection);
+	// Uniforms are set through state, which skips values the program
+	// already holds. Per-object transforms come from the Object block
+	// instead; see TransformBuffer.
+	void camera_transforms(PD::StateCache& state,
+	                       const glm::mat4 view,
+	                       const glm::mat4 projection);
+
+	// Whether transforms come from per-instance attributes (see
+	// InstanceData) rather than the Object block
+	void instanced(PD::StateCache& state, const bool enabled);
+
+	// Describes how the bound vertex attributes are encoded. Positions are
+	// decoded as position * scale + offset; octahedral normals arrive as two
+	// snorm components.
+	void vertex_format(PD::StateCache& state,
+	                   const glm::vec3 position_scale,
+	                   const glm::vec3 position_offset,
+	                   const bool      octahedral_normals);
 };
 
 // ---------------------
@@ -58,7 +75,9 @@ class FragmentShaderProgram final : public ShaderProgram {
 
 	explicit FragmentShaderProgram(const std::string& file);
 
-	void camera(const glm::mat4 view, const glm::vec3 eye);
+	void camera(PD::StateCache& state,
+	            const glm::mat4 view,
+	            const glm::vec3 eye);
 };
 
 #endif
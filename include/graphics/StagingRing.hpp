@@ -0,0 +1,125 @@
+#ifndef PD_STAGINGRING_HPP
+#define PD_STAGINGRING_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <glbinding/gl/gl.h>
+#include <globjects/Buffer.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+
+namespace PD {
+
+	// Suballocates a circular range first in, first out: blocks are taken
+	// after the newest one, wrapping around to the start when the end of the
+	// range is too short, and only the oldest block can be freed.
+	class RingAllocator final {
+		public:
+		static constexpr std::size_t NONE = std::numeric_limits<std::size_t>::max();
+
+		explicit RingAllocator(std::size_t capacity);
+
+		// Offset of a contiguous block of size bytes, or NONE until enough
+		// older blocks are freed. Sizes above capacity never fit.
+		std::size_t allocate(std::size_t size);
+
+		// Frees the oldest block
+		void free_oldest();
+
+		std::size_t capacity() const;
+		std::size_t used() const; // By blocks, not the gaps wrapping leaves
+		bool        empty() const;
+
+		private:
+		struct block {
+			std::size_t offset;
+			std::size_t size;
+		};
+
+		std::deque<block> m_blocks{}; // Oldest first
+		std::size_t       m_capacity;
+		std::size_t       m_head; // Where the newest block ends
+		std::size_t       m_used;
+	};
+
+	// Bytes of an asset copied into a StagingRing, waiting for the GL thread
+	// to copy them on into their texture or buffers
+	struct staging_block {
+		const globjects::Buffer* buffer;
+		std::size_t              offset;
+		std::size_t              size;
+		std::byte*               data; // Mapped, for writing
+	};
+
+	// Persistently mapped buffer that uploads are staged in. Worker threads
+	// allocate blocks and write assets into them; the GL thread then issues
+	// copies from the buffer, as pixel unpack or copy read buffer, which
+	// return at once as the driver has nothing left to copy out of client
+	// memory. Once the copies are issued the block is released, fencing
+	// it, and reclaim() frees blocks whose fences have signalled.
+	//
+	// Without GL_ARB_buffer_storage the buffer cannot stay mapped while it is
+	// read, so workers write into a copy in client memory instead, and
+	// commit() moves each block into the buffer through an unsynchronized
+	// mapping. The fences still keep the GPU off blocks being rewritten.
+	//
+	// allocate() may be called from any thread, everything else only on the
+	// GL thread.
+	class StagingRing final {
+		public:
+		static constexpr std::size_t DEFAULT_CAPACITY = 64 << 20;
+
+		// Blocks start at multiples of this, which suits texel data of any
+		// format as pixel unpack offset
+		static constexpr std::size_t ALIGNMENT = 256;
+
+		explicit StagingRing(std::size_t capacity = DEFAULT_CAPACITY);
+		~StagingRing();
+
+		StagingRing(const StagingRing&)            = delete;
+		StagingRing& operator=(const StagingRing&) = delete;
+
+		// A block of size bytes, waiting for reclaim() to free older ones if
+		// the ring is full. Empty if size exceeds the capacity, or if stop is
+		// requested while waiting.
+		std::optional<staging_block> allocate(std::size_t     size,
+		                                      std::stop_token stop);
+
+		// Makes what was written to block visible to the copies reading it.
+		// Call before issuing them; a no-op while persistently mapped.
+		void commit(const staging_block& block);
+
+		// Fences block once every command reading it has been issued. Throws
+		// for a block not allocated from this ring.
+		void release(const staging_block& block);
+
+		// Frees released blocks the GPU is done with, oldest first, and wakes
+		// allocations waiting for room. Call once per frame.
+		void reclaim();
+
+		std::size_t capacity() const;
+
+		private:
+		struct pending {
+			std::size_t offset;
+			gl::GLsync  fence; // Null until released
+		};
+
+		std::unique_ptr<globjects::Buffer> m_buffer;
+		std::unique_ptr<std::byte[]>       m_client; // Without buffer storage
+		std::byte*                         m_mapped;
+		std::size_t                        m_capacity;
+
+		std::mutex                  m_mutex;
+		std::condition_variable_any m_freed;
+		RingAllocator               m_allocator;
+		std::deque<pending>         m_pending; // Same order as m_allocator
+	};
+
+} // namespace PD
+
+#endif
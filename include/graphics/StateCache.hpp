@@ -0,0 +1,190 @@
+#ifndef PD_STATECACHE_HPP
+#define PD_STATECACHE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <glbinding/gl/gl.h>
+#include <glm/glm.hpp>
+#include <globjects/Program.h>
+#include <globjects/ProgramPipeline.h>
+#include <globjects/Texture.h>
+#include <globjects/VertexArray.h>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace PD {
+
+	// Last value uploaded to each uniform of each program, compared byte for
+	// byte so that uploading the same value again can be skipped
+	class uniform_values final {
+		public:
+		// Records value for the uniform and returns whether it differs from
+		// the one recorded before. A uniform seen for the first time differs.
+		bool update(gl::GLuint                 program,
+		            gl::GLint                  location,
+		            std::span<const std::byte> value);
+
+		void clear();
+
+		private:
+		std::unordered_map<std::uint64_t, std::vector<std::byte>> m_values{};
+	};
+
+	// Shadow of the GL state RenderContext changes: the bound program
+	// pipeline, vertex array and textures, blending, depth and stencil state,
+	// the scissor rectangle and depth bounds, and the uniforms of every
+	// program.
+	// Setting state through the cache only reaches GL when it differs from
+	// what the cache last set, and uniform locations are looked up once per
+	// program and name.
+	//
+	// Until the cache has set a piece of state it does not know it, so the
+	// first call always goes through. State changed behind its back must be
+	// forgotten with begin_frame() or invalidate().
+	class StateCache final {
+		public:
+		// GL calls made and skipped since begin_frame()
+		struct statistics {
+			std::size_t issued;
+			std::size_t elided;
+		};
+
+		// Texture units the cache tracks; binds to higher units always go
+		// through
+		static constexpr std::size_t TEXTURE_UNITS = 32;
+
+		// Resets the statistics and forgets bindings, which texture uploads
+		// and GeometryArena growth change outside of frames. Capabilities,
+		// blending, depth, scissor and depth bounds state, and uniform values
+		// are kept.
+		void begin_frame();
+
+		// Forgets everything
+		void invalidate();
+
+		void use(const globjects::ProgramPipeline& pipeline);
+		void bind(const globjects::VertexArray& vao);
+		void bind(gl::GLuint unit, const globjects::Texture& texture);
+
+		void enable(gl::GLenum capability, bool enabled);
+		void blend(gl::GLenum equation, gl::GLenum source, gl::GLenum destination);
+		void depth_function(gl::GLenum function);
+		void depth_mask(bool write);
+		void color_mask(bool write); // All four channels alike
+		void scissor(gl::GLint   x,
+		             gl::GLint   y,
+		             gl::GLsizei width,
+		             gl::GLsizei height);
+
+		// State as last set through the cache, for passes that change it and
+		// put it back. Until set, GL's initial state: capabilities disabled,
+		// GL_LESS and depth writes on.
+		bool       enabled(gl::GLenum capability) const;
+		gl::GLenum depth_function() const;
+		bool       depth_mask() const;
+
+		// Requires GL_EXT_depth_bounds_test
+		void depth_bounds(float min_depth, float max_depth);
+
+		// Compares every bit of the stencil value, for both faces
+		void stencil_function(gl::GLenum function, gl::GLint reference);
+
+		// face is GL_FRONT, GL_BACK or GL_FRONT_AND_BACK
+		void stencil_operations(gl::GLenum face,
+		                        gl::GLenum stencil_fail,
+		                        gl::GLenum depth_fail,
+		                        gl::GLenum pass);
+
+		// -1 if the program has no active uniform of that name
+		gl::GLint location(const globjects::Program& program,
+		                   std::string_view          name);
+
+		// Uniforms the program does not use are ignored
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             float                     value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             int                       value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             bool                      value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             const glm::vec3&          value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             const glm::vec4&          value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             const glm::mat4&          value);
+		void uniform(const globjects::Program& program,
+		             gl::GLint                 location,
+		             std::span<const gl::GLint> values);
+
+		template <typename T>
+		void uniform(const globjects::Program& program,
+		             std::string_view          name,
+		             const T&                  value) {
+			uniform(program, location(program, name), value);
+		}
+
+		const statistics& frame_statistics() const;
+
+		private:
+		// Hashes string_view and string alike, so lookups need no string
+		struct name_hash {
+			using is_transparent = void;
+			std::size_t operator()(std::string_view name) const {
+				return std::hash<std::string_view>()(name);
+			}
+		};
+
+		using locations = std::unordered_map<std::string,
+		                                     gl::GLint,
+		                                     name_hash,
+		                                     std::equal_to<>>;
+
+		// 0 is no object, which is also what the cache starts out knowing
+		gl::GLuint                            m_pipeline = 0;
+		gl::GLuint                            m_vao      = 0;
+		std::array<gl::GLuint, TEXTURE_UNITS> m_textures{};
+
+		// Unknown until set: -1 for flags, sizes and depths, 0 for enums
+		std::unordered_map<gl::GLenum, int> m_capabilities{};
+		std::array<gl::GLenum, 3>           m_blend{};
+		gl::GLenum                          m_depth_function{};
+		int                                 m_depth_mask       = -1;
+		int                                 m_color_mask       = -1;
+		std::array<gl::GLint, 4>            m_scissor          = {0, 0, -1, -1};
+		std::array<float, 2>                m_depth_bounds     = {-1.0f, -1.0f};
+		std::array<gl::GLint, 2>            m_stencil_function = {0, -1};
+
+		// Front faces, then back faces
+		std::array<std::array<gl::GLenum, 3>, 2> m_stencil_operations{};
+
+		std::unordered_map<gl::GLuint, locations> m_locations{};
+		uniform_values                            m_uniforms{};
+		statistics                                m_statistics{};
+
+		// Counts the call and returns whether it has to be made
+		bool issue(bool changed);
+
+		template <typename T>
+		bool changed(const globjects::Program& program,
+		             gl::GLint                 location,
+		             const T&                  value) {
+			return location >= 0 &&
+			       issue(m_uniforms.update(
+			         program.id(), location, std::as_bytes(std::span(&value, 1))));
+		}
+	};
+
+} // namespace PD
+
+#endif
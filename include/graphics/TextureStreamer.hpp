@@ -0,0 +1,108 @@
+#ifndef PD_TEXTURESTREAMER_HPP
+#define PD_TEXTURESTREAMER_HPP
+
+#include "Renderer.hpp"
+
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <globjects/Texture.h>
+#include <memory>
+#include <unordered_map>
+
+namespace PD {
+
+	// Streams the mip levels of 2D textures in and out of video memory.
+	// A texture starts out with only its mip tail, the levels no larger than
+	// TAIL_EXTENT, which stay resident for as long as the texture lives.
+	// Finer levels are uploaded one at a time, coarse to fine, as draws
+	// request them, and GL_TEXTURE_BASE_LEVEL follows the finest level that
+	// is resident so sampling never reaches a missing one.
+	//
+	// All streamed levels share one byte budget. A level only comes in if it
+	// fits, making room by evicting finer levels than their textures were
+	// last requested at, least recently requested textures first.
+	//
+	// Levels from map_texture() are read from the mapped file as they are
+	// uploaded, and their pages are dropped again once the level is resident,
+	// so levels evicted under pressure are read back from the disk. Decoded
+	// images stay in system memory instead. Textures are ordinary mutable
+	// textures rather than immutable storage, so that freed levels actually
+	// give their memory back. Only use on the render thread.
+	class TextureStreamer final {
+		public:
+		static constexpr std::size_t DEFAULT_BUDGET        = 256 << 20;
+		static constexpr std::size_t DEFAULT_UPLOAD_BUDGET = 4 << 20;
+		static constexpr int         TAIL_EXTENT           = 64;
+
+		// Finest level whose texels are no smaller than pixels on an object
+		// covering projected_radius pixels, with the texture repeating tiling
+		// times across the object's bounding sphere
+		static std::size_t wanted_level(glm::ivec2  extent,
+		                                std::size_t levels,
+		                                float       projected_radius,
+		                                float       tiling = 1.0f);
+
+		// Coarsest level that is streamed, the finest one of the mip tail
+		static std::size_t tail_level(glm::ivec2 extent, std::size_t levels);
+
+		explicit TextureStreamer(
+		  std::size_t budget        = DEFAULT_BUDGET,
+		  std::size_t upload_budget = DEFAULT_UPLOAD_BUDGET);
+
+		TextureStreamer(const TextureStreamer&)            = delete;
+		TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+		// Uploads the mip tail and starts streaming the rest. The streamer
+		// forgets the texture once the last reference to it is dropped.
+		std::shared_ptr<globjects::Texture> add(const texture_data& data);
+
+		// Asks for the detail a draw of texture needs this frame, as by
+		// wanted_level(). Textures the streamer does not know are ignored,
+		// so anything a material binds may be passed.
+		void request(const globjects::Texture& texture,
+		             float                     projected_radius,
+		             float                     tiling = 1.0f);
+
+		// Uploads requested levels, finest missing detail first, until this
+		// frame's upload budget is spent, evicting as needed to stay within the
+		// budget. At least one level is uploaded per call when any is wanted.
+		// Call once per frame, outside of RenderContext frames, as it binds
+		// textures behind the StateCache's back.
+		void update();
+
+		void set_budget(std::size_t bytes);
+		void set_upload_budget(std::size_t bytes);
+
+		// Video memory held by every streamed texture, mip tails included
+		std::size_t bytes() const;
+		std::size_t budget() const;
+
+		private:
+		struct streamed {
+			std::weak_ptr<globjects::Texture> texture;
+			texture_levels                    source;
+			std::size_t                       tail;
+			std::size_t                       resident; // Base level
+			std::size_t                       wanted;   // Finest this frame
+			std::size_t                       last_requested; // Frame
+		};
+
+		std::unordered_map<const globjects::Texture*, streamed> m_textures;
+		std::size_t                                             m_budget;
+		std::size_t                                             m_upload_budget;
+		std::size_t                                             m_bytes;
+		std::size_t                                             m_frame;
+
+		// Frees the finest resident level of texture
+		void evict(streamed& texture);
+
+		// Evicts levels of textures other than keep until bytes more fit the
+		// budget. With surplus_only, only levels finer than wanted may go.
+		bool make_room(std::size_t     bytes,
+		               const streamed* keep,
+		               bool            surplus_only);
+	};
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef PD_TRANSFORMBUFFER_HPP
+#define PD_TRANSFORMBUFFER_HPP
+
+#include <array>
+#include <cstddef>
+#include <glbinding/gl/gl.h>
+#include <glm/glm.hpp>
+#include <globjects/Buffer.h>
+#include <memory>
+
+namespace PD {
+
+	// Per-object transforms of a frame in a persistently mapped uniform
+	// buffer, laid out as the std140 block
+	//
+	//   layout(std140) uniform Object {
+	//     mat4 model;
+	//     mat4 model_view;
+	//     mat4 normal;
+	//   };
+	//
+	// Each object's matrices are computed and written once, and every pass
+	// drawing it binds the same range. The buffer is a ring of FRAMES
+	// regions, each fenced when its frame ends, so writing a frame only
+	// waits for the GPU to finish the frame that used the region before.
+	//
+	// Without GL_ARB_buffer_storage the buffer holds a single region that
+	// is orphaned every frame and written with glBufferSubData instead.
+	class TransformBuffer final {
+		public:
+		static constexpr std::size_t CAPACITY = 4096; // Objects per frame
+		static constexpr std::size_t FRAMES   = 3;
+
+		// Uniform buffer binding point the block is read from
+		static const gl::GLuint BINDING;
+
+		struct object_transforms {
+			glm::mat4 model;
+			glm::mat4 model_view;
+			glm::mat4 normal; // Inverse transpose of model_view
+		};
+
+		static object_transforms compute(const glm::mat4& model,
+		                                 const glm::mat4& view);
+
+		TransformBuffer();
+		~TransformBuffer();
+
+		TransformBuffer(const TransformBuffer&)            = delete;
+		TransformBuffer& operator=(const TransformBuffer&) = delete;
+
+		// Moves on to the next region, waiting for the GPU if it still reads it
+		void begin_frame();
+
+		// Fences the region once every draw of the frame has been issued
+		void end_frame();
+
+		// Writes an object's transforms into the frame's region and returns
+		// where they are. Throws std::length_error for more than CAPACITY
+		// objects in a frame.
+		std::size_t push(const glm::mat4& model, const glm::mat4& view);
+
+		// Binds the transforms at offset, as returned by push(), to BINDING
+		void bind(std::size_t offset) const;
+
+		private:
+		std::unique_ptr<globjects::Buffer> m_buffer;
+		std::byte*                         m_mapped; // Null when orphaning
+		std::size_t                        m_stride; // Aligned object size
+		std::size_t                        m_frame;
+		std::size_t                        m_count;
+		std::array<gl::GLsync, FRAMES>     m_fences{};
+	};
+
+} // namespace PD
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef PD_JOB_SYSTEM_HPP
+#define PD_JOB_SYSTEM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace PD {
+
+	// Counts unfinished jobs. A job submitted against a counter increments it
+	// and decrements it when done, so waiting for the counter to reach zero
+	// is a fence over everything submitted against it. The first exception
+	// thrown by any of those jobs is rethrown by JobSystem::wait.
+	class JobCounter final {
+		std::atomic<std::size_t> m_remaining;
+		std::atomic_flag         m_failed;
+		std::exception_ptr       m_error;
+
+		friend class JobSystem;
+
+		public:
+		JobCounter() : m_remaining(0), m_failed(), m_error() {}
+		JobCounter(const JobCounter&)            = delete;
+		JobCounter& operator=(const JobCounter&) = delete;
+
+		bool done() const {
+			return m_remaining.load(std::memory_order_acquire) == 0;
+		}
+	};
+
+	// Work-stealing scheduler. Every worker owns a deque: it pushes and pops
+	// its own jobs at the back, while idle workers steal the oldest job from
+	// the front of someone else's. Threads outside the pool submit to a shared
+	// queue that every worker steals from.
+	//
+	// wait() never blocks a worker outright; the waiting thread runs other
+	// jobs until its counter clears, so jobs may wait on jobs they spawned.
+	class JobSystem final {
+		public:
+		using job = std::function<void()>;
+
+		explicit JobSystem(unsigned workers = default_workers());
+		~JobSystem();
+
+		JobSystem(const JobSystem&)            = delete;
+		JobSystem& operator=(const JobSystem&) = delete;
+
+		void submit(job work, JobCounter* counter = nullptr);
+		void wait(JobCounter& counter);
+
+		// Calls body(first, last) over [begin, end) in chunks of at most grain
+		// elements and returns once every chunk has run. The calling thread
+		// takes part in the work.
+		template <typename Body>
+		void parallel_for(std::size_t begin,
+		                  std::size_t end,
+		                  std::size_t grain,
+		                  Body&&      body);
+
+		unsigned worker_count() const;
+
+		static unsigned default_workers();
+
+		private:
+		struct task {
+			job         work;
+			JobCounter* counter;
+		};
+
+		struct queue {
+			std::mutex       mutex{};
+			std::deque<task> tasks{};
+		};
+
+		// One queue per worker, followed by the shared queue for outside threads
+		std::vector<std::unique_ptr<queue>> m_queues;
+		std::vector<std::thread>            m_workers;
+
+		std::atomic<std::size_t> m_queued;
+		std::mutex               m_sleep_mutex;
+		std::condition_variable  m_wake;
+		bool                     m_stopping;
+
+		std::size_t own_queue() const;
+		bool        try_run(std::size_t home);
+		void        run(task& next);
+		void        work(std::size_t index);
+	};
+
+	template <typename Body>
+	void JobSystem::parallel_for(std::size_t begin,
+	                             std::size_t end,
+	                             std::size_t grain,
+	                             Body&&      body) {
+		if(begin >= end) { return; }
+		grain = std::max<std::size_t>(grain, 1);
+
+		// The first chunk is kept back for the calling thread
+		JobCounter        counter;
+		const std::size_t first_end = std::min(end, begin + grain);
+		for(std::size_t first = first_end; first < end; first += grain) {
+			const std::size_t last = std::min(end, first + grain);
+			submit([&body, first, last] { body(first, last); }, &counter);
+		}
+		try {
+			body(begin, first_end);
+		} catch(...) {
+			// The submitted chunks still refer to body and counter
+			try {
+				wait(counter);
+			} catch(...) {}
+			throw;
+		}
+		wait(counter);
+	}
+
+} // namespace PD
+
+#endif
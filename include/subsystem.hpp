@@ -0,0 +1,64 @@
+#ifndef PD_SUBSYSTEM_HPP
+#define PD_SUBSYSTEM_HPP
+
+#include "job_system.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace PD {
+
+	struct frame_context {
+		double     delta; // Seconds since the previous frame
+		JobSystem& jobs;
+	};
+
+	// Update tasks and the order they have to run in. The graph is built once
+	// and run every frame: each task is scheduled on the job system as soon as
+	// every task it runs after has finished, so independent tasks run in
+	// parallel. Tasks may use the job system themselves, e.g. parallel_for.
+	class FrameGraph final {
+		public:
+		using task = std::function<void(const frame_context&)>;
+
+		// Names have to be unique. Tasks named in after may be added later, but
+		// must exist by the time the graph first runs.
+		void add(std::string name, task work, std::vector<std::string> after = {});
+
+		// Returns once every task has run. If a task throws, tasks after it are
+		// skipped and the exception is rethrown here.
+		void run(JobSystem& jobs, double delta);
+
+		private:
+		struct node {
+			std::string              name;
+			task                     work;
+			std::vector<std::string> after;
+			std::vector<std::size_t> successors;
+			std::size_t              dependencies;
+		};
+
+		std::vector<node> m_nodes{};
+		bool              m_resolved = false;
+
+		// Resolves names to indices and rejects unknown names and cycles
+		void resolve();
+	};
+
+	// Part of the engine updated every frame, such as the scene, physics or
+	// rendering. A subsystem adds its tasks once, when it joins the engine.
+	class Subsystem {
+		public:
+		Subsystem()                            = default;
+		Subsystem(const Subsystem&)            = delete;
+		Subsystem& operator=(const Subsystem&) = delete;
+		virtual ~Subsystem()                   = default;
+
+		virtual void schedule(FrameGraph& graph) = 0;
+	};
+
+} // namespace PD
+
+#endif
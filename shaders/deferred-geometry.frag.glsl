@@ -0,0 +1,54 @@
+#version 330
+
+// ----------------------------------------------------------------------------
+//  Uniforms
+// ----------------------------------------------------------------------------
+
+uniform sampler2D albedo_map;
+uniform sampler2D roughness_map;
+uniform sampler2D metalness_map;
+uniform sampler2D occlusion_map;
+
+// ----------------------------------------------------------------------------
+//  Input
+// ----------------------------------------------------------------------------
+
+in vec3 frag_position;
+in vec3 frag_normal;
+in vec2 frag_uv;
+
+// ----------------------------------------------------------------------------
+//  Output (see GBuffer)
+// ----------------------------------------------------------------------------
+
+layout(location = 0) out vec4 out_albedo;
+layout(location = 1) out vec4 out_material;
+
+// ----------------------------------------------------------------------------
+//  Normal encoding
+// ----------------------------------------------------------------------------
+
+vec2 sign_not_zero(vec2 v) {
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encode_octahedral(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+}
+
+// ----------------------------------------------------------------------------
+//  Entry point
+// ----------------------------------------------------------------------------
+
+void main() {
+	vec3  albedo    = texture(albedo_map, frag_uv).rgb;
+	float occlusion = texture(occlusion_map, frag_uv).r;
+	float roughness = texture(roughness_map, frag_uv).r;
+	float metalness = texture(metalness_map, frag_uv).r;
+
+	out_albedo   = vec4(albedo, occlusion);
+	out_material = vec4(encode_octahedral(normalize(frag_normal)),
+	                    roughness,
+	                    metalness);
+}
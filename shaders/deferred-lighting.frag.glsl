@@ -0,0 +1,117 @@
+#version 330
+
+#define PI 3.1415926535897932384626433832795028
+
+// ----------------------------------------------------------------------------
+//  Uniforms
+// ----------------------------------------------------------------------------
+
+uniform mat4 view;
+uniform mat4 inverse_projection;
+
+// G-buffer (see GBuffer)
+uniform sampler2D g_albedo;
+uniform sampler2D g_material;
+uniform sampler2D g_depth;
+
+// The first pass of a frame only applies ambience; every later pass adds one
+// light
+uniform bool  ambient_pass;
+uniform float ambience;
+
+struct Light {
+	vec3 position;
+	vec3 direction;
+	vec3 color;
+	float intensity;
+	float angle;
+	float radius;
+};
+
+uniform Light light;
+
+// ----------------------------------------------------------------------------
+//  Output
+// ----------------------------------------------------------------------------
+
+layout(location = 0) out vec4 out_color;
+
+// ----------------------------------------------------------------------------
+//  G-buffer decoding
+// ----------------------------------------------------------------------------
+
+vec2 sign_not_zero(vec2 v) {
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec3 decode_octahedral(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if(n.z < 0.0) {
+		n.xy = (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+	}
+	return normalize(n);
+}
+
+vec3 view_position(ivec2 pixel, float depth) {
+	vec2 uv  = (vec2(pixel) + 0.5) / vec2(textureSize(g_depth, 0));
+	vec4 ndc = vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	vec4 pos = inverse_projection * ndc;
+	return pos.xyz / pos.w;
+}
+
+// ----------------------------------------------------------------------------
+//  Entry point
+// ----------------------------------------------------------------------------
+
+void main() {
+	ivec2 pixel    = ivec2(gl_FragCoord.xy);
+	vec4  albedo   = texelFetch(g_albedo, pixel, 0);
+	vec4  material = texelFetch(g_material, pixel, 0);
+	float depth    = texelFetch(g_depth, pixel, 0).r;
+
+	// Nothing was drawn here
+	if(depth == 1.0) {
+		discard;
+	}
+
+	if(ambient_pass) {
+		out_color = vec4(ambience * albedo.a * albedo.rgb, 1.0);
+		return;
+	}
+
+	vec3  position  = view_position(pixel, depth);
+	vec3  normal    = decode_octahedral(material.rg);
+	float roughness = material.b;
+	float metalness = material.a;
+
+	vec3  light_position = (view * vec4(light.position, 1.0)).xyz;
+	vec3  to_light       = light_position - position;
+	float distance       = length(to_light);
+	to_light /= distance;
+
+	// Same falloff as the forward highlight pass, windowed to reach zero at
+	// the radius the light volume is clipped to
+	float falloff     = 1.0 / (pow(light.radius, 2) * 0.05);
+	float window      = clamp(1.0 - pow(distance / light.radius, 4), 0.0, 1.0);
+	float attenuation = window * window / (1.0 + falloff * pow(distance, 2));
+
+	if(light.angle < PI) {
+		vec3 axis = normalize((view * vec4(light.direction, 0.0)).xyz);
+		if(dot(-to_light, axis) < cos(light.angle * 0.5)) {
+			discard;
+		}
+	}
+
+	vec3  to_eye   = normalize(-position);
+	vec3  halfway  = normalize(to_light + to_eye);
+	float diffuse  = max(dot(normal, to_light), 0.0);
+	float shine    = mix(256.0, 2.0, roughness);
+	float specular = pow(max(dot(normal, halfway), 0.0), shine);
+
+	vec3 diffuse_color  = (1.0 - metalness) * albedo.rgb;
+	vec3 specular_color = mix(vec3(0.04), albedo.rgb, metalness);
+	vec3 radiance = light.color * light.intensity * attenuation;
+
+	out_color =
+	  vec4((diffuse * diffuse_color + specular * specular_color) * radiance, 1.0);
+}
@@ -0,0 +1,4 @@
+#version 330
+
+// Depth pre-pass: color writes are masked off, so depth is all there is
+void main() {}
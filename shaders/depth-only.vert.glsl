@@ -0,0 +1,51 @@
+#version 330
+
+// Depth pre-pass. Positions come from the position-only stream (see
+// Geometry::depthVao) and are transformed exactly as in
+// standard-pbr.vert.glsl, so that later passes can test against the depths
+// written here for equality.
+
+// ----------------------------------------------------------------------------
+//  Uniforms
+// ----------------------------------------------------------------------------
+
+uniform mat4 view_transform;
+uniform mat4 projection_transform;
+
+layout(std140) uniform Object {
+	mat4 model;
+	mat4 model_view;
+	mat4 normal;
+} object;
+
+uniform bool instanced = false;
+
+uniform vec3 position_scale = vec3(1.0);
+uniform vec3 position_offset = vec3(0.0);
+
+// ----------------------------------------------------------------------------
+//  Input
+// ----------------------------------------------------------------------------
+
+layout(location = 0) in vec3 position;
+layout(location = 3) in mat4 instance_model;
+
+// ----------------------------------------------------------------------------
+//  Output
+// ----------------------------------------------------------------------------
+
+invariant gl_Position;
+
+// ----------------------------------------------------------------------------
+//  Entry point
+// ----------------------------------------------------------------------------
+
+void main() {
+	vec3 model_position = position * position_scale + position_offset;
+	vec4 pos = vec4(model_position, 1.0f);
+
+	mat4 model_view = instanced ? view_transform * instance_model : object.model_view;
+	pos = model_view * pos;
+
+	gl_Position = projection_transform * pos;
+}
@@ -0,0 +1,107 @@
+#version 330
+
+#define PI 3.1415926535897932384626433832795028
+
+// Must match LightBuffer::CAPACITY and RenderContext::MAX_LIGHTS_PER_DRAW
+#define MAX_LIGHTS 256
+#define MAX_LIGHTS_PER_DRAW 16
+
+// ----------------------------------------------------------------------------
+//  Uniforms
+// ----------------------------------------------------------------------------
+
+uniform mat4 view;
+
+uniform sampler2D albedo_map;
+uniform sampler2D roughness_map;
+uniform sampler2D metalness_map;
+uniform sampler2D occlusion_map;
+
+uniform float ambience;
+
+uniform int ID;
+
+// See LightBuffer
+struct PackedLight {
+	vec4 position_radius;
+	vec4 direction_angle;
+	vec4 color_intensity;
+};
+
+layout(std140) uniform Lights {
+	PackedLight lights[MAX_LIGHTS];
+};
+
+// Lights reaching this draw, as indices into lights
+uniform int light_count;
+uniform int light_indices[MAX_LIGHTS_PER_DRAW];
+
+// ----------------------------------------------------------------------------
+//  Input
+// ----------------------------------------------------------------------------
+
+in vec3 frag_position;
+in vec3 frag_normal;
+in vec2 frag_uv;
+
+// ----------------------------------------------------------------------------
+//  Output
+// ----------------------------------------------------------------------------
+
+layout(location = 0) out vec4 out_color;
+layout(location = 1) out int out_id;
+
+// ----------------------------------------------------------------------------
+//  Entry point
+// ----------------------------------------------------------------------------
+
+void main() {
+	vec3  albedo    = texture(albedo_map, frag_uv).rgb;
+	float occlusion = texture(occlusion_map, frag_uv).r;
+	float roughness = texture(roughness_map, frag_uv).r;
+	float metalness = texture(metalness_map, frag_uv).r;
+
+	vec3 position = frag_position;
+	vec3 normal   = normalize(frag_normal);
+	vec3 to_eye   = normalize(-position);
+	float shine   = mix(256.0, 2.0, roughness);
+
+	vec3 diffuse_color  = (1.0 - metalness) * albedo;
+	vec3 specular_color = mix(vec3(0.04), albedo, metalness);
+
+	vec3 color = ambience * occlusion * albedo;
+	for(int i = 0; i < light_count; ++i) {
+		PackedLight light = lights[light_indices[i]];
+		float radius    = light.position_radius.w;
+		float angle     = light.direction_angle.w;
+		float intensity = light.color_intensity.w;
+
+		vec3  light_position = (view * vec4(light.position_radius.xyz, 1.0)).xyz;
+		vec3  to_light       = light_position - position;
+		float distance       = length(to_light);
+		to_light /= distance;
+
+		// Same falloff as the multi-pass highlight shaders, windowed to reach
+		// zero at the radius lights are culled at
+		float falloff     = 1.0 / (pow(radius, 2) * 0.05);
+		float window      = clamp(1.0 - pow(distance / radius, 4), 0.0, 1.0);
+		float attenuation = window * window / (1.0 + falloff * pow(distance, 2));
+
+		if(angle < PI) {
+			vec3 axis = (view * vec4(light.direction_angle.xyz, 0.0)).xyz;
+			if(dot(-to_light, normalize(axis)) < cos(angle * 0.5)) {
+				continue;
+			}
+		}
+
+		vec3  halfway  = normalize(to_light + to_eye);
+		float diffuse  = max(dot(normal, to_light), 0.0);
+		float specular = pow(max(dot(normal, halfway), 0.0), shine);
+		vec3  radiance = light.color_intensity.rgb * intensity * attenuation;
+
+		color += (diffuse * diffuse_color + specular * specular_color) * radiance;
+	}
+
+	out_color = vec4(color, 1.0);
+	out_id = ID;
+}
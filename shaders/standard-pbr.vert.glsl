@@ -4,10 +4,25 @@
 //  Uniforms
 // ----------------------------------------------------------------------------
 
-uniform mat4 model_transform;
-uniform mat4 view_transfrom;
+uniform mat4 view_transform;
 uniform mat4 projection_transform;
-uniform mat4 normal_transform;
+
+// Transforms of the object being drawn, written once per frame and shared by
+// every pass (see TransformBuffer)
+layout(std140) uniform Object {
+	mat4 model;
+	mat4 model_view;
+	mat4 normal;
+} object;
+
+// Instanced draws take the model and normal transforms from per-instance
+// attributes instead (see InstanceData)
+uniform bool instanced = false;
+
+// Vertex format (see Geometry). Identity/false for full-precision meshes.
+uniform vec3 position_scale = vec3(1.0);
+uniform vec3 position_offset = vec3(0.0);
+uniform bool octahedral_normals = false;
 
 // ----------------------------------------------------------------------------
 //  Input
@@ -16,6 +31,8 @@ uniform mat4 normal_transform;
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 layout(location = 2) in vec2 uv;
+layout(location = 3) in mat4 instance_model;
+layout(location = 7) in mat4 instance_normal;
 
 // ----------------------------------------------------------------------------
 //  Output
@@ -25,20 +42,45 @@ out vec3 frag_position;
 out vec3 frag_normal;
 out vec2 frag_uv;
 
+// Must match depth-only.vert.glsl bit for bit after a depth pre-pass
+invariant gl_Position;
+
+// ----------------------------------------------------------------------------
+//  Vertex decoding
+// ----------------------------------------------------------------------------
+
+vec2 sign_not_zero(vec2 v) {
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec3 decode_octahedral(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if(n.z < 0.0) {
+		n.xy = (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+	}
+	return normalize(n);
+}
+
 // ----------------------------------------------------------------------------
 //  Entry point
 // ----------------------------------------------------------------------------
 
 void main() {
-	vec4 pos = vec4(position, 1.0f);
-	vec4 norm = vec4(normal, 0.0f);
+	vec3 model_position = position * position_scale + position_offset;
+	vec3 model_normal = octahedral_normals ? decode_octahedral(normal.xy) : normal;
+
+	vec4 pos = vec4(model_position, 1.0f);
+	vec4 norm = vec4(model_normal, 0.0f);
+
+	mat4 model_view = instanced ? view_transform * instance_model : object.model_view;
+	mat4 normal_matrix = instanced ? instance_normal : object.normal;
 
-	pos = view * model * pos;
-	norm = normalMatrix * norm;
+	pos = model_view * pos;
+	norm = normal_matrix * norm;
 
 	frag_position = pos.xyz;
 	frag_normal = norm.xyz;
 	frag_uv = uv;
 
-	gl_Position = projection * pos;
+	gl_Position = projection_transform * pos;
 }
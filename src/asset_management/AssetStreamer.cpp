@@ -0,0 +1,230 @@
+#include "AssetStreamer.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <plog/Log.h>
+#include <utility>
+
+using namespace std;
+
+namespace PD {
+
+	AssetStreamer::AssetStreamer(
+	  shared_ptr<Geometry>           placeholder_geometry,
+	  shared_ptr<globjects::Texture> placeholder_texture,
+	  size_t                         upload_budget,
+	  unsigned                       workers)
+	  : m_placeholder_geometry(std::move(placeholder_geometry))
+	  , m_placeholder_texture(std::move(placeholder_texture))
+	  , m_upload_budget(upload_budget)
+	  , m_pending(0)
+	  , m_geometry_arena(nullptr)
+	  , m_texture_streamer(nullptr)
+	  , m_staging_ring(nullptr)
+	  , m_geometry_cache()
+	  , m_texture_cache()
+	  , m_geometry_handles()
+	  , m_texture_handles()
+	  , m_jobs_mutex()
+	  , m_jobs_available()
+	  , m_jobs()
+	  , m_staged_mutex()
+	  , m_staged()
+	  , m_workers() {
+		for(unsigned i = 0; i < max(workers, 1u); ++i) {
+			m_workers.emplace_back([this](stop_token stop) { work(stop); });
+		}
+	}
+
+	// Workers are joined before anything they touch is destroyed
+	AssetStreamer::~AssetStreamer() { m_workers.clear(); }
+
+	unsigned AssetStreamer::default_workers() {
+		// Leave a core for the render thread
+		return max(thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	void AssetStreamer::work(stop_token stop) {
+		while(true) {
+			function<staged(stop_token)> job;
+			{
+				unique_lock lock(m_jobs_mutex);
+				if(!m_jobs_available.wait(
+				     lock, stop, [this] { return !m_jobs.empty(); })) {
+					return;
+				}
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+
+			staged result = job(stop);
+
+			const scoped_lock lock(m_staged_mutex);
+			m_staged.push_back(std::move(result));
+		}
+	}
+
+	template <typename T, typename Decode, typename Upload>
+	shared_ptr<StreamedAsset<T>>
+	AssetStreamer::request(handle_map<T>&       handles,
+	                       ResourceCache<T>&    cache,
+	                       const shared_ptr<T>& placeholder,
+	                       const string&        name,
+	                       Decode               decode,
+	                       Upload               upload,
+	                       StagingRing*         ring) {
+		auto& known = handles[name];
+		if(auto handle = known.lock()) { return handle; }
+
+		if(auto resource = cache.get(name)) {
+			auto handle = make_shared<StreamedAsset<T>>(std::move(resource), true);
+			known       = handle;
+			return handle;
+		}
+
+		auto handle = make_shared<StreamedAsset<T>>(placeholder, false);
+		known       = handle;
+		++m_pending;
+
+		// Decoding and staging run on a worker; the returned closure runs in
+		// pump()
+		auto job = [this, handle, &handles, &cache, name, decode, upload, ring](
+		             stop_token stop) {
+			try {
+				auto data = decode();
+				if(ring) { data.stage(*ring, stop); }
+				const auto finish = [this,
+				                     handle,
+				                     &handles,
+				                     &cache,
+				                     name,
+				                     data,
+				                     upload,
+				                     ring] {
+					try {
+						if(data.staged) { ring->commit(*data.staged); }
+						handle->m_resource = upload(data);
+					} catch(const exception& error) {
+						// The ring frees blocks in order, so a block never released
+						// would stall every later one
+						if(data.staged) { ring->release(*data.staged); }
+						LOG(plog::error) << "failed to upload " << name << ": "
+						                 << error.what();
+						handles.erase(name);
+						--m_pending;
+						return;
+					}
+					if(data.staged) { ring->release(*data.staged); }
+					handle->m_resident = true;
+					cache.put(name, handle->m_resource);
+					--m_pending;
+				};
+				return staged{data.bytes(), finish};
+			} catch(const exception& error) {
+				LOG(plog::error) << "failed to stream " << name << ": "
+				                 << error.what();
+
+				// Forget the handle so that a later request retries the load
+				const auto forget = [this, &handles, name] {
+					handles.erase(name);
+					--m_pending;
+				};
+				return staged{0, forget};
+			}
+		};
+
+		{
+			const scoped_lock lock(m_jobs_mutex);
+			m_jobs.push_back(std::move(job));
+		}
+		m_jobs_available.notify_one();
+		return handle;
+	}
+
+	shared_ptr<StreamedAsset<Geometry>>
+	AssetStreamer::request_geometry(const string&      name,
+	                                PMDL::VertexFormat format) {
+		return request(
+		  m_geometry_handles,
+		  m_geometry_cache,
+		  m_placeholder_geometry,
+		  name,
+		  // Arena meshes draw depth from their full vertices
+		  [name, format, positionStream = m_geometry_arena == nullptr] {
+			  return GeometryData::load(name, format, positionStream);
+		  },
+		  [this](const GeometryData& data) {
+			  return m_geometry_arena ? make_shared<Geometry>(data, *m_geometry_arena)
+			                          : make_shared<Geometry>(data);
+		  },
+		  m_staging_ring);
+	}
+
+	shared_ptr<StreamedAsset<globjects::Texture>>
+	AssetStreamer::request_texture(const string& name) {
+		return request(
+		  m_texture_handles,
+		  m_texture_cache,
+		  m_placeholder_texture,
+		  name,
+		  // The streamer reads finer levels from the file as they are wanted
+		  [name, mapped = m_texture_streamer != nullptr] {
+			  return mapped ? map_texture(name) : decode_texture(name);
+		  },
+		  [this](const texture_data& data) {
+			  return m_texture_streamer
+			           ? m_texture_streamer->add(data)
+			           : shared_ptr<globjects::Texture>(upload_texture(data));
+		  },
+		  // The streamer specifies levels straight from the file or image
+		  m_texture_streamer ? nullptr : m_staging_ring);
+	}
+
+	void AssetStreamer::pump() {
+		if(m_staging_ring) { m_staging_ring->reclaim(); }
+
+		size_t uploaded = 0;
+		while(true) {
+			staged next;
+			{
+				const scoped_lock lock(m_staged_mutex);
+				if(m_staged.empty()) { return; }
+				if(uploaded > 0 &&
+				   uploaded + m_staged.front().bytes > m_upload_budget) {
+					return;
+				}
+				next = std::move(m_staged.front());
+				m_staged.pop_front();
+			}
+			next.upload();
+			uploaded += max<size_t>(next.bytes, 1);
+		}
+	}
+
+	size_t AssetStreamer::pending() const { return m_pending; }
+
+	void AssetStreamer::set_upload_budget(size_t bytes) {
+		m_upload_budget = bytes;
+	}
+
+	void AssetStreamer::set_geometry_arena(GeometryArena* arena) {
+		m_geometry_arena = arena;
+	}
+
+	void AssetStreamer::set_texture_streamer(TextureStreamer* streamer) {
+		m_texture_streamer = streamer;
+	}
+
+	void AssetStreamer::set_staging_ring(StagingRing* ring) {
+		m_staging_ring = ring;
+	}
+
+	ResourceCache<Geometry>& AssetStreamer::geometry_cache() {
+		return m_geometry_cache;
+	}
+
+	ResourceCache<globjects::Texture>& AssetStreamer::texture_cache() {
+		return m_texture_cache;
+	}
+
+} // namespace PD
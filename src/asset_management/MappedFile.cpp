@@ -0,0 +1,161 @@
+#include "MappedFile.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+	size_t page_size() {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	// The pages range overlaps, or with inner only those it covers wholly,
+	// as the address of the first one and their combined size
+	pair<byte*, size_t> pages(span<const byte> range, bool inner) {
+		static const uintptr_t page  = page_size();
+		const auto             begin = reinterpret_cast<uintptr_t>(range.data());
+		const uintptr_t        end   = begin + range.size();
+		const uintptr_t first = inner ? (begin + page - 1) / page * page
+		                              : begin / page * page;
+		const uintptr_t last =
+		  inner ? end / page * page : (end + page - 1) / page * page;
+		if(range.empty() || last <= first) { return {nullptr, 0}; }
+		return {reinterpret_cast<byte*>(first), last - first};
+	}
+
+} // namespace
+
+namespace PD {
+
+#ifdef _WIN32
+
+	MappedFile::MappedFile(const string& filename)
+	  : m_data(nullptr)
+	  , m_size(0)
+	  , m_file(INVALID_HANDLE_VALUE)
+	  , m_mapping(nullptr) {
+		m_file = CreateFileA(filename.c_str(),
+		                     GENERIC_READ,
+		                     FILE_SHARE_READ,
+		                     nullptr,
+		                     OPEN_EXISTING,
+		                     FILE_FLAG_SEQUENTIAL_SCAN,
+		                     nullptr);
+		if(m_file == INVALID_HANDLE_VALUE) {
+			throw runtime_error("could not open " + filename);
+		}
+
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(m_file, &size)) {
+			CloseHandle(m_file);
+			throw runtime_error("could not stat " + filename);
+		}
+		m_size = static_cast<size_t>(size.QuadPart);
+		if(m_size == 0) { return; }
+
+		m_mapping =
+		  CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		const void* view =
+		  m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if(!view) {
+			if(m_mapping) { CloseHandle(m_mapping); }
+			CloseHandle(m_file);
+			throw runtime_error("could not map " + filename);
+		}
+		m_data = static_cast<const byte*>(view);
+	}
+
+	MappedFile::~MappedFile() {
+		if(m_data) { UnmapViewOfFile(m_data); }
+		if(m_mapping) { CloseHandle(m_mapping); }
+		CloseHandle(m_file);
+	}
+
+#else
+
+	MappedFile::MappedFile(const string& filename)
+	  : m_data(nullptr), m_size(0), m_descriptor(-1) {
+		m_descriptor = open(filename.c_str(), O_RDONLY);
+		if(m_descriptor < 0) { throw runtime_error("could not open " + filename); }
+
+		struct stat status;
+		if(fstat(m_descriptor, &status) != 0) {
+			close(m_descriptor);
+			throw runtime_error("could not stat " + filename);
+		}
+		m_size = static_cast<size_t>(status.st_size);
+		if(m_size == 0) { return; }
+
+		void* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_descriptor, 0);
+		if(view == MAP_FAILED) {
+			close(m_descriptor);
+			throw runtime_error("could not map " + filename);
+		}
+		m_data = static_cast<const byte*>(view);
+	}
+
+	MappedFile::~MappedFile() {
+		if(m_data) { munmap(const_cast<byte*>(m_data), m_size); }
+		close(m_descriptor);
+	}
+
+#endif
+
+	void MappedFile::prefetch() const { prefetch(bytes()); }
+
+	void MappedFile::prefetch(span<const byte> range) const {
+		// Smallest page size of any platform we run on
+		constexpr size_t PREFETCH_STRIDE = 4096;
+
+		const volatile byte* data = range.data();
+		for(size_t offset = 0; offset < range.size(); offset += PREFETCH_STRIDE) {
+			static_cast<void>(data[offset]);
+		}
+		if(!range.empty()) { static_cast<void>(data[range.size() - 1]); }
+	}
+
+	void MappedFile::readAhead(span<const byte> range) const {
+		const auto [first, size] = pages(range, false);
+		if(size == 0) { return; }
+#ifdef _WIN32
+		WIN32_MEMORY_RANGE_ENTRY entry{first, size};
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+#else
+		madvise(first, size, MADV_WILLNEED);
+#endif
+	}
+
+	void MappedFile::discard(span<const byte> range) const {
+		const auto [first, size] = pages(range, true);
+		if(size == 0) { return; }
+#ifdef _WIN32
+		// Unlocking pages that are not locked still takes them out of the
+		// working set
+		VirtualUnlock(first, size);
+#else
+		// The mapping is private and never written, so its pages are clean
+		// copies of the file
+		madvise(first, size, MADV_DONTNEED);
+#endif
+	}
+
+} // namespace PD
@@ -1 +1,204 @@
 #include "ResourceCache.hpp"
+
+#include "ConcurrentResourceCache.hpp"
+
+#include <atomic>
+#include <doctest/doctest.h>
+#include <future>
+#include <thread>
+#include <vector>
+
+namespace {
+
+	struct blob {
+		std::size_t bytes;
+	};
+
+	struct blob_size {
+		std::size_t operator()(const blob& resource) const {
+			return resource.bytes;
+		}
+	};
+
+	using blob_cache = ResourceCache<blob, blob_size>;
+
+	std::shared_ptr<blob> make_blob(std::size_t bytes) {
+		return std::make_shared<blob>(blob{bytes});
+	}
+
+	using concurrent_blob_cache = PD::ConcurrentResourceCache<blob, blob_size>;
+
+	constexpr std::size_t REQUESTERS = 8;
+
+	// Has REQUESTERS threads ask cache for key at once. The first one runs
+	// loader, which waits for release; the test only releases it once every
+	// other thread has joined the load in flight.
+	template <typename Loader>
+	std::vector<concurrent_blob_cache::future>
+	request_together(concurrent_blob_cache& cache,
+	                 const std::string&     key,
+	                 Loader                 loader) {
+		const std::size_t                          hits = cache.statistics().hits;
+		std::promise<void>                         release;
+		const std::shared_future<void>             released = release.get_future();
+		std::vector<concurrent_blob_cache::future> futures(REQUESTERS);
+		{
+			std::vector<std::jthread> requesters;
+			for(auto& future: futures) {
+				requesters.emplace_back([&] {
+					future = cache.get_or_load(key, [&] {
+						released.wait();
+						return loader();
+					});
+				});
+			}
+			while(cache.statistics().hits < hits + REQUESTERS - 1) {
+				std::this_thread::yield();
+			}
+			release.set_value();
+		}
+		return futures;
+	}
+
+} // namespace
+
+TEST_CASE("resource caches evict the least recently used entry") {
+	blob_cache cache(30);
+	cache.put("a", make_blob(10));
+	cache.put("b", make_blob(10));
+	cache.put("c", make_blob(10));
+	CHECK(cache.bytes() == 30);
+
+	// Getting a makes b the oldest entry
+	CHECK(cache.get("a"));
+	cache.put("d", make_blob(10));
+	CHECK(cache.size() == 3);
+	CHECK(cache.get("a"));
+	CHECK_FALSE(cache.get("b"));
+	CHECK(cache.get("c"));
+	CHECK(cache.get("d"));
+
+	SUBCASE("a lower budget evicts down to it") {
+		cache.setBudget(10);
+		CHECK(cache.bytes() == 10);
+		CHECK(cache.get("d"));
+	}
+}
+
+TEST_CASE("putting an existing key replaces its resource") {
+	blob_cache cache(100);
+	cache.put("a", make_blob(10));
+	cache.put("b", make_blob(20));
+
+	const auto replacement = make_blob(40);
+	cache.put("a", replacement);
+	CHECK(cache.size() == 2);
+	CHECK(cache.bytes() == 60);
+	CHECK(cache.get("a") == replacement);
+
+	// Replacing also counts as a use, leaving b to go first
+	cache.put("c", make_blob(50));
+	CHECK_FALSE(cache.get("b"));
+	CHECK(cache.get("a") == replacement);
+
+	CHECK_THROWS_AS(cache.put("d", nullptr), std::runtime_error);
+}
+
+TEST_CASE("trimming skips entries that are still referenced") {
+	blob_cache cache(100);
+	auto       held = make_blob(60);
+	cache.put("held", held);
+	cache.put("free", make_blob(30));
+
+	// The held entry is the oldest, but only the free one may go
+	cache.setBudget(50);
+	CHECK(cache.size() == 1);
+	CHECK(cache.bytes() == 60);
+	CHECK(cache.get("held") == held);
+
+	// Once the last outside reference is dropped, the next trim evicts it
+	held.reset();
+	cache.trim();
+	CHECK(cache.size() == 0);
+	CHECK(cache.bytes() == 0);
+}
+
+TEST_CASE("resource caches count hits, misses and evictions") {
+	blob_cache cache(20);
+	cache.put("a", make_blob(10));
+	cache.put("b", make_blob(10));
+
+	CHECK(cache.get("a"));
+	CHECK(cache.get("b"));
+	CHECK_FALSE(cache.get("c"));
+	cache.put("c", make_blob(20));
+
+	const ResourceCacheStatistics& statistics = cache.statistics();
+	CHECK(statistics.hits == 2);
+	CHECK(statistics.misses == 1);
+	CHECK(statistics.evictions == 2);
+}
+
+TEST_CASE("concurrent requests for one key load it once") {
+	concurrent_blob_cache    cache;
+	std::atomic<std::size_t> loads = 0;
+	const auto               futures =
+	  request_together(cache, "a", [&] {
+		  ++loads;
+		  return make_blob(10);
+	  });
+
+	CHECK(loads == 1);
+	const std::shared_ptr<blob> loaded = futures.front().get();
+	for(const auto& future: futures) { CHECK(future.get() == loaded); }
+
+	// Everyone but the loading thread joined the load in flight
+	const ResourceCacheStatistics statistics = cache.statistics();
+	CHECK(statistics.hits == REQUESTERS - 1);
+	CHECK(statistics.misses == 1);
+
+	SUBCASE("later requests hit the cache") {
+		CHECK(cache.get_or_load("a", [] { return make_blob(10); }).get() ==
+		      loaded);
+		CHECK(cache.statistics().hits == REQUESTERS);
+		CHECK(cache.statistics().misses == 1);
+	}
+}
+
+TEST_CASE("a failed concurrent load reaches every waiter and is retried") {
+	concurrent_blob_cache cache;
+	const auto            futures =
+	  request_together(cache, "a", []() -> std::shared_ptr<blob> {
+		  throw std::runtime_error("corrupt");
+	  });
+	for(const auto& future: futures) {
+		CHECK_THROWS_AS(future.get(), std::runtime_error);
+	}
+	CHECK_FALSE(cache.get("a"));
+
+	const auto retried = cache.get_or_load("a", [] { return make_blob(10); });
+	CHECK(retried.get()->bytes == 10);
+	CHECK(cache.statistics().misses == 2);
+}
+
+TEST_CASE("concurrent caches keep one budget over all shards") {
+	concurrent_blob_cache cache(100);
+
+	// More than a shard's share of the budget, yet it fits the whole cache
+	cache.put("a", make_blob(60));
+	CHECK(cache.get("a"));
+	CHECK(cache.bytes() == 60);
+
+	cache.put("b", make_blob(30));
+	CHECK(cache.bytes() == 90);
+
+	// Over budget, the entries nobody holds go until it fits again
+	const auto held = make_blob(30);
+	cache.put("c", held);
+	CHECK(cache.bytes() <= 100);
+	CHECK(cache.get("c") == held);
+
+	cache.set_budget(0);
+	CHECK(cache.bytes() == 30);
+	CHECK(cache.statistics().evictions == 2);
+}
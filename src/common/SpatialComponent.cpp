@@ -1,6 +1,8 @@
 #include "SpatialComponent.hpp"
 
 #include <plog/Log.h>
+#include <stdexcept>
+#include <utility>
 
 using namespace plog;
 using namespace glm;
@@ -9,56 +11,93 @@ const vec4 SpatialComponent::canonicalForward = vec4(0.0f, 0.0f, -1.0f, 0.0f);
 const vec4 SpatialComponent::canonicalUp      = vec4(0.0f, 1.0f, 0.0f, 0.0f);
 const vec4 SpatialComponent::canonicalLeft    = vec4(-1.0f, 0.0f, 0.0f, 0.0f);
 
-SpatialComponent::SpatialComponent()
-  : m_orientation(quat(0.0f, 0.0f, 1.0f, 0.0f))
-  , m_position(vec4(0.0f, 0.0f, 0.0f, 0.0f)) {}
+SpatialComponent::SpatialComponent(TransformStore& store)
+  : m_store(&store), m_id(store.create()) {}
 
-// Moving the given amount along the axes defined by m_orientation.
+SpatialComponent::~SpatialComponent() {
+	if(m_store) { m_store->destroy(m_id); }
+}
+
+SpatialComponent::SpatialComponent(SpatialComponent&& other) noexcept
+  : m_store(std::exchange(other.m_store, nullptr)), m_id(other.m_id) {}
+
+SpatialComponent&
+SpatialComponent::operator=(SpatialComponent&& other) noexcept {
+	if(this != &other) {
+		if(m_store) { m_store->destroy(m_id); }
+		m_store = std::exchange(other.m_store, nullptr);
+		m_id    = other.m_id;
+	}
+	return *this;
+}
+
+// Moving the given amount along the axes defined by the orientation. The
+// rotated canonical axes are columns of the rotation matrix, so only those
+// three columns are computed (the same terms glm::mat4_cast uses).
 void SpatialComponent::translate(float longitude,
                                  float latitude,
                                  float altitude) {
-	const mat4 orientationMatrix = mat4_cast(m_orientation);
+	const quat q = m_store->orientation(m_id);
 
-	const vec4 forward = orientationMatrix * canonicalForward;
-	const vec4 up      = orientationMatrix * canonicalUp;
-	const vec4 left    = orientationMatrix * canonicalLeft;
+	const vec3 right(1.0f - 2.0f * (q.y * q.y + q.z * q.z),
+	                 2.0f * (q.x * q.y + q.w * q.z),
+	                 2.0f * (q.x * q.z - q.w * q.y));
+	const vec3 up(2.0f * (q.x * q.y - q.w * q.z),
+	              1.0f - 2.0f * (q.x * q.x + q.z * q.z),
+	              2.0f * (q.y * q.z + q.w * q.x));
+	const vec3 back(2.0f * (q.x * q.z + q.w * q.y),
+	                2.0f * (q.y * q.z - q.w * q.x),
+	                1.0f - 2.0f * (q.x * q.x + q.y * q.y));
 
-	const vec4 longVec = forward * longitude;
-	const vec4 latVec  = left * latitude;
-	const vec4 altVec  = up * altitude;
+	const vec3 longVec = -back * longitude;
+	const vec3 latVec  = -right * latitude;
+	const vec3 altVec  = up * altitude;
 
-	m_position += longVec + latVec + altVec;
+	m_store->setPosition(m_id,
+	                     m_store->position(m_id) + longVec + latVec + altVec);
 }
 
-// Rotates around the axes defined by m_orientation by the given amounts in
-// degrees. Each call to rotate() updates m_orientation, so rotations do not
+// Rotates around the axes defined by the orientation by the given amounts in
+// degrees. Each call to rotate() updates the orientation, so rotations do not
 // compose additively.
 void SpatialComponent::rotate(float roll, float pitch, float yaw) {
 	const float rollRad  = radians(roll);
 	const float pitchRad = radians(pitch);
 	const float yawRad   = radians(yaw);
 	const quat  rotationQuat(vec3(pitchRad, yawRad, rollRad));
-	m_orientation *= rotationQuat;
+	m_store->setOrientation(m_id, m_store->orientation(m_id) * rotationQuat);
 }
 
 // Directly sets the orientation, overriding any previous values.
 void SpatialComponent::setOrientation(float rad, float x, float y, float z) {
-	m_orientation = quat(rad, x, y, z);
+	m_store->setOrientation(m_id, quat(rad, x, y, z));
 }
 
 // Directly sets the position, overriding any previous values.
 void SpatialComponent::setPosition(float x, float y, float z) {
-	m_position = vec4(x, y, z, 0);
+	m_store->setPosition(m_id, vec3(x, y, z));
 }
 
-const vec4& SpatialComponent::position() const { return m_position; }
+void SpatialComponent::attachTo(const SpatialComponent& parent) {
+	if(parent.m_store != m_store) {
+		throw std::runtime_error("parent belongs to another transform store");
+	}
+	m_store->setParent(m_id, parent.m_id);
+}
 
-const quat& SpatialComponent::orientation() const { return m_orientation; }
+void SpatialComponent::detach() {
+	m_store->setParent(m_id, TransformStore::NONE);
+}
 
-// Computes a 4x4 matrix representing the complete world-space transformation
-const mat4 SpatialComponent::matrix() const {
-	const mat4 rotationMatrix    = mat4_cast(m_orientation);
-	const mat4 translationMatrix = glm::translate(mat4(), vec3(m_position));
+const vec4 SpatialComponent::position() const {
+	return vec4(m_store->position(m_id), 0.0f);
+}
 
-	return translationMatrix * rotationMatrix;
+const quat SpatialComponent::orientation() const {
+	return m_store->orientation(m_id);
 }
+
+// The complete world-space transformation, as of the last change
+const mat4 SpatialComponent::matrix() const { return m_store->matrix(m_id); }
+
+TransformStore::Id SpatialComponent::id() const { return m_id; }
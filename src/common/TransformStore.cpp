@@ -0,0 +1,636 @@
+#include "TransformStore.hpp"
+
+#include "job_system.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	constexpr uint32_t INVALID = numeric_limits<uint32_t>::max();
+
+	// Groups of four entities computed per job in a parallel update
+	constexpr size_t BATCH_GROUPS = 256;
+
+	// The arrays are sorted again once structural changes have moved this
+	// share of the entities out of place, so sorting costs each change O(1)
+	// amortized
+	constexpr size_t OUT_OF_ORDER_SHARE = 8;
+
+	size_t padded(size_t size) {
+		return (size + PD::simd::WIDTH - 1) / PD::simd::WIDTH * PD::simd::WIDTH;
+	}
+
+	// Scalar version of the kernel in computeLocals, for single entities
+	mat4 localMatrix(const quat& q, const vec3& position) {
+		mat4 local(1.0f);
+		local[0] = vec4(1.0f - 2.0f * (q.y * q.y + q.z * q.z),
+		                2.0f * (q.x * q.y + q.w * q.z),
+		                2.0f * (q.x * q.z - q.w * q.y),
+		                0.0f);
+		local[1] = vec4(2.0f * (q.x * q.y - q.w * q.z),
+		                1.0f - 2.0f * (q.x * q.x + q.z * q.z),
+		                2.0f * (q.y * q.z + q.w * q.x),
+		                0.0f);
+		local[2] = vec4(2.0f * (q.x * q.z + q.w * q.y),
+		                2.0f * (q.y * q.z - q.w * q.x),
+		                1.0f - 2.0f * (q.x * q.x + q.y * q.y),
+		                0.0f);
+		local[3] = vec4(position, 1.0f);
+		return local;
+	}
+
+	// Reorders the first order.size() elements so that element k is the one
+	// previously at order[k]. Padding past the end is left alone.
+	template <typename T>
+	void permute(vector<T>& values, const vector<uint32_t>& order) {
+		vector<T> reordered(values);
+		for(size_t k = 0; k < order.size(); ++k) {
+			reordered[k] = values[order[k]];
+		}
+		values.swap(reordered);
+	}
+
+} // namespace
+
+TransformStore::TransformStore()
+  : m_positionX()
+  , m_positionY()
+  , m_positionZ()
+  , m_orientationX()
+  , m_orientationY()
+  , m_orientationZ()
+  , m_orientationW()
+  , m_locals()
+  , m_worlds()
+  , m_parents()
+  , m_firstChildren()
+  , m_nextSiblings()
+  , m_previousSiblings()
+  , m_dirty()
+  , m_dirtyIds()
+  , m_outOfOrder(0)
+  , m_denseToId()
+  , m_idToDense()
+  , m_freeIds()
+  , m_size(0) {}
+
+// Inputs and local matrices are kept padded to the SIMD width, so the kernel
+// never needs a scalar tail. Padding lanes compute garbage nobody reads.
+void TransformStore::resize(size_t size) {
+	const size_t capacity = padded(size);
+	for(vector<float>* component: {&m_positionX,
+	                               &m_positionY,
+	                               &m_positionZ,
+	                               &m_orientationX,
+	                               &m_orientationY,
+	                               &m_orientationZ,
+	                               &m_orientationW}) {
+		component->resize(capacity, 0.0f);
+	}
+	m_locals.resize(capacity);
+	m_worlds.resize(size);
+	m_parents.resize(size);
+	m_firstChildren.resize(size);
+	m_nextSiblings.resize(size);
+	m_previousSiblings.resize(size);
+	m_dirty.resize(size);
+	m_denseToId.resize(size);
+	m_size = size;
+}
+
+void TransformStore::markDirty(size_t index) {
+	if(!m_dirty[index]) {
+		m_dirty[index] = 1;
+		m_dirtyIds.push_back(m_denseToId[index]);
+	}
+}
+
+// Makes index the first child of parentIndex, or a root if that is NONE
+void TransformStore::link(uint32_t index, uint32_t parentIndex) {
+	m_parents[index]          = parentIndex;
+	m_previousSiblings[index] = NONE;
+	m_nextSiblings[index]     = NONE;
+	if(parentIndex == NONE) { return; }
+
+	const uint32_t next = m_firstChildren[parentIndex];
+	m_nextSiblings[index] = next;
+	if(next != NONE) { m_previousSiblings[next] = index; }
+	m_firstChildren[parentIndex] = index;
+}
+
+void TransformStore::unlink(uint32_t index) {
+	const uint32_t previous = m_previousSiblings[index];
+	const uint32_t next     = m_nextSiblings[index];
+	if(previous != NONE) {
+		m_nextSiblings[previous] = next;
+	} else if(m_parents[index] != NONE) {
+		m_firstChildren[m_parents[index]] = next;
+	}
+	if(next != NONE) { m_previousSiblings[next] = previous; }
+	link(index, NONE);
+}
+
+// New entities are roots at the end, which keeps parents ahead of children
+TransformStore::Id TransformStore::create() {
+	Id id;
+	if(m_freeIds.empty()) {
+		id = static_cast<Id>(m_idToDense.size());
+		m_idToDense.push_back(INVALID);
+	} else {
+		id = m_freeIds.back();
+		m_freeIds.pop_back();
+	}
+
+	const size_t index = m_size;
+	resize(m_size + 1);
+	m_denseToId[index] = id;
+	m_idToDense[id]    = static_cast<uint32_t>(index);
+
+	// Same defaults SpatialComponent has always had
+	m_positionX[index]     = 0.0f;
+	m_positionY[index]     = 0.0f;
+	m_positionZ[index]     = 0.0f;
+	m_orientationX[index]  = 0.0f;
+	m_orientationY[index]  = 1.0f;
+	m_orientationZ[index]  = 0.0f;
+	m_orientationW[index]  = 0.0f;
+	m_firstChildren[index] = NONE;
+	m_dirty[index]         = 0;
+	link(static_cast<uint32_t>(index), NONE);
+	markDirty(index);
+	return id;
+}
+
+// The last entity moves into the freed slot, keeping the arrays dense. Only
+// the children of the two entities and the siblings of the moved one are
+// touched; the hierarchy order is left for update() to restore.
+void TransformStore::destroy(Id id) {
+	const uint32_t index = m_idToDense.at(id);
+	if(index == INVALID) { throw runtime_error("transform destroyed twice"); }
+
+	while(m_firstChildren[index] != NONE) {
+		const uint32_t child = m_firstChildren[index];
+		unlink(child);
+		markDirty(child);
+	}
+	unlink(index);
+
+	const uint32_t last = static_cast<uint32_t>(m_size - 1);
+	if(index != last) {
+		for(vector<float>* component: {&m_positionX,
+		                               &m_positionY,
+		                               &m_positionZ,
+		                               &m_orientationX,
+		                               &m_orientationY,
+		                               &m_orientationZ,
+		                               &m_orientationW}) {
+			(*component)[index] = (*component)[last];
+		}
+		m_locals[index]                 = m_locals[last];
+		m_worlds[index]                 = m_worlds[last];
+		m_parents[index]                = m_parents[last];
+		m_firstChildren[index]          = m_firstChildren[last];
+		m_nextSiblings[index]           = m_nextSiblings[last];
+		m_previousSiblings[index]       = m_previousSiblings[last];
+		m_dirty[index]                  = m_dirty[last];
+		m_denseToId[index]              = m_denseToId[last];
+		m_idToDense[m_denseToId[index]] = index;
+
+		// Everything linking to the last slot now links to the freed one
+		for(uint32_t child = m_firstChildren[index]; child != NONE;
+		    child          = m_nextSiblings[child]) {
+			m_parents[child] = index;
+		}
+		const uint32_t previous = m_previousSiblings[index];
+		if(previous != NONE) {
+			m_nextSiblings[previous] = index;
+		} else if(m_parents[index] != NONE) {
+			m_firstChildren[m_parents[index]] = index;
+		}
+		if(m_nextSiblings[index] != NONE) {
+			m_previousSiblings[m_nextSiblings[index]] = index;
+		}
+		++m_outOfOrder;
+	}
+
+	m_idToDense[id] = INVALID;
+	m_freeIds.push_back(id);
+	resize(last);
+}
+
+vec3 TransformStore::position(Id id) const {
+	const size_t index = m_idToDense[id];
+	return {m_positionX[index], m_positionY[index], m_positionZ[index]};
+}
+
+quat TransformStore::orientation(Id id) const {
+	const size_t index = m_idToDense[id];
+	return quat(m_orientationW[index],
+	            m_orientationX[index],
+	            m_orientationY[index],
+	            m_orientationZ[index]);
+}
+
+TransformStore::Id TransformStore::parent(Id id) const {
+	const uint32_t parentIndex = m_parents[m_idToDense[id]];
+	return parentIndex == NONE ? NONE : m_denseToId[parentIndex];
+}
+
+void TransformStore::setPosition(Id id, const vec3& position) {
+	const size_t index = m_idToDense[id];
+	m_positionX[index] = position.x;
+	m_positionY[index] = position.y;
+	m_positionZ[index] = position.z;
+	markDirty(index);
+}
+
+void TransformStore::setOrientation(Id id, const quat& orientation) {
+	const size_t index    = m_idToDense[id];
+	m_orientationX[index] = orientation.x;
+	m_orientationY[index] = orientation.y;
+	m_orientationZ[index] = orientation.z;
+	m_orientationW[index] = orientation.w;
+	markDirty(index);
+}
+
+void TransformStore::setParent(Id id, Id parent) {
+	const uint32_t index       = m_idToDense[id];
+	const uint32_t parentIndex = parent == NONE ? NONE : m_idToDense[parent];
+	for(uint32_t ancestor = parentIndex; ancestor != NONE;
+	    ancestor          = m_parents[ancestor]) {
+		if(ancestor == index) {
+			throw runtime_error("transform would become its own ancestor");
+		}
+	}
+
+	unlink(index);
+	link(index, parentIndex);
+	++m_outOfOrder;
+	markDirty(index);
+}
+
+mat4 TransformStore::matrix(Id id) const {
+	const size_t index = m_idToDense[id];
+
+	bool stale = false;
+	for(uint32_t i = static_cast<uint32_t>(index); i != NONE; i = m_parents[i]) {
+		stale = stale || m_dirty[i];
+	}
+	if(!stale) { return m_worlds[index]; }
+
+	const auto local = [this](size_t i) {
+		return m_dirty[i] ? localMatrix(orientation(m_denseToId[i]),
+		                                position(m_denseToId[i]))
+		                  : m_locals[i];
+	};
+
+	mat4 world = local(index);
+	for(uint32_t i = m_parents[index]; i != NONE; i = m_parents[i]) {
+		world = local(i) * world;
+	}
+	return world;
+}
+
+// Breadth-first traversal from the roots, which also leaves the children of
+// every entity next to each other
+void TransformStore::restoreOrder() {
+	vector<uint32_t> order;
+	order.reserve(m_size);
+	for(size_t i = 0; i < m_size; ++i) {
+		if(m_parents[i] == NONE) { order.push_back(static_cast<uint32_t>(i)); }
+	}
+	for(size_t head = 0; head < order.size(); ++head) {
+		for(uint32_t child = m_firstChildren[order[head]]; child != NONE;
+		    child          = m_nextSiblings[child]) {
+			order.push_back(child);
+		}
+	}
+
+	vector<uint32_t> newIndex(m_size);
+	for(size_t k = 0; k < m_size; ++k) {
+		newIndex[order[k]] = static_cast<uint32_t>(k);
+	}
+
+	for(vector<float>* component: {&m_positionX,
+	                               &m_positionY,
+	                               &m_positionZ,
+	                               &m_orientationX,
+	                               &m_orientationY,
+	                               &m_orientationZ,
+	                               &m_orientationW}) {
+		permute(*component, order);
+	}
+	permute(m_locals, order);
+	permute(m_worlds, order);
+	permute(m_dirty, order);
+	permute(m_denseToId, order);
+	for(vector<uint32_t>* links: {&m_parents,
+	                              &m_firstChildren,
+	                              &m_nextSiblings,
+	                              &m_previousSiblings}) {
+		permute(*links, order);
+		for(uint32_t& target: *links) {
+			if(target != NONE) { target = newIndex[target]; }
+		}
+	}
+
+	for(size_t k = 0; k < m_size; ++k) {
+		m_idToDense[m_denseToId[k]] = static_cast<uint32_t>(k);
+	}
+	m_outOfOrder = 0;
+}
+
+// Expands the quaternions into rotation matrices exactly like glm::mat4_cast
+// (which does not normalize either) and appends the translation column.
+// Each group of four entities is computed lane-wise, then transposed so that
+// every matrix is written out contiguously.
+void TransformStore::computeLocals(size_t first, size_t last) {
+	using namespace PD::simd;
+
+	const float4 zero = broadcast(0.0f);
+	const float4 one  = broadcast(1.0f);
+	const float4 two  = broadcast(2.0f);
+
+	for(size_t i = first; i < last; i += WIDTH) {
+		const float4 x = load(&m_orientationX[i]);
+		const float4 y = load(&m_orientationY[i]);
+		const float4 z = load(&m_orientationZ[i]);
+		const float4 w = load(&m_orientationW[i]);
+
+		const float4 xx = x * x, yy = y * y, zz = z * z;
+		const float4 xy = x * y, xz = x * z, yz = y * z;
+		const float4 wx = w * x, wy = w * y, wz = w * z;
+
+		float4 columns[4][4] = {
+		  {one - two * (yy + zz), two * (xy + wz), two * (xz - wy), zero},
+		  {two * (xy - wz), one - two * (xx + zz), two * (yz + wx), zero},
+		  {two * (xz + wy), two * (yz - wx), one - two * (xx + yy), zero},
+		  {load(&m_positionX[i]),
+		   load(&m_positionY[i]),
+		   load(&m_positionZ[i]),
+		   one}};
+
+		for(int column = 0; column < 4; ++column) {
+			float4* lanes = columns[column];
+			transpose(lanes[0], lanes[1], lanes[2], lanes[3]);
+			for(int lane = 0; lane < WIDTH; ++lane) {
+				store(&m_locals[i + lane][column][0], lanes[lane]);
+			}
+		}
+	}
+}
+
+vector<uint32_t> TransformStore::collectDirty() {
+	vector<uint32_t> dirty;
+	dirty.reserve(m_dirtyIds.size());
+	for(Id id: m_dirtyIds) {
+		// Ids may have been destroyed, or destroyed and reused, since
+		const uint32_t index = id < m_idToDense.size() ? m_idToDense[id] : INVALID;
+		if(index != INVALID && m_dirty[index]) { dirty.push_back(index); }
+	}
+	m_dirtyIds.clear();
+
+	sort(dirty.begin(), dirty.end());
+	dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+	return dirty;
+}
+
+// Each dirty entity's subtree is recomputed top-down. Entities below a dirty
+// ancestor are left to it, so no subtree is computed twice, whether or not
+// the arrays are in order.
+void TransformStore::propagate(span<const uint32_t> dirty) {
+	vector<uint32_t> pending;
+	for(uint32_t root: dirty) {
+		if(!m_dirty[root]) { continue; }
+		bool covered = false;
+		for(uint32_t ancestor = m_parents[root]; ancestor != NONE && !covered;
+		    ancestor          = m_parents[ancestor]) {
+			covered = m_dirty[ancestor];
+		}
+		if(covered) { continue; }
+
+		pending.push_back(root);
+		while(!pending.empty()) {
+			const uint32_t i = pending.back();
+			pending.pop_back();
+
+			const uint32_t parentIndex = m_parents[i];
+			m_worlds[i] = parentIndex == NONE ? m_locals[i]
+			                                  : m_worlds[parentIndex] * m_locals[i];
+			m_dirty[i]  = 0;
+
+			for(uint32_t child = m_firstChildren[i]; child != NONE;
+			    child          = m_nextSiblings[child]) {
+				pending.push_back(child);
+			}
+		}
+	}
+}
+
+void TransformStore::update() {
+	if(m_outOfOrder * OUT_OF_ORDER_SHARE > m_size) { restoreOrder(); }
+	const vector<uint32_t> dirty = collectDirty();
+
+	size_t computed = numeric_limits<size_t>::max();
+	for(uint32_t index: dirty) {
+		const size_t group = index / PD::simd::WIDTH * PD::simd::WIDTH;
+		if(group != computed) {
+			computeLocals(group, group + PD::simd::WIDTH);
+			computed = group;
+		}
+	}
+	propagate(dirty);
+}
+
+// Local matrices are independent and computed in parallel; propagation
+// follows the hierarchy and stays on the calling thread
+void TransformStore::update(PD::JobSystem& jobs) {
+	if(m_outOfOrder * OUT_OF_ORDER_SHARE > m_size) { restoreOrder(); }
+	const vector<uint32_t> dirty = collectDirty();
+
+	vector<size_t> groups;
+	for(uint32_t index: dirty) {
+		const size_t group = index / PD::simd::WIDTH * PD::simd::WIDTH;
+		if(groups.empty() || groups.back() != group) { groups.push_back(group); }
+	}
+	jobs.parallel_for(0,
+	                  groups.size(),
+	                  BATCH_GROUPS,
+	                  [this, &groups](size_t first, size_t last) {
+		                  for(size_t g = first; g < last; ++g) {
+			                  computeLocals(groups[g], groups[g] + PD::simd::WIDTH);
+		                  }
+	                  });
+	propagate(dirty);
+}
+
+size_t TransformStore::size() const { return m_size; }
+
+size_t TransformStore::indexOf(Id id) const { return m_idToDense[id]; }
+
+span<const mat4> TransformStore::matrices() const {
+	return {m_worlds.data(), m_size};
+}
+
+namespace {
+
+	// World matrix of id built the obvious way, one ancestor at a time
+	mat4 reference(const TransformStore& store, TransformStore::Id id) {
+		const mat4 local = translate(mat4(1.0f), store.position(id)) *
+		                   mat4_cast(store.orientation(id));
+		const TransformStore::Id parent = store.parent(id);
+		return parent == TransformStore::NONE ? local
+		                                      : reference(store, parent) * local;
+	}
+
+	bool close(const mat4& a, const mat4& b) {
+		for(int column = 0; column < 4; ++column) {
+			for(int row = 0; row < 4; ++row) {
+				if(std::abs(a[column][row] - b[column][row]) > 1e-4f) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool isAncestor(const TransformStore& store,
+	                TransformStore::Id    ancestor,
+	                TransformStore::Id    id) {
+		for(; id != TransformStore::NONE; id = store.parent(id)) {
+			if(id == ancestor) { return true; }
+		}
+		return false;
+	}
+
+} // namespace
+
+TEST_CASE("world matrices match translate times mat4_cast down the hierarchy") {
+	mt19937                          random(7);
+	uniform_real_distribution<float> coordinate(-10.0f, 10.0f);
+	uniform_real_distribution<float> component(-1.0f, 1.0f);
+	const auto randomize = [&](TransformStore& store, TransformStore::Id id) {
+		store.setPosition(
+		  id, {coordinate(random), coordinate(random), coordinate(random)});
+		store.setOrientation(id,
+		                     normalize(quat(component(random),
+		                                    component(random),
+		                                    component(random),
+		                                    component(random))));
+	};
+
+	// An entity count that is no multiple of the SIMD width, parented to
+	// earlier entities, then some destroyed and some moved under later ones
+	TransformStore             store;
+	vector<TransformStore::Id> ids;
+	for(uint32_t i = 0; i < 103; ++i) {
+		ids.push_back(store.create());
+		randomize(store, ids.back());
+		if(i > 0 && i % 5 != 0) {
+			store.setParent(ids.back(), ids[random() % (ids.size() - 1)]);
+		}
+	}
+	vector<TransformStore::Id> alive;
+	for(size_t i = 0; i < ids.size(); ++i) {
+		if(i % 9 == 0) {
+			store.destroy(ids[i]);
+		} else {
+			alive.push_back(ids[i]);
+		}
+	}
+	ids.swap(alive);
+	for(size_t i = 0; i < 10; ++i) {
+		const TransformStore::Id id     = ids[i];
+		const TransformStore::Id parent = ids[ids.size() - 1 - i];
+		if(!isAncestor(store, id, parent)) { store.setParent(id, parent); }
+	}
+
+	const auto matchesReference = [&] {
+		for(TransformStore::Id id: ids) {
+			CHECK(close(store.matrices()[store.indexOf(id)], reference(store, id)));
+		}
+	};
+
+	// Single matrices are computed on demand before any update
+	for(TransformStore::Id id: ids) {
+		CHECK(close(store.matrix(id), reference(store, id)));
+	}
+
+	store.update();
+	CHECK(store.size() == ids.size());
+	matchesReference();
+
+	// Breadth-first order puts every parent ahead of its children
+	for(TransformStore::Id id: ids) {
+		const TransformStore::Id parent = store.parent(id);
+		if(parent != TransformStore::NONE) {
+			CHECK(store.indexOf(parent) < store.indexOf(id));
+		}
+	}
+
+	SUBCASE("moving an ancestor updates its whole subtree") {
+		for(TransformStore::Id id: ids) {
+			if(store.parent(id) == TransformStore::NONE) {
+				randomize(store, id);
+				break;
+			}
+		}
+		store.update();
+		matchesReference();
+	}
+
+	SUBCASE("parallel updates compute the same matrices") {
+		PD::JobSystem jobs(2);
+		for(size_t i = 0; i < ids.size(); i += 3) { randomize(store, ids[i]); }
+		store.update(jobs);
+		matchesReference();
+	}
+}
+
+TEST_CASE("destroying an entity frees its children without resorting") {
+	// A root with a chain below it, and a second root after the chain
+	TransformStore             store;
+	vector<TransformStore::Id> chain;
+	for(uint32_t i = 0; i < 40; ++i) {
+		chain.push_back(store.create());
+		store.setPosition(chain.back(), {float(i), 1.0f, 0.0f});
+		store.setOrientation(chain.back(), quat(1.0f, 0.0f, 0.0f, 0.0f));
+		if(i > 0) { store.setParent(chain.back(), chain[i - 1]); }
+	}
+	const TransformStore::Id other = store.create();
+	store.setPosition(other, {0.0f, 0.0f, 5.0f});
+	store.setOrientation(other, quat(1.0f, 0.0f, 0.0f, 0.0f));
+	store.update();
+
+	// The last entity moves into the freed slot, ahead of its parent; one
+	// move is too few to sort the arrays again
+	store.destroy(chain[10]);
+	store.setParent(other, chain[30]);
+	store.update();
+	CHECK(store.indexOf(other) < store.indexOf(chain[30]));
+
+	CHECK(store.parent(chain[11]) == TransformStore::NONE);
+	CHECK(store.parent(chain[12]) == chain[11]);
+	for(size_t i = 0; i < chain.size(); ++i) {
+		if(i == 10) { continue; }
+		CHECK(close(store.matrices()[store.indexOf(chain[i])],
+		            reference(store, chain[i])));
+	}
+	CHECK(close(store.matrices()[store.indexOf(other)], reference(store, other)));
+
+	SUBCASE("out of order entities still follow their ancestors") {
+		store.setPosition(chain[20], {0.0f, -3.0f, 0.0f});
+		store.update();
+		CHECK(
+		  close(store.matrices()[store.indexOf(other)], reference(store, other)));
+	}
+}
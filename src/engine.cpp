@@ -0,0 +1,12 @@
+#include "engine.hpp"
+
+namespace PD {
+
+	Engine::Engine(unsigned workers)
+	  : m_jobs(workers), m_graph(), m_subsystems() {}
+
+	void Engine::update(double delta) { m_graph.run(m_jobs, delta); }
+
+	JobSystem& Engine::jobs() { return m_jobs; }
+
+} // namespace PD
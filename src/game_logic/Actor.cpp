@@ -3,6 +3,7 @@
 #include "RenderComponent.hpp"
 #include "SpatialComponent.hpp"
 
-Actor::Actor(const std::string& name) {
+Actor::Actor(const std::string& name, TransformStore& transforms)
+  : m_renderComponent(), m_spatialComponent(transforms) {
 	// TODO: Load Actor from file
 }
@@ -0,0 +1,478 @@
+#include "DynamicBvh.hpp"
+
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	using PD::aabb;
+
+	aabb merge(const aabb& a, const aabb& b) {
+		return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+	}
+
+	bool contains(const aabb& outer, const aabb& inner) {
+		return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y &&
+		       outer.min.z <= inner.min.z && inner.max.x <= outer.max.x &&
+		       inner.max.y <= outer.max.y && inner.max.z <= outer.max.z;
+	}
+
+	// Half the surface area, which is all the insertion cost needs
+	float area(const aabb& box) {
+		const vec3 size = box.max - box.min;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	// Bit p of planes is set while the box may still be behind plane p. The
+	// box is dropped once it is behind any plane, and a plane is cleared once
+	// the box is entirely in front of it.
+	bool clip(const PD::frustum& frustum, const aabb& box, unsigned& planes) {
+		const vec3 center = (box.min + box.max) * 0.5f;
+		const vec3 extent = (box.max - box.min) * 0.5f;
+		for(unsigned p = 0; p < 6; ++p) {
+			if(!(planes & (1u << p))) { continue; }
+
+			const vec4& plane  = frustum.planes[p];
+			const float middle = dot(vec3(plane), center) + plane.w;
+			const float reach  = dot(abs(vec3(plane)), extent);
+			if(middle + reach < 0.0f) { return false; }
+			if(middle - reach >= 0.0f) { planes &= ~(1u << p); }
+		}
+		return true;
+	}
+
+	bool overlaps(const aabb& box, const vec3& center, float radius) {
+		const vec3 nearest = clamp(center, box.min, box.max);
+		return dot(nearest - center, nearest - center) <= radius * radius;
+	}
+
+	// Slab test. Returns the distance at which the ray enters the box, or
+	// nothing if it misses it before max_distance.
+	optional<float> entry(const PD::ray& ray,
+	                      const vec3&    inverse_direction,
+	                      const aabb&    box,
+	                      float          max_distance) {
+		float enter = 0.0f;
+		float leave = max_distance;
+		for(int axis = 0; axis < 3; ++axis) {
+			float t0 = (box.min[axis] - ray.origin[axis]) * inverse_direction[axis];
+			float t1 = (box.max[axis] - ray.origin[axis]) * inverse_direction[axis];
+			if(t0 > t1) { swap(t0, t1); }
+			// NaN from 0 * inf, a ray along a slab face, compares false and
+			// leaves the interval alone
+			enter = t0 > enter ? t0 : enter;
+			leave = t1 < leave ? t1 : leave;
+			if(enter > leave) { return nullopt; }
+		}
+		return enter;
+	}
+
+} // namespace
+
+namespace PD {
+
+	DynamicBvh::DynamicBvh(float margin) : m_margin(margin) {}
+
+	DynamicBvh::proxy DynamicBvh::allocate() {
+		if(m_free == NONE) {
+			m_nodes.push_back({});
+			m_free                 = static_cast<proxy>(m_nodes.size() - 1);
+			m_nodes[m_free].parent = NONE;
+		}
+		const proxy index = m_free;
+		m_free            = m_nodes[index].parent;
+
+		node& allocated       = m_nodes[index];
+		allocated.parent      = NONE;
+		allocated.children[0] = NONE;
+		allocated.children[1] = NONE;
+		allocated.height      = 0;
+		allocated.user        = 0;
+		return index;
+	}
+
+	void DynamicBvh::release(proxy index) {
+		m_nodes[index].parent = m_free;
+		m_nodes[index].height = -1;
+		m_free                = index;
+	}
+
+	DynamicBvh::proxy DynamicBvh::insert(const aabb& box, uint32_t user) {
+		const proxy leaf    = allocate();
+		const vec3  margin  = vec3(m_margin);
+		m_nodes[leaf].box   = {box.min - margin, box.max + margin};
+		m_nodes[leaf].exact = box;
+		m_nodes[leaf].user  = user;
+		insert_leaf(leaf);
+		++m_size;
+		return leaf;
+	}
+
+	void DynamicBvh::remove(proxy leaf) {
+		if(leaf >= m_nodes.size() || !m_nodes[leaf].leaf() ||
+		   m_nodes[leaf].height != 0) {
+			throw runtime_error("not a leaf of this hierarchy");
+		}
+		remove_leaf(leaf);
+		release(leaf);
+		--m_size;
+	}
+
+	bool DynamicBvh::move(proxy leaf, const aabb& box, const vec3& displacement) {
+		node& moved = m_nodes[leaf];
+		moved.exact = box;
+		if(contains(moved.box, box)) { return false; }
+
+		remove_leaf(leaf);
+		const vec3 margin = vec3(m_margin);
+		aabb       fat{box.min - margin, box.max + margin};
+		fat.min += glm::min(displacement, vec3(0.0f));
+		fat.max += glm::max(displacement, vec3(0.0f));
+		m_nodes[leaf].box = fat;
+		insert_leaf(leaf);
+		return true;
+	}
+
+	uint32_t DynamicBvh::user(proxy leaf) const { return m_nodes[leaf].user; }
+
+	const aabb& DynamicBvh::box(proxy leaf) const { return m_nodes[leaf].exact; }
+
+	size_t DynamicBvh::size() const { return m_size; }
+
+	int DynamicBvh::height() const {
+		return m_root == NONE ? 0 : m_nodes[m_root].height;
+	}
+
+	// Descends towards the sibling that adds the least surface area, stopping
+	// where making a new parent here is cheaper than going further down. The
+	// inherited cost is the growth every ancestor's box already had to accept.
+	void DynamicBvh::insert_leaf(proxy leaf) {
+		if(m_root == NONE) {
+			m_root               = leaf;
+			m_nodes[leaf].parent = NONE;
+			return;
+		}
+
+		const aabb box     = m_nodes[leaf].box;
+		proxy      sibling = m_root;
+		while(!m_nodes[sibling].leaf()) {
+			const node& current     = m_nodes[sibling];
+			const float combined    = area(merge(current.box, box));
+			const float cost        = 2.0f * combined;
+			const float inheritance = 2.0f * (combined - area(current.box));
+
+			float child_costs[2];
+			for(int c = 0; c < 2; ++c) {
+				const node& child = m_nodes[current.children[c]];
+				const float grown = area(merge(child.box, box));
+				child_costs[c] =
+				  (child.leaf() ? grown : grown - area(child.box)) + inheritance;
+			}
+
+			if(cost < child_costs[0] && cost < child_costs[1]) { break; }
+			sibling = current.children[child_costs[0] < child_costs[1] ? 0 : 1];
+		}
+
+		const proxy old_parent = m_nodes[sibling].parent;
+		const proxy parent     = allocate();
+		node&       joined     = m_nodes[parent];
+		joined.parent          = old_parent;
+		joined.box             = merge(box, m_nodes[sibling].box);
+		joined.height          = m_nodes[sibling].height + 1;
+		joined.children[0]     = sibling;
+		joined.children[1]     = leaf;
+
+		if(old_parent == NONE) {
+			m_root = parent;
+		} else {
+			proxy* slot = m_nodes[old_parent].children;
+			slot[slot[0] == sibling ? 0 : 1] = parent;
+		}
+		m_nodes[sibling].parent = parent;
+		m_nodes[leaf].parent    = parent;
+
+		refit(parent);
+	}
+
+	void DynamicBvh::remove_leaf(proxy leaf) {
+		if(leaf == m_root) {
+			m_root = NONE;
+			return;
+		}
+
+		const proxy  parent      = m_nodes[leaf].parent;
+		const proxy  grandparent = m_nodes[parent].parent;
+		const proxy* children    = m_nodes[parent].children;
+		const proxy  sibling     = children[children[0] == leaf ? 1 : 0];
+
+		if(grandparent == NONE) {
+			m_root                  = sibling;
+			m_nodes[sibling].parent = NONE;
+			release(parent);
+			return;
+		}
+
+		proxy* slot = m_nodes[grandparent].children;
+		slot[slot[0] == parent ? 0 : 1] = sibling;
+		m_nodes[sibling].parent         = grandparent;
+		release(parent);
+		refit(grandparent);
+	}
+
+	void DynamicBvh::refit(proxy index) {
+		while(index != NONE) {
+			index              = balance(index);
+			node&       fixed  = m_nodes[index];
+			const node& first  = m_nodes[fixed.children[0]];
+			const node& second = m_nodes[fixed.children[1]];
+			fixed.height       = 1 + std::max(first.height, second.height);
+			fixed.box          = merge(first.box, second.box);
+			index              = fixed.parent;
+		}
+	}
+
+	// If one child of a is more than one level taller than the other, the
+	// taller child takes a's place and a takes its shorter grandchild. The
+	// taller grandchild stays with the promoted node.
+	DynamicBvh::proxy DynamicBvh::balance(proxy a) {
+		if(m_nodes[a].leaf() || m_nodes[a].height < 2) { return a; }
+
+		const int difference = m_nodes[m_nodes[a].children[1]].height -
+		                       m_nodes[m_nodes[a].children[0]].height;
+		if(difference >= -1 && difference <= 1) { return a; }
+
+		// The side of a that is promoted, and the one that stays
+		const int   up    = difference > 1 ? 1 : 0;
+		const proxy stays = m_nodes[a].children[1 - up];
+		const proxy b     = m_nodes[a].children[up];
+		const proxy f     = m_nodes[b].children[0];
+		const proxy g     = m_nodes[b].children[1];
+
+		m_nodes[b].children[0] = a;
+		m_nodes[b].parent      = m_nodes[a].parent;
+		m_nodes[a].parent      = b;
+		if(m_nodes[b].parent == NONE) {
+			m_root = b;
+		} else {
+			proxy* slot = m_nodes[m_nodes[b].parent].children;
+			slot[slot[0] == a ? 0 : 1] = b;
+		}
+
+		const bool  f_taller = m_nodes[f].height > m_nodes[g].height;
+		const proxy kept     = f_taller ? f : g;
+		const proxy given    = f_taller ? g : f;
+		m_nodes[b].children[1]  = kept;
+		m_nodes[a].children[up] = given;
+		m_nodes[given].parent   = a;
+
+		m_nodes[a].box = merge(m_nodes[stays].box, m_nodes[given].box);
+		m_nodes[b].box = merge(m_nodes[a].box, m_nodes[kept].box);
+		m_nodes[a].height =
+		  1 + std::max(m_nodes[stays].height, m_nodes[given].height);
+		m_nodes[b].height =
+		  1 + std::max(m_nodes[a].height, m_nodes[kept].height);
+		return b;
+	}
+
+	void DynamicBvh::query(const frustum&    frustum,
+	                       vector<uint32_t>& found) const {
+		if(m_root == NONE) { return; }
+
+		vector<pair<proxy, unsigned>> pending{{m_root, 0x3Fu}};
+		while(!pending.empty()) {
+			auto [index, planes] = pending.back();
+			pending.pop_back();
+
+			const node& current = m_nodes[index];
+			if(planes != 0 && !clip(frustum, current.box, planes)) { continue; }
+			if(current.leaf()) {
+				if(planes == 0 || clip(frustum, current.exact, planes)) {
+					found.push_back(current.user);
+				}
+				continue;
+			}
+			pending.emplace_back(current.children[0], planes);
+			pending.emplace_back(current.children[1], planes);
+		}
+	}
+
+	void DynamicBvh::query(const vec3&       center,
+	                       float             radius,
+	                       vector<uint32_t>& found) const {
+		if(m_root == NONE) { return; }
+
+		vector<proxy> pending{m_root};
+		while(!pending.empty()) {
+			const node& current = m_nodes[pending.back()];
+			pending.pop_back();
+
+			if(!overlaps(current.box, center, radius)) { continue; }
+			if(current.leaf()) {
+				if(overlaps(current.exact, center, radius)) {
+					found.push_back(current.user);
+				}
+				continue;
+			}
+			pending.push_back(current.children[0]);
+			pending.push_back(current.children[1]);
+		}
+	}
+
+	// Subtrees are skipped once they start beyond the nearest hit so far, and
+	// the nearer child is visited first so that hits shorten the search early
+	optional<ray_hit> DynamicBvh::raycast(const ray&        ray,
+	                                      float             max_distance,
+	                                      const exact_test& exact) const {
+		if(m_root == NONE) { return nullopt; }
+
+		const vec3        inverse_direction = 1.0f / ray.direction;
+		optional<ray_hit> nearest;
+		float             limit = max_distance;
+
+		vector<pair<proxy, float>> pending{{m_root, 0.0f}};
+		while(!pending.empty()) {
+			const auto [index, start] = pending.back();
+			pending.pop_back();
+			if(start > limit) { continue; }
+
+			const node& current = m_nodes[index];
+			if(current.leaf()) {
+				optional<float> distance =
+				  entry(ray, inverse_direction, current.exact, limit);
+				if(distance && exact) { distance = exact(current.user); }
+				if(distance && *distance <= limit) {
+					limit   = *distance;
+					nearest = ray_hit{current.user, *distance};
+				}
+				continue;
+			}
+
+			optional<float> entries[2];
+			for(int c = 0; c < 2; ++c) {
+				entries[c] = entry(
+				  ray, inverse_direction, m_nodes[current.children[c]].box, limit);
+			}
+			// Pushed far side first, so the near side is popped first
+			const bool first_nearer =
+			  entries[0] && (!entries[1] || *entries[0] <= *entries[1]);
+			const int nearer = first_nearer ? 0 : 1;
+			for(int c: {1 - nearer, nearer}) {
+				if(entries[c]) {
+					pending.emplace_back(current.children[c], *entries[c]);
+				}
+			}
+		}
+		return nearest;
+	}
+
+} // namespace PD
+
+namespace {
+
+	aabb cube(const vec3& center, float half) {
+		return {center - vec3(half), center + vec3(half)};
+	}
+
+} // namespace
+
+TEST_CASE("dynamic BVH queries match a linear scan") {
+	mt19937                          random(3);
+	uniform_real_distribution<float> coordinate(-100.0f, 100.0f);
+	uniform_real_distribution<float> step(-3.0f, 3.0f);
+
+	PD::DynamicBvh                bvh;
+	vector<PD::DynamicBvh::proxy> leaves;
+	vector<aabb>                  boxes;
+	for(uint32_t i = 0; i < 2000; ++i) {
+		boxes.push_back(cube(vec3(coordinate(random),
+		                          coordinate(random),
+		                          coordinate(random)),
+		                     1.0f));
+		leaves.push_back(bvh.insert(boxes.back(), i));
+	}
+
+	// Move everything a few times, then drop every third object
+	for(int round = 0; round < 5; ++round) {
+		for(uint32_t i = 0; i < leaves.size(); ++i) {
+			const vec3 offset(step(random), step(random), step(random));
+			boxes[i] = {boxes[i].min + offset, boxes[i].max + offset};
+			bvh.move(leaves[i], boxes[i], offset);
+		}
+	}
+	for(uint32_t i = 0; i < leaves.size(); i += 3) {
+		bvh.remove(leaves[i]);
+		leaves[i] = PD::DynamicBvh::NONE;
+	}
+	const auto alive = [&](uint32_t i) {
+		return leaves[i] != PD::DynamicBvh::NONE;
+	};
+
+	CHECK(bvh.size() == 2000 - 667);
+	// A balanced tree over 1333 leaves is 11 levels deep; rotations keep it
+	// well short of the linear worst case
+	CHECK(bvh.height() < 24);
+
+	SUBCASE("sphere") {
+		const vec3       center(10.0f, -5.0f, 20.0f);
+		const float      radius = 30.0f;
+		vector<uint32_t> found, expected;
+		bvh.query(center, radius, found);
+		for(uint32_t i = 0; i < boxes.size(); ++i) {
+			const vec3 nearest = clamp(center, boxes[i].min, boxes[i].max);
+			if(alive(i) && distance(nearest, center) <= radius) {
+				expected.push_back(i);
+			}
+		}
+		sort(found.begin(), found.end());
+		CHECK(found == expected);
+	}
+
+	SUBCASE("frustum") {
+		const auto frustum = PD::frustum::from_matrix(
+		  glm::perspective(radians(60.0f), 1.0f, 1.0f, 80.0f));
+		vector<uint32_t> found, expected;
+		bvh.query(frustum, found);
+		for(uint32_t i = 0; i < boxes.size(); ++i) {
+			unsigned planes = 0x3Fu;
+			if(alive(i) && clip(frustum, boxes[i], planes)) { expected.push_back(i); }
+		}
+		sort(found.begin(), found.end());
+		CHECK(found == expected);
+	}
+
+	SUBCASE("ray") {
+		const PD::ray ray{vec3(-150.0f, 1.0f, 2.0f), vec3(1.0f, 0.01f, -0.02f)};
+		const vec3    inverse_direction = 1.0f / ray.direction;
+
+		optional<PD::ray_hit> expected;
+		for(uint32_t i = 0; i < boxes.size(); ++i) {
+			if(!alive(i)) { continue; }
+			const auto hit = entry(ray, inverse_direction, boxes[i], 1000.0f);
+			if(hit && (!expected || *hit < expected->distance)) {
+				expected = PD::ray_hit{i, *hit};
+			}
+		}
+
+		const auto hit = bvh.raycast(ray, 1000.0f);
+		REQUIRE(hit.has_value() == expected.has_value());
+		if(hit) {
+			CHECK(hit->user == expected->user);
+			CHECK(hit->distance == expected->distance);
+		}
+	}
+}
+
+TEST_CASE("dynamic BVH stays balanced when objects arrive in order") {
+	PD::DynamicBvh bvh;
+	for(uint32_t i = 0; i < 4096; ++i) {
+		bvh.insert(cube(vec3(static_cast<float>(i) * 3.0f, 0.0f, 0.0f), 1.0f), i);
+	}
+	CHECK(bvh.height() <= 20);
+}
@@ -1,5 +1,9 @@
 #include "Scene.hpp"
 
-Scene::Scene(const std::string& name) : m_ambience(1.0f) {
+Scene::Scene(const std::string& name) : m_actorIndex(), m_ambience(1.0f) {
 	// TODO: Load Scene from file
 }
+
+PD::DynamicBvh& Scene::actorIndex() { return m_actorIndex; }
+
+const PD::DynamicBvh& Scene::actorIndex() const { return m_actorIndex; }
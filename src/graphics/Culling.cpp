@@ -0,0 +1,281 @@
+#include "Culling.hpp"
+
+#include "simd.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <limits>
+#include <random>
+
+using namespace glm;
+using namespace std;
+
+namespace PD {
+
+	bounds bounds::fit(span<const vec3> points) {
+		if(points.empty()) { return {vec3(0.0f), vec3(0.0f), vec3(0.0f), 0.0f}; }
+
+		bounds result{vec3(numeric_limits<float>::max()),
+		              vec3(numeric_limits<float>::lowest()),
+		              vec3(0.0f),
+		              0.0f};
+		for(const vec3& point: points) {
+			result.min = glm::min(result.min, point);
+			result.max = glm::max(result.max, point);
+		}
+		result.center = (result.min + result.max) * 0.5f;
+		for(const vec3& point: points) {
+			result.radius = std::max(result.radius, distance(point, result.center));
+		}
+		return result;
+	}
+
+	// Gribb and Hartmann: each clip plane is the last row of the matrix plus
+	// or minus one of the others. glm matrices are indexed by column first.
+	frustum frustum::from_matrix(const mat4& view_projection) {
+		const auto row = [&](int i) {
+			return vec4(view_projection[0][i],
+			            view_projection[1][i],
+			            view_projection[2][i],
+			            view_projection[3][i]);
+		};
+
+		frustum result{{row(3) + row(0),
+		                row(3) - row(0),
+		                row(3) + row(1),
+		                row(3) - row(1),
+		                row(3) + row(2),
+		                row(3) - row(2)}};
+		for(vec4& plane: result.planes) { plane /= length(vec3(plane)); }
+		return result;
+	}
+
+	// Each world axis of the box gets the absolute contribution of every
+	// rotated and scaled model axis (Arvo's method)
+	aabb world_box(const bounds& local, const mat4& world) {
+		const vec3 extent = (local.max - local.min) * 0.5f;
+		const vec3 center =
+		  vec3(world * vec4((local.min + local.max) * 0.5f, 1.0f));
+		const vec3 world_extent = abs(vec3(world[0])) * extent.x +
+		                          abs(vec3(world[1])) * extent.y +
+		                          abs(vec3(world[2])) * extent.z;
+		return {center - world_extent, center + world_extent};
+	}
+
+	// Padding lanes stay zero; cull() masks them out
+	void box_set::resize(size_t size) {
+		const size_t capacity =
+		  (size + simd::WIDTH - 1) / simd::WIDTH * simd::WIDTH;
+		for(vector<float>* component: {&m_center_x,
+		                               &m_center_y,
+		                               &m_center_z,
+		                               &m_extent_x,
+		                               &m_extent_y,
+		                               &m_extent_z}) {
+			component->resize(capacity, 0.0f);
+		}
+		m_size = size;
+	}
+
+	size_t box_set::size() const { return m_size; }
+
+	void box_set::set(size_t index, const bounds& local, const mat4& world) {
+		const aabb box    = world_box(local, world);
+		const vec3 center = (box.min + box.max) * 0.5f;
+		const vec3 extent = (box.max - box.min) * 0.5f;
+
+		m_center_x[index] = center.x;
+		m_center_y[index] = center.y;
+		m_center_z[index] = center.z;
+		m_extent_x[index] = extent.x;
+		m_extent_y[index] = extent.y;
+		m_extent_z[index] = extent.z;
+	}
+
+	// A box is outside once it lies entirely behind any plane, which is the
+	// case when even its corner furthest along the plane normal is behind it.
+	// That corner's distance is the center's distance plus the extents
+	// weighted by the absolute normal.
+	void box_set::cull(const frustum& frustum, vector<uint32_t>& visible) const {
+		using namespace simd;
+
+		float4 normal_x[6], normal_y[6], normal_z[6], offset[6];
+		float4 abs_x[6], abs_y[6], abs_z[6];
+		for(int p = 0; p < 6; ++p) {
+			const vec4& plane = frustum.planes[p];
+			normal_x[p]       = broadcast(plane.x);
+			normal_y[p]       = broadcast(plane.y);
+			normal_z[p]       = broadcast(plane.z);
+			offset[p]         = broadcast(plane.w);
+			abs_x[p]          = broadcast(std::abs(plane.x));
+			abs_y[p]          = broadcast(std::abs(plane.y));
+			abs_z[p]          = broadcast(std::abs(plane.z));
+		}
+		const float4 zero = broadcast(0.0f);
+
+		for(size_t i = 0; i < m_size; i += WIDTH) {
+			const float4 center_x = load(&m_center_x[i]);
+			const float4 center_y = load(&m_center_y[i]);
+			const float4 center_z = load(&m_center_z[i]);
+			const float4 extent_x = load(&m_extent_x[i]);
+			const float4 extent_y = load(&m_extent_y[i]);
+			const float4 extent_z = load(&m_extent_z[i]);
+
+			float4 outside = zero;
+			for(int p = 0; p < 6; ++p) {
+				const float4 distance =
+				  normal_x[p] * center_x + normal_y[p] * center_y +
+				  normal_z[p] * center_z + offset[p] + abs_x[p] * extent_x +
+				  abs_y[p] * extent_y + abs_z[p] * extent_z;
+				outside = outside | less(distance, zero);
+			}
+
+			unsigned inside = ~static_cast<unsigned>(movemask(outside)) & 0xFu;
+			if(m_size - i < WIDTH) { inside &= (1u << (m_size - i)) - 1u; }
+			while(inside != 0) {
+				visible.push_back(static_cast<uint32_t>(i) + countr_zero(inside));
+				inside &= inside - 1u;
+			}
+		}
+	}
+
+} // namespace PD
+
+namespace {
+
+	PD::bounds unit_box() {
+		return PD::bounds::fit(
+		  vector<vec3>{vec3(-1.0f, -1.0f, -1.0f), vec3(1.0f, 1.0f, 1.0f)});
+	}
+
+	// Camera at the origin looking down -z, seeing 1 to 100 units away
+	PD::frustum test_frustum() {
+		return PD::frustum::from_matrix(
+		  perspective(radians(90.0f), 1.0f, 1.0f, 100.0f));
+	}
+
+} // namespace
+
+TEST_CASE("bounds enclose their points") {
+	const vector<vec3> points = {
+	  vec3(1.0f, 2.0f, 3.0f), vec3(-1.0f, 0.0f, 5.0f), vec3(3.0f, -2.0f, 3.0f)};
+	const PD::bounds result = PD::bounds::fit(points);
+
+	CHECK(result.min == vec3(-1.0f, -2.0f, 3.0f));
+	CHECK(result.max == vec3(3.0f, 2.0f, 5.0f));
+	CHECK(result.center == vec3(1.0f, 0.0f, 4.0f));
+	for(const vec3& point: points) {
+		CHECK(distance(point, result.center) <= result.radius);
+	}
+}
+
+TEST_CASE("frustum culling keeps boxes inside or crossing the frustum") {
+	const vec3 positions[] = {
+	  vec3(0.0f, 0.0f, -10.0f),   // inside
+	  vec3(0.0f, 0.0f, 10.0f),    // behind the camera
+	  vec3(-30.0f, 0.0f, -10.0f), // left
+	  vec3(30.0f, 0.0f, -10.0f),  // right
+	  vec3(0.0f, 30.0f, -10.0f),  // above
+	  vec3(0.0f, -30.0f, -10.0f), // below
+	  vec3(0.0f, 0.0f, -200.0f),  // beyond the far plane
+	  vec3(10.5f, 0.0f, -10.0f),  // crossing the right plane
+	  vec3(0.0f, 0.0f, -100.5f),  // crossing the far plane
+	};
+
+	PD::box_set boxes;
+	boxes.resize(size(positions));
+	for(size_t i = 0; i < size(positions); ++i) {
+		boxes.set(i, unit_box(), translate(mat4(1.0f), positions[i]));
+	}
+
+	const vector<uint32_t> expected = {0, 7, 8};
+	vector<uint32_t>       visible;
+	boxes.cull(test_frustum(), visible);
+	CHECK(visible == expected);
+}
+
+TEST_CASE("rotated boxes are enclosed by their world-space box") {
+	// Upright, the box is just outside the right plane. Rotated by 45 degrees
+	// its corners reach far enough along x to cross it.
+	const mat4 placement = translate(mat4(1.0f), vec3(12.2f, 0.0f, -10.0f));
+	const mat4 rotated =
+	  rotate(placement, radians(45.0f), vec3(0.0f, 0.0f, 1.0f));
+
+	PD::box_set boxes;
+	boxes.resize(2);
+	boxes.set(0, unit_box(), placement);
+	boxes.set(1, unit_box(), rotated);
+
+	const vector<uint32_t> expected = {1};
+	vector<uint32_t>       visible;
+	boxes.cull(test_frustum(), visible);
+	CHECK(visible == expected);
+}
+
+TEST_CASE("frustum culling matches a scalar test for random boxes") {
+	const PD::frustum frustum = test_frustum();
+
+	mt19937                          random(7);
+	uniform_real_distribution<float> coordinate(-120.0f, 120.0f);
+	uniform_real_distribution<float> extent(0.0f, 5.0f);
+
+	const size_t     count = 1001;
+	PD::box_set      boxes;
+	vector<uint32_t> expected;
+	boxes.resize(count);
+	for(size_t i = 0; i < count; ++i) {
+		const vec3 half(extent(random), extent(random), extent(random));
+		const vec3 center(
+		  coordinate(random), coordinate(random), coordinate(random));
+		const PD::bounds local{-half, half, vec3(0.0f), length(half)};
+		boxes.set(i, local, translate(mat4(1.0f), center));
+
+		bool inside = true;
+		for(const vec4& plane: frustum.planes) {
+			const float distance = dot(vec3(plane), center) + plane.w +
+			                       dot(abs(vec3(plane)), half);
+			inside = inside && distance >= 0.0f;
+		}
+		if(inside) { expected.push_back(static_cast<uint32_t>(i)); }
+	}
+
+	vector<uint32_t> visible;
+	boxes.cull(frustum, visible);
+	CHECK(visible == expected);
+}
+
+// Measures rather than tests, so it only runs when asked for with
+// run_tests --no-skip
+TEST_CASE("frustum culling benchmark" * doctest::skip()) {
+	const size_t count = 100'000;
+
+	mt19937                          random(11);
+	uniform_real_distribution<float> coordinate(-200.0f, 200.0f);
+	PD::box_set                      boxes;
+	boxes.resize(count);
+	for(size_t i = 0; i < count; ++i) {
+		const vec3 position(
+		  coordinate(random), coordinate(random), coordinate(random));
+		boxes.set(i, unit_box(), translate(mat4(1.0f), position));
+	}
+
+	const PD::frustum frustum = test_frustum();
+	vector<uint32_t>  visible;
+	visible.reserve(count);
+
+	const int  runs  = 100;
+	const auto start = chrono::steady_clock::now();
+	for(int run = 0; run < runs; ++run) {
+		visible.clear();
+		boxes.cull(frustum, visible);
+	}
+	const chrono::duration<double, micro> elapsed =
+	  chrono::steady_clock::now() - start;
+
+	MESSAGE("culled " << count << " boxes in " << elapsed.count() / runs
+	                  << " us, " << visible.size() << " visible");
+	CHECK(visible.size() < count);
+}
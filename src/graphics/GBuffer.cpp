@@ -0,0 +1,60 @@
+#include "GBuffer.hpp"
+
+#include <stdexcept>
+
+using namespace gl;
+using namespace std;
+using namespace globjects;
+
+namespace {
+
+	unique_ptr<Texture> make_target(GLenum format, int width, int height) {
+		auto texture = make_unique<Texture>(GL_TEXTURE_2D);
+		texture->storage2D(1, format, width, height);
+		// Read with texelFetch, but a texture without mipmaps is incomplete
+		// under the default minification filter
+		texture->setParameter(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		texture->setParameter(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		return texture;
+	}
+
+} // namespace
+
+namespace PD {
+
+	const GLuint GBuffer::ALBEDO_TEXTURE_UNIT   = 5;
+	const GLuint GBuffer::MATERIAL_TEXTURE_UNIT = 6;
+	const GLuint GBuffer::DEPTH_TEXTURE_UNIT    = 7;
+
+	GBuffer::GBuffer(int width, int height)
+	  : albedo_texture(make_target(GL_RGBA8, width, height))
+	  , material_texture(make_target(GL_RGBA16F, width, height))
+	  , depth_texture(make_target(GL_DEPTH24_STENCIL8, width, height))
+	  , frame_buffer(new globjects::Framebuffer())
+	  , width(width)
+	  , height(height) {
+		frame_buffer->attachTexture(GL_COLOR_ATTACHMENT0, albedo_texture.get());
+		frame_buffer->attachTexture(GL_COLOR_ATTACHMENT1, material_texture.get());
+		frame_buffer->attachTexture(GL_DEPTH_STENCIL_ATTACHMENT,
+		                            depth_texture.get());
+		frame_buffer->setDrawBuffers({GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1});
+
+		if(frame_buffer->checkStatus() != GL_FRAMEBUFFER_COMPLETE) {
+			throw runtime_error("could not build G-buffer");
+		}
+	}
+
+	void GBuffer::begin() const {
+		frame_buffer->bind(GL_FRAMEBUFFER);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		frame_buffer->clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT |
+		                    GL_STENCIL_BUFFER_BIT);
+	}
+
+	void GBuffer::bind_textures() const {
+		albedo_texture->bindActive(ALBEDO_TEXTURE_UNIT);
+		material_texture->bindActive(MATERIAL_TEXTURE_UNIT);
+		depth_texture->bindActive(DEPTH_TEXTURE_UNIT);
+	}
+
+} // namespace PD
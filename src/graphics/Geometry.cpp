@@ -1,12 +1,19 @@
 #include "Geometry.hpp"
 
+#include "MappedFile.hpp"
 #include "PMDL.hpp"
 
 #include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <fstream>
 #include <glbinding/gl/gl.h>
 #include <glm/glm.hpp>
 #include <globjects/VertexAttributeBinding.h>
+#include <limits>
 #include <plog/Log.h>
+#include <span>
 #include <vector>
 
 using namespace std;
@@ -14,66 +21,519 @@ using namespace globjects;
 using namespace gl;
 using namespace glm;
 
-Geometry::Geometry(const string& name)
+namespace {
+
+	struct AttributeFormat {
+		GLint     size;
+		GLenum    type;
+		GLboolean normalized;
+		GLuint    offset;
+	};
+
+	// Attribute locations 0, 1 and 2 are position, normal and texture
+	// coordinates for every vertex format.
+	struct VertexLayout {
+		GLint           stride;
+		AttributeFormat attributes[3];
+	};
+
+	const VertexLayout FLOAT32_LAYOUT = {
+	  sizeof(PMDL::Vertex),
+	  {{3, GL_FLOAT, GL_FALSE, offsetof(PMDL::Vertex, position)},
+	   {3, GL_FLOAT, GL_FALSE, offsetof(PMDL::Vertex, normal)},
+	   {2, GL_FLOAT, GL_FALSE, offsetof(PMDL::Vertex, texCoord)}}};
+
+	const VertexLayout QUANTIZED_LAYOUT = {
+	  sizeof(PMDL::PackedVertex),
+	  {{3, GL_SHORT, GL_TRUE, offsetof(PMDL::PackedVertex, position)},
+	   {2, GL_SHORT, GL_TRUE, offsetof(PMDL::PackedVertex, normal)},
+	   {2, GL_HALF_FLOAT, GL_FALSE, offsetof(PMDL::PackedVertex, texCoord)}}};
+
+	// Fraction of pixelError an object has to drop below before it may switch
+	// to a coarser level of detail
+	constexpr float LOD_HYSTERESIS = 0.25f;
+
+	// Geometry::selectLod for a chain of levels, with errors converted to
+	// pixels at pixelsPerUnit
+	size_t selectLevel(span<const PMDL::Lod> lods,
+	                   float                 pixelsPerUnit,
+	                   size_t                current,
+	                   float                 pixelError) {
+		// Errors grow with each level, so the coarsest acceptable level is the
+		// last one under the threshold
+		const auto coarsest = [&](float threshold) {
+			size_t level = 0;
+			while(level + 1 < lods.size() &&
+			      lods[level + 1].error * pixelsPerUnit <= threshold) {
+				++level;
+			}
+			return level;
+		};
+
+		// Refine as soon as the current level is too coarse, but only coarsen
+		// once the next level is comfortably below the threshold
+		return std::clamp(current,
+		                  coarsest(pixelError * (1.0f - LOD_HYSTERESIS)),
+		                  coarsest(pixelError));
+	}
+
+	// Formats the attributes of InstanceData in vao, all read from
+	// INSTANCE_BINDING and advancing once per instance
+	void bindInstanceFormat(VertexArray& vao) {
+		auto binding = vao.binding(Geometry::INSTANCE_BINDING);
+		for(const GLuint first: {Geometry::INSTANCE_MODEL_LOCATION,
+		                         Geometry::INSTANCE_NORMAL_LOCATION}) {
+			const GLuint matrix = first == Geometry::INSTANCE_MODEL_LOCATION
+			                        ? offsetof(InstanceData, model)
+			                        : offsetof(InstanceData, normal);
+			for(GLuint column = 0; column < 4; ++column) {
+				binding->setAttribute(first + column);
+				binding->setFormat(
+				  4, GL_FLOAT, GL_FALSE, matrix + column * sizeof(vec4));
+				vao.enable(first + column);
+			}
+		}
+		binding->setDivisor(1);
+	}
+
+	template <typename T>
+	void append(vector<byte>& storage, const vector<T>& data) {
+		const auto bytes = as_bytes(span(data));
+		storage.insert(storage.end(), bytes.begin(), bytes.end());
+	}
+
+	// Blobs are only guaranteed byte alignment, hence the copies
+	template <typename T>
+	T read(span<const byte> blob, size_t index) {
+		T value;
+		memcpy(&value, blob.data() + index * sizeof(T), sizeof(T));
+		return value;
+	}
+
+	// Model-space positions as the GPU will see them, so quantized meshes are
+	// bounded by their quantized positions
+	vector<vec3> decodePositions(const GeometryData& data) {
+		vector<vec3> positions;
+		if(data.format == PMDL::VertexFormat::Quantized) {
+			const PMDL::Quantization quantization{
+			  {data.positionScale.x, data.positionScale.y, data.positionScale.z},
+			  {data.positionOffset.x, data.positionOffset.y, data.positionOffset.z}};
+			const size_t count = data.vertexData.size() / sizeof(PMDL::PackedVertex);
+			positions.reserve(count);
+			for(size_t i = 0; i < count; ++i) {
+				const auto        packed = read<PMDL::PackedVertex>(data.vertexData, i);
+				const PMDL::Vec3f p      = PMDL::unpack(packed, quantization).position;
+				positions.emplace_back(p.x, p.y, p.z);
+			}
+		} else {
+			const size_t count = data.vertexData.size() / sizeof(PMDL::Vertex);
+			positions.reserve(count);
+			for(size_t i = 0; i < count; ++i) {
+				const PMDL::Vec3f p = read<PMDL::Vertex>(data.vertexData, i).position;
+				positions.emplace_back(p.x, p.y, p.z);
+			}
+		}
+		return positions;
+	}
+
+	size_t indexAt(const GeometryData& data, size_t i) {
+		return data.indexType == GL_UNSIGNED_SHORT
+		         ? read<PMDL::uint16>(data.indexData, i)
+		         : read<PMDL::Index>(data.indexData, i);
+	}
+
+	void fitBounds(GeometryData& data, const vector<vec3>& positions) {
+		data.meshBounds = PD::bounds::fit(positions);
+
+		vector<vec3> used;
+		for(const PMDL::Lod& level: data.lods) {
+			const size_t end =
+			  static_cast<size_t>(level.indexOffset) + level.indexCount;
+			used.clear();
+			used.reserve(level.indexCount);
+			for(size_t i = level.indexOffset; i < end; ++i) {
+				used.push_back(positions[indexAt(data, i)]);
+			}
+			data.lodBounds.push_back(PD::bounds::fit(used));
+		}
+	}
+
+	// Version 1 files carry no bounds, so they are fitted to the decoded
+	// blobs at every load
+	void prepareCulling(GeometryData& data) {
+		fitBounds(data, decodePositions(data));
+	}
+
+	PD::bounds toBounds(const PMDL::Bounds& b) {
+		return {vec3(b.min.x, b.min.y, b.min.z),
+		        vec3(b.max.x, b.max.y, b.max.z),
+		        vec3(b.center.x, b.center.y, b.center.z),
+		        b.radius};
+	}
+
+	// Copies the position attribute of every vertex into a stream of its
+	// own, for depth passes. Version 2 files have it split when cooking.
+	vector<byte> splitPositions(span<const byte> vertexData,
+	                            PMDL::VertexFormat format) {
+		const size_t vertexStride   = Geometry::vertexStride(format);
+		const size_t positionStride = Geometry::positionStride(format);
+		const size_t count          = vertexData.size() / vertexStride;
+		vector<byte> positions(count * positionStride);
+		for(size_t i = 0; i < count; ++i) {
+			memcpy(positions.data() + i * positionStride,
+			       vertexData.data() + i * vertexStride,
+			       positionStride);
+		}
+		return positions;
+	}
+
+} // namespace
+
+GeometryData GeometryData::load(const string&      name,
+                                PMDL::VertexFormat format,
+                                bool               positionStream) {
+	GeometryData data{nullptr,
+	                  nullptr,
+	                  {},
+	                  {},
+	                  GL_UNSIGNED_INT,
+	                  format,
+	                  vec3(1.0f),
+	                  vec3(0.0f),
+	                  {},
+	                  PD::bounds::fit({}),
+	                  {},
+	                  {},
+	                  nullopt};
+
+	// Version 2 files already hold GPU-ready blobs and their bounds, so the
+	// mapped pages are handed straight to the driver. Version 1 files still go
+	// through cereal.
+	auto file = make_shared<const PD::MappedFile>(name);
+	if(PMDL::MappedView::isMapped(file->bytes())) {
+		file->prefetch();
+		const PMDL::MappedView view   = PMDL::MappedView::map(file->bytes());
+		const PMDL::Vec3f&     scale  = view.header->positionScale;
+		const PMDL::Vec3f&     offset = view.header->positionOffset;
+		data.format                   = view.header->vertexFormat;
+		data.positionScale            = vec3(scale.x, scale.y, scale.z);
+		data.positionOffset           = vec3(offset.x, offset.y, offset.z);
+		data.lods.assign(view.lods.begin(), view.lods.end());
+		data.indexType =
+		  view.header->indexSize == sizeof(PMDL::uint16) ? GL_UNSIGNED_SHORT
+		                                                 : GL_UNSIGNED_INT;
+		data.vertexData = view.vertexData;
+		data.indexData  = view.indexData;
+		if(positionStream) { data.positionData = view.positionData; }
+		data.mapping = std::move(file);
+		data.meshBounds = toBounds(view.header->bounds);
+		for(const PMDL::Bounds& level: view.lodBounds) {
+			data.lodBounds.push_back(toBounds(level));
+		}
+		return data;
+	}
+	file.reset();
+
+	ifstream         fileStream(name, ios::binary);
+	const PMDL::File fileData = PMDL::File::parse(fileStream);
+	const auto&      vertices = fileData.body.vertices;
+	const auto&      indices  = fileData.body.indices;
+	data.lods                 = fileData.body.levels();
+
+	vector<byte> storage;
+	if(format == PMDL::VertexFormat::Quantized) {
+		const auto         quantization = PMDL::Quantization::fit(vertices);
+		const PMDL::Vec3f& scale        = quantization.scale;
+		const PMDL::Vec3f& offset       = quantization.offset;
+		data.positionScale              = vec3(scale.x, scale.y, scale.z);
+		data.positionOffset             = vec3(offset.x, offset.y, offset.z);
+
+		vector<PMDL::PackedVertex> packed;
+		packed.reserve(vertices.size());
+		for(const PMDL::Vertex& vertex: vertices) {
+			packed.push_back(PMDL::pack(vertex, quantization));
+		}
+		append(storage, packed);
+	} else {
+		append(storage, vertices);
+	}
+	const size_t vertexBytes = storage.size();
+
+	// Narrowing needs a copy, so it is only worth it for the compact format.
+	// Version 2 files are narrowed when they are written.
+	if(format == PMDL::VertexFormat::Quantized &&
+	   PMDL::fitsShortIndices(vertices.size())) {
+		data.indexType = GL_UNSIGNED_SHORT;
+		append(storage, vector<PMDL::uint16>(indices.begin(), indices.end()));
+	} else {
+		append(storage, indices);
+	}
+	const size_t indexBytes = storage.size() - vertexBytes;
+	if(positionStream) {
+		append(storage, splitPositions(span(storage).first(vertexBytes), format));
+	}
+
+	data.storage = make_shared<const vector<byte>>(std::move(storage));
+	const span<const byte> blobs(*data.storage);
+	data.vertexData   = blobs.first(vertexBytes);
+	data.indexData    = blobs.subspan(vertexBytes, indexBytes);
+	data.positionData = blobs.subspan(vertexBytes + indexBytes);
+	prepareCulling(data);
+	return data;
+}
+
+size_t GeometryData::bytes() const {
+	return vertexData.size() + indexData.size() + positionData.size();
+}
+
+void GeometryData::stage(PD::StagingRing& ring, stop_token stop) {
+	staged = ring.allocate(bytes(), stop);
+	if(!staged) { return; }
+
+	const span<const byte> blobs[] = {vertexData, indexData, positionData};
+	byte*                  target = staged->data;
+	for(const span<const byte> blob: blobs) {
+		if(blob.empty()) { continue; }
+		memcpy(target, blob.data(), blob.size());
+		target += blob.size();
+	}
+}
+
+Geometry::Geometry(const string& name, PMDL::VertexFormat format)
+  : Geometry(GeometryData::load(name, format)) {}
+
+Geometry::Geometry(const GeometryData& data)
   : m_vertexArray(new VertexArray())
   , m_vertexBuffer(new Buffer())
   , m_indexBuffer(new Buffer())
-  , m_elementCount(0) {
+  , m_positionBuffer(data.positionData.empty() ? nullptr : new Buffer())
+  , m_depthArray(data.positionData.empty() ? nullptr : new VertexArray())
+  , m_elementCount(static_cast<int>(data.lods.front().indexCount))
+  , m_indexType(data.indexType)
+  , m_format(data.format)
+  , m_positionScale(data.positionScale)
+  , m_positionOffset(data.positionOffset)
+  , m_lods(data.lods)
+  , m_meshBounds(data.meshBounds)
+  , m_lodBounds(data.lodBounds)
+  , m_gpuBytes(data.bytes())
+  , m_arena(nullptr)
+  , m_arenaMesh(0) {
 	LOG(plog::debug) << "constructing geometry";
-	struct Vertex final {
-		vec3 position;
-		vec3 normal;
-		vec2 texCoord;
-	};
 
-	// Prepare buffer data
-	vector<Vertex>     vertices;
-	vector<gl::GLuint> indices;
-	ifstream           fileStream(name, ios::binary);
-	PMDL::File         fileData = PMDL::File::parse(fileStream);
+	const span<const byte> blobs[] = {
+	  data.vertexData, data.indexData, data.positionData};
+	Buffer* const buffers[] = {
+	  m_vertexBuffer.get(), m_indexBuffer.get(), m_positionBuffer.get()};
 
-	// Load model vertices into local buffer
-	for(PMDL::Vertex fileVert: fileData.body.vertices) {
-		Vertex vert;
-		vert.position =
-		  vec3(fileVert.position.x, fileVert.position.y, fileVert.position.z);
-		vert.normal = vec3(fileVert.normal.x, fileVert.normal.y, fileVert.normal.z);
-		vert.texCoord = vec2(fileVert.texCoord.u, fileVert.texCoord.v);
-		vertices.push_back(vert);
+	// Staged blobs are copied on the GPU; the driver would otherwise copy
+	// them out of client memory before returning
+	size_t offset = data.staged ? data.staged->offset : 0;
+	for(size_t index = 0; index < size(blobs); ++index) {
+		const span<const byte> blob = blobs[index];
+		if(!buffers[index]) { continue; }
+		if(!data.staged) {
+			buffers[index]->setData(blob.size(), blob.data(), GL_STATIC_DRAW);
+			continue;
+		}
+		buffers[index]->setData(blob.size(), nullptr, GL_STATIC_DRAW);
+		if(!blob.empty()) {
+			data.staged->buffer->copySubData(buffers[index],
+			                                 static_cast<GLintptr>(offset),
+			                                 0,
+			                                 static_cast<GLsizeiptr>(blob.size()));
+		}
+		offset += blob.size();
 	}
 
-	// Load model indices into local buffer
-	copy(fileData.body.indices.begin(),
-	     fileData.body.indices.end(),
-	     back_inserter(indices));
+	bindAttributes();
+}
+
+Geometry::Geometry(const GeometryData& data, PD::GeometryArena& arena)
+  : m_vertexArray(nullptr)
+  , m_vertexBuffer(nullptr)
+  , m_indexBuffer(nullptr)
+  , m_positionBuffer(nullptr)
+  , m_depthArray(nullptr)
+  , m_elementCount(static_cast<int>(data.lods.front().indexCount))
+  , m_indexType(data.indexType)
+  , m_format(data.format)
+  , m_positionScale(data.positionScale)
+  , m_positionOffset(data.positionOffset)
+  , m_lods(data.lods)
+  , m_meshBounds(data.meshBounds)
+  , m_lodBounds(data.lodBounds)
+  , m_gpuBytes(data.vertexData.size() + data.indexData.size())
+  , m_arena(&arena)
+  , m_arenaMesh(arena.add(data)) {}
 
-	m_elementCount = indices.size();
+Geometry::~Geometry() {
+	if(m_arena) { m_arena->remove(m_arenaMesh); }
+}
 
-	m_vertexBuffer->setData(vertices, GL_STATIC_DRAW);
-	m_indexBuffer->setData(indices, GL_STATIC_DRAW);
+size_t Geometry::vertexStride(PMDL::VertexFormat format) {
+	return format == PMDL::VertexFormat::Quantized ? QUANTIZED_LAYOUT.stride
+	                                               : FLOAT32_LAYOUT.stride;
+}
 
-	m_vertexArray->bind();
-	m_vertexArray->bindElementBuffer(m_indexBuffer.get());
+size_t Geometry::positionStride(PMDL::VertexFormat format) {
+	return PMDL::positionStride(format);
+}
 
-	auto positionBinding = m_vertexArray->binding(0);
-	positionBinding->setAttribute(0);
-	positionBinding->setBuffer(m_vertexBuffer.get(), 0, 32);
-	positionBinding->setFormat(3, GL_FLOAT, GL_FALSE, 0);
-	m_vertexArray->enable(0);
+void Geometry::bindVertexFormat(VertexArray&       vao,
+                                PMDL::VertexFormat format,
+                                const Buffer&      vertices,
+                                const Buffer&      indices) {
+	const VertexLayout& layout = format == PMDL::VertexFormat::Quantized
+	                               ? QUANTIZED_LAYOUT
+	                               : FLOAT32_LAYOUT;
 
-	auto normalBinding = m_vertexArray->binding(1);
-	normalBinding->setAttribute(1);
-	normalBinding->setBuffer(m_vertexBuffer.get(), 0, 32);
-	normalBinding->setFormat(3, GL_FLOAT, GL_FALSE, 12);
-	m_vertexArray->enable(1);
+	vao.bind();
+	vao.bindElementBuffer(&indices);
 
-	auto uvBinding = m_vertexArray->binding(2);
-	uvBinding->setAttribute(2);
-	uvBinding->setBuffer(m_vertexBuffer.get(), 0, 32);
-	uvBinding->setFormat(2, GL_FLOAT, GL_FALSE, 24);
-	m_vertexArray->enable(2);
+	for(GLuint location = 0; location < 3; ++location) {
+		const AttributeFormat& attribute = layout.attributes[location];
+		auto                   binding   = vao.binding(location);
+		binding->setAttribute(location);
+		binding->setBuffer(&vertices, 0, layout.stride);
+		binding->setFormat(attribute.size,
+		                   attribute.type,
+		                   attribute.normalized,
+		                   attribute.offset);
+		vao.enable(location);
+	}
+	bindInstanceFormat(vao);
 }
 
-globjects::VertexArray& Geometry::vao() const { return *m_vertexArray; }
+void Geometry::bindAttributes() {
+	bindVertexFormat(*m_vertexArray, m_format, *m_vertexBuffer, *m_indexBuffer);
+	if(!m_depthArray) { return; }
+
+	// Positions sit at the start of either vertex layout
+	const AttributeFormat& position = m_format == PMDL::VertexFormat::Quantized
+	                                    ? QUANTIZED_LAYOUT.attributes[0]
+	                                    : FLOAT32_LAYOUT.attributes[0];
+	m_depthArray->bind();
+	m_depthArray->bindElementBuffer(m_indexBuffer.get());
+	auto binding = m_depthArray->binding(0);
+	binding->setAttribute(0);
+	binding->setBuffer(m_positionBuffer.get(),
+	                   0,
+	                   static_cast<GLint>(positionStride(m_format)));
+	binding->setFormat(position.size, position.type, position.normalized, 0);
+	m_depthArray->enable(0);
+	bindInstanceFormat(*m_depthArray);
+}
+
+globjects::VertexArray& Geometry::vao() const {
+	return m_arena ? m_arena->vao(m_format) : *m_vertexArray;
+}
+
+globjects::VertexArray& Geometry::depthVao() const {
+	return m_depthArray ? *m_depthArray : vao();
+}
 
 int Geometry::elements() const { return m_elementCount; }
+
+gl::GLenum Geometry::indexType() const { return m_indexType; }
+
+PMDL::VertexFormat Geometry::format() const { return m_format; }
+
+const vec3& Geometry::positionScale() const { return m_positionScale; }
+
+const vec3& Geometry::positionOffset() const { return m_positionOffset; }
+
+size_t Geometry::lodCount() const { return m_lods.size(); }
+
+const PD::bounds& Geometry::meshBounds() const { return m_meshBounds; }
+
+const PD::bounds& Geometry::lodBounds(size_t lod) const {
+	return m_lodBounds[std::min(lod, m_lodBounds.size() - 1)];
+}
+
+size_t Geometry::gpuBytes() const { return m_gpuBytes; }
+
+float Geometry::projectedRadius(const mat4& modelView,
+                                const mat4& projection,
+                                float       viewportHeight) const {
+	const vec4  center = modelView * vec4(m_meshBounds.center, 1.0f);
+	const float scale  = std::max({glm::length(vec3(modelView[0])),
+	                               glm::length(vec3(modelView[1])),
+	                               glm::length(vec3(modelView[2]))});
+	const float radius = m_meshBounds.radius * scale;
+
+	// The camera looks down -z; inside the sphere everything is full detail
+	const float distance = -center.z;
+	if(distance <= radius) { return numeric_limits<float>::max(); }
+	return radius / distance * projection[1][1] * viewportHeight * 0.5f;
+}
+
+size_t Geometry::selectLod(float  projectedRadius,
+                           size_t current,
+                           float  pixelError) const {
+	if(m_lods.size() < 2 || m_meshBounds.radius <= 0.0f) { return 0; }
+
+	const float pixelsPerUnit = projectedRadius / m_meshBounds.radius;
+	return selectLevel(m_lods, pixelsPerUnit, current, pixelError);
+}
+
+void Geometry::bindInstances(const Buffer& buffer, size_t offset) {
+	glBindVertexBuffer(INSTANCE_BINDING,
+	                   buffer.id(),
+	                   static_cast<GLintptr>(offset),
+	                   static_cast<GLsizei>(sizeof(InstanceData)));
+}
+
+void Geometry::draw(size_t lod, int instances) const {
+	const PMDL::Lod& level     = m_lods[std::min(lod, m_lods.size() - 1)];
+	const size_t     indexSize = m_indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+	const auto       count     = static_cast<GLsizei>(level.indexCount);
+	if(!m_arena) {
+		const auto offset =
+		  reinterpret_cast<const void*>(level.indexOffset * indexSize);
+		if(instances > 0) {
+			glDrawElementsInstanced(
+			  GL_TRIANGLES, count, m_indexType, offset, instances);
+		} else {
+			glDrawElements(GL_TRIANGLES, count, m_indexType, offset);
+		}
+		return;
+	}
+
+	// Arena meshes move when the arena grows or defragments, so their place
+	// is looked up on every draw
+	const PD::GeometryArena::placement place = m_arena->where(m_arenaMesh);
+	const size_t start  = place.index_offset + level.indexOffset * indexSize;
+	const auto   offset = reinterpret_cast<const void*>(start);
+	if(instances > 0) {
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES,
+		                                  count,
+		                                  m_indexType,
+		                                  offset,
+		                                  instances,
+		                                  place.base_vertex);
+	} else {
+		glDrawElementsBaseVertex(
+		  GL_TRIANGLES, count, m_indexType, offset, place.base_vertex);
+	}
+}
+
+TEST_CASE("levels of detail only coarsen past the hysteresis margin") {
+	const vector<PMDL::Lod> lods = {
+	  {0, 300, 0.0f}, {300, 150, 1.0f}, {450, 75, 2.0f}};
+
+	// Level 1 is at the threshold at one pixel per unit, and comfortably
+	// below it only at 0.75
+	CHECK(selectLevel(lods, 1.0f, 0, 1.0f) == 0);
+	CHECK(selectLevel(lods, 0.8f, 0, 1.0f) == 0);
+	CHECK(selectLevel(lods, 0.75f, 0, 1.0f) == 1);
+
+	// Having coarsened, it stays until level 1 actually gets too coarse
+	CHECK(selectLevel(lods, 0.8f, 1, 1.0f) == 1);
+	CHECK(selectLevel(lods, 1.0f, 1, 1.0f) == 1);
+	CHECK(selectLevel(lods, 1.01f, 1, 1.0f) == 0);
+
+	// Large steps skip levels both ways
+	CHECK(selectLevel(lods, 0.1f, 0, 1.0f) == 2);
+	CHECK(selectLevel(lods, 4.0f, 2, 1.0f) == 0);
+}
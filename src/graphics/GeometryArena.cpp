@@ -0,0 +1,336 @@
+#include "GeometryArena.hpp"
+
+#include "Geometry.hpp"
+
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <stdexcept>
+
+using namespace gl;
+using namespace globjects;
+using namespace std;
+
+namespace {
+
+	// Index data of either type starts on a 4-byte boundary
+	constexpr size_t INDEX_ALIGNMENT = 4;
+
+	size_t slot(PMDL::VertexFormat format) { return static_cast<size_t>(format); }
+
+	size_t align_up(size_t value, size_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	unique_ptr<Buffer> make_buffer(size_t bytes) {
+		auto buffer = make_unique<Buffer>();
+		buffer->setData(static_cast<GLsizeiptr>(bytes), nullptr, GL_STATIC_DRAW);
+		return buffer;
+	}
+
+} // namespace
+
+namespace PD {
+
+	// --------------
+	// RangeAllocator
+	// --------------
+
+	RangeAllocator::RangeAllocator(size_t capacity)
+	  : m_capacity(0)
+	  , m_used(0) {
+		grow(capacity);
+	}
+
+	size_t RangeAllocator::allocate(size_t size, size_t alignment) {
+		if(size == 0) { return NONE; }
+		for(auto block = m_free.begin(); block != m_free.end(); ++block) {
+			const auto [start, length] = *block;
+			const size_t offset        = align_up(start, alignment);
+			if(offset + size > start + length) { continue; }
+
+			m_free.erase(block);
+			if(offset > start) { m_free.emplace(start, offset - start); }
+			if(offset + size < start + length) {
+				m_free.emplace(offset + size, start + length - offset - size);
+			}
+			m_used += size;
+			return offset;
+		}
+		return NONE;
+	}
+
+	void RangeAllocator::free(size_t offset, size_t size) {
+		if(size == 0) { return; }
+		m_used -= size;
+
+		auto next = m_free.lower_bound(offset);
+		if(next != m_free.end() && offset + size == next->first) {
+			size += next->second;
+			next = m_free.erase(next);
+		}
+		if(next != m_free.begin()) {
+			const auto previous = prev(next);
+			if(previous->first + previous->second == offset) {
+				previous->second += size;
+				return;
+			}
+		}
+		m_free.emplace_hint(next, offset, size);
+	}
+
+	void RangeAllocator::grow(size_t capacity) {
+		if(capacity <= m_capacity) { return; }
+		const size_t added = capacity - m_capacity;
+		const size_t end   = m_capacity;
+		m_capacity         = capacity;
+		m_used += added; // Given back by free()
+		free(end, added);
+	}
+
+	size_t RangeAllocator::capacity() const { return m_capacity; }
+
+	size_t RangeAllocator::used() const { return m_used; }
+
+	size_t RangeAllocator::largest_free() const {
+		size_t largest = 0;
+		for(const auto& [offset, size]: m_free) { largest = max(largest, size); }
+		return largest;
+	}
+
+	// -------------
+	// GeometryArena
+	// -------------
+
+	GeometryArena::GeometryArena(size_t vertex_bytes, size_t index_bytes)
+	  : m_pools()
+	  , m_indices(make_buffer(index_bytes))
+	  , m_index_allocator(index_bytes) {
+		for(const auto format:
+		    {PMDL::VertexFormat::Float32, PMDL::VertexFormat::Quantized}) {
+			pool& target     = pool_of(format);
+			target.stride    = Geometry::vertexStride(format);
+			target.vertices  = make_buffer(vertex_bytes);
+			target.vao       = make_unique<VertexArray>();
+			target.allocator = RangeAllocator(vertex_bytes / target.stride);
+		}
+		bind_buffers();
+	}
+
+	GeometryArena::pool& GeometryArena::pool_of(PMDL::VertexFormat format) {
+		return m_pools[slot(format)];
+	}
+
+	GeometryArena::handle GeometryArena::add(const GeometryData& data) {
+		pool&        target   = pool_of(data.format);
+		const size_t vertices = data.vertexData.size() / target.stride;
+		const size_t indices  = data.indexData.size();
+		if(vertices == 0 || indices == 0) {
+			throw invalid_argument("mesh has no vertices or indices");
+		}
+
+		size_t first_vertex = target.allocator.allocate(vertices);
+		size_t index_offset = m_index_allocator.allocate(indices, INDEX_ALIGNMENT);
+		if(first_vertex == RangeAllocator::NONE ||
+		   index_offset == RangeAllocator::NONE) {
+			// Undo whichever half succeeded, then make room for both at once
+			if(first_vertex != RangeAllocator::NONE) {
+				target.allocator.free(first_vertex, vertices);
+			}
+			if(index_offset != RangeAllocator::NONE) {
+				m_index_allocator.free(index_offset, indices);
+			}
+
+			array<size_t, 2> capacities{};
+			for(size_t index = 0; index < m_pools.size(); ++index) {
+				const RangeAllocator& allocator = m_pools[index].allocator;
+				const size_t needed = index == slot(data.format) ? vertices : 0;
+				capacities[index] =
+				  max(allocator.capacity(), (allocator.used() + needed) * 2);
+			}
+			relocate(capacities[0],
+			         capacities[1],
+			         max(m_index_allocator.capacity(),
+			             (m_index_allocator.used() + indices) * 2 + INDEX_ALIGNMENT));
+
+			first_vertex = target.allocator.allocate(vertices);
+			index_offset = m_index_allocator.allocate(indices, INDEX_ALIGNMENT);
+		}
+
+		const auto vertex_offset =
+		  static_cast<GLintptr>(first_vertex * target.stride);
+		const auto vertex_bytes = static_cast<GLsizeiptr>(data.vertexData.size());
+		if(data.staged) {
+			// Vertex and index data lie back to back in the staging ring
+			const auto staged = static_cast<GLintptr>(data.staged->offset);
+			data.staged->buffer->copySubData(
+			  target.vertices.get(), staged, vertex_offset, vertex_bytes);
+			data.staged->buffer->copySubData(m_indices.get(),
+			                                 staged + vertex_bytes,
+			                                 static_cast<GLintptr>(index_offset),
+			                                 static_cast<GLsizeiptr>(indices));
+		} else {
+			target.vertices->setSubData(
+			  vertex_offset, vertex_bytes, data.vertexData.data());
+			m_indices->setSubData(static_cast<GLintptr>(index_offset),
+			                      static_cast<GLsizeiptr>(indices),
+			                      data.indexData.data());
+		}
+
+		const allocation record{
+		  data.format, first_vertex, vertices, index_offset, indices, true};
+		if(!m_free_handles.empty()) {
+			const handle mesh = m_free_handles.back();
+			m_free_handles.pop_back();
+			m_meshes[mesh] = record;
+			return mesh;
+		}
+		m_meshes.push_back(record);
+		return static_cast<handle>(m_meshes.size() - 1);
+	}
+
+	void GeometryArena::remove(handle mesh) {
+		allocation& record = m_meshes.at(mesh);
+		if(!record.live) { throw invalid_argument("mesh is not in the arena"); }
+		pool_of(record.format)
+		  .allocator.free(record.first_vertex, record.vertex_count);
+		m_index_allocator.free(record.index_offset, record.index_bytes);
+		record.live = false;
+		m_free_handles.push_back(mesh);
+
+		if(fragmentation() > DEFRAGMENT_THRESHOLD) { defragment(); }
+	}
+
+	GeometryArena::placement GeometryArena::where(handle mesh) const {
+		const allocation& record = m_meshes[mesh];
+		return {static_cast<GLint>(record.first_vertex), record.index_offset};
+	}
+
+	VertexArray& GeometryArena::vao(PMDL::VertexFormat format) const {
+		return *m_pools[slot(format)].vao;
+	}
+
+	void GeometryArena::defragment() {
+		relocate(m_pools[0].allocator.capacity(),
+		         m_pools[1].allocator.capacity(),
+		         m_index_allocator.capacity());
+	}
+
+	float GeometryArena::fragmentation() const {
+		size_t free    = 0;
+		size_t largest = 0;
+		for(const RangeAllocator* allocator:
+		    {&m_pools[0].allocator, &m_pools[1].allocator, &m_index_allocator}) {
+			free += allocator->capacity() - allocator->used();
+			largest += allocator->largest_free();
+		}
+		return free == 0 ? 0.0f : 1.0f - float(largest) / float(free);
+	}
+
+	void GeometryArena::relocate(size_t float32_vertices,
+	                             size_t quantized_vertices,
+	                             size_t index_bytes) {
+		const array<size_t, 2> capacities = {float32_vertices, quantized_vertices};
+		array<unique_ptr<Buffer>, 2> vertices;
+		for(size_t index = 0; index < m_pools.size(); ++index) {
+			vertices[index] = make_buffer(capacities[index] * m_pools[index].stride);
+			m_pools[index].allocator = RangeAllocator(capacities[index]);
+		}
+		auto indices      = make_buffer(index_bytes);
+		m_index_allocator = RangeAllocator(index_bytes);
+
+		// Live meshes are packed into the new buffers in the order their
+		// indices were laid out; the old buffers go once everything is copied
+		vector<handle> live;
+		for(handle mesh = 0; mesh < m_meshes.size(); ++mesh) {
+			if(m_meshes[mesh].live) { live.push_back(mesh); }
+		}
+		ranges::sort(live, {}, [&](handle mesh) {
+			return m_meshes[mesh].index_offset;
+		});
+
+		for(const handle mesh: live) {
+			allocation&  record = m_meshes[mesh];
+			pool&        source = pool_of(record.format);
+			const size_t target = slot(record.format);
+
+			const size_t first_vertex =
+			  source.allocator.allocate(record.vertex_count);
+			const size_t index_offset =
+			  m_index_allocator.allocate(record.index_bytes, INDEX_ALIGNMENT);
+			source.vertices->copySubData(
+			  vertices[target].get(),
+			  static_cast<GLintptr>(record.first_vertex * source.stride),
+			  static_cast<GLintptr>(first_vertex * source.stride),
+			  static_cast<GLsizeiptr>(record.vertex_count * source.stride));
+			m_indices->copySubData(indices.get(),
+			                       static_cast<GLintptr>(record.index_offset),
+			                       static_cast<GLintptr>(index_offset),
+			                       static_cast<GLsizeiptr>(record.index_bytes));
+
+			record.first_vertex = first_vertex;
+			record.index_offset = index_offset;
+		}
+
+		for(size_t index = 0; index < m_pools.size(); ++index) {
+			m_pools[index].vertices = std::move(vertices[index]);
+		}
+		m_indices = std::move(indices);
+		bind_buffers();
+	}
+
+	void GeometryArena::bind_buffers() {
+		for(const auto format:
+		    {PMDL::VertexFormat::Float32, PMDL::VertexFormat::Quantized}) {
+			const pool& source = pool_of(format);
+			Geometry::bindVertexFormat(
+			  *source.vao, format, *source.vertices, *m_indices);
+		}
+	}
+
+} // namespace PD
+
+TEST_CASE("range allocator reuses and merges freed blocks") {
+	PD::RangeAllocator allocator(100);
+
+	const size_t a = allocator.allocate(30);
+	const size_t b = allocator.allocate(30);
+	const size_t c = allocator.allocate(30);
+	CHECK(a == 0);
+	CHECK(b == 30);
+	CHECK(c == 60);
+	CHECK(allocator.allocate(20) == PD::RangeAllocator::NONE);
+	CHECK(allocator.used() == 90);
+
+	SUBCASE("a freed block is reused") {
+		allocator.free(b, 30);
+		CHECK(allocator.allocate(25) == 30);
+	}
+
+	SUBCASE("neighbouring free blocks merge") {
+		allocator.free(a, 30);
+		allocator.free(c, 30);
+		CHECK(allocator.largest_free() == 40);
+		allocator.free(b, 30);
+		CHECK(allocator.largest_free() == 100);
+		CHECK(allocator.used() == 0);
+		CHECK(allocator.allocate(100) == 0);
+	}
+
+	SUBCASE("growing extends the last free block") {
+		allocator.grow(120);
+		CHECK(allocator.largest_free() == 30);
+		CHECK(allocator.allocate(30) == 90);
+	}
+}
+
+TEST_CASE("range allocator honours alignment") {
+	PD::RangeAllocator allocator(64);
+
+	CHECK(allocator.allocate(3) == 0);
+	const size_t aligned = allocator.allocate(8, 4);
+	CHECK(aligned == 4);
+	CHECK(allocator.used() == 11);
+
+	// The padding before the aligned block stays available
+	CHECK(allocator.allocate(1) == 3);
+}
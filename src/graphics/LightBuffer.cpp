@@ -0,0 +1,65 @@
+#include "LightBuffer.hpp"
+
+#include <cstddef>
+#include <doctest/doctest.h>
+#include <stdexcept>
+
+using namespace gl;
+using namespace glm;
+using namespace std;
+
+namespace PD {
+
+	// std140 lays arrays of this struct out with no padding between elements
+	static_assert(sizeof(LightBuffer::packed_light) == 3 * sizeof(vec4));
+
+	const GLuint LightBuffer::BINDING = 0;
+
+	LightBuffer::packed_light LightBuffer::pack(const Light& light) {
+		return {vec4(light.position, light.radius),
+		        vec4(light.direction, light.angle),
+		        vec4(light.color, light.intensity)};
+	}
+
+	LightBuffer::LightBuffer() : m_buffer(new globjects::Buffer()) {
+		m_staging.reserve(CAPACITY);
+		m_buffer->setData(
+		  CAPACITY * sizeof(packed_light), nullptr, GL_DYNAMIC_DRAW);
+	}
+
+	void LightBuffer::update(span<const Light> lights) {
+		if(lights.size() > CAPACITY) {
+			throw length_error("too many lights for one light buffer");
+		}
+		m_staging.clear();
+		for(const Light& light: lights) { m_staging.push_back(pack(light)); }
+		if(!m_staging.empty()) {
+			m_buffer->setSubData(
+			  0, m_staging.size() * sizeof(packed_light), m_staging.data());
+		}
+	}
+
+	void LightBuffer::bind() const {
+		m_buffer->bindBase(GL_UNIFORM_BUFFER, BINDING);
+	}
+
+	size_t LightBuffer::size() const { return m_staging.size(); }
+
+} // namespace PD
+
+TEST_CASE("lights are packed into std140 vec4 slots") {
+	const Light light(vec3(1.0f, 2.0f, 3.0f),
+	                  vec3(0.0f, -1.0f, 0.0f),
+	                  vec3(0.5f),
+	                  2.0f,
+	                  0.7f,
+	                  9.0f);
+	const auto packed = PD::LightBuffer::pack(light);
+
+	CHECK(offsetof(PD::LightBuffer::packed_light, position_radius) == 0);
+	CHECK(offsetof(PD::LightBuffer::packed_light, direction_angle) == 16);
+	CHECK(offsetof(PD::LightBuffer::packed_light, color_intensity) == 32);
+	CHECK(packed.position_radius == vec4(1.0f, 2.0f, 3.0f, 9.0f));
+	CHECK(packed.direction_angle == vec4(0.0f, -1.0f, 0.0f, 0.7f));
+	CHECK(packed.color_intensity == vec4(0.5f, 0.5f, 0.5f, 2.0f));
+}
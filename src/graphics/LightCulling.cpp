@@ -0,0 +1,255 @@
+#include "LightCulling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <doctest/doctest.h>
+#include <glm/gtc/constants.hpp>
+#include <limits>
+
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	bool touches_sphere(const PD::aabb& box, const vec3& center, float radius) {
+		const vec3 nearest = clamp(center, box.min, box.max);
+		return dot(nearest - center, nearest - center) <= radius * radius;
+	}
+
+	// The box is approximated by its bounding sphere, which is then tested
+	// against the cone: it is out if it lies behind the apex, beyond the
+	// range, or further from the cone's surface than its radius
+	bool touches_cone(const PD::aabb& box, const Light& light) {
+		const vec3  center = (box.min + box.max) * 0.5f;
+		const float radius = length(box.max - box.min) * 0.5f;
+
+		const vec3  axis   = normalize(light.direction);
+		const vec3  offset = center - light.position;
+		const float along  = dot(offset, axis);
+		const float across =
+		  std::sqrt(std::max(dot(offset, offset) - along * along, 0.0f));
+		const float half    = light.angle * 0.5f;
+		const float outside = std::cos(half) * across - std::sin(half) * along;
+
+		return outside <= radius && along <= light.radius + radius &&
+		       along >= -radius;
+	}
+
+	bool is_spot(const Light& light) {
+		return light.angle < pi<float>() &&
+		       dot(light.direction, light.direction) > 0.0f;
+	}
+
+} // namespace
+
+namespace PD {
+
+	// For a spot light the region is the sector of its range sphere inside
+	// the cone: narrow cones are bounded by a sphere through the apex and the
+	// rim of the cap, wide ones by the sphere around the rim
+	light_sphere light_reach(const Light& light) {
+		light_sphere result{light.position, light.radius};
+		if(!is_spot(light)) { return result; }
+
+		const vec3  axis = normalize(light.direction);
+		const float half = light.angle * 0.5f;
+		if(half <= quarter_pi<float>()) {
+			const float offset = light.radius / (2.0f * std::cos(half));
+			result.center      = light.position + axis * offset;
+			result.radius      = offset;
+		} else {
+			result.center = light.position + axis * light.radius * std::cos(half);
+			result.radius = light.radius * std::sin(half);
+		}
+		return result;
+	}
+
+	span<const uint32_t> light_lists::of(size_t object) const {
+		return span(indices).subspan(offsets[object],
+		                             offsets[object + 1] - offsets[object]);
+	}
+
+	void assign_lights(span<const Light> lights,
+	                   span<const aabb>  objects,
+	                   light_lists&      lists) {
+		lists.offsets.clear();
+		lists.indices.clear();
+		lists.offsets.reserve(objects.size() + 1);
+		lists.offsets.push_back(0);
+
+		for(const aabb& box: objects) {
+			for(uint32_t index = 0; index < lights.size(); ++index) {
+				const Light& light = lights[index];
+				if(!touches_sphere(box, light.position, light.radius)) { continue; }
+				if(is_spot(light) && !touches_cone(box, light)) { continue; }
+				lists.indices.push_back(index);
+			}
+			lists.offsets.push_back(static_cast<uint32_t>(lists.indices.size()));
+		}
+	}
+
+	bool light_extent::empty() const {
+		return width <= 0 || height <= 0 || min_depth > max_depth;
+	}
+
+	light_extent project_light(const Light& light,
+	                           const mat4&  view_projection,
+	                           int          width,
+	                           int          height) {
+		const light_extent whole{0, 0, width, height, 0.0f, 1.0f};
+		const auto         region = light_reach(light);
+
+		vec3   lowest(numeric_limits<float>::max());
+		vec3   highest(-numeric_limits<float>::max());
+		size_t behind = 0;
+		for(int corner = 0; corner < 8; ++corner) {
+			const vec3 sign((corner & 1) ? 1.0f : -1.0f,
+			                (corner & 2) ? 1.0f : -1.0f,
+			                (corner & 4) ? 1.0f : -1.0f);
+			const vec4 clip =
+			  view_projection * vec4(region.center + sign * region.radius, 1.0f);
+			if(clip.z < -clip.w) {
+				++behind;
+				continue;
+			}
+			const vec3 ndc = vec3(clip) / clip.w;
+			lowest         = min(lowest, ndc);
+			highest        = max(highest, ndc);
+		}
+		if(behind == 8) { return {0, 0, 0, 0, 1.0f, 0.0f}; }
+		if(behind > 0) { return whole; }
+
+		// NDC to pixels, widened to whole pixels and clamped to the viewport
+		const auto to_pixel = [](float ndc, int size, auto round) {
+			const float pixel =
+			  round((ndc * 0.5f + 0.5f) * static_cast<float>(size));
+			return std::clamp(static_cast<int>(pixel), 0, size);
+		};
+		const auto down = [](float value) { return std::floor(value); };
+		const auto up   = [](float value) { return std::ceil(value); };
+
+		const int left   = to_pixel(lowest.x, width, down);
+		const int right  = to_pixel(highest.x, width, up);
+		const int bottom = to_pixel(lowest.y, height, down);
+		const int top    = to_pixel(highest.y, height, up);
+		return {left,
+		        bottom,
+		        right - left,
+		        top - bottom,
+		        std::max(lowest.z * 0.5f + 0.5f, 0.0f),
+		        std::min(highest.z * 0.5f + 0.5f, 1.0f)};
+	}
+
+} // namespace PD
+
+namespace {
+
+	PD::aabb cube(const vec3& center, float half) {
+		return {center - vec3(half), center + vec3(half)};
+	}
+
+	Light point(const vec3& position, float radius) {
+		return {position, vec3(0.0f), vec3(1.0f), 1.0f, two_pi<float>(), radius};
+	}
+
+	Light spot(const vec3& position, const vec3& direction, float angle) {
+		return {position, direction, vec3(1.0f), 1.0f, angle, 20.0f};
+	}
+
+} // namespace
+
+TEST_CASE("point lights reach objects within their radius") {
+	const vector<Light> lights = {point(vec3(0.0f), 5.0f),
+	                              point(vec3(10.0f, 0.0f, 0.0f), 2.0f),
+	                              point(vec3(0.0f, 7.0f, 0.0f), 5.5f)};
+	const vector<PD::aabb> objects = {cube(vec3(0.0f, 5.0f, 0.0f), 1.0f),
+	                                  cube(vec3(20.0f, 0.0f, 0.0f), 1.0f)};
+
+	PD::light_lists lists;
+	PD::assign_lights(lights, objects, lists);
+
+	const vector<uint32_t> first(lists.of(0).begin(), lists.of(0).end());
+	const vector<uint32_t> expected = {0, 2};
+	CHECK(first == expected);
+	CHECK(lists.of(1).empty());
+}
+
+TEST_CASE("spot lights only reach objects inside their cone") {
+	// Pointing down -z with a 60 degree aperture
+	const vector<Light> lights = {
+	  spot(vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), radians(60.0f))};
+	const vector<PD::aabb> objects = {
+	  cube(vec3(0.0f, 0.0f, -10.0f), 1.0f), // On the axis
+	  cube(vec3(0.0f, 0.0f, 10.0f), 1.0f),  // Behind
+	  cube(vec3(9.0f, 0.0f, -10.0f), 1.0f), // Beside the cone
+	  cube(vec3(6.0f, 0.0f, -10.0f), 1.0f), // Crossing its surface
+	  cube(vec3(0.0f, 0.0f, -30.0f), 1.0f), // Beyond the radius
+	};
+
+	PD::light_lists lists;
+	PD::assign_lights(lights, objects, lists);
+
+	CHECK(lists.of(0).size() == 1);
+	CHECK(lists.of(1).empty());
+	CHECK(lists.of(2).empty());
+	CHECK(lists.of(3).size() == 1);
+	CHECK(lists.of(4).empty());
+}
+
+TEST_CASE("lights project to the screen area and depth they can reach") {
+	const int  width  = 200;
+	const int  height = 100;
+	const mat4 view_projection =
+	  perspective(radians(90.0f), 2.0f, 0.1f, 100.0f) *
+	  lookAt(vec3(0.0f), vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 1.0f, 0.0f));
+
+	SUBCASE("a small light in front of the camera stays small") {
+		const auto extent = PD::project_light(
+		  point(vec3(0.0f, 0.0f, -10.0f), 1.0f), view_projection, width, height);
+		REQUIRE(!extent.empty());
+		CHECK(extent.x > 80);
+		CHECK(extent.x + extent.width < 120);
+		CHECK(extent.y > 30);
+		CHECK(extent.y + extent.height < 70);
+		CHECK(extent.min_depth > 0.9f);
+		CHECK(extent.max_depth < 1.0f);
+	}
+
+	SUBCASE("a light around the eye covers everything") {
+		const auto extent = PD::project_light(
+		  point(vec3(0.0f), 1.0f), view_projection, width, height);
+		CHECK(extent.width == width);
+		CHECK(extent.height == height);
+		CHECK(extent.min_depth == 0.0f);
+		CHECK(extent.max_depth == 1.0f);
+	}
+
+	SUBCASE("lights behind the camera or off screen are empty") {
+		CHECK(PD::project_light(point(vec3(0.0f, 0.0f, 10.0f), 1.0f),
+		                        view_projection,
+		                        width,
+		                        height)
+		        .empty());
+		CHECK(PD::project_light(point(vec3(50.0f, 0.0f, -10.0f), 1.0f),
+		                        view_projection,
+		                        width,
+		                        height)
+		        .empty());
+	}
+
+	SUBCASE("spot lights are bounded by their cone") {
+		const auto cone = PD::project_light(
+		  spot(vec3(-5.0f, 0.0f, -30.0f), vec3(-1.0f, 0.0f, 0.0f), radians(30.0f)),
+		  view_projection,
+		  width,
+		  height);
+		const auto sphere =
+		  PD::project_light(point(vec3(-5.0f, 0.0f, -30.0f), 20.0f),
+		                    view_projection,
+		                    width,
+		                    height);
+		REQUIRE(!cone.empty());
+		CHECK(cone.x + cone.width <= width / 2);
+		CHECK(cone.height < sphere.height);
+	}
+}
@@ -0,0 +1,440 @@
+#include "MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <doctest/doctest.h>
+#include <glm/glm.hpp>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+	using PMDL::Index;
+
+	// -------------------------------------------------------------------------
+	//  Forsyth scoring
+	// -------------------------------------------------------------------------
+
+	constexpr size_t FORSYTH_CACHE_SIZE  = 32;
+	constexpr float  CACHE_DECAY_POWER   = 1.5f;
+	constexpr float  LAST_TRIANGLE_SCORE = 0.75f;
+	constexpr float  VALENCE_BOOST_SCALE = 2.0f;
+	constexpr float  VALENCE_BOOST_POWER = 0.5f;
+
+	float vertexScore(int cachePosition, uint32_t remainingTriangles) {
+		if(remainingTriangles == 0) { return -1.0f; }
+
+		float score = 0.0f;
+		if(cachePosition >= 0) {
+			if(cachePosition < 3) {
+				// The last triangle's vertices are scored flat so that the next
+				// triangle does not simply reuse the most recent edge.
+				score = LAST_TRIANGLE_SCORE;
+			} else {
+				const float scale = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+				score = powf(1.0f - (cachePosition - 3) * scale, CACHE_DECAY_POWER);
+			}
+		}
+
+		// Boost vertices with few triangles left so that they are finished off
+		// instead of being left stranded
+		return score + VALENCE_BOOST_SCALE *
+		                 powf(static_cast<float>(remainingTriangles),
+		                      -VALENCE_BOOST_POWER);
+	}
+
+	// -------------------------------------------------------------------------
+	//  Geometry helpers
+	// -------------------------------------------------------------------------
+
+	glm::vec3 position(const PMDL::Vertex& vertex) {
+		return {vertex.position.x, vertex.position.y, vertex.position.z};
+	}
+
+	// Every pass indexes per-vertex arrays with the indices as they are
+	void checkIndices(const vector<Index>& indices, size_t vertexCount) {
+		for(Index index: indices) {
+			if(index >= vertexCount) {
+				throw out_of_range("PMDL index " + to_string(index) +
+				                   " past the last vertex");
+			}
+		}
+	}
+
+	struct Cluster {
+		size_t    begin;
+		size_t    end;
+		glm::vec3 centroid;
+		glm::vec3 normal;
+		float     sortKey;
+	};
+
+} // namespace
+
+PMDL::VertexCacheStatistics PMDL::analyzeVertexCache(
+  const vector<Index>& indices, size_t vertexCount, size_t cacheSize) {
+	checkIndices(indices, vertexCount);
+	vector<size_t> insertedAt(vertexCount, 0);
+	vector<bool>   referenced(vertexCount, false);
+	size_t         misses    = 0;
+	size_t         unique    = 0;
+	size_t         timestamp = cacheSize + 1;
+
+	// A vertex is in the FIFO if it was inserted less than cacheSize misses ago
+	for(Index index: indices) {
+		if(timestamp - insertedAt[index] > cacheSize) {
+			insertedAt[index] = timestamp++;
+			++misses;
+		}
+		if(!referenced[index]) {
+			referenced[index] = true;
+			++unique;
+		}
+	}
+
+	const size_t triangles = indices.size() / 3;
+	return {triangles ? static_cast<float>(misses) / triangles : 0.0f,
+	        unique ? static_cast<float>(misses) / unique : 0.0f};
+}
+
+void PMDL::optimizeVertexCache(vector<Index>& indices, size_t vertexCount) {
+	const size_t triangleCount = indices.size() / 3;
+	if(triangleCount == 0) { return; }
+	checkIndices(indices, vertexCount);
+
+	// Per-vertex lists of the triangles that still have to be emitted. Emitted
+	// triangles are swapped past the end of their vertex's active range.
+	vector<uint32_t> remaining(vertexCount, 0);
+	for(Index index: indices) { ++remaining[index]; }
+
+	vector<uint32_t> offsets(vertexCount + 1, 0);
+	partial_sum(remaining.begin(), remaining.end(), offsets.begin() + 1);
+
+	vector<uint32_t> adjacency(indices.size());
+	{
+		vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+		for(size_t i = 0; i < indices.size(); ++i) {
+			adjacency[cursor[indices[i]]++] = static_cast<uint32_t>(i / 3);
+		}
+	}
+
+	vector<int>   cachePosition(vertexCount, -1);
+	vector<float> score(vertexCount);
+	for(size_t v = 0; v < vertexCount; ++v) {
+		score[v] = vertexScore(-1, remaining[v]);
+	}
+
+	const auto triangleScore = [&](size_t triangle) {
+		return score[indices[triangle * 3]] + score[indices[triangle * 3 + 1]] +
+		       score[indices[triangle * 3 + 2]];
+	};
+
+	vector<bool>  emitted(triangleCount, false);
+	vector<Index> output;
+	output.reserve(indices.size());
+
+	vector<Index> cache;
+	vector<Index> nextCache;
+	cache.reserve(FORSYTH_CACHE_SIZE + 3);
+	nextCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+	size_t best   = numeric_limits<size_t>::max();
+	size_t cursor = 0;
+
+	for(size_t n = 0; n < triangleCount; ++n) {
+		// Nothing in the cache has triangles left: restart at the next
+		// unemitted triangle in input order
+		if(best == numeric_limits<size_t>::max()) {
+			while(emitted[cursor]) { ++cursor; }
+			best = cursor;
+		}
+
+		emitted[best] = true;
+		nextCache.clear();
+		for(size_t corner = 0; corner < 3; ++corner) {
+			const Index vertex = indices[best * 3 + corner];
+			output.push_back(vertex);
+			nextCache.push_back(vertex);
+
+			const auto first = adjacency.begin() + offsets[vertex];
+			const auto last  = first + remaining[vertex];
+			iter_swap(find(first, last, best), last - 1);
+			--remaining[vertex];
+		}
+
+		for(Index vertex: cache) {
+			if(find(nextCache.begin(), nextCache.end(), vertex) == nextCache.end()) {
+				nextCache.push_back(vertex);
+			}
+		}
+
+		// Rescore everything that entered, moved in or fell out of the cache
+		for(size_t i = 0; i < nextCache.size(); ++i) {
+			const Index vertex    = nextCache[i];
+			cachePosition[vertex] = i < FORSYTH_CACHE_SIZE ? static_cast<int>(i) : -1;
+			score[vertex]         = vertexScore(cachePosition[vertex], remaining[vertex]);
+		}
+		if(nextCache.size() > FORSYTH_CACHE_SIZE) {
+			nextCache.resize(FORSYTH_CACHE_SIZE);
+		}
+		swap(cache, nextCache);
+
+		// The next triangle is the best one touching the cache
+		best            = numeric_limits<size_t>::max();
+		float bestScore = -numeric_limits<float>::max();
+		for(Index vertex: cache) {
+			for(uint32_t i = 0; i < remaining[vertex]; ++i) {
+				const uint32_t triangle = adjacency[offsets[vertex] + i];
+				const float    value    = triangleScore(triangle);
+				if(value > bestScore) {
+					bestScore = value;
+					best      = triangle;
+				}
+			}
+		}
+	}
+
+	indices.swap(output);
+}
+
+void PMDL::optimizeOverdraw(vector<Index>&        indices,
+                            const vector<Vertex>& vertices,
+                            float                 threshold) {
+	const size_t triangleCount = indices.size() / 3;
+	if(triangleCount == 0) { return; }
+
+	constexpr size_t MIN_CLUSTER_SIZE = 16;
+
+	const float baseline = analyzeVertexCache(indices, vertices.size()).acmr;
+
+	// Hard boundaries: triangles where a FIFO cache misses all three vertices
+	// are where the cache optimizer restarted, so reordering whole clusters
+	// there costs next to nothing in cache efficiency.
+	vector<Cluster> clusters;
+	{
+		vector<size_t> insertedAt(vertices.size(), 0);
+		size_t         timestamp = DEFAULT_CACHE_SIZE + 1;
+		size_t         start     = 0;
+		for(size_t triangle = 0; triangle < triangleCount; ++triangle) {
+			int misses = 0;
+			for(size_t corner = 0; corner < 3; ++corner) {
+				const Index index = indices[triangle * 3 + corner];
+				if(timestamp - insertedAt[index] > DEFAULT_CACHE_SIZE) {
+					insertedAt[index] = timestamp++;
+					++misses;
+				}
+			}
+			if(misses == 3 && triangle - start >= MIN_CLUSTER_SIZE) {
+				clusters.push_back(
+				  {start, triangle, glm::vec3(0.0f), glm::vec3(0.0f), 0.0f});
+				start = triangle;
+			}
+		}
+		clusters.push_back(
+		  {start, triangleCount, glm::vec3(0.0f), glm::vec3(0.0f), 0.0f});
+	}
+	if(clusters.size() < 2) { return; }
+
+	// Sort key: how far a cluster faces away from the mesh centroid. Clusters
+	// on the outside of the mesh are likely to occlude those further in, so
+	// they are drawn first.
+	glm::vec3 meshCentroid(0.0f);
+	float     meshArea = 0.0f;
+	for(Cluster& cluster: clusters) {
+		float area = 0.0f;
+		for(size_t triangle = cluster.begin; triangle < cluster.end; ++triangle) {
+			const glm::vec3 a = position(vertices[indices[triangle * 3]]);
+			const glm::vec3 b = position(vertices[indices[triangle * 3 + 1]]);
+			const glm::vec3 c = position(vertices[indices[triangle * 3 + 2]]);
+
+			const glm::vec3 faceNormal = glm::cross(b - a, c - a);
+			const float     faceArea   = glm::length(faceNormal);
+			cluster.centroid += (a + b + c) * (faceArea / 3.0f);
+			cluster.normal += faceNormal;
+			area += faceArea;
+		}
+		meshCentroid += cluster.centroid;
+		meshArea += area;
+		if(area > 0.0f) { cluster.centroid /= area; }
+	}
+	if(meshArea > 0.0f) { meshCentroid /= meshArea; }
+
+	for(Cluster& cluster: clusters) {
+		const float length = glm::length(cluster.normal);
+		cluster.sortKey =
+		  length > 0.0f
+		    ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length)
+		    : 0.0f;
+	}
+
+	stable_sort(clusters.begin(),
+	            clusters.end(),
+	            [](const Cluster& lhs, const Cluster& rhs) {
+		            return lhs.sortKey > rhs.sortKey;
+	            });
+
+	vector<Index> sorted;
+	sorted.reserve(indices.size());
+	for(const Cluster& cluster: clusters) {
+		sorted.insert(sorted.end(),
+		              indices.begin() + cluster.begin * 3,
+		              indices.begin() + cluster.end * 3);
+	}
+
+	if(analyzeVertexCache(sorted, vertices.size()).acmr <= baseline * threshold) {
+		indices.swap(sorted);
+	}
+}
+
+void PMDL::optimizeVertexFetch(Body& body) {
+	constexpr Index UNUSED = numeric_limits<Index>::max();
+	checkIndices(body.indices, body.vertices.size());
+
+	vector<Index>  remap(body.vertices.size(), UNUSED);
+	vector<Vertex> vertices;
+	vertices.reserve(body.vertices.size());
+
+	for(Index& index: body.indices) {
+		if(remap[index] == UNUSED) {
+			remap[index] = static_cast<Index>(vertices.size());
+			vertices.push_back(body.vertices[index]);
+		}
+		index = remap[index];
+	}
+
+	body.vertices.swap(vertices);
+}
+
+void PMDL::optimize(Body& body) {
+	// Levels of detail are drawn on their own, so each is ordered on its own.
+	// The shared vertices then follow the finest level's first-use order.
+	for(const Lod& lod: body.levels()) {
+		const auto    first = body.indices.begin() + lod.indexOffset;
+		vector<Index> level(first, first + lod.indexCount);
+		optimizeVertexCache(level, body.vertices.size());
+		optimizeOverdraw(level, body.vertices);
+		copy(level.begin(), level.end(), first);
+	}
+	optimizeVertexFetch(body);
+}
+
+namespace {
+
+	// Triangles of a side x side quad grid in the xy plane, shuffled so that
+	// the input order has no locality to start from
+	PMDL::Body shuffled_grid(PMDL::Index side) {
+		PMDL::Body body;
+		for(PMDL::Index y = 0; y <= side; ++y) {
+			for(PMDL::Index x = 0; x <= side; ++x) {
+				body.vertices.push_back({{float(x), float(y), 0.0f},
+				                         {0.0f, 0.0f, 1.0f},
+				                         {0.0f, 0.0f}});
+			}
+		}
+
+		vector<array<PMDL::Index, 3>> triangles;
+		for(PMDL::Index y = 0; y < side; ++y) {
+			for(PMDL::Index x = 0; x < side; ++x) {
+				const PMDL::Index corner = y * (side + 1) + x;
+				triangles.push_back({corner, corner + 1, corner + side + 2});
+				triangles.push_back({corner, corner + side + 2, corner + side + 1});
+			}
+		}
+		shuffle(triangles.begin(), triangles.end(), mt19937(5));
+		for(const auto& triangle: triangles) {
+			body.indices.insert(body.indices.end(), triangle.begin(), triangle.end());
+		}
+		return body;
+	}
+
+	// Triangles as sorted vertex positions, independent of both triangle and
+	// vertex order. The corners keep their winding, so they are only rotated.
+	vector<array<float, 9>> triangle_set(const PMDL::Body& body) {
+		vector<array<float, 9>> triangles;
+		for(size_t i = 0; i < body.indices.size(); i += 3) {
+			array<array<float, 3>, 3> corners;
+			for(size_t corner = 0; corner < 3; ++corner) {
+				const PMDL::Vec3f& p = body.vertices[body.indices[i + corner]].position;
+				corners[corner]      = {p.x, p.y, p.z};
+			}
+			rotate(corners.begin(),
+			       min_element(corners.begin(), corners.end()),
+			       corners.end());
+
+			array<float, 9> triangle;
+			for(size_t corner = 0; corner < 3; ++corner) {
+				copy(corners[corner].begin(),
+				     corners[corner].end(),
+				     triangle.begin() + corner * 3);
+			}
+			triangles.push_back(triangle);
+		}
+		sort(triangles.begin(), triangles.end());
+		return triangles;
+	}
+
+} // namespace
+
+TEST_CASE("vertex cache optimization reorders whole triangles") {
+	PMDL::Body  body  = shuffled_grid(32);
+	const auto  input = triangle_set(body);
+	const float shuffled =
+	  PMDL::analyzeVertexCache(body.indices, body.vertices.size()).acmr;
+
+	PMDL::optimizeVertexCache(body.indices, body.vertices.size());
+	CHECK(triangle_set(body) == input);
+
+	// Shuffled, nearly every triangle misses on every corner; in order a
+	// grid needs not much more than one new vertex per triangle
+	const float optimized =
+	  PMDL::analyzeVertexCache(body.indices, body.vertices.size()).acmr;
+	CHECK(shuffled > 2.0f);
+	CHECK(optimized < 0.8f);
+
+	SUBCASE("overdraw ordering moves clusters without costing the cache") {
+		PMDL::optimizeOverdraw(body.indices, body.vertices);
+		CHECK(triangle_set(body) == input);
+		CHECK(PMDL::analyzeVertexCache(body.indices, body.vertices.size()).acmr <=
+		      optimized * 1.05f);
+	}
+}
+
+TEST_CASE("vertex fetch optimization remaps vertices into first-use order") {
+	PMDL::Body body = shuffled_grid(8);
+
+	// A vertex no triangle uses is dropped
+	body.vertices.push_back(
+	  {{-1.0f, -1.0f, -1.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 0.0f}});
+	const auto   input    = triangle_set(body);
+	const size_t vertices = body.vertices.size();
+
+	PMDL::optimizeVertexFetch(body);
+	CHECK(body.vertices.size() == vertices - 1);
+	CHECK(triangle_set(body) == input);
+
+	// Every index is either one seen before or the next new vertex
+	PMDL::Index next = 0;
+	for(PMDL::Index index: body.indices) {
+		REQUIRE(index <= next);
+		if(index == next) { ++next; }
+	}
+	CHECK(next == body.vertices.size());
+}
+
+TEST_CASE("mesh optimization rejects indices past the last vertex") {
+	PMDL::Body body = shuffled_grid(2);
+	body.indices.back() = static_cast<PMDL::Index>(body.vertices.size());
+
+	CHECK_THROWS_AS(
+	  PMDL::analyzeVertexCache(body.indices, body.vertices.size()),
+	  out_of_range);
+	CHECK_THROWS_AS(
+	  PMDL::optimizeVertexCache(body.indices, body.vertices.size()),
+	  out_of_range);
+	CHECK_THROWS_AS(PMDL::optimizeVertexFetch(body), out_of_range);
+}
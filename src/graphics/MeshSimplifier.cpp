@@ -0,0 +1,413 @@
+#include "MeshSimplifier.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <numeric>
+#include <set>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+	using PMDL::Index;
+
+	// Symmetric 4x4 error quadric, upper triangle only
+	struct Quadric {
+		double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+
+		Quadric& operator+=(const Quadric& q) {
+			a00 += q.a00, a01 += q.a01, a02 += q.a02, a03 += q.a03;
+			a11 += q.a11, a12 += q.a12, a13 += q.a13;
+			a22 += q.a22, a23 += q.a23;
+			a33 += q.a33;
+			return *this;
+		}
+	};
+
+	Quadric operator+(Quadric lhs, const Quadric& rhs) { return lhs += rhs; }
+
+	// Quadric of the squared distance to the plane n.p + d = 0
+	Quadric planeQuadric(glm::dvec3 n, double d) {
+		return {n.x * n.x,
+		        n.x * n.y,
+		        n.x * n.z,
+		        n.x * d,
+		        n.y * n.y,
+		        n.y * n.z,
+		        n.y * d,
+		        n.z * n.z,
+		        n.z * d,
+		        d * d};
+	}
+
+	double evaluate(const Quadric& q, glm::dvec3 p) {
+		const double error = q.a00 * p.x * p.x + 2 * q.a01 * p.x * p.y +
+		                     2 * q.a02 * p.x * p.z + 2 * q.a03 * p.x +
+		                     q.a11 * p.y * p.y + 2 * q.a12 * p.y * p.z +
+		                     2 * q.a13 * p.y + q.a22 * p.z * p.z +
+		                     2 * q.a23 * p.z + q.a33;
+		return max(error, 0.0);
+	}
+
+	glm::dvec3 position(const PMDL::Vertex& vertex) {
+		return {vertex.position.x, vertex.position.y, vertex.position.z};
+	}
+
+	struct PositionHash {
+		size_t operator()(const PMDL::Vec3f& p) const {
+			uint32_t bits[3];
+			memcpy(bits, &p, sizeof(bits));
+			return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^
+			       (bits[2] * 83492791u);
+		}
+	};
+
+	struct PositionEqual {
+		bool operator()(const PMDL::Vec3f& a, const PMDL::Vec3f& b) const {
+			return a.x == b.x && a.y == b.y && a.z == b.z;
+		}
+	};
+
+	struct Collapse {
+		Index  from;
+		Index  to;
+		double cost;
+	};
+
+	uint64_t edgeKey(Index a, Index b) {
+		return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+	}
+
+} // namespace
+
+PMDL::Simplification PMDL::simplify(const vector<Index>&  source,
+                                    const vector<Vertex>& vertices,
+                                    size_t                targetIndexCount) {
+	const size_t  vertexCount = vertices.size();
+	vector<Index> indices     = source;
+
+	// Weld vertices that share a position. Split vertices are seams, and any
+	// vertex on a seam stays put so that both sides keep matching.
+	vector<Index> canonical(vertexCount);
+	vector<bool>  locked(vertexCount, false);
+	{
+		unordered_map<Vec3f, Index, PositionHash, PositionEqual> welded;
+		for(Index v = 0; v < vertexCount; ++v) {
+			const auto [it, inserted] = welded.try_emplace(vertices[v].position, v);
+			canonical[v]              = it->second;
+			if(!inserted) { locked[v] = locked[it->second] = true; }
+		}
+	}
+
+	// Edges used by only one triangle lie on an open border
+	{
+		unordered_map<uint64_t, int> edgeUse;
+		for(size_t i = 0; i < indices.size(); i += 3) {
+			for(size_t e = 0; e < 3; ++e) {
+				++edgeUse[edgeKey(canonical[indices[i + e]],
+				                  canonical[indices[i + (e + 1) % 3]])];
+			}
+		}
+		for(const auto& [key, uses]: edgeUse) {
+			if(uses == 1) {
+				locked[static_cast<Index>(key >> 32)]        = true;
+				locked[static_cast<Index>(key & 0xFFFFFFFF)] = true;
+			}
+		}
+		for(Index v = 0; v < vertexCount; ++v) {
+			if(locked[canonical[v]]) { locked[v] = true; }
+		}
+	}
+
+	vector<Quadric> quadrics(vertexCount, Quadric{});
+	for(size_t i = 0; i + 2 < indices.size(); i += 3) {
+		const glm::dvec3 a = position(vertices[indices[i]]);
+		const glm::dvec3 b = position(vertices[indices[i + 1]]);
+		const glm::dvec3 c = position(vertices[indices[i + 2]]);
+
+		glm::dvec3   normal = glm::cross(b - a, c - a);
+		const double length = glm::length(normal);
+		if(length == 0.0) { continue; }
+		normal /= length;
+
+		const Quadric plane = planeQuadric(normal, -glm::dot(normal, a));
+		for(size_t corner = 0; corner < 3; ++corner) {
+			quadrics[canonical[indices[i + corner]]] += plane;
+		}
+	}
+
+	double maxCost = 0.0;
+
+	// Each pass collapses a batch of independent edges, cheapest first, then
+	// rebuilds. A vertex and its one-ring are touched at most once per pass so
+	// that the flip checks below stay valid.
+	while(indices.size() > targetIndexCount) {
+		const size_t triangleCount = indices.size() / 3;
+
+		vector<Collapse> candidates;
+		candidates.reserve(indices.size() * 2);
+		for(size_t i = 0; i < indices.size(); i += 3) {
+			for(size_t e = 0; e < 3; ++e) {
+				const Index a = indices[i + e];
+				const Index b = indices[i + (e + 1) % 3];
+				const auto  q = quadrics[canonical[a]] + quadrics[canonical[b]];
+				if(!locked[a]) {
+					candidates.push_back({a, b, evaluate(q, position(vertices[b]))});
+				}
+				if(!locked[b]) {
+					candidates.push_back({b, a, evaluate(q, position(vertices[a]))});
+				}
+			}
+		}
+		sort(candidates.begin(),
+		     candidates.end(),
+		     [](const Collapse& lhs, const Collapse& rhs) {
+			     return lhs.cost < rhs.cost;
+		     });
+
+		vector<uint32_t> offsets(vertexCount + 1, 0);
+		for(Index index: indices) { ++offsets[index + 1]; }
+		partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+		vector<uint32_t> adjacency(indices.size());
+		{
+			vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+			for(size_t i = 0; i < indices.size(); ++i) {
+				adjacency[cursor[indices[i]]++] = static_cast<uint32_t>(i / 3);
+			}
+		}
+
+		// A collapse is rejected if it would flip any surviving triangle
+		const auto flips = [&](Index from, Index to) {
+			for(uint32_t t = offsets[from]; t < offsets[from + 1]; ++t) {
+				const Index* corners = &indices[adjacency[t] * 3];
+				if(corners[0] == to || corners[1] == to || corners[2] == to) {
+					continue;
+				}
+
+				glm::dvec3 before[3];
+				glm::dvec3 after[3];
+				for(size_t c = 0; c < 3; ++c) {
+					before[c] = position(vertices[corners[c]]);
+					after[c]  = corners[c] == from ? position(vertices[to]) : before[c];
+				}
+				const glm::dvec3 n0 =
+				  glm::cross(before[1] - before[0], before[2] - before[0]);
+				const glm::dvec3 n1 =
+				  glm::cross(after[1] - after[0], after[2] - after[0]);
+				if(glm::dot(n0, n1) <= 0.0) { return true; }
+			}
+			return false;
+		};
+
+		vector<bool>  touched(vertexCount, false);
+		vector<Index> remap(vertexCount);
+		iota(remap.begin(), remap.end(), 0);
+
+		const size_t targetTriangles = targetIndexCount / 3;
+		size_t       removed         = 0;
+		for(const Collapse& collapse: candidates) {
+			if(triangleCount - removed <= targetTriangles) { break; }
+			if(touched[collapse.from] || touched[collapse.to]) { continue; }
+			if(flips(collapse.from, collapse.to)) { continue; }
+
+			remap[collapse.from] = collapse.to;
+			quadrics[canonical[collapse.to]] += quadrics[canonical[collapse.from]];
+			maxCost = max(maxCost, collapse.cost);
+
+			for(uint32_t t = offsets[collapse.from]; t < offsets[collapse.from + 1];
+			    ++t) {
+				const Index* corners = &indices[adjacency[t] * 3];
+				touched[corners[0]]  = true;
+				touched[corners[1]]  = true;
+				touched[corners[2]]  = true;
+				if(corners[0] == collapse.to || corners[1] == collapse.to ||
+				   corners[2] == collapse.to) {
+					++removed;
+				}
+			}
+		}
+		if(removed == 0) { break; }
+
+		// Apply the collapses and drop the triangles that became degenerate
+		size_t kept = 0;
+		for(size_t i = 0; i < indices.size(); i += 3) {
+			const Index a = remap[indices[i]];
+			const Index b = remap[indices[i + 1]];
+			const Index c = remap[indices[i + 2]];
+			if(a == b || b == c || c == a) { continue; }
+			indices[kept++] = a;
+			indices[kept++] = b;
+			indices[kept++] = c;
+		}
+		indices.resize(kept);
+	}
+
+	return {indices, static_cast<float>(sqrt(maxCost))};
+}
+
+void PMDL::generateLods(Body& body, size_t count, float reduction) {
+	// Drop any previous chain and keep only the finest level
+	const Lod finest = body.levels().front();
+	vector<Index> base(body.indices.begin() + finest.indexOffset,
+	                   body.indices.begin() + finest.indexOffset + finest.indexCount);
+
+	body.indices = base;
+	body.lods    = {{0, static_cast<uint32>(base.size()), 0.0f}};
+
+	size_t target = base.size();
+	for(size_t level = 1; level < count; ++level) {
+		target = static_cast<size_t>(static_cast<float>(target) * reduction) / 3 * 3;
+		if(target < 3) { break; }
+
+		Simplification simplified = simplify(base, body.vertices, target);
+		if(simplified.indices.size() >= body.lods.back().indexCount) { break; }
+
+		body.lods.push_back({static_cast<uint32>(body.indices.size()),
+		                     static_cast<uint32>(simplified.indices.size()),
+		                     simplified.error});
+		body.indices.insert(body.indices.end(),
+		                    simplified.indices.begin(),
+		                    simplified.indices.end());
+	}
+
+	if(body.lods.size() == 1) { body.lods.clear(); }
+}
+
+namespace {
+
+	PMDL::Vertex vertex(glm::vec3 p, glm::vec2 uv = glm::vec2(0.0f)) {
+		return {{p.x, p.y, p.z}, {0.0f, 0.0f, 1.0f}, {uv.x, uv.y}};
+	}
+
+	// Closed unit sphere of rings x segments quads, with single pole vertices
+	// and the last segment wrapping around to the first, so nothing is locked
+	PMDL::Body sphere(PMDL::Index rings, PMDL::Index segments) {
+		PMDL::Body body;
+		body.vertices.push_back(vertex({0.0f, 1.0f, 0.0f}));
+		for(PMDL::Index ring = 1; ring < rings; ++ring) {
+			const float theta = glm::pi<float>() * float(ring) / float(rings);
+			for(PMDL::Index segment = 0; segment < segments; ++segment) {
+				const float phi =
+				  glm::two_pi<float>() * float(segment) / float(segments);
+				body.vertices.push_back(vertex({sin(theta) * cos(phi),
+				                                cos(theta),
+				                                sin(theta) * sin(phi)}));
+			}
+		}
+		body.vertices.push_back(vertex({0.0f, -1.0f, 0.0f}));
+
+		const auto south = static_cast<PMDL::Index>(body.vertices.size() - 1);
+		const auto at    = [&](PMDL::Index ring, PMDL::Index segment) {
+			if(ring == 0) { return PMDL::Index(0); }
+			if(ring == rings) { return south; }
+			return 1 + (ring - 1) * segments + segment % segments;
+		};
+		for(PMDL::Index ring = 0; ring < rings; ++ring) {
+			for(PMDL::Index segment = 0; segment < segments; ++segment) {
+				const PMDL::Index a = at(ring, segment);
+				const PMDL::Index b = at(ring, segment + 1);
+				const PMDL::Index c = at(ring + 1, segment);
+				const PMDL::Index d = at(ring + 1, segment + 1);
+				if(ring > 0) { body.indices.insert(body.indices.end(), {a, b, c}); }
+				if(ring + 1 < rings) {
+					body.indices.insert(body.indices.end(), {b, d, c});
+				}
+			}
+		}
+		return body;
+	}
+
+} // namespace
+
+TEST_CASE("simplification reaches the target triangle count") {
+	const PMDL::Body body   = sphere(24, 48);
+	const size_t     target = body.indices.size() / 4 / 3 * 3;
+
+	const PMDL::Simplification simplified =
+	  PMDL::simplify(body.indices, body.vertices, target);
+	CHECK(simplified.indices.size() % 3 == 0);
+	CHECK(simplified.indices.size() <= target);
+
+	// Collapses on a closed mesh remove two triangles each, and a pass stops
+	// at the first one to reach the target
+	CHECK(simplified.indices.size() + 6 >= target);
+	CHECK(simplified.error > 0.0f);
+	CHECK(simplified.error < 0.5f);
+}
+
+TEST_CASE("simplification keeps borders and seams in place") {
+	// A flat grid, split down the middle into two UV islands sharing the
+	// positions of the seam column
+	constexpr PMDL::Index side = 16;
+	constexpr PMDL::Index seam = side / 2;
+
+	PMDL::Body       body;
+	const auto       row = [](PMDL::Index y) { return y * (side + 2); };
+	set<PMDL::Index> locked;
+	for(PMDL::Index y = 0; y <= side; ++y) {
+		for(PMDL::Index x = 0; x <= side + 1; ++x) {
+			// Column seam + 1 repeats the position of column seam
+			const PMDL::Index column = x > seam ? x - 1 : x;
+			body.vertices.push_back(vertex(
+			  {float(column), float(y), 0.0f}, {x > seam ? 1.0f : 0.0f, 0.0f}));
+
+			if(y == 0 || y == side || column == 0 || column == side ||
+			   column == seam) {
+				locked.insert(row(y) + x);
+			}
+		}
+	}
+	for(PMDL::Index y = 0; y < side; ++y) {
+		for(PMDL::Index x = 0; x <= side; ++x) {
+			if(x == seam) { continue; }
+			const PMDL::Index a = row(y) + x;
+			const PMDL::Index b = row(y + 1) + x;
+			body.indices.insert(body.indices.end(), {a, a + 1, b + 1});
+			body.indices.insert(body.indices.end(), {a, b + 1, b});
+		}
+	}
+
+	const PMDL::Simplification simplified =
+	  PMDL::simplify(body.indices, body.vertices, 0);
+
+	// The interior of a plane collapses for free, while every locked vertex
+	// still holds its triangles
+	CHECK(simplified.indices.size() < body.indices.size() / 4);
+	CHECK(simplified.error == 0.0f);
+	const set<PMDL::Index> used(simplified.indices.begin(),
+	                            simplified.indices.end());
+	for(PMDL::Index v: locked) { CHECK(used.count(v) == 1); }
+
+	// With the border in place, what is left still covers the whole grid
+	double area = 0.0;
+	for(size_t i = 0; i < simplified.indices.size(); i += 3) {
+		const glm::dvec3 a = position(body.vertices[simplified.indices[i]]);
+		const glm::dvec3 b = position(body.vertices[simplified.indices[i + 1]]);
+		const glm::dvec3 c = position(body.vertices[simplified.indices[i + 2]]);
+		area += glm::cross(b - a, c - a).z * 0.5;
+	}
+	CHECK(std::abs(area - double(side * side)) < 1e-6);
+}
+
+TEST_CASE("levels of detail get coarser and their error grows") {
+	PMDL::Body body = sphere(32, 64);
+	PMDL::generateLods(body, 5);
+
+	REQUIRE(body.lods.size() == 5);
+	CHECK(body.lods[0].indexOffset == 0);
+	CHECK(body.lods[0].error == 0.0f);
+	for(size_t level = 1; level < body.lods.size(); ++level) {
+		const PMDL::Lod& finer = body.lods[level - 1];
+		const PMDL::Lod& lod   = body.lods[level];
+		CHECK(lod.indexOffset == finer.indexOffset + finer.indexCount);
+		CHECK(lod.indexCount < finer.indexCount);
+		CHECK(lod.error >= finer.error);
+	}
+	CHECK(body.indices.size() ==
+	      body.lods.back().indexOffset + body.lods.back().indexCount);
+}
@@ -0,0 +1,389 @@
+#include "OcclusionBuffer.hpp"
+
+#include "PMDL.hpp"
+#include "job_system.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <stdexcept>
+
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	size_t round_up(size_t value, size_t multiple) {
+		return (value + multiple - 1) / multiple * multiple;
+	}
+
+	// Sutherland-Hodgman against the near plane, z >= -w in clip space. A
+	// triangle becomes at most a quad; returns the number of vertices left.
+	int clip_near(const vec4 (&triangle)[3], vec4 (&polygon)[4]) {
+		int count = 0;
+		for(int i = 0; i < 3; ++i) {
+			const vec4& from    = triangle[i];
+			const vec4& to      = triangle[(i + 1) % 3];
+			const float from_in = from.z + from.w;
+			const float to_in   = to.z + to.w;
+			if(from_in >= 0.0f) { polygon[count++] = from; }
+			if((from_in >= 0.0f) != (to_in >= 0.0f)) {
+				polygon[count++] = from + (to - from) * (from_in / (from_in - to_in));
+			}
+		}
+		return count;
+	}
+
+} // namespace
+
+namespace PD {
+
+	occluder_mesh occluder_mesh::load(const string& name) {
+		const PMDL::File file     = PMDL::File::read(name);
+		const PMDL::Lod  finest   = file.body.levels().front();
+		const auto&      vertices = file.body.vertices;
+		const auto first = file.body.indices.begin() + finest.indexOffset;
+
+		occluder_mesh mesh;
+		mesh.vertices.reserve(vertices.size());
+		for(const PMDL::Vertex& vertex: vertices) {
+			mesh.vertices.emplace_back(
+			  vertex.position.x, vertex.position.y, vertex.position.z);
+		}
+		mesh.indices.assign(first, first + finest.indexCount);
+		for(const uint32_t index: mesh.indices) {
+			if(index >= vertices.size()) {
+				throw runtime_error("occluder " + name + " indexes past its vertices");
+			}
+		}
+		return mesh;
+	}
+
+	OcclusionBuffer::OcclusionBuffer(size_t width, size_t height)
+	  : m_width(round_up(std::max<size_t>(width, 1), TILE_WIDTH))
+	  , m_height(round_up(std::max<size_t>(height, 1), TILE_HEIGHT))
+	  , m_view_projection(1.0f) {
+		m_depth.assign(m_width * m_height, 1.0f);
+		m_tile_depth.assign(tile_columns() * band_count(), 1.0f);
+	}
+
+	size_t OcclusionBuffer::tile_columns() const { return m_width / TILE_WIDTH; }
+
+	size_t OcclusionBuffer::band_count() const { return m_height / TILE_HEIGHT; }
+
+	size_t OcclusionBuffer::width() const { return m_width; }
+
+	size_t OcclusionBuffer::height() const { return m_height; }
+
+	float OcclusionBuffer::depth(size_t x, size_t y) const {
+		return m_depth[y * m_width + x];
+	}
+
+	void OcclusionBuffer::begin(const mat4& view_projection) {
+		m_view_projection = view_projection;
+		fill(m_depth.begin(), m_depth.end(), 1.0f);
+		fill(m_tile_depth.begin(), m_tile_depth.end(), 1.0f);
+		m_triangles.clear();
+	}
+
+	void OcclusionBuffer::add_occluder(span<const vec3>     vertices,
+	                                   span<const uint32_t> indices,
+	                                   const mat4&          model) {
+		const mat4 transform = m_view_projection * model;
+
+		vector<vec4> clip;
+		clip.reserve(vertices.size());
+		for(const vec3& vertex: vertices) {
+			clip.push_back(transform * vec4(vertex, 1.0f));
+		}
+
+		for(size_t i = 0; i + 2 < indices.size(); i += 3) {
+			const vec4 corners[3] = {
+			  clip[indices[i]], clip[indices[i + 1]], clip[indices[i + 2]]};
+			vec4      polygon[4];
+			const int count = clip_near(corners, polygon);
+			for(int fan = 1; fan + 1 < count; ++fan) {
+				add_triangle({polygon[0], polygon[fan], polygon[fan + 1]});
+			}
+		}
+	}
+
+	// Everything left is in front of the near plane, so w is positive
+	void OcclusionBuffer::add_triangle(const vec4 (&clip)[3]) {
+		triangle result{};
+		vec3     window[3];
+		for(int i = 0; i < 3; ++i) {
+			const vec3 ndc = vec3(clip[i]) / clip[i].w;
+			window[i] = vec3((ndc.x * 0.5f + 0.5f) * static_cast<float>(m_width),
+			                 (ndc.y * 0.5f + 0.5f) * static_cast<float>(m_height),
+			                 ndc.z * 0.5f + 0.5f);
+			result.vertices[i] = vec2(window[i]);
+		}
+
+		const vec3  first  = window[1] - window[0];
+		const vec3  second = window[2] - window[0];
+		const float area   = first.x * second.y - first.y * second.x;
+		if(!(area > 0.0f)) { return; } // Back facing, degenerate or NaN
+
+		const float a      = (first.z * second.y - second.z * first.y) / area;
+		const float b      = (first.x * second.z - second.x * first.z) / area;
+		const float c      = window[0].z - a * window[0].x - b * window[0].y;
+		result.depth_plane = vec3(a, b, c);
+
+		result.min_y = std::min({window[0].y, window[1].y, window[2].y});
+		result.max_y = std::max({window[0].y, window[1].y, window[2].y});
+		const float min_x = std::min({window[0].x, window[1].x, window[2].x});
+		const float max_x = std::max({window[0].x, window[1].x, window[2].x});
+		if(result.max_y < 0.0f || result.min_y > static_cast<float>(m_height) ||
+		   max_x < 0.0f || min_x > static_cast<float>(m_width)) {
+			return;
+		}
+		m_triangles.push_back(result);
+	}
+
+	// Pixels are covered when their center is on the inner side of all three
+	// edges. Edge functions and depth are linear over the screen, so both are
+	// evaluated for four neighbouring pixels at once.
+	void OcclusionBuffer::rasterize(size_t band) {
+		using namespace simd;
+
+		alignas(16) static constexpr float LANES[WIDTH] = {0.5f, 1.5f, 2.5f, 3.5f};
+		const float4 lanes = load(LANES);
+		const float4 zero  = broadcast(0.0f);
+
+		const size_t band_first = band * TILE_HEIGHT;
+		const size_t band_last  = band_first + TILE_HEIGHT;
+
+		for(const triangle& current: m_triangles) {
+			const float top    = static_cast<float>(band_last);
+			const float bottom = static_cast<float>(band_first);
+			if(current.max_y < bottom || current.min_y > top) { continue; }
+
+			const vec2* v     = current.vertices;
+			const float min_x = std::min({v[0].x, v[1].x, v[2].x});
+			const float max_x = std::max({v[0].x, v[1].x, v[2].x});
+			const auto  clamp_to = [](float value, size_t limit) {
+				return static_cast<size_t>(
+				  std::clamp(value, 0.0f, static_cast<float>(limit)));
+			};
+			const size_t x_first =
+			  clamp_to(std::floor(min_x), m_width) / WIDTH * WIDTH;
+			const size_t x_last = clamp_to(std::ceil(max_x), m_width);
+			const size_t y_first =
+			  std::max(band_first, clamp_to(std::floor(current.min_y), m_height));
+			const size_t y_last =
+			  std::min(band_last, clamp_to(std::ceil(current.max_y), m_height));
+
+			// Edge i is a * x + b * y + c, positive on the inner side
+			float4 edge_a[3], edge_b[3], edge_c[3];
+			for(int i = 0; i < 3; ++i) {
+				const vec2& from = v[i];
+				const vec2& to   = v[(i + 1) % 3];
+				const float a    = from.y - to.y;
+				const float b    = to.x - from.x;
+				edge_a[i]        = broadcast(a);
+				edge_b[i]        = broadcast(b);
+				edge_c[i]        = broadcast(-(a * from.x + b * from.y));
+			}
+			const float4 depth_a = broadcast(current.depth_plane.x);
+			const float4 depth_b = broadcast(current.depth_plane.y);
+			const float4 depth_c = broadcast(current.depth_plane.z);
+
+			for(size_t y = y_first; y < y_last; ++y) {
+				const float4 center_y = broadcast(static_cast<float>(y) + 0.5f);
+				float4       row[3];
+				for(int i = 0; i < 3; ++i) {
+					row[i] = edge_b[i] * center_y + edge_c[i];
+				}
+				const float4 row_depth = depth_b * center_y + depth_c;
+				float*       pixels    = &m_depth[y * m_width];
+
+				for(size_t x = x_first; x < x_last; x += WIDTH) {
+					const float4 center_x = broadcast(static_cast<float>(x)) + lanes;
+					const float4 outside  = less(edge_a[0] * center_x + row[0], zero) |
+					                       less(edge_a[1] * center_x + row[1], zero) |
+					                       less(edge_a[2] * center_x + row[2], zero);
+					if(movemask(outside) == 0xF) { continue; }
+
+					const float4 depth  = depth_a * center_x + row_depth;
+					const float4 stored = load(pixels + x);
+					store(pixels + x, select(outside, stored, min(stored, depth)));
+				}
+			}
+		}
+
+		for(size_t column = 0; column < tile_columns(); ++column) {
+			float farthest = 0.0f;
+			for(size_t y = band_first; y < band_last; ++y) {
+				const float* row = &m_depth[y * m_width + column * TILE_WIDTH];
+				farthest = std::max(farthest, *max_element(row, row + TILE_WIDTH));
+			}
+			m_tile_depth[band * tile_columns() + column] = farthest;
+		}
+	}
+
+	void OcclusionBuffer::render() {
+		for(size_t band = 0; band < band_count(); ++band) { rasterize(band); }
+	}
+
+	// Bands share no pixels, so they need no synchronization
+	void OcclusionBuffer::render(JobSystem& jobs) {
+		jobs.parallel_for(0, band_count(), 1, [this](size_t first, size_t last) {
+			for(size_t band = first; band < last; ++band) { rasterize(band); }
+		});
+	}
+
+	// The box is hidden if every pixel its screen rectangle touches holds
+	// something nearer than the box's nearest corner
+	bool OcclusionBuffer::visible(const aabb& box) const {
+		vec2  low(numeric_limits<float>::max());
+		vec2  high(numeric_limits<float>::lowest());
+		float nearest = numeric_limits<float>::max();
+		for(int i = 0; i < 8; ++i) {
+			const vec3 corner(i & 1 ? box.max.x : box.min.x,
+			                  i & 2 ? box.max.y : box.min.y,
+			                  i & 4 ? box.max.z : box.min.z);
+			const vec4 clip = m_view_projection * vec4(corner, 1.0f);
+			if(!(clip.z + clip.w > 0.0f)) { return true; }
+
+			const vec3 ndc = vec3(clip) / clip.w;
+			const vec2 window((ndc.x * 0.5f + 0.5f) * static_cast<float>(m_width),
+			                  (ndc.y * 0.5f + 0.5f) * static_cast<float>(m_height));
+			low     = glm::min(low, window);
+			high    = glm::max(high, window);
+			nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+		}
+
+		const auto clamp_to = [](float value, size_t limit) {
+			return static_cast<size_t>(
+			  std::clamp(value, 0.0f, static_cast<float>(limit)));
+		};
+		const size_t x_first = clamp_to(std::floor(low.x), m_width);
+		const size_t x_last  = clamp_to(std::ceil(high.x), m_width);
+		const size_t y_first = clamp_to(std::floor(low.y), m_height);
+		const size_t y_last  = clamp_to(std::ceil(high.y), m_height);
+
+		for(size_t tile_y = y_first / TILE_HEIGHT;
+		    tile_y * TILE_HEIGHT < y_last;
+		    ++tile_y) {
+			for(size_t tile_x = x_first / TILE_WIDTH;
+			    tile_x * TILE_WIDTH < x_last;
+			    ++tile_x) {
+				if(m_tile_depth[tile_y * tile_columns() + tile_x] < nearest) {
+					continue;
+				}
+
+				const size_t y_end = std::min(y_last, (tile_y + 1) * TILE_HEIGHT);
+				const size_t x_end = std::min(x_last, (tile_x + 1) * TILE_WIDTH);
+				const size_t y_begin = std::max(y_first, tile_y * TILE_HEIGHT);
+				const size_t x_begin = std::max(x_first, tile_x * TILE_WIDTH);
+				for(size_t y = y_begin; y < y_end; ++y) {
+					for(size_t x = x_begin; x < x_end; ++x) {
+						if(m_depth[y * m_width + x] >= nearest) { return true; }
+					}
+				}
+			}
+		}
+		return false;
+	}
+
+} // namespace PD
+
+namespace {
+
+	// Square facing the camera, counter-clockwise as seen from +z
+	const vector<vec3> SQUARE = {vec3(-1.0f, -1.0f, 0.0f),
+	                             vec3(1.0f, -1.0f, 0.0f),
+	                             vec3(1.0f, 1.0f, 0.0f),
+	                             vec3(-1.0f, 1.0f, 0.0f)};
+
+	const vector<uint32_t> FRONT = {0, 1, 2, 0, 2, 3};
+	const vector<uint32_t> BACK  = {0, 2, 1, 0, 3, 2};
+
+	PD::aabb cube(const vec3& center, float half) {
+		return {center - vec3(half), center + vec3(half)};
+	}
+
+	// Camera at the origin looking down -z, with a 10 by 10 wall 10 units away
+	// covering the middle half of the screen
+	PD::OcclusionBuffer wall(const vector<uint32_t>& indices) {
+		PD::OcclusionBuffer buffer(64, 64);
+		buffer.begin(perspective(radians(90.0f), 1.0f, 1.0f, 100.0f));
+		buffer.add_occluder(SQUARE,
+		                    indices,
+		                    scale(translate(mat4(1.0f), vec3(0.0f, 0.0f, -10.0f)),
+		                          vec3(5.0f)));
+		buffer.render();
+		return buffer;
+	}
+
+} // namespace
+
+TEST_CASE("occluders hide boxes entirely behind them") {
+	const PD::OcclusionBuffer buffer = wall(FRONT);
+
+	CHECK(!buffer.visible(cube(vec3(0.0f, 0.0f, -20.0f), 1.0f)));
+	CHECK(!buffer.visible(cube(vec3(8.0f, -8.0f, -40.0f), 2.0f)));
+
+	CHECK(buffer.visible(cube(vec3(0.0f, 0.0f, -5.0f), 1.0f)));    // In front
+	CHECK(buffer.visible(cube(vec3(0.0f, 0.0f, -10.0f), 1.0f)));   // Crossing
+	CHECK(buffer.visible(cube(vec3(15.0f, 0.0f, -20.0f), 1.0f)));  // Beside
+	CHECK(buffer.visible(cube(vec3(10.0f, 0.0f, -20.0f), 1.0f)));  // At the edge
+	CHECK(buffer.visible(cube(vec3(0.0f, 0.0f, 0.5f), 1.0f)));     // Near plane
+	CHECK(!buffer.visible(cube(vec3(200.0f, 0.0f, -20.0f), 1.0f))); // Off-screen
+}
+
+TEST_CASE("back faces do not occlude") {
+	const PD::OcclusionBuffer buffer = wall(BACK);
+	CHECK(buffer.visible(cube(vec3(0.0f, 0.0f, -20.0f), 1.0f)));
+}
+
+TEST_CASE("occluders crossing the near plane are clipped") {
+	// A floor below the camera that starts behind it and runs into the
+	// distance covers the lower half of the screen
+	PD::OcclusionBuffer buffer(64, 64);
+	buffer.begin(perspective(radians(90.0f), 1.0f, 1.0f, 100.0f));
+	const mat4 floor = scale(
+	  rotate(translate(mat4(1.0f), vec3(0.0f, -1.0f, -40.0f)),
+	         radians(-90.0f),
+	         vec3(1.0f, 0.0f, 0.0f)),
+	  vec3(50.0f));
+	buffer.add_occluder(SQUARE, FRONT, floor);
+	buffer.render();
+
+	CHECK(buffer.depth(32, 0) < 1.0f);
+	CHECK(buffer.depth(32, 63) == 1.0f);
+	CHECK(!buffer.visible(cube(vec3(0.0f, -4.0f, -20.0f), 1.0f)));
+	CHECK(buffer.visible(cube(vec3(0.0f, 2.0f, -20.0f), 1.0f)));
+}
+
+TEST_CASE("bands rendered on workers match a serial render") {
+	PD::JobSystem       jobs(3);
+	PD::OcclusionBuffer serial(128, 96);
+	PD::OcclusionBuffer parallel(128, 96);
+
+	const mat4 projection = perspective(radians(70.0f), 4.0f / 3.0f, 0.5f, 50.0f);
+	serial.begin(projection);
+	parallel.begin(projection);
+	for(int i = 0; i < 20; ++i) {
+		const float angle = static_cast<float>(i) * 0.3f;
+		const vec3  position(
+		  std::sin(angle) * 6.0f, std::cos(angle) * 3.0f, -8.0f - angle);
+		const mat4 model = rotate(
+		  translate(mat4(1.0f), position), angle, vec3(0.3f, 1.0f, 0.2f));
+		serial.add_occluder(SQUARE, FRONT, model);
+		parallel.add_occluder(SQUARE, FRONT, model);
+	}
+	serial.render();
+	parallel.render(jobs);
+
+	bool same = true;
+	for(size_t y = 0; y < serial.height(); ++y) {
+		for(size_t x = 0; x < serial.width(); ++x) {
+			same = same && serial.depth(x, y) == parallel.depth(x, y);
+		}
+	}
+	CHECK(same);
+}
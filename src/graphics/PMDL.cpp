@@ -1,18 +1,466 @@
 #include "PMDL.hpp"
 
+#include "Culling.hpp"
+#include "MappedFile.hpp"
+
+#include <algorithm>
 #include <cereal/archives/json.hpp>
 #include <cereal/archives/portable_binary.hpp>
 #include <cereal/types/vector.hpp>
+#include <cmath>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+	std::uint64_t align(std::uint64_t offset) {
+		const std::uint64_t alignment = PMDL::BLOB_ALIGNMENT;
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	void pad(std::ostream& of, std::uint64_t to) {
+		static const char zeroes[PMDL::BLOB_ALIGNMENT] = {};
+		const auto        at = static_cast<std::uint64_t>(of.tellp());
+		of.write(zeroes, static_cast<std::streamsize>(to - at));
+	}
+
+	template <typename T>
+	void writeBlob(std::ostream& of, const std::vector<T>& blob) {
+		of.write(reinterpret_cast<const char*>(blob.data()),
+		         static_cast<std::streamsize>(blob.size() * sizeof(T)));
+	}
+
+	glm::vec2 signNotZero(glm::vec2 v) {
+		return {v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f};
+	}
+
+	// Octahedral normal encoding: project onto the octahedron |x|+|y|+|z| = 1
+	// and fold the lower hemisphere over the diagonals. Degenerate normals
+	// have no direction to keep and encode as +z.
+	glm::vec2 encodeOctahedral(glm::vec3 n) {
+		const float norm = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		if(!(norm > 0.0f) || !std::isfinite(norm)) { return {0.0f, 0.0f}; }
+		n /= norm;
+		glm::vec2 e(n.x, n.y);
+		if(n.z < 0.0f) { e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * signNotZero(e); }
+		return e;
+	}
+
+	glm::vec3 decodeOctahedral(glm::vec2 e) {
+		glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+		if(n.z < 0.0f) {
+			const glm::vec2 folded =
+			  (1.0f - glm::abs(glm::vec2(n.y, n.x))) * signNotZero(e);
+			n.x = folded.x;
+			n.y = folded.y;
+		}
+		return glm::normalize(n);
+	}
+
+	glm::vec3 toVec3(const PMDL::Vec3f& v) { return {v.x, v.y, v.z}; }
+
+	PMDL::Vec3f toVec3f(const glm::vec3& v) { return {v.x, v.y, v.z}; }
+
+	// Same fit as the loader would make, stored so it does not have to
+	PMDL::Bounds fitBounds(const std::vector<glm::vec3>& points) {
+		const PD::bounds fitted = PD::bounds::fit(points);
+		return {toVec3f(fitted.min),
+		        toVec3f(fitted.max),
+		        toVec3f(fitted.center),
+		        fitted.radius};
+	}
+
+	void checkIndices(const std::vector<PMDL::Index>& indices,
+	                  std::size_t                     vertexCount) {
+		for(const PMDL::Index index: indices) {
+			if(index >= vertexCount) {
+				throw std::runtime_error("PMDL index past the last vertex");
+			}
+		}
+	}
+
+	std::int16_t packSnorm(float value) {
+		return static_cast<std::int16_t>(glm::packSnorm1x16(value));
+	}
+
+	float unpackSnorm(std::int16_t value) {
+		return glm::unpackSnorm1x16(static_cast<std::uint16_t>(value));
+	}
+
+} // namespace
+
+PMDL::Quantization PMDL::Quantization::fit(const std::vector<Vertex>& vertices) {
+	if(vertices.empty()) { return {{1.0f, 1.0f, 1.0f}, {0.0f, 0.0f, 0.0f}}; }
+
+	glm::vec3 low(std::numeric_limits<float>::max());
+	glm::vec3 high(std::numeric_limits<float>::lowest());
+	for(const Vertex& vertex: vertices) {
+		const glm::vec3 p(vertex.position.x, vertex.position.y, vertex.position.z);
+		low  = glm::min(low, p);
+		high = glm::max(high, p);
+	}
+
+	// Flat meshes still need a non-zero scale on their degenerate axis
+	const glm::vec3 center = (low + high) * 0.5f;
+	const glm::vec3 extent =
+	  glm::max((high - low) * 0.5f, glm::vec3(std::numeric_limits<float>::min()));
+	return {{extent.x, extent.y, extent.z}, {center.x, center.y, center.z}};
+}
+
+PMDL::PackedVertex PMDL::pack(const Vertex& vertex, const Quantization& q) {
+	const glm::vec2 normal = encodeOctahedral(
+	  glm::vec3(vertex.normal.x, vertex.normal.y, vertex.normal.z));
+
+	PackedVertex packed{};
+	packed.position[0] = packSnorm((vertex.position.x - q.offset.x) / q.scale.x);
+	packed.position[1] = packSnorm((vertex.position.y - q.offset.y) / q.scale.y);
+	packed.position[2] = packSnorm((vertex.position.z - q.offset.z) / q.scale.z);
+	packed.normal[0]   = packSnorm(normal.x);
+	packed.normal[1]   = packSnorm(normal.y);
+	packed.texCoord[0] = glm::packHalf1x16(vertex.texCoord.u);
+	packed.texCoord[1] = glm::packHalf1x16(vertex.texCoord.v);
+	return packed;
+}
+
+PMDL::Vertex PMDL::unpack(const PackedVertex& vertex, const Quantization& q) {
+	const glm::vec3 normal = decodeOctahedral(
+	  glm::vec2(unpackSnorm(vertex.normal[0]), unpackSnorm(vertex.normal[1])));
+
+	return {{unpackSnorm(vertex.position[0]) * q.scale.x + q.offset.x,
+	         unpackSnorm(vertex.position[1]) * q.scale.y + q.offset.y,
+	         unpackSnorm(vertex.position[2]) * q.scale.z + q.offset.z},
+	        {normal.x, normal.y, normal.z},
+	        {glm::unpackHalf1x16(vertex.texCoord[0]),
+	         glm::unpackHalf1x16(vertex.texCoord[1])}};
+}
+
+std::vector<PMDL::Lod> PMDL::Body::levels() const {
+	if(!lods.empty()) { return lods; }
+	return {{0, static_cast<uint32>(indices.size()), 0.0f}};
+}
 
 void PMDL::File::write(const std::string& filename) {
+	if(body.lods.size() > 1) {
+		throw std::runtime_error("levels of detail require PMDL v2");
+	}
 	std::ofstream                       of(filename, std::ofstream::binary);
 	cereal::PortableBinaryOutputArchive oarchive(of);
 	oarchive(*this);
 }
 
+void PMDL::File::writeMapped(const std::string& filename,
+                             VertexFormat       format) const {
+	std::ofstream of(filename, std::ofstream::binary);
+	writeMapped(of, format);
+	if(!of) { throw std::runtime_error("could not write " + filename); }
+}
+
+void PMDL::File::writeMapped(std::ostream& of, VertexFormat format) const {
+	checkIndices(body.indices, body.vertices.size());
+	const bool             shortIndices = fitsShortIndices(body.vertices.size());
+	const std::vector<Lod> levels       = body.levels();
+
+	MappedHeader mapped{};
+	mapped.signature    = MAPPED_SIGNATURE;
+	mapped.version      = MAPPED_VERSION;
+	mapped.vertexFormat = format;
+	mapped.vertexStride = format == VertexFormat::Quantized ? sizeof(PackedVertex)
+	                                                        : sizeof(Vertex);
+	mapped.indexSize = shortIndices ? sizeof(uint16) : sizeof(Index);
+	mapped.positionScale  = {1.0f, 1.0f, 1.0f};
+	mapped.positionOffset = {0.0f, 0.0f, 0.0f};
+	mapped.vertexOffset   = align(sizeof(MappedHeader));
+	mapped.vertexCount    = body.vertices.size();
+	mapped.indexOffset =
+	  align(mapped.vertexOffset + mapped.vertexCount * mapped.vertexStride);
+	mapped.indexCount = body.indices.size();
+	mapped.lodOffset =
+	  align(mapped.indexOffset + mapped.indexCount * mapped.indexSize);
+	mapped.lodCount = levels.size();
+	mapped.lodBoundsOffset =
+	  align(mapped.lodOffset + mapped.lodCount * sizeof(Lod));
+	mapped.positionStreamOffset =
+	  align(mapped.lodBoundsOffset + mapped.lodCount * sizeof(Bounds));
+
+	// Positions as the GPU decodes them, so quantized meshes are bounded by
+	// their quantized positions
+	std::vector<glm::vec3> positions;
+	positions.reserve(body.vertices.size());
+	std::vector<PackedVertex> packed;
+	if(format == VertexFormat::Quantized) {
+		const Quantization quantization = Quantization::fit(body.vertices);
+		mapped.positionScale            = quantization.scale;
+		mapped.positionOffset           = quantization.offset;
+
+		packed.reserve(body.vertices.size());
+		for(const Vertex& vertex: body.vertices) {
+			packed.push_back(pack(vertex, quantization));
+			positions.push_back(
+			  toVec3(unpack(packed.back(), quantization).position));
+		}
+	} else {
+		for(const Vertex& vertex: body.vertices) {
+			positions.push_back(toVec3(vertex.position));
+		}
+	}
+
+	mapped.bounds = fitBounds(positions);
+	std::vector<Bounds>    lodBounds;
+	std::vector<glm::vec3> used;
+	for(const Lod& level: levels) {
+		used.clear();
+		for(uint32 i = 0; i < level.indexCount; ++i) {
+			used.push_back(positions[body.indices[level.indexOffset + i]]);
+		}
+		lodBounds.push_back(fitBounds(used));
+	}
+
+	// The position attribute leads either vertex layout
+	const std::size_t      stride = positionStride(format);
+	std::vector<std::byte> positionStream(body.vertices.size() * stride);
+	of.write(reinterpret_cast<const char*>(&mapped), sizeof(mapped));
+	pad(of, mapped.vertexOffset);
+	if(format == VertexFormat::Quantized) {
+		for(std::size_t i = 0; i < packed.size(); ++i) {
+			std::memcpy(&positionStream[i * stride], packed[i].position, stride);
+		}
+		writeBlob(of, packed);
+	} else {
+		for(std::size_t i = 0; i < body.vertices.size(); ++i) {
+			std::memcpy(
+			  &positionStream[i * stride], &body.vertices[i].position, stride);
+		}
+		writeBlob(of, body.vertices);
+	}
+
+	pad(of, mapped.indexOffset);
+	if(shortIndices) {
+		writeBlob(of, std::vector<uint16>(body.indices.begin(), body.indices.end()));
+	} else {
+		writeBlob(of, body.indices);
+	}
+
+	pad(of, mapped.lodOffset);
+	writeBlob(of, levels);
+	pad(of, mapped.lodBoundsOffset);
+	writeBlob(of, lodBounds);
+	pad(of, mapped.positionStreamOffset);
+	writeBlob(of, positionStream);
+}
+
 PMDL::File PMDL::File::parse(std::istream& fileContents) {
 	cereal::PortableBinaryInputArchive iarchive(fileContents);
 	File                               file;
 	iarchive(file);
+	checkIndices(file.body.indices, file.body.vertices.size());
 	return file;
 }
+
+PMDL::File PMDL::File::read(const std::string& filename) {
+	{
+		const PD::MappedFile mapping(filename);
+		if(MappedView::isMapped(mapping.bytes())) {
+			const MappedView view = MappedView::map(mapping.bytes());
+			const auto       quantization =
+			  Quantization{view.header->positionScale, view.header->positionOffset};
+
+			File file;
+			// Decoded, the file is what write() would turn into version 1
+			file.header = Header(SIGNATURE, VERSION);
+			file.body.vertices.resize(view.header->vertexCount);
+			if(view.header->vertexFormat == VertexFormat::Quantized) {
+				for(std::size_t i = 0; i < file.body.vertices.size(); ++i) {
+					PackedVertex packed;
+					std::memcpy(&packed,
+					            view.vertexData.data() + i * sizeof(PackedVertex),
+					            sizeof(PackedVertex));
+					file.body.vertices[i] = unpack(packed, quantization);
+				}
+			} else {
+				std::memcpy(file.body.vertices.data(),
+				            view.vertexData.data(),
+				            view.vertexData.size());
+			}
+
+			file.body.indices.resize(view.header->indexCount);
+			if(view.header->indexSize == sizeof(uint16)) {
+				std::vector<uint16> narrow(view.header->indexCount);
+				std::memcpy(narrow.data(), view.indexData.data(), view.indexData.size());
+				std::copy(narrow.begin(), narrow.end(), file.body.indices.begin());
+			} else {
+				std::memcpy(file.body.indices.data(),
+				            view.indexData.data(),
+				            view.indexData.size());
+			}
+
+			if(view.lods.size() > 1) {
+				file.body.lods.assign(view.lods.begin(), view.lods.end());
+			}
+			return file;
+		}
+	}
+
+	std::ifstream fileStream(filename, std::ios::binary);
+	return parse(fileStream);
+}
+
+bool PMDL::MappedView::isMapped(std::span<const std::byte> fileContents) {
+	uint32 signature = 0;
+	if(fileContents.size() < sizeof(signature)) { return false; }
+	std::memcpy(&signature, fileContents.data(), sizeof(signature));
+	return signature == MAPPED_SIGNATURE;
+}
+
+PMDL::MappedView PMDL::MappedView::map(std::span<const std::byte> fileContents) {
+	if(fileContents.size() < sizeof(MappedHeader) || !isMapped(fileContents)) {
+		throw std::runtime_error("not a PMDL v2 file");
+	}
+	// Mappings are page-aligned, so the header can be read in place
+	const auto* header = reinterpret_cast<const MappedHeader*>(fileContents.data());
+	if(header->version != MAPPED_VERSION) {
+		throw std::runtime_error("unsupported PMDL version " +
+		                         std::to_string(header->version));
+	}
+
+	const bool quantized = header->vertexFormat == VertexFormat::Quantized;
+	if(header->vertexFormat != VertexFormat::Float32 && !quantized) {
+		throw std::runtime_error("unknown PMDL vertex format");
+	}
+	if(header->vertexStride !=
+	   (quantized ? sizeof(PackedVertex) : sizeof(Vertex))) {
+		throw std::runtime_error("PMDL vertex stride does not match its format");
+	}
+	if(header->indexSize != sizeof(uint16) && header->indexSize != sizeof(Index)) {
+		throw std::runtime_error("PMDL indices must be 16 or 32 bits");
+	}
+
+	const auto blob = [&](uint64 offset, uint64 count, uint32 stride) {
+		if(stride != 0 && count > std::numeric_limits<uint64>::max() / stride) {
+			throw std::runtime_error("PMDL v2 blob size overflows");
+		}
+		const uint64 size = count * stride;
+		if(offset % BLOB_ALIGNMENT != 0 || offset > fileContents.size() ||
+		   size > fileContents.size() - offset) {
+			throw std::runtime_error("PMDL v2 blob lies outside of the file");
+		}
+		return fileContents.subspan(offset, size);
+	};
+
+	const auto lodData = blob(header->lodOffset, header->lodCount, sizeof(Lod));
+	const std::span<const Lod> lods(reinterpret_cast<const Lod*>(lodData.data()),
+	                                header->lodCount);
+	if(lods.empty()) { throw std::runtime_error("PMDL v2 file has no LOD table"); }
+	for(const Lod& lod: lods) {
+		if(lod.indexOffset > header->indexCount ||
+		   lod.indexCount > header->indexCount - lod.indexOffset) {
+			throw std::runtime_error("PMDL LOD lies outside of the index blob");
+		}
+	}
+	const auto boundsData =
+	  blob(header->lodBoundsOffset, header->lodCount, sizeof(Bounds));
+
+	// Loaders index positions with these on the CPU, and out of range
+	// indices are undefined behaviour on the GPU
+	const auto indexData =
+	  blob(header->indexOffset, header->indexCount, header->indexSize);
+	for(uint64 i = 0; i < header->indexCount; ++i) {
+		uint64 index = 0;
+		if(header->indexSize == sizeof(uint16)) {
+			uint16 narrow;
+			std::memcpy(
+			  &narrow, indexData.data() + i * sizeof(narrow), sizeof(narrow));
+			index = narrow;
+		} else {
+			Index wide;
+			std::memcpy(&wide, indexData.data() + i * sizeof(wide), sizeof(wide));
+			index = wide;
+		}
+		if(index >= header->vertexCount) {
+			throw std::runtime_error("PMDL index past the last vertex");
+		}
+	}
+
+	const std::span<const Bounds> lodBounds(
+	  reinterpret_cast<const Bounds*>(boundsData.data()), header->lodCount);
+
+	return {header,
+	        blob(header->vertexOffset, header->vertexCount, header->vertexStride),
+	        indexData,
+	        lods,
+	        lodBounds,
+	        blob(header->positionStreamOffset,
+	             header->vertexCount,
+	             static_cast<uint32>(positionStride(header->vertexFormat)))};
+}
+
+TEST_CASE("degenerate normals pack to a unit normal") {
+	const PMDL::Quantization quantization{{1.0f, 1.0f, 1.0f}, {0.0f, 0.0f, 0.0f}};
+	const PMDL::Vertex       vertex{{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, {}};
+
+	const PMDL::PackedVertex packed = PMDL::pack(vertex, quantization);
+	CHECK(packed.normal[0] == 0);
+	CHECK(packed.normal[1] == 0);
+
+	const PMDL::Vertex unpacked = PMDL::unpack(packed, quantization);
+	CHECK(std::abs(unpacked.normal.z - 1.0f) < 1e-6f);
+}
+
+namespace {
+
+	// Writes file as version 2 into storage aligned for the header
+	std::vector<PMDL::MappedHeader> writeAligned(const PMDL::File& file) {
+		std::ostringstream stream;
+		file.writeMapped(stream);
+		const std::string               bytes = stream.str();
+		std::vector<PMDL::MappedHeader> storage(
+		  (bytes.size() + sizeof(PMDL::MappedHeader) - 1) /
+		  sizeof(PMDL::MappedHeader));
+		std::memcpy(storage.data(), bytes.data(), bytes.size());
+		return storage;
+	}
+
+} // namespace
+
+TEST_CASE("version 2 files carry the bounds of the mesh and each level") {
+	PMDL::File file;
+	file.body.vertices = {{{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {}},
+	                      {{2.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {}},
+	                      {{0.0f, 2.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {}},
+	                      {{4.0f, 4.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {}}};
+	file.body.indices  = {0, 1, 2, 1, 3, 2, 0, 1, 2};
+	file.body.lods     = {{0, 6, 0.0f}, {6, 3, 1.0f}};
+
+	auto storage = writeAligned(file);
+	const std::span<const std::byte> bytes =
+	  std::as_bytes(std::span(storage));
+	const PMDL::MappedView view = PMDL::MappedView::map(bytes);
+
+	CHECK(view.header->bounds.max.x == 4.0f);
+	CHECK(view.header->bounds.center.y == 2.0f);
+	REQUIRE(view.lodBounds.size() == 2);
+	CHECK(view.lodBounds[0].max.y == 4.0f);
+	CHECK(view.lodBounds[1].max.x == 2.0f);
+	CHECK(view.lodBounds[1].max.y == 2.0f);
+
+	// The depth stream holds just the positions
+	REQUIRE(view.positionData.size() == 4 * sizeof(PMDL::Vec3f));
+	PMDL::Vec3f last;
+	std::memcpy(&last, view.positionData.data() + 3 * sizeof(last), sizeof(last));
+	CHECK(last.x == 4.0f);
+	CHECK(last.y == 4.0f);
+
+	SUBCASE("an index past the last vertex is rejected") {
+		auto* indices = reinterpret_cast<std::byte*>(storage.data()) +
+		                storage.front().indexOffset;
+		indices[0] = std::byte{4};
+		CHECK_THROWS_AS(PMDL::MappedView::map(bytes), std::runtime_error);
+
+		file.body.indices[0] = 4;
+		std::ostringstream stream;
+		CHECK_THROWS_AS(file.writeMapped(stream), std::runtime_error);
+	}
+}
@@ -2,10 +2,107 @@
 
 #include "ShaderProgram.hpp"
 
+#include <algorithm>
+#include <array>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <globjects/UniformBlock.h>
+#include <globjects/VertexArray.h>
+#include <globjects/globjects.h>
+#include <numeric>
+#include <stdexcept>
+
 using namespace std;
 using namespace gl;
 using namespace globjects;
 
+namespace {
+
+	void bind_object_block(VertexShaderProgram& vertex_shader) {
+		vertex_shader.raw()->uniformBlock("Object")->setBinding(
+		  PD::TransformBuffer::BINDING);
+	}
+
+	using triangle = array<glm::vec3, 3>;
+
+	// Octahedron subdivided twice, with its corners on the unit sphere and
+	// then pushed out until even the middles of its faces lie outside it.
+	// Faces wind counter-clockwise seen from outside.
+	vector<triangle> light_volume_triangles() {
+		vector<triangle> triangles;
+		for(const float x: {-1.0f, 1.0f}) {
+			for(const float y: {-1.0f, 1.0f}) {
+				for(const float z: {-1.0f, 1.0f}) {
+					triangle face{glm::vec3(x, 0.0f, 0.0f),
+					              glm::vec3(0.0f, y, 0.0f),
+					              glm::vec3(0.0f, 0.0f, z)};
+					if(x * y * z < 0.0f) { swap(face[1], face[2]); }
+					triangles.push_back(face);
+				}
+			}
+		}
+
+		for(int level = 0; level < 2; ++level) {
+			vector<triangle> finer;
+			for(const auto& [a, b, c]: triangles) {
+				const glm::vec3 ab = normalize(a + b);
+				const glm::vec3 bc = normalize(b + c);
+				const glm::vec3 ca = normalize(c + a);
+				finer.insert(finer.end(),
+				             {{a, ab, ca}, {ab, b, bc}, {ca, bc, c}, {ab, bc, ca}});
+			}
+			triangles = std::move(finer);
+		}
+
+		float inner = 1.0f;
+		for(const auto& [a, b, c]: triangles) {
+			inner = std::min(inner, dot(normalize(cross(b - a, c - a)), a));
+		}
+		for(triangle& face: triangles) {
+			for(glm::vec3& corner: face) { corner /= inner; }
+		}
+		return triangles;
+	}
+
+	GeometryData light_volume_data() {
+		vector<PMDL::Vertex> vertices;
+		vector<PMDL::Index>  indices;
+		vector<glm::vec3>    positions;
+		for(const triangle& face: light_volume_triangles()) {
+			for(const glm::vec3& corner: face) {
+				indices.push_back(static_cast<PMDL::Index>(vertices.size()));
+				vertices.emplace_back(PMDL::Vec3f{corner.x, corner.y, corner.z},
+				                      PMDL::Vec3f{},
+				                      PMDL::Vec2f{});
+				positions.push_back(corner);
+			}
+		}
+
+		const auto vertex_bytes = as_bytes(span(vertices));
+		const auto index_bytes  = as_bytes(span(indices));
+		auto       storage =
+		  make_shared<vector<byte>>(vertex_bytes.begin(), vertex_bytes.end());
+		storage->insert(storage->end(), index_bytes.begin(), index_bytes.end());
+
+		const span<const byte> blobs(*storage);
+		const PD::bounds       bounds = PD::bounds::fit(positions);
+		return {nullptr,
+		        std::move(storage),
+		        blobs.first(vertex_bytes.size()),
+		        blobs.subspan(vertex_bytes.size()),
+		        GL_UNSIGNED_INT,
+		        PMDL::VertexFormat::Float32,
+		        glm::vec3(1.0f),
+		        glm::vec3(0.0f),
+		        {{0, static_cast<PMDL::uint32>(indices.size()), 0.0f}},
+		        bounds,
+		        {bounds},
+		        {},
+		        nullopt};
+	}
+
+} // namespace
+
 namespace PD {
 
 	RenderContext::RenderContext(framebuffer_ptr frame_buffer,
@@ -13,15 +110,405 @@ namespace PD {
 	                             pipeline_ptr    highlight_pipeline)
 	  : m_frame_buffer(std::move(frame_buffer))
 	  , m_ambient_pipeline(std::move(ambient_pipeline))
-	  , m_highlight_pipeline(std::move(highlight_pipeline)) {}
+	  , m_highlight_pipeline(std::move(highlight_pipeline))
+	  , m_depth_pipeline(nullptr)
+	  , m_g_buffer(nullptr)
+	  , m_fullscreen(nullptr)
+	  , m_light_buffer(nullptr)
+	  , m_instance_buffer(new Buffer())
+	  , m_transform_buffer(new TransformBuffer())
+	  , m_depth_bounds(hasExtension(GLextension::GL_EXT_depth_bounds_test))
+	  , m_light_volume(nullptr)
+	  , m_volume_instance(nullptr) {
+		bind_object_block(m_ambient_pipeline->vertex_shader());
+		bind_object_block(m_highlight_pipeline->vertex_shader());
+	}
+
+	RenderContext::RenderContext(framebuffer_ptr frame_buffer,
+	                             pipeline_ptr    ambient_pipeline,
+	                             pipeline_ptr    highlight_pipeline,
+	                             g_buffer_ptr    g_buffer)
+	  : m_frame_buffer(std::move(frame_buffer))
+	  , m_ambient_pipeline(std::move(ambient_pipeline))
+	  , m_highlight_pipeline(std::move(highlight_pipeline))
+	  , m_depth_pipeline(nullptr)
+	  , m_g_buffer(std::move(g_buffer))
+	  , m_fullscreen(new VertexArray())
+	  , m_light_buffer(nullptr)
+	  , m_instance_buffer(new Buffer())
+	  , m_transform_buffer(new TransformBuffer())
+	  , m_depth_bounds(hasExtension(GLextension::GL_EXT_depth_bounds_test))
+	  , m_light_volume(nullptr)
+	  , m_volume_instance(nullptr) {
+		if(m_g_buffer->width != m_frame_buffer->width ||
+		   m_g_buffer->height != m_frame_buffer->height) {
+			throw invalid_argument("G-buffer and frame buffer sizes differ");
+		}
+		bind_object_block(m_ambient_pipeline->vertex_shader());
+
+		globjects::Program& fragment_shader =
+		  *m_highlight_pipeline->fragment_shader();
+		fragment_shader.setUniform("g_albedo", GBuffer::ALBEDO_TEXTURE_UNIT);
+		fragment_shader.setUniform("g_material", GBuffer::MATERIAL_TEXTURE_UNIT);
+		fragment_shader.setUniform("g_depth", GBuffer::DEPTH_TEXTURE_UNIT);
+	}
+
+	RenderContext::RenderContext(framebuffer_ptr frame_buffer,
+	                             pipeline_ptr    lit_pipeline,
+	                             lights_ptr      light_buffer)
+	  : m_frame_buffer(std::move(frame_buffer))
+	  , m_ambient_pipeline(std::move(lit_pipeline))
+	  , m_highlight_pipeline(nullptr)
+	  , m_depth_pipeline(nullptr)
+	  , m_g_buffer(nullptr)
+	  , m_fullscreen(nullptr)
+	  , m_light_buffer(std::move(light_buffer))
+	  , m_instance_buffer(new Buffer())
+	  , m_transform_buffer(new TransformBuffer())
+	  , m_depth_bounds(hasExtension(GLextension::GL_EXT_depth_bounds_test))
+	  , m_light_volume(nullptr)
+	  , m_volume_instance(nullptr) {
+		m_every_light.reserve(LightBuffer::CAPACITY);
+		bind_object_block(m_ambient_pipeline->vertex_shader());
+
+		globjects::Program& fragment_shader =
+		  *m_ambient_pipeline->fragment_shader();
+		fragment_shader.uniformBlock("Lights")->setBinding(LightBuffer::BINDING);
+	}
 
-	void RenderContext::ambient_pass(const globjects::VertexArray& vao,
-	                                 const int                     elements,
-	                                 const float                   ambience) {
-		m_ambient_pipeline->raw()->use();
-		globjects::Program& vertexShader = *m_ambient_pipeline->vertex_shader();
-		vertexShader.setUniform("ambience", ambience);
-		vao.drawElements(GL_TRIANGLES, elements, GL_UNSIGNED_INT);
+	void RenderContext::set_depth_prepass(pipeline_ptr depth_pipeline) {
+		m_depth_pipeline = std::move(depth_pipeline);
+		m_light_volume.reset();
+		m_volume_instance.reset();
+		if(!m_depth_pipeline) { return; }
+		bind_object_block(m_depth_pipeline->vertex_shader());
+		m_depth_pipeline->vertex_shader().instanced(m_state, true);
+
+		// Single-pass shading has no light passes to mark volumes for
+		if(!m_depth_bounds && !single_pass()) {
+			m_light_volume    = make_unique<Geometry>(light_volume_data());
+			m_volume_instance = make_unique<Buffer>();
+		}
+	}
+
+	void RenderContext::begin_frame(span<const Light> lights) {
+		m_state.begin_frame();
+
+		// What configure_gl sets up, so passes that change it can put it back
+		m_state.enable(GL_CULL_FACE, true);
+		m_state.enable(GL_DEPTH_TEST, true);
+		m_state.depth_function(GL_LEQUAL);
+		m_state.depth_mask(true);
+		m_state.color_mask(true);
+		m_transform_buffer->begin_frame();
+		if(deferred()) { m_g_buffer->begin(); }
+		if(single_pass()) {
+			m_light_buffer->update(lights);
+			m_light_buffer->bind();
+			m_every_light.resize(lights.size());
+			iota(m_every_light.begin(), m_every_light.end(), 0u);
+		}
+	}
+
+	void RenderContext::end_frame(span<const Light> lights,
+	                              const glm::mat4&  view,
+	                              const glm::mat4&  projection,
+	                              const glm::vec3&  eye,
+	                              float             ambience) {
+		// Fullscreen passes do not read object transforms
+		m_transform_buffer->end_frame();
+		if(!deferred()) { return; }
+
+		// Later passes, forward or not, depth-test against what was drawn
+		const int width  = m_frame_buffer->width;
+		const int height = m_frame_buffer->height;
+		clear(*m_frame_buffer->raw());
+		m_g_buffer->raw()->blit(GL_COLOR_ATTACHMENT0,
+		                        {0, 0, width, height},
+		                        m_frame_buffer->raw(),
+		                        GL_COLOR_ATTACHMENT0,
+		                        {0, 0, width, height},
+		                        GL_DEPTH_BUFFER_BIT,
+		                        GL_NEAREST);
+
+		m_frame_buffer->raw()->bind(GL_FRAMEBUFFER);
+		m_state.enable(GL_DEPTH_TEST, false);
+		m_state.depth_mask(false);
+		m_state.bind(*m_fullscreen);
+		m_g_buffer->bind_textures();
+
+		FragmentShaderProgram& fragment_shader =
+		  m_highlight_pipeline->fragment_shader();
+		const globjects::Program& program = *fragment_shader.raw();
+		fragment_shader.camera(m_state, view, eye);
+		m_state.uniform(program, "inverse_projection", inverse(projection));
+		m_state.uniform(program, "ambience", ambience);
+		m_state.uniform(program, "ambient_pass", true);
+		m_state.use(*m_highlight_pipeline->raw());
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		m_state.uniform(program, "ambient_pass", false);
+		highlight_pass(
+		  lights.begin(), lights.end(), projection * view, [this] {
+			  m_state.bind(*m_fullscreen);
+			  glDrawArrays(GL_TRIANGLES, 0, 3);
+		  });
+
+		m_state.depth_mask(true);
+		m_state.enable(GL_DEPTH_TEST, true);
+	}
+
+	void RenderContext::execute(const RenderQueue& queue,
+	                            const glm::mat4&   view,
+	                            const glm::mat4&   projection,
+	                            const glm::vec3&   eye,
+	                            float              ambience,
+	                            span<const Light>  lights) {
+		const bool multi_pass = !deferred() && !single_pass();
+
+		// All instance transforms of the frame go up in one upload
+		const span<const InstanceData> instances = queue.instances();
+		m_instance_buffer->setData(
+		  instances.size_bytes(), instances.data(), GL_STREAM_DRAW);
+
+		// Instanced draws read their transforms from the instance attributes,
+		// but the shaders still declare the Object block, which must have a
+		// range bound while it is active
+		m_transform_buffer->bind(m_transform_buffer->push(glm::mat4(1.0f), view));
+
+		const bool prepass = m_depth_pipeline && !deferred();
+		if(prepass) { depth_prepass(queue, view, projection); }
+
+		// Pipelines may share shader programs, whose uniforms then only go up
+		// once
+		VertexShaderProgram& ambient_vertex = m_ambient_pipeline->vertex_shader();
+		ambient_vertex.camera_transforms(m_state, view, projection);
+		ambient_vertex.instanced(m_state, true);
+		m_ambient_pipeline->fragment_shader().camera(m_state, view, eye);
+		if(multi_pass) {
+			VertexShaderProgram& highlight_vertex =
+			  m_highlight_pipeline->vertex_shader();
+			highlight_vertex.camera_transforms(m_state, view, projection);
+			highlight_vertex.instanced(m_state, true);
+			m_highlight_pipeline->fragment_shader().camera(m_state, view, eye);
+		}
+		if(deferred()) { m_state.use(*m_ambient_pipeline->raw()); }
+
+		const span<const draw_packet> packets        = queue.packets();
+		const Geometry*               bound_geometry = nullptr;
+		for(const draw_batch& batch: queue.batches()) {
+			const draw_packet& packet   = packets[batch.first];
+			const Geometry&    geometry = *packet.geometry;
+			const auto         count    = static_cast<int>(batch.count);
+			if(&geometry != bound_geometry) {
+				const bool octahedral_normals =
+				  geometry.format() == PMDL::VertexFormat::Quantized;
+				// Meshes sharing an arena share its vertex array too
+				m_state.bind(geometry.vao());
+				ambient_vertex.vertex_format(m_state,
+				                             geometry.positionScale(),
+				                             geometry.positionOffset(),
+				                             octahedral_normals);
+				if(multi_pass) {
+					m_highlight_pipeline->vertex_shader().vertex_format(
+					  m_state,
+					  geometry.positionScale(),
+					  geometry.positionOffset(),
+					  octahedral_normals);
+				}
+				bound_geometry = &geometry;
+			}
+			m_state.bind(FragmentShaderProgram::ALBEDO_TEXTURE_UNIT, *packet.albedo);
+			Geometry::bindInstances(*m_instance_buffer,
+			                        batch.first * sizeof(InstanceData));
+
+			if(deferred()) {
+				geometry.draw(packet.lod, count);
+				continue;
+			}
+			if(single_pass()) {
+				lit_pass(geometry, packet.lod, ambience, packet.lights, count);
+				continue;
+			}
+			ambient_pass(geometry, packet.lod, ambience, count);
+			auto listed = views::transform(
+			  packet.lights, [&](uint32_t index) -> const Light& {
+				  return lights[index];
+			  });
+			highlight_pass(listed.begin(),
+			               listed.end(),
+			               projection * view,
+			               [&] {
+				               m_state.bind(geometry.vao());
+				               geometry.draw(packet.lod, count);
+			               });
+		}
+
+		// Single draws keep using the Object block
+		ambient_vertex.instanced(m_state, false);
+		if(multi_pass) {
+			m_highlight_pipeline->vertex_shader().instanced(m_state, false);
+		}
+		if(prepass) {
+			m_state.depth_function(GL_LEQUAL);
+			m_state.depth_mask(true);
+		}
+	}
+
+	void RenderContext::depth_prepass(const RenderQueue& queue,
+	                                  const glm::mat4&   view,
+	                                  const glm::mat4&   projection) {
+		VertexShaderProgram& vertex_shader = m_depth_pipeline->vertex_shader();
+		vertex_shader.camera_transforms(m_state, view, projection);
+		m_state.use(*m_depth_pipeline->raw());
+		m_state.color_mask(false);
+		m_state.depth_mask(true);
+		m_state.depth_function(GL_LESS);
+
+		const span<const draw_packet> packets = queue.packets();
+		for(const draw_batch& batch: queue.batches()) {
+			const draw_packet& packet   = packets[batch.first];
+			const Geometry&    geometry = *packet.geometry;
+			m_state.bind(geometry.depthVao());
+			vertex_shader.vertex_format(
+			  m_state,
+			  geometry.positionScale(),
+			  geometry.positionOffset(),
+			  geometry.format() == PMDL::VertexFormat::Quantized);
+			Geometry::bindInstances(*m_instance_buffer,
+			                        batch.first * sizeof(InstanceData));
+			geometry.draw(packet.lod, static_cast<int>(batch.count));
+		}
+
+		m_state.color_mask(true);
+		m_state.depth_mask(false);
+		m_state.depth_function(GL_EQUAL);
+	}
+
+	void RenderContext::mark_light_volume(const Light&     light,
+	                                      const glm::mat4& view_projection) {
+		const light_sphere reach = light_reach(light);
+		const glm::mat4    model =
+		  glm::scale(glm::translate(glm::mat4(1.0f), reach.center),
+		             glm::vec3(reach.radius));
+		const InstanceData instance{model, glm::mat4(1.0f)};
+		m_volume_instance->setData(sizeof(instance), &instance, GL_STREAM_DRAW);
+
+		// Clears the scissor rectangle only
+		glClear(GL_STENCIL_BUFFER_BIT);
+
+		VertexShaderProgram& vertex_shader = m_depth_pipeline->vertex_shader();
+		vertex_shader.camera_transforms(m_state, glm::mat4(1.0f), view_projection);
+		vertex_shader.vertex_format(
+		  m_state, glm::vec3(1.0f), glm::vec3(0.0f), false);
+		m_state.use(*m_depth_pipeline->raw());
+		m_state.bind(m_light_volume->vao());
+		Geometry::bindInstances(*m_volume_instance, 0);
+
+		// Depth-fail counting, which holds with the eye inside the volume:
+		// back faces behind the surface count up, front faces behind it count
+		// down, leaving non-zero where the surface lies between the two.
+		// Clamping depth keeps the far side from being clipped.
+		const bool   depth_test     = m_state.enabled(GL_DEPTH_TEST);
+		const bool   depth_write    = m_state.depth_mask();
+		const GLenum depth_function = m_state.depth_function();
+		const bool   culling        = m_state.enabled(GL_CULL_FACE);
+		m_state.color_mask(false);
+		m_state.depth_mask(false);
+		m_state.enable(GL_CULL_FACE, false);
+		m_state.enable(GL_DEPTH_CLAMP, true);
+		m_state.enable(GL_DEPTH_TEST, true);
+		m_state.depth_function(GL_LESS);
+		m_state.enable(GL_STENCIL_TEST, true);
+		m_state.stencil_function(GL_ALWAYS, 0);
+		m_state.stencil_operations(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+		m_state.stencil_operations(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+		m_light_volume->draw(0, 1);
+
+		m_state.stencil_function(GL_NOTEQUAL, 0);
+		m_state.stencil_operations(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_KEEP);
+		m_state.enable(GL_DEPTH_CLAMP, false);
+		m_state.enable(GL_CULL_FACE, culling);
+		m_state.enable(GL_DEPTH_TEST, depth_test);
+		m_state.depth_function(depth_function);
+		m_state.depth_mask(depth_write);
+		m_state.color_mask(true);
+	}
+
+	void RenderContext::prepare(const textures       textures,
+	                            const Geometry&      geometry,
+	                            const mvp_transforms transforms,
+	                            const glm::vec3      eye) {
+		m_state.bind(geometry.vao());
+		m_state.bind(FragmentShaderProgram::ALBEDO_TEXTURE_UNIT, *textures.albedo);
+		// TODO: Bind other texture units
+
+		const bool octahedral_normals =
+		  geometry.format() == PMDL::VertexFormat::Quantized;
+
+		m_transform_buffer->bind(
+		  m_transform_buffer->push(transforms.model, transforms.view));
+
+		VertexShaderProgram& vertex_shader = m_ambient_pipeline->vertex_shader();
+		vertex_shader.camera_transforms(
+		  m_state, transforms.view, transforms.projection);
+		vertex_shader.vertex_format(m_state,
+		                            geometry.positionScale(),
+		                            geometry.positionOffset(),
+		                            octahedral_normals);
+		m_ambient_pipeline->fragment_shader().camera(
+		  m_state, transforms.view, eye);
+	}
+
+	void RenderContext::ambient_pass(const Geometry&   geometry,
+	                                 const std::size_t lod,
+	                                 const float       ambience,
+	                                 const int         instances) {
+		m_state.use(*m_ambient_pipeline->raw());
+		m_state.uniform(*m_ambient_pipeline->vertex_shader(), "ambience", ambience);
+		geometry.draw(lod, instances);
+	}
+
+	void RenderContext::lit_pass(const Geometry&      geometry,
+	                             const std::size_t    lod,
+	                             const float          ambience,
+	                             span<const uint32_t> affecting,
+	                             const int            instances) {
+		m_state.use(*m_ambient_pipeline->raw());
+		const globjects::Program& program =
+		  *m_ambient_pipeline->fragment_shader().raw();
+
+		// Ambience only goes into the first draw
+		size_t first = 0;
+		do {
+			const size_t count =
+			  std::min(affecting.size() - first, MAX_LIGHTS_PER_DRAW);
+			GLint indices[MAX_LIGHTS_PER_DRAW];
+			copy_n(affecting.begin() + first, count, indices);
+
+			m_state.uniform(program, "ambience", first == 0 ? ambience : 0.0f);
+			m_state.uniform(program, "light_count", static_cast<int>(count));
+			m_state.uniform(program, "light_indices", span(indices, count));
+			if(first == MAX_LIGHTS_PER_DRAW) {
+				m_state.enable(GL_BLEND, true);
+				m_state.blend(GL_FUNC_ADD, GL_ONE, GL_ONE);
+			}
+
+			geometry.draw(lod, instances);
+			first += count;
+		} while(first < affecting.size());
+		if(first > MAX_LIGHTS_PER_DRAW) { m_state.enable(GL_BLEND, false); }
 	}
 
 } // namespace PD
+
+TEST_CASE("light volumes enclose the unit sphere") {
+	const auto triangles = light_volume_triangles();
+	CHECK(triangles.size() == 128);
+	for(const auto& [a, b, c]: triangles) {
+		// Every face faces out and keeps the whole sphere behind it
+		const glm::vec3 normal = normalize(cross(b - a, c - a));
+		CHECK(dot(normal, a) >= 1.0f - 1e-5f);
+		CHECK(length(a) < 1.2f);
+	}
+}
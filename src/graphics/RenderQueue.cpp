@@ -0,0 +1,234 @@
+#include "RenderQueue.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+#include <utility>
+
+using namespace glm;
+using namespace std;
+
+namespace PD {
+
+	namespace render_key {
+
+		uint32_t quantize_depth(float depth) {
+			return depth > 0.0f ? bit_cast<uint32_t>(depth) >> 12 : 0;
+		}
+
+		uint64_t make(uint32_t pass,
+		              uint32_t pipeline,
+		              uint32_t material,
+		              uint32_t geometry,
+		              uint32_t lod,
+		              float    depth) {
+			return uint64_t(pass & 0xF) << PASS_SHIFT |
+			       uint64_t(pipeline & 0xF) << PIPELINE_SHIFT |
+			       uint64_t(material & 0xFFFF) << MATERIAL_SHIFT |
+			       uint64_t(geometry & 0xFFFF) << GEOMETRY_SHIFT |
+			       uint64_t(lod & 0xF) << LOD_SHIFT | quantize_depth(depth);
+		}
+
+	} // namespace render_key
+
+	void radix_sort(vector<sort_entry>& entries, vector<sort_entry>& scratch) {
+		if(entries.size() < 2) { return; }
+
+		// One histogram per byte, all counted in a single read of the keys
+		array<array<size_t, 256>, 8> counts{};
+		for(const sort_entry& entry: entries) {
+			for(size_t digit = 0; digit < 8; ++digit) {
+				++counts[digit][(entry.key >> (digit * 8)) & 0xFF];
+			}
+		}
+
+		scratch.resize(entries.size());
+		for(size_t digit = 0; digit < 8; ++digit) {
+			array<size_t, 256>& count = counts[digit];
+			const size_t shared = (entries.front().key >> (digit * 8)) & 0xFF;
+			if(count[shared] == entries.size()) { continue; }
+
+			size_t offset = 0;
+			for(size_t& bucket: count) { offset += exchange(bucket, offset); }
+			for(const sort_entry& entry: entries) {
+				scratch[count[(entry.key >> (digit * 8)) & 0xFF]++] = entry;
+			}
+			entries.swap(scratch);
+		}
+	}
+
+	void batch_packets(span<const draw_packet> packets,
+	                   vector<draw_batch>&     batches) {
+		batches.clear();
+		for(uint32_t index = 0; index < packets.size(); ++index) {
+			const draw_packet& packet = packets[index];
+			if(!batches.empty()) {
+				const draw_packet& first = packets[batches.back().first];
+				if(packet.geometry == first.geometry && packet.lod == first.lod &&
+				   packet.albedo == first.albedo &&
+				   ranges::equal(packet.lights, first.lights)) {
+					++batches.back().count;
+					continue;
+				}
+			}
+			batches.push_back({index, 1});
+		}
+	}
+
+	void RenderQueue::begin(const mat4& view) {
+		m_view = view;
+		m_packets.clear();
+		m_entries.clear();
+		m_batches.clear();
+		m_instances.clear();
+		m_materials.clear();
+		m_geometries.clear();
+		m_is_sorted = false;
+	}
+
+	void RenderQueue::submit(const globjects::Texture* albedo,
+	                         const Geometry&           geometry,
+	                         size_t                    lod,
+	                         const mat4&               model,
+	                         span<const uint32_t>      lights,
+	                         uint32_t                  pass) {
+		const auto material =
+		  m_materials.try_emplace(albedo, m_materials.size()).first->second;
+		const auto mesh =
+		  m_geometries.try_emplace(&geometry, m_geometries.size()).first->second;
+		// The only per-object pipeline state is how vertices are encoded
+		const auto  pipeline = static_cast<uint32_t>(geometry.format());
+		const float depth    = -(m_view * model[3]).z;
+
+		m_entries.push_back(
+		  {render_key::make(
+		     pass, pipeline, material, mesh, static_cast<uint32_t>(lod), depth),
+		   static_cast<uint32_t>(m_packets.size())});
+		m_packets.push_back({albedo, &geometry, lod, model, lights});
+		m_is_sorted = false;
+	}
+
+	void RenderQueue::sort() {
+		radix_sort(m_entries, m_scratch);
+		m_sorted.clear();
+		m_sorted.reserve(m_entries.size());
+		m_instances.clear();
+		m_instances.reserve(m_entries.size());
+		for(const sort_entry& entry: m_entries) {
+			const draw_packet& packet = m_packets[entry.index];
+			m_sorted.push_back(packet);
+			m_instances.push_back(
+			  {packet.model, inverseTranspose(m_view * packet.model)});
+		}
+		batch_packets(m_sorted, m_batches);
+		m_is_sorted = true;
+	}
+
+	span<const draw_packet> RenderQueue::packets() const {
+		return m_is_sorted ? m_sorted : m_packets;
+	}
+
+	span<const draw_batch> RenderQueue::batches() const { return m_batches; }
+
+	span<const InstanceData> RenderQueue::instances() const {
+		return m_instances;
+	}
+
+	size_t RenderQueue::size() const { return m_packets.size(); }
+
+} // namespace PD
+
+TEST_CASE("render keys order by pass, then state, then depth") {
+	using PD::render_key::make;
+
+	CHECK(make(0, 3, 9, 9, 9, 100.0f) < make(1, 0, 0, 0, 0, 0.0f));
+	CHECK(make(0, 0, 9, 9, 9, 100.0f) < make(0, 1, 0, 0, 0, 0.0f));
+	CHECK(make(0, 0, 1, 9, 9, 100.0f) < make(0, 0, 2, 0, 0, 0.0f));
+	CHECK(make(0, 0, 1, 1, 9, 100.0f) < make(0, 0, 1, 2, 0, 0.0f));
+	CHECK(make(0, 0, 1, 1, 0, 100.0f) < make(0, 0, 1, 1, 1, 0.0f));
+	CHECK(make(0, 0, 1, 1, 0, 1.0f) < make(0, 0, 1, 1, 0, 2.0f));
+	CHECK(make(0, 0, 1, 1, 0, -5.0f) == make(0, 0, 1, 1, 0, 0.0f));
+}
+
+TEST_CASE("quantized depth keeps the order of distances") {
+	float previous = 0.0f;
+	for(float depth = 0.01f; depth < 10'000.0f; depth *= 1.5f) {
+		CHECK(PD::render_key::quantize_depth(previous) <
+		      PD::render_key::quantize_depth(depth));
+		previous = depth;
+	}
+	CHECK(PD::render_key::quantize_depth(1e6f) < (1u << 20));
+}
+
+TEST_CASE("radix sort matches a stable sort") {
+	mt19937_64                         random(7);
+	uniform_int_distribution<uint64_t> any;
+	uniform_int_distribution<uint64_t> few(0, 3);
+
+	SUBCASE("random keys") {
+		vector<PD::sort_entry> entries, scratch;
+		for(uint32_t index = 0; index < 10'000; ++index) {
+			entries.push_back({any(random), index});
+		}
+		auto expected = entries;
+		stable_sort(expected.begin(), expected.end(), [](auto a, auto b) {
+			return a.key < b.key;
+		});
+
+		PD::radix_sort(entries, scratch);
+		CHECK(equal(entries.begin(),
+		            entries.end(),
+		            expected.begin(),
+		            [](auto a, auto b) { return a.index == b.index; }));
+	}
+
+	SUBCASE("keys sharing most bytes keep submission order when equal") {
+		vector<PD::sort_entry> entries, scratch;
+		for(uint32_t index = 0; index < 1'000; ++index) {
+			entries.push_back({few(random) << 40 | few(random), index});
+		}
+		auto expected = entries;
+		stable_sort(expected.begin(), expected.end(), [](auto a, auto b) {
+			return a.key < b.key;
+		});
+
+		PD::radix_sort(entries, scratch);
+		CHECK(equal(entries.begin(),
+		            entries.end(),
+		            expected.begin(),
+		            [](auto a, auto b) { return a.index == b.index; }));
+	}
+}
+
+TEST_CASE("packets batch while only their model matrix differs") {
+	const vector<uint32_t> lights = {0, 1};
+	const vector<uint32_t> same   = {0, 1};
+	const vector<uint32_t> other  = {1};
+
+	vector<PD::draw_packet> packets;
+	const auto add = [&](size_t lod, span<const uint32_t> affecting) {
+		const mat4 model = translate(mat4(1.0f), vec3(float(packets.size())));
+		packets.push_back({nullptr, nullptr, lod, model, affecting});
+	};
+	add(0, lights);
+	add(0, lights);
+	add(0, same); // Equal lights in another list still batch
+	add(1, lights);
+	add(1, other);
+	add(1, other);
+
+	vector<PD::draw_batch> batches;
+	PD::batch_packets(packets, batches);
+
+	REQUIRE(batches.size() == 3);
+	CHECK(batches[0].first == 0);
+	CHECK(batches[0].count == 3);
+	CHECK(batches[1].first == 3);
+	CHECK(batches[1].count == 1);
+	CHECK(batches[2].first == 4);
+	CHECK(batches[2].count == 2);
+}
@@ -1,15 +1,125 @@
 #include "Renderer.hpp"
 
+#include "TextureStreamer.hpp"
+
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <filesystem>
+#include <fstream>
 #include <glbinding/gl/gl.h>
 #include <gli/gli.hpp>
 #include <globjects/ProgramPipeline.h>
 #include <globjects/globjects.h>
+#include <stdexcept>
 
 using namespace globjects;
 using namespace gl;
 using namespace std;
 
+namespace {
+
+	constexpr uint32_t fourcc(char a, char b, char c, char d) {
+		return static_cast<uint32_t>(a) | static_cast<uint32_t>(b) << 8 |
+		       static_cast<uint32_t>(c) << 16 | static_cast<uint32_t>(d) << 24;
+	}
+
+	// Sizes and fields of the DDS headers that follow the magic number
+	constexpr size_t   DDS_HEADER_SIZE  = 124;
+	constexpr size_t   DX10_HEADER_SIZE = 20;
+	constexpr uint32_t DDSD_MIPMAPCOUNT = 0x20000;
+	constexpr uint32_t DDPF_FOURCC      = 0x4;
+	constexpr uint32_t DDSCAPS2_CUBEMAP = 0x200;
+	constexpr uint32_t DDSCAPS2_VOLUME  = 0x200000;
+	constexpr uint32_t DX10_TEXTURE2D   = 3;
+	constexpr uint32_t DX10_TEXTURECUBE = 0x4;
+	constexpr size_t   MAX_LEVELS       = 32;
+
+	uint32_t read_u32(span<const byte> bytes, size_t offset) {
+		uint32_t value;
+		memcpy(&value, bytes.data() + offset, sizeof(value));
+		return value;
+	}
+
+	// Levels of a 2D DDS texture where they lie in file, or nothing for
+	// cubemaps, arrays and formats only gli knows how to convert
+	optional<PD::texture_levels>
+	dds_levels(const string& name, shared_ptr<const PD::MappedFile> file) {
+		const span<const byte> bytes = file->bytes();
+		if(bytes.size() < 4 + DDS_HEADER_SIZE ||
+		   read_u32(bytes, 0) != fourcc('D', 'D', 'S', ' ')) {
+			return nullopt;
+		}
+		const span<const byte> header = bytes.subspan(4, DDS_HEADER_SIZE);
+		if(!(read_u32(header, 76) & DDPF_FOURCC) ||
+		   read_u32(header, 108) & (DDSCAPS2_CUBEMAP | DDSCAPS2_VOLUME)) {
+			return nullopt;
+		}
+
+		const gli::dx       dx;
+		const uint32_t code   = read_u32(header, 80);
+		size_t         offset = 4 + DDS_HEADER_SIZE;
+		gli::format         format = gli::FORMAT_UNDEFINED;
+		if(code == fourcc('D', 'X', '1', '0')) {
+			if(bytes.size() < offset + DX10_HEADER_SIZE) { return nullopt; }
+			const span<const byte> dx10 = bytes.subspan(offset, DX10_HEADER_SIZE);
+			if(read_u32(dx10, 4) != DX10_TEXTURE2D ||
+			   read_u32(dx10, 8) & DX10_TEXTURECUBE || read_u32(dx10, 12) > 1) {
+				return nullopt;
+			}
+			const auto dxgi =
+			  static_cast<gli::dx::dxgi_format_dds>(read_u32(dx10, 0));
+			format = dx.find(gli::dx::D3DFMT_DX10, gli::dx::dxgiFormat(dxgi));
+			offset += DX10_HEADER_SIZE;
+		} else {
+			format = dx.find(static_cast<gli::dx::d3dfmt>(code));
+		}
+		if(!gli::is_valid(format)) { return nullopt; }
+
+		const glm::ivec2 extent(read_u32(header, 12), read_u32(header, 8));
+		const size_t     count =
+		  read_u32(header, 4) & DDSD_MIPMAPCOUNT
+		    ? max<uint32_t>(read_u32(header, 24), 1)
+		    : 1;
+		if(extent.x <= 0 || extent.y <= 0 || count > MAX_LEVELS) {
+			throw runtime_error(name + " is not a valid texture");
+		}
+
+		const gli::swizzles rgba(gli::SWIZZLE_RED,
+		                         gli::SWIZZLE_GREEN,
+		                         gli::SWIZZLE_BLUE,
+		                         gli::SWIZZLE_ALPHA);
+		PD::texture_levels levels{
+		  std::move(file), gli::texture(), format, rgba, extent, {}};
+		const glm::ivec2 block(gli::block_extent(format));
+		const size_t     block_size = gli::block_size(format);
+		for(size_t level = 0; level < count; ++level) {
+			const glm::ivec2 texels =
+			  glm::max(extent >> static_cast<int>(level), glm::ivec2(1));
+			const glm::ivec2 blocks = (texels + block - 1) / block;
+			const size_t     size   = static_cast<size_t>(blocks.x) *
+			                     static_cast<size_t>(blocks.y) * block_size;
+			if(size > bytes.size() - offset) {
+				throw runtime_error(name + " is not a valid texture");
+			}
+			levels.levels.push_back(bytes.subspan(offset, size));
+			offset += size;
+		}
+		return levels;
+	}
+
+	// Levels TextureStreamer keeps resident from the start
+	span<const span<const byte>> mip_tail(const PD::texture_levels& levels) {
+		const size_t tail =
+		  PD::TextureStreamer::tail_level(levels.extent, levels.levels.size());
+		return span(levels.levels).subspan(tail);
+	}
+
+} // namespace
+
 namespace PD {
 	void configure_gl() {
 		// Enable back-face culling, z-buffering, and anti-aliasing
@@ -45,21 +155,66 @@ namespace PD {
 		                        GL_NEAREST);
 	}
 
-	// TODO: Rewrite to load using globjects methods, move to appropriate file
-	unique_ptr<globjects::Texture> load_texture(const string& name) {
+	texture_levels levels_of(const gli::texture& image) {
+		const gli::extent3d extent = image.extent();
+		texture_levels      levels{nullptr,
+		                          image,
+		                          image.format(),
+		                          image.swizzles(),
+		                          {extent.x, extent.y},
+		                          {}};
+		for(size_t level = 0; level < image.levels(); ++level) {
+			levels.levels.emplace_back(
+			  static_cast<const byte*>(image.data(0, 0, level)), image.size(level));
+		}
+		return levels;
+	}
+
+	size_t texture_data::bytes() const {
+		if(!mapped) { return image.size(); }
+		size_t bytes = 0;
+		for(const auto level: mip_tail(*mapped)) { bytes += level.size(); }
+		return bytes;
+	}
+
+	void texture_data::stage(StagingRing& ring, stop_token stop) {
+		if(mapped) { return; }
+		staged = ring.allocate(image.size(), stop);
+		if(staged) { memcpy(staged->data, image.data(), image.size()); }
+	}
+
+	texture_data decode_texture(const string& name) {
 		gli::texture texture = gli::load(name);
 		if(texture.empty()) {
 			throw std::runtime_error(name + std::string(" is not a valid texture"));
 		}
+		if(texture.target() != gli::TARGET_2D) {
+			throw std::runtime_error(
+			  "texture target is not GL_TEXTURE_2D/gli::TARGET_2D");
+		}
+		return {texture};
+	}
+
+	texture_data map_texture(const string& name) {
+		optional<texture_levels> levels =
+		  dds_levels(name, make_shared<const MappedFile>(name));
+		if(!levels) { return decode_texture(name); }
 
+		// The render thread uploads the mip tail as soon as it gets the data
+		for(const auto level: mip_tail(*levels)) { levels->file->prefetch(level); }
+		return {gli::texture(), nullopt, std::move(levels)};
+	}
+
+	// TODO: Rewrite to load using globjects methods, move to appropriate file
+	unique_ptr<globjects::Texture> upload_texture(const texture_data& data) {
+		if(data.mapped) {
+			throw invalid_argument("mapped textures are streamed by TextureStreamer");
+		}
+		const gli::texture&   texture = data.image;
 		gli::gl               gl(gli::gl::PROFILE_GL33);
 		const gli::gl::format format =
 		  gl.translate(texture.format(), texture.swizzles());
 		GLenum target = static_cast<GLenum>(gl.translate(texture.target()));
-		if(target != GL_TEXTURE_2D) {
-			throw std::runtime_error(
-			  "texture target is not GL_TEXTURE_2D/gli::TARGET_2D");
-		}
 
 		// Reserve memory on the GPU for texture and describe its layout
 		GLuint textureID;
@@ -82,36 +237,144 @@ namespace PD {
 		               extent.x,
 		               extent.y);
 
-		// Write image data to GPU memory
+		// Staged images are unpacked from the staging ring, at the same offsets
+		// the levels have in the image
+		const auto* const image = static_cast<const byte*>(texture.data());
+		const auto        pixels =
+		  [&](size_t layer, size_t face, size_t level) -> const void* {
+			const void* level_data = texture.data(layer, face, level);
+			if(!data.staged) { return level_data; }
+			return reinterpret_cast<const void*>(static_cast<uintptr_t>(
+			  data.staged->offset +
+			  static_cast<size_t>(static_cast<const byte*>(level_data) - image)));
+		};
+		if(data.staged) { data.staged->buffer->bind(GL_PIXEL_UNPACK_BUFFER); }
+
+		// Write image data to GPU memory. Every level has its own extent.
 		for(std::size_t layer = 0; layer < texture.layers(); ++layer) {
 			for(std::size_t face = 0; face < texture.faces(); ++face) {
 				for(std::size_t level = 0; level < texture.levels(); ++level) {
+					const gli::tvec3<GLsizei> size(texture.extent(level));
 					if(gli::is_compressed(texture.format())) {
 						glCompressedTexSubImage2D(target,
 						                          level,
 						                          0,
 						                          0,
-						                          extent.x,
-						                          extent.y,
+						                          size.x,
+						                          size.y,
 						                          static_cast<GLenum>(format.Internal),
 						                          texture.size(level),
-						                          texture.data(layer, face, level));
+						                          pixels(layer, face, level));
 					} else {
 						glTexSubImage2D(target,
 						                level,
 						                0,
 						                0,
-						                extent.x,
-						                extent.y,
+						                size.x,
+						                size.y,
 						                static_cast<GLenum>(format.External),
 						                static_cast<GLenum>(format.Type),
-						                texture.data(layer, face, level));
+						                pixels(layer, face, level));
 					}
 				}
 			}
 		}
+		if(data.staged) { globjects::Buffer::unbind(GL_PIXEL_UNPACK_BUFFER); }
 
 		return globjects::Texture::fromId(textureID, GL_TEXTURE_2D);
 	}
 
+	unique_ptr<globjects::Texture> load_texture(const string& name) {
+		return upload_texture(decode_texture(name));
+	}
+
+	size_t texture_bytes(const globjects::Texture& texture) {
+		// Levels below the base level may have been freed by TextureStreamer
+		size_t bytes = 0;
+		for(GLint level = texture.getParameter(GL_TEXTURE_BASE_LEVEL);; ++level) {
+			const GLint width  = texture.getLevelParameter(level, GL_TEXTURE_WIDTH);
+			const GLint height = texture.getLevelParameter(level, GL_TEXTURE_HEIGHT);
+			if(width == 0 || height == 0) { break; }
+
+			if(texture.getLevelParameter(level, GL_TEXTURE_COMPRESSED)) {
+				bytes += static_cast<size_t>(
+				  texture.getLevelParameter(level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE));
+				continue;
+			}
+
+			GLint bits = 0;
+			for(const GLenum component: {GL_TEXTURE_RED_SIZE,
+			                             GL_TEXTURE_GREEN_SIZE,
+			                             GL_TEXTURE_BLUE_SIZE,
+			                             GL_TEXTURE_ALPHA_SIZE,
+			                             GL_TEXTURE_DEPTH_SIZE,
+			                             GL_TEXTURE_STENCIL_SIZE}) {
+				bits += texture.getLevelParameter(level, component);
+			}
+			bytes += static_cast<size_t>(width) * static_cast<size_t>(height) *
+			         static_cast<size_t>(bits) / 8;
+		}
+		return bytes;
+	}
+
 } // namespace PD
+
+namespace {
+
+	// A DXT1 DDS file of extent with the given mip levels, each filled with
+	// its index
+	string write_dds(glm::ivec2 extent, uint32_t levels) {
+		array<uint32_t, 1 + DDS_HEADER_SIZE / 4> header{};
+		header[0]  = fourcc('D', 'D', 'S', ' ');
+		header[1]  = DDS_HEADER_SIZE;
+		header[2]  = DDSD_MIPMAPCOUNT;
+		header[3]  = static_cast<uint32_t>(extent.y);
+		header[4]  = static_cast<uint32_t>(extent.x);
+		header[7]  = levels;
+		header[20] = DDPF_FOURCC;
+		header[21] = fourcc('D', 'X', 'T', '1');
+
+		const string name =
+		  (filesystem::temp_directory_path() / "pd_mapped.dds").string();
+		ofstream     file(name, ofstream::binary);
+		file.write(reinterpret_cast<const char*>(header.data()), sizeof(header));
+		for(uint32_t level = 0; level < levels; ++level) {
+			const int    columns = max((extent.x >> level) / 4, 1);
+			const int    rows    = max((extent.y >> level) / 4, 1);
+			const string blocks(static_cast<size_t>(columns * rows * 8),
+			                    static_cast<char>(level));
+			file.write(blocks.data(), static_cast<streamsize>(blocks.size()));
+		}
+		return name;
+	}
+
+} // namespace
+
+TEST_CASE("mapped DDS textures locate their levels in the file") {
+	const string name = write_dds({16, 8}, 5);
+	{
+		const PD::texture_data data = PD::map_texture(name);
+		REQUIRE(data.mapped);
+		CHECK(data.image.empty());
+		CHECK(data.mapped->extent == glm::ivec2(16, 8));
+
+		// Blocks cover 4x4 texels, so the smallest levels take one each
+		const vector<span<const byte>>& levels = data.mapped->levels;
+		REQUIRE(levels.size() == 5);
+		const size_t sizes[] = {64, 16, 8, 8, 8};
+		for(size_t level = 0; level < levels.size(); ++level) {
+			CHECK(levels[level].size() == sizes[level]);
+			CHECK(levels[level].front() == static_cast<byte>(level));
+			CHECK(levels[level].back() == static_cast<byte>(level));
+		}
+
+		// The whole chain is the mip tail, uploaded up front
+		CHECK(data.bytes() == 104);
+	}
+
+	SUBCASE("files missing level data are rejected") {
+		filesystem::resize_file(name, 4 + DDS_HEADER_SIZE + 80);
+		CHECK_THROWS_AS(PD::map_texture(name), runtime_error);
+	}
+	filesystem::remove(name);
+}
@@ -2,7 +2,6 @@
 
 #include <glbinding/gl/gl.h>
 #include <glm/glm.hpp>
-#include <glm/gtc/matrix_inverse.hpp>
 
 using namespace std;
 using namespace gl;
@@ -31,13 +30,25 @@ ShaderProgram::~ShaderProgram() { m_program->release(); }
 VertexShaderProgram::VertexShaderProgram(const std::string& file)
   : ShaderProgram(GL_VERTEX_SHADER, file) {}
 
-void VertexShaderProgram::transforms(const glm::mat4 model,
-                                     const glm::mat4 view,
-                                     const glm::mat4 projection) {
-	m_program->setUniform("model_transform", model);
-	m_program->setUniform("view_transform", view);
-	m_program->setUniform("projection_transform", projection);
-	m_program->setUniform("normal_transform", inverseTranspose(model * view));
+void VertexShaderProgram::camera_transforms(PD::StateCache& state,
+                                            const glm::mat4 view,
+                                            const glm::mat4 projection) {
+	state.uniform(*m_program, "view_transform", view);
+	state.uniform(*m_program, "projection_transform", projection);
+}
+
+void VertexShaderProgram::instanced(PD::StateCache& state,
+                                    const bool      enabled) {
+	state.uniform(*m_program, "instanced", enabled);
+}
+
+void VertexShaderProgram::vertex_format(PD::StateCache& state,
+                                        const glm::vec3 position_scale,
+                                        const glm::vec3 position_offset,
+                                        const bool      octahedral_normals) {
+	state.uniform(*m_program, "position_scale", position_scale);
+	state.uniform(*m_program, "position_offset", position_offset);
+	state.uniform(*m_program, "octahedral_normals", octahedral_normals);
 }
 
 // -------------------
@@ -60,7 +71,9 @@ FragmentShaderProgram::FragmentShaderProgram(const std::string& file)
 	m_program->setUniform("emission_map", EMISSION_TEXTURE_UNIT);
 }
 
-void FragmentShaderProgram::camera(const glm::mat4 view, const glm::vec3 eye) {
-	m_program->setUniform("view", view);
-	m_program->setUniform("eye_position", eye);
+void FragmentShaderProgram::camera(PD::StateCache& state,
+                                   const glm::mat4 view,
+                                   const glm::vec3 eye) {
+	state.uniform(*m_program, "view", view);
+	state.uniform(*m_program, "eye_position", eye);
 }
@@ -0,0 +1,206 @@
+#include "StagingRing.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <globjects/globjects.h>
+#include <stdexcept>
+
+using namespace gl;
+using namespace std;
+
+namespace {
+
+	size_t align_up(size_t value, size_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+} // namespace
+
+namespace PD {
+
+	// -------------
+	// RingAllocator
+	// -------------
+
+	RingAllocator::RingAllocator(size_t capacity)
+	  : m_capacity(capacity)
+	  , m_head(0)
+	  , m_used(0) {}
+
+	size_t RingAllocator::allocate(size_t size) {
+		if(size == 0 || size > m_capacity) { return NONE; }
+
+		// Free space is after the newest block and before the oldest one
+		size_t offset = NONE;
+		if(m_blocks.empty()) {
+			offset = 0;
+		} else if(const size_t tail = m_blocks.front().offset; m_head > tail) {
+			if(m_head + size <= m_capacity) {
+				offset = m_head;
+			} else if(size <= tail) {
+				offset = 0;
+			}
+		} else if(m_head + size <= tail) {
+			offset = m_head;
+		}
+		if(offset == NONE) { return NONE; }
+
+		m_blocks.push_back({offset, size});
+		m_head = offset + size;
+		m_used += size;
+		return offset;
+	}
+
+	void RingAllocator::free_oldest() {
+		m_used -= m_blocks.front().size;
+		m_blocks.pop_front();
+		if(m_blocks.empty()) { m_head = 0; }
+	}
+
+	size_t RingAllocator::capacity() const { return m_capacity; }
+
+	size_t RingAllocator::used() const { return m_used; }
+
+	bool RingAllocator::empty() const { return m_blocks.empty(); }
+
+	// -----------
+	// StagingRing
+	// -----------
+
+	StagingRing::StagingRing(size_t capacity)
+	  : m_buffer(new globjects::Buffer())
+	  , m_client(nullptr)
+	  , m_mapped(nullptr)
+	  , m_capacity(capacity)
+	  , m_mutex()
+	  , m_freed()
+	  , m_allocator(capacity)
+	  , m_pending() {
+		const auto bytes = static_cast<GLsizeiptr>(capacity);
+		if(!globjects::hasExtension(GLextension::GL_ARB_buffer_storage)) {
+			m_buffer->setData(bytes, nullptr, GL_STREAM_DRAW);
+			m_client.reset(new byte[capacity]);
+			m_mapped = m_client.get();
+			return;
+		}
+
+		// Coherent, so what workers write is visible to the copies without
+		// flushing
+		m_buffer->setStorage(bytes,
+		                     nullptr,
+		                     GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+		                       GL_MAP_COHERENT_BIT);
+		m_mapped = static_cast<byte*>(m_buffer->mapRange(
+		  0,
+		  bytes,
+		  GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+	}
+
+	StagingRing::~StagingRing() {
+		for(const pending& block: m_pending) {
+			if(block.fence) { glDeleteSync(block.fence); }
+		}
+		if(!m_client) { m_buffer->unmap(); }
+	}
+
+	optional<staging_block> StagingRing::allocate(size_t size, stop_token stop) {
+		const size_t aligned = align_up(size, ALIGNMENT);
+		if(size == 0 || aligned > m_capacity) { return nullopt; }
+
+		unique_lock lock(m_mutex);
+		size_t      offset = RingAllocator::NONE;
+		if(!m_freed.wait(lock, stop, [&] {
+			   offset = m_allocator.allocate(aligned);
+			   return offset != RingAllocator::NONE;
+		   })) {
+			return nullopt;
+		}
+		m_pending.push_back({offset, nullptr});
+		return staging_block{m_buffer.get(), offset, size, m_mapped + offset};
+	}
+
+	void StagingRing::commit(const staging_block& block) {
+		if(!m_client) { return; }
+
+		// The block is only reused once its fence has signalled, so there is
+		// nothing for the driver to synchronize with
+		void* const target = m_buffer->mapRange(
+		  static_cast<GLintptr>(block.offset),
+		  static_cast<GLsizeiptr>(block.size),
+		  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+		    GL_MAP_UNSYNCHRONIZED_BIT);
+		memcpy(target, block.data, block.size);
+		m_buffer->unmap();
+	}
+
+	void StagingRing::release(const staging_block& block) {
+		const scoped_lock lock(m_mutex);
+		const auto found = ranges::find(m_pending, block.offset, &pending::offset);
+		if(found == m_pending.end() || found->fence) {
+			throw invalid_argument("block is not pending in the staging ring");
+		}
+		found->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void StagingRing::reclaim() {
+		bool freed = false;
+		{
+			const scoped_lock lock(m_mutex);
+
+			// Blocks are freed in allocation order, so one still being written
+			// or read holds back every newer one
+			while(!m_pending.empty() && m_pending.front().fence) {
+				const GLsync fence = m_pending.front().fence;
+				const GLenum status =
+				  glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+				if(status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+					break;
+				}
+				glDeleteSync(fence);
+				m_pending.pop_front();
+				m_allocator.free_oldest();
+				freed = true;
+			}
+		}
+		if(freed) { m_freed.notify_all(); }
+	}
+
+	size_t StagingRing::capacity() const { return m_capacity; }
+
+} // namespace PD
+
+TEST_CASE("ring allocator hands out blocks in a circle") {
+	PD::RingAllocator allocator(100);
+
+	CHECK(allocator.allocate(40) == 0);
+	CHECK(allocator.allocate(40) == 40);
+	CHECK(allocator.allocate(30) == PD::RingAllocator::NONE);
+	CHECK(allocator.used() == 80);
+
+	SUBCASE("blocks wrap around once the oldest is freed") {
+		allocator.free_oldest();
+		CHECK(allocator.allocate(30) == 0);
+
+		// The gap at the end stays unused, and the newest block may not run
+		// into the oldest one
+		CHECK(allocator.allocate(15) == PD::RingAllocator::NONE);
+		CHECK(allocator.allocate(10) == 30);
+		CHECK(allocator.used() == 80);
+
+		allocator.free_oldest();
+		CHECK(allocator.allocate(60) == 40);
+	}
+
+	SUBCASE("an empty ring starts over") {
+		allocator.free_oldest();
+		allocator.free_oldest();
+		CHECK(allocator.empty());
+		CHECK(allocator.allocate(100) == 0);
+	}
+
+	SUBCASE("blocks larger than the ring never fit") {
+		CHECK(allocator.allocate(101) == PD::RingAllocator::NONE);
+		CHECK(allocator.allocate(0) == PD::RingAllocator::NONE);
+	}
+}
@@ -0,0 +1,273 @@
+#include "StateCache.hpp"
+
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <glm/gtc/type_ptr.hpp>
+#include <utility>
+
+using namespace gl;
+using namespace glm;
+using namespace std;
+
+namespace PD {
+
+	// --------------
+	// uniform_values
+	// --------------
+
+	bool uniform_values::update(GLuint           program,
+	                            GLint            location,
+	                            span<const byte> value) {
+		const uint64_t key =
+		  uint64_t(program) << 32 | static_cast<uint32_t>(location);
+		vector<byte>& stored = m_values[key];
+		if(!stored.empty() && ranges::equal(stored, value)) { return false; }
+		stored.assign(value.begin(), value.end());
+		return true;
+	}
+
+	void uniform_values::clear() { m_values.clear(); }
+
+	// ----------
+	// StateCache
+	// ----------
+
+	void StateCache::begin_frame() {
+		m_pipeline   = 0;
+		m_vao        = 0;
+		m_textures   = {};
+		m_statistics = {};
+	}
+
+	void StateCache::invalidate() {
+		begin_frame();
+		m_capabilities.clear();
+		m_blend          = {};
+		m_depth_function = {};
+		m_depth_mask     = -1;
+		m_color_mask     = -1;
+		m_scissor        = {0, 0, -1, -1};
+		m_depth_bounds   = {-1.0f, -1.0f};
+		m_stencil_function   = {0, -1};
+		m_stencil_operations = {};
+		m_locations.clear();
+		m_uniforms.clear();
+	}
+
+	bool StateCache::issue(bool changed) {
+		++(changed ? m_statistics.issued : m_statistics.elided);
+		return changed;
+	}
+
+	void StateCache::use(const globjects::ProgramPipeline& pipeline) {
+		if(issue(exchange(m_pipeline, pipeline.id()) != pipeline.id())) {
+			pipeline.use();
+		}
+	}
+
+	void StateCache::bind(const globjects::VertexArray& vao) {
+		if(issue(exchange(m_vao, vao.id()) != vao.id())) { vao.bind(); }
+	}
+
+	void StateCache::bind(GLuint unit, const globjects::Texture& texture) {
+		if(unit >= TEXTURE_UNITS) {
+			issue(true);
+			texture.bindActive(unit);
+			return;
+		}
+		if(issue(exchange(m_textures[unit], texture.id()) != texture.id())) {
+			texture.bindActive(unit);
+		}
+	}
+
+	void StateCache::enable(GLenum capability, bool enabled) {
+		const auto [state, known] = m_capabilities.try_emplace(capability, -1);
+		if(!issue(exchange(state->second, enabled) != int(enabled))) { return; }
+		if(enabled) {
+			glEnable(capability);
+		} else {
+			glDisable(capability);
+		}
+	}
+
+	void StateCache::blend(GLenum equation, GLenum source, GLenum destination) {
+		const array<GLenum, 3> blend = {equation, source, destination};
+		if(issue(exchange(m_blend, blend) != blend)) {
+			glBlendEquation(equation);
+			glBlendFunc(source, destination);
+		}
+	}
+
+	void StateCache::depth_function(GLenum function) {
+		if(issue(exchange(m_depth_function, function) != function)) {
+			glDepthFunc(function);
+		}
+	}
+
+	void StateCache::depth_mask(bool write) {
+		if(issue(exchange(m_depth_mask, int(write)) != int(write))) {
+			glDepthMask(write ? GL_TRUE : GL_FALSE);
+		}
+	}
+
+	void StateCache::color_mask(bool write) {
+		if(issue(exchange(m_color_mask, int(write)) != int(write))) {
+			const GLboolean mask = write ? GL_TRUE : GL_FALSE;
+			glColorMask(mask, mask, mask, mask);
+		}
+	}
+
+	void StateCache::scissor(GLint x, GLint y, GLsizei width, GLsizei height) {
+		const array<GLint, 4> scissor = {x, y, width, height};
+		if(issue(exchange(m_scissor, scissor) != scissor)) {
+			glScissor(x, y, width, height);
+		}
+	}
+
+	void StateCache::depth_bounds(float min_depth, float max_depth) {
+		const array<float, 2> bounds = {min_depth, max_depth};
+		if(issue(exchange(m_depth_bounds, bounds) != bounds)) {
+			glDepthBoundsEXT(min_depth, max_depth);
+		}
+	}
+
+	bool StateCache::enabled(GLenum capability) const {
+		const auto found = m_capabilities.find(capability);
+		return found != m_capabilities.end() && found->second == 1;
+	}
+
+	GLenum StateCache::depth_function() const {
+		return m_depth_function != GLenum{} ? m_depth_function : GL_LESS;
+	}
+
+	bool StateCache::depth_mask() const { return m_depth_mask != 0; }
+
+	void StateCache::stencil_function(GLenum function, GLint reference) {
+		const array<GLint, 2> stencil = {static_cast<GLint>(function), reference};
+		if(issue(exchange(m_stencil_function, stencil) != stencil)) {
+			glStencilFunc(function, reference, ~0u);
+		}
+	}
+
+	void StateCache::stencil_operations(GLenum face,
+	                                    GLenum stencil_fail,
+	                                    GLenum depth_fail,
+	                                    GLenum pass) {
+		const array<GLenum, 3> operations = {stencil_fail, depth_fail, pass};
+		const GLenum           faces[]    = {GL_FRONT, GL_BACK};
+		bool                   changed    = false;
+		for(size_t side = 0; side < size(faces); ++side) {
+			if(face != GL_FRONT_AND_BACK && face != faces[side]) { continue; }
+			changed |= exchange(m_stencil_operations[side], operations) != operations;
+		}
+		if(issue(changed)) {
+			glStencilOpSeparate(face, stencil_fail, depth_fail, pass);
+		}
+	}
+
+	GLint StateCache::location(const globjects::Program& program,
+	                           string_view               name) {
+		locations& known = m_locations[program.id()];
+		if(const auto found = known.find(name); found != known.end()) {
+			return found->second;
+		}
+		const string key(name);
+		return known.emplace(key, program.getUniformLocation(key)).first->second;
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         float                     value) {
+		if(changed(program, location, value)) {
+			glProgramUniform1f(program.id(), location, value);
+		}
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         int                       value) {
+		if(changed(program, location, value)) {
+			glProgramUniform1i(program.id(), location, value);
+		}
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         bool                      value) {
+		uniform(program, location, int(value));
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         const vec3&               value) {
+		if(changed(program, location, value)) {
+			glProgramUniform3fv(program.id(), location, 1, value_ptr(value));
+		}
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         const vec4&               value) {
+		if(changed(program, location, value)) {
+			glProgramUniform4fv(program.id(), location, 1, value_ptr(value));
+		}
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         const mat4&               value) {
+		if(changed(program, location, value)) {
+			glProgramUniformMatrix4fv(
+			  program.id(), location, 1, GL_FALSE, value_ptr(value));
+		}
+	}
+
+	void StateCache::uniform(const globjects::Program& program,
+	                         GLint                     location,
+	                         span<const GLint>         values) {
+		if(location < 0 || values.empty()) { return; }
+		if(issue(m_uniforms.update(program.id(), location, as_bytes(values)))) {
+			glProgramUniform1iv(program.id(),
+			                    location,
+			                    static_cast<GLsizei>(values.size()),
+			                    values.data());
+		}
+	}
+
+	const StateCache::statistics& StateCache::frame_statistics() const {
+		return m_statistics;
+	}
+
+} // namespace PD
+
+TEST_CASE("uniform values only report changes") {
+	PD::uniform_values values;
+	const auto bytes = [](const auto& value) {
+		return as_bytes(span(&value, 1));
+	};
+
+	const mat4 identity(1.0f);
+	const mat4 scaled(2.0f);
+	CHECK(values.update(1, 0, bytes(identity)));
+	CHECK_FALSE(values.update(1, 0, bytes(identity)));
+	CHECK(values.update(1, 0, bytes(scaled)));
+
+	SUBCASE("programs and locations are tracked apart") {
+		CHECK(values.update(2, 0, bytes(scaled)));
+		CHECK(values.update(1, 1, bytes(scaled)));
+		CHECK_FALSE(values.update(2, 0, bytes(scaled)));
+	}
+
+	SUBCASE("arrays compare in full") {
+		const int first[]  = {1, 2, 3};
+		const int second[] = {1, 2};
+		CHECK(values.update(1, 2, as_bytes(span(first))));
+		CHECK(values.update(1, 2, as_bytes(span(second))));
+		CHECK_FALSE(values.update(1, 2, as_bytes(span(second))));
+	}
+
+	SUBCASE("clearing forgets every value") {
+		values.clear();
+		CHECK(values.update(1, 0, bytes(scaled)));
+	}
+}
@@ -0,0 +1,280 @@
+#include "TextureStreamer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <doctest/doctest.h>
+#include <gli/gli.hpp>
+#include <limits>
+
+using namespace gl;
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	// Respecifies one level of the bound 2D texture from source, or frees it
+	// when upload is false. Mapped pages of an uploaded level are dropped, as
+	// the driver has its own copy.
+	void specify_level(const PD::texture_levels& source,
+	                   size_t                    level,
+	                   bool                      upload) {
+		const gli::gl               gl(gli::gl::PROFILE_GL33);
+		const gli::gl::format       format =
+		  gl.translate(source.format, source.swizzles);
+		const ivec2                 extent =
+		  glm::max(source.extent >> static_cast<int>(level), ivec2(1));
+		const span<const std::byte> bytes = source.levels[level];
+
+		const GLsizei width  = upload ? extent.x : 0;
+		const GLsizei height = upload ? extent.y : 0;
+		const void*   data   = upload ? bytes.data() : nullptr;
+		if(gli::is_compressed(source.format)) {
+			glCompressedTexImage2D(
+			  GL_TEXTURE_2D,
+			  static_cast<GLint>(level),
+			  static_cast<GLenum>(format.Internal),
+			  width,
+			  height,
+			  0,
+			  upload ? static_cast<GLsizei>(bytes.size()) : 0,
+			  data);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D,
+			             static_cast<GLint>(level),
+			             static_cast<GLenum>(format.Internal),
+			             width,
+			             height,
+			             0,
+			             static_cast<GLenum>(format.External),
+			             static_cast<GLenum>(format.Type),
+			             data);
+		}
+		if(upload && source.file) { source.file->discard(bytes); }
+	}
+
+	void set_base_level(size_t level) {
+		glTexParameteri(
+		  GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, static_cast<GLint>(level));
+	}
+
+} // namespace
+
+namespace PD {
+
+	size_t TextureStreamer::wanted_level(ivec2  extent,
+	                                     size_t levels,
+	                                     float  projected_radius,
+	                                     float  tiling) {
+		if(levels < 2 || projected_radius >= numeric_limits<float>::max()) {
+			return 0;
+		}
+		const float pixels = 2.0f * projected_radius;
+		if(pixels <= 0.0f) { return levels - 1; }
+
+		// Each level halves the texels across the object
+		const float texels = float(std::max(extent.x, extent.y)) * tiling;
+		if(texels <= pixels) { return 0; }
+		return std::min(static_cast<size_t>(std::log2(texels / pixels)),
+		                levels - 1);
+	}
+
+	size_t TextureStreamer::tail_level(ivec2 extent, size_t levels) {
+		size_t level = 0;
+		while(level + 1 < levels &&
+		      std::max(extent.x >> level, extent.y >> level) > TAIL_EXTENT) {
+			++level;
+		}
+		return level;
+	}
+
+	TextureStreamer::TextureStreamer(size_t budget, size_t upload_budget)
+	  : m_textures()
+	  , m_budget(budget)
+	  , m_upload_budget(upload_budget)
+	  , m_bytes(0)
+	  , m_frame(0) {}
+
+	shared_ptr<globjects::Texture>
+	TextureStreamer::add(const texture_data& data) {
+		texture_levels source = data.mapped ? *data.mapped : levels_of(data.image);
+		const size_t   levels = source.levels.size();
+		const gli::gl  gl(gli::gl::PROFILE_GL33);
+		const gli::gl::format format =
+		  gl.translate(source.format, source.swizzles);
+
+		auto texture = make_shared<globjects::Texture>(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, texture->id());
+		glTexParameteri(
+		  GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(levels - 1));
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, format.Swizzles[0]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, format.Swizzles[1]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, format.Swizzles[2]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, format.Swizzles[3]);
+
+		const size_t tail = tail_level(source.extent, levels);
+		for(size_t level = tail; level < levels; ++level) {
+			specify_level(source, level, true);
+			m_bytes += source.levels[level].size();
+		}
+		set_base_level(tail);
+
+		// A texture freed since may have left an entry at the same address
+		m_textures.insert_or_assign(
+		  texture.get(),
+		  streamed{texture, std::move(source), tail, tail, tail, m_frame});
+		return texture;
+	}
+
+	void TextureStreamer::request(const globjects::Texture& texture,
+	                              float                     projected_radius,
+	                              float                     tiling) {
+		const auto found = m_textures.find(&texture);
+		if(found == m_textures.end()) { return; }
+
+		streamed&    entry  = found->second;
+		const size_t wanted = wanted_level(entry.source.extent,
+		                                   entry.source.levels.size(),
+		                                   projected_radius,
+		                                   tiling);
+		entry.wanted         = std::min(entry.wanted, wanted);
+		entry.last_requested = m_frame;
+	}
+
+	void TextureStreamer::update() {
+		// Dropped textures took their memory with them
+		erase_if(m_textures, [this](const auto& entry) {
+			const streamed& texture = entry.second;
+			if(!texture.texture.expired()) { return false; }
+			for(size_t level = texture.resident;
+			    level < texture.source.levels.size();
+			    ++level) {
+				m_bytes -= texture.source.levels[level].size();
+			}
+			return true;
+		});
+
+		size_t uploaded = 0;
+		while(true) {
+			// The texture missing the most levels goes first
+			streamed* next = nullptr;
+			for(auto& [key, texture]: m_textures) {
+				if(texture.resident <= texture.wanted) { continue; }
+				if(!next || texture.resident - texture.wanted >
+				              next->resident - next->wanted) {
+					next = &texture;
+				}
+			}
+			if(!next) { break; }
+
+			const size_t level = next->resident - 1;
+			const size_t bytes = next->source.levels[level].size();
+			if(uploaded > 0 && uploaded + bytes > m_upload_budget) { break; }
+			if(!make_room(bytes, next, true)) {
+				// Settle for what is resident until room frees up
+				next->wanted = next->resident;
+				continue;
+			}
+
+			glBindTexture(GL_TEXTURE_2D, next->texture.lock()->id());
+			specify_level(next->source, level, true);
+			set_base_level(level);
+			next->resident = level;
+			m_bytes += bytes;
+			uploaded += bytes;
+		}
+
+		// Mip tails and a lowered budget may still leave too much resident
+		make_room(0, nullptr, false);
+
+		for(auto& [key, texture]: m_textures) {
+			// Start reading the level next frame uploads in the background
+			const texture_levels& source = texture.source;
+			if(source.file && texture.resident > texture.wanted) {
+				source.file->readAhead(source.levels[texture.resident - 1]);
+			}
+			texture.wanted = texture.tail;
+		}
+		++m_frame;
+	}
+
+	void TextureStreamer::evict(streamed& texture) {
+		const size_t level = texture.resident;
+		glBindTexture(GL_TEXTURE_2D, texture.texture.lock()->id());
+
+		// Sampling moves off the level before it goes
+		set_base_level(level + 1);
+		specify_level(texture.source, level, false);
+		texture.resident = level + 1;
+		m_bytes -= texture.source.levels[level].size();
+	}
+
+	bool TextureStreamer::make_room(size_t          bytes,
+	                                const streamed* keep,
+	                                bool            surplus_only) {
+		while(m_bytes + bytes > m_budget) {
+			// Least recently requested first, then the most detailed
+			streamed* victim = nullptr;
+			for(auto& [key, texture]: m_textures) {
+				if(&texture == keep || texture.resident >= texture.tail) { continue; }
+				if(surplus_only && texture.resident >= texture.wanted) { continue; }
+				if(!victim || texture.last_requested < victim->last_requested ||
+				   (texture.last_requested == victim->last_requested &&
+				    texture.resident < victim->resident)) {
+					victim = &texture;
+				}
+			}
+			if(!victim) { return false; }
+			evict(*victim);
+		}
+		return true;
+	}
+
+	void TextureStreamer::set_budget(size_t bytes) { m_budget = bytes; }
+
+	void TextureStreamer::set_upload_budget(size_t bytes) {
+		m_upload_budget = bytes;
+	}
+
+	size_t TextureStreamer::bytes() const { return m_bytes; }
+
+	size_t TextureStreamer::budget() const { return m_budget; }
+
+} // namespace PD
+
+TEST_CASE("streamed textures want the level matching their size on screen") {
+	using PD::TextureStreamer;
+	const ivec2  extent(1024, 1024);
+	const size_t levels = 11;
+
+	// One texel per pixel across the object's diameter needs full detail
+	CHECK(TextureStreamer::wanted_level(extent, levels, 512.0f) == 0);
+	CHECK(TextureStreamer::wanted_level(extent, levels, 2048.0f) == 0);
+
+	// Texels may not become larger than pixels, so partial levels round finer
+	CHECK(TextureStreamer::wanted_level(extent, levels, 128.0f) == 2);
+	CHECK(TextureStreamer::wanted_level(extent, levels, 100.0f) == 2);
+
+	// Tiling the texture across the object needs more of its detail
+	CHECK(TextureStreamer::wanted_level(extent, levels, 512.0f, 4.0f) == 2);
+
+	SUBCASE("objects off screen or around the camera") {
+		CHECK(TextureStreamer::wanted_level(extent, levels, 0.0f) == 10);
+		CHECK(TextureStreamer::wanted_level(extent, levels, 0.01f) == 10);
+		CHECK(TextureStreamer::wanted_level(
+		        extent, levels, numeric_limits<float>::max()) == 0);
+	}
+
+	SUBCASE("textures without mips have nothing to stream") {
+		CHECK(TextureStreamer::wanted_level(extent, 1, 1.0f) == 0);
+	}
+}
+
+TEST_CASE("mip tails hold the levels no larger than the tail extent") {
+	using PD::TextureStreamer;
+	CHECK(TextureStreamer::tail_level({1024, 1024}, 11) == 4);
+	CHECK(TextureStreamer::tail_level({2048, 64}, 12) == 5);
+	CHECK(TextureStreamer::tail_level({48, 32}, 6) == 0);
+
+	// Without the mips to get there, the whole chain is the tail
+	CHECK(TextureStreamer::tail_level({1024, 1024}, 3) == 2);
+}
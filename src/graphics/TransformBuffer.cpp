@@ -0,0 +1,145 @@
+#include "TransformBuffer.hpp"
+
+#include <cstring>
+#include <doctest/doctest.h>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <globjects/globjects.h>
+#include <stdexcept>
+
+using namespace gl;
+using namespace glm;
+using namespace std;
+
+namespace {
+
+	size_t uniform_offset_alignment() {
+		GLint alignment = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		return static_cast<size_t>(max(alignment, 1));
+	}
+
+} // namespace
+
+namespace PD {
+
+	// std140 lays out consecutive mat4s with no padding between them
+	static_assert(sizeof(TransformBuffer::object_transforms) ==
+	              3 * sizeof(mat4));
+
+	const GLuint TransformBuffer::BINDING = 1;
+
+	TransformBuffer::object_transforms
+	TransformBuffer::compute(const mat4& model, const mat4& view) {
+		const mat4 model_view = view * model;
+		return {model, model_view, inverseTranspose(model_view)};
+	}
+
+	TransformBuffer::TransformBuffer()
+	  : m_buffer(new globjects::Buffer())
+	  , m_mapped(nullptr)
+	  , m_stride(0)
+	  , m_frame(FRAMES - 1)
+	  , m_count(0) {
+		const size_t alignment = uniform_offset_alignment();
+		m_stride = (sizeof(object_transforms) + alignment - 1) / alignment *
+		           alignment;
+
+		if(!globjects::hasExtension(GLextension::GL_ARB_buffer_storage)) {
+			m_buffer->setData(static_cast<GLsizeiptr>(CAPACITY * m_stride),
+			                  nullptr,
+			                  GL_STREAM_DRAW);
+			return;
+		}
+
+		// Coherent, so writes reach the GPU without flushing
+		const auto bytes = static_cast<GLsizeiptr>(FRAMES * CAPACITY * m_stride);
+		m_buffer->setStorage(bytes,
+		                     nullptr,
+		                     GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+		                       GL_MAP_COHERENT_BIT);
+		m_mapped = static_cast<byte*>(m_buffer->mapRange(
+		  0,
+		  bytes,
+		  GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+	}
+
+	TransformBuffer::~TransformBuffer() {
+		for(const GLsync fence: m_fences) {
+			if(fence) { glDeleteSync(fence); }
+		}
+		if(m_mapped) { m_buffer->unmap(); }
+	}
+
+	void TransformBuffer::begin_frame() {
+		m_count = 0;
+		if(!m_mapped) {
+			// The driver hands out fresh storage while the GPU still reads the
+			// old one
+			m_buffer->setData(static_cast<GLsizeiptr>(CAPACITY * m_stride),
+			                  nullptr,
+			                  GL_STREAM_DRAW);
+			return;
+		}
+		m_frame = (m_frame + 1) % FRAMES;
+
+		GLsync& fence = m_fences[m_frame];
+		if(!fence) { return; }
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	void TransformBuffer::end_frame() {
+		if(!m_mapped) { return; }
+		GLsync& fence = m_fences[m_frame];
+		if(fence) { glDeleteSync(fence); }
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	size_t TransformBuffer::push(const mat4& model, const mat4& view) {
+		if(m_count == CAPACITY) {
+			throw length_error("too many objects for one transform buffer frame");
+		}
+		const auto transforms = compute(model, view);
+		if(!m_mapped) {
+			const size_t offset = m_count++ * m_stride;
+			m_buffer->setSubData(
+			  static_cast<GLintptr>(offset), sizeof(transforms), &transforms);
+			return offset;
+		}
+		const size_t offset = (m_frame * CAPACITY + m_count) * m_stride;
+		memcpy(m_mapped + offset, &transforms, sizeof(transforms));
+		++m_count;
+		return offset;
+	}
+
+	void TransformBuffer::bind(size_t offset) const {
+		m_buffer->bindRange(GL_UNIFORM_BUFFER,
+		                    BINDING,
+		                    static_cast<GLintptr>(offset),
+		                    sizeof(object_transforms));
+	}
+
+} // namespace PD
+
+TEST_CASE("object transforms are computed once for every pass") {
+	const mat4 model = scale(translate(mat4(1.0f), vec3(1.0f, 2.0f, 3.0f)),
+	                         vec3(2.0f, 1.0f, 1.0f));
+	const mat4 view =
+	  lookAt(vec3(0.0f, 0.0f, 5.0f), vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+	const auto transforms = PD::TransformBuffer::compute(model, view);
+
+	CHECK(offsetof(PD::TransformBuffer::object_transforms, model_view) == 64);
+	CHECK(offsetof(PD::TransformBuffer::object_transforms, normal) == 128);
+	CHECK(transforms.model == model);
+	CHECK(transforms.model_view == view * model);
+
+	// Normals stay perpendicular to surfaces under non-uniform scaling
+	const vec3 tangent = normalize(vec3(1.0f, -2.0f, 0.0f));
+	const vec3 normal  = normalize(vec3(2.0f, 1.0f, 0.0f));
+	const vec3 moved_tangent =
+	  vec3(transforms.model_view * vec4(tangent, 0.0f));
+	const vec3 moved_normal = vec3(transforms.normal * vec4(normal, 0.0f));
+	CHECK(abs(dot(moved_tangent, moved_normal)) < 1e-5f);
+}
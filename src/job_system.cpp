@@ -0,0 +1,206 @@
+#include "job_system.hpp"
+
+#include <doctest/doctest.h>
+#include <plog/Log.h>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+namespace PD {
+
+	namespace {
+		// Identifies the pool and queue a worker thread belongs to
+		thread_local const JobSystem* t_owner = nullptr;
+		thread_local size_t           t_index = 0;
+	} // namespace
+
+	JobSystem::JobSystem(unsigned workers)
+	  : m_queues()
+	  , m_workers()
+	  , m_queued(0)
+	  , m_sleep_mutex()
+	  , m_wake()
+	  , m_stopping(false) {
+		for(unsigned i = 0; i <= workers; ++i) {
+			m_queues.push_back(make_unique<queue>());
+		}
+		for(unsigned i = 0; i < workers; ++i) {
+			m_workers.emplace_back([this, i] { work(i); });
+		}
+	}
+
+	// Jobs still queued are run before the workers exit
+	JobSystem::~JobSystem() {
+		{
+			const scoped_lock lock(m_sleep_mutex);
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+		for(thread& worker: m_workers) { worker.join(); }
+	}
+
+	unsigned JobSystem::default_workers() {
+		// The thread that owns the pool works too, while it waits
+		return max(thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	unsigned JobSystem::worker_count() const {
+		return static_cast<unsigned>(m_workers.size());
+	}
+
+	size_t JobSystem::own_queue() const {
+		return t_owner == this ? t_index : m_queues.size() - 1;
+	}
+
+	void JobSystem::submit(job work, JobCounter* counter) {
+		if(counter) { counter->m_remaining.fetch_add(1, memory_order_relaxed); }
+		{
+			queue&            target = *m_queues[own_queue()];
+			const scoped_lock lock(target.mutex);
+			target.tasks.push_back({std::move(work), counter});
+		}
+		m_queued.fetch_add(1, memory_order_release);
+
+		// Taking the lock orders the wake-up after a worker's emptiness check
+		{ const scoped_lock lock(m_sleep_mutex); }
+		m_wake.notify_one();
+	}
+
+	bool JobSystem::try_run(size_t home) {
+		task next{nullptr, nullptr};
+		bool found = false;
+
+		// Newest own job first, for cache locality
+		{
+			queue&            own = *m_queues[home];
+			const scoped_lock lock(own.mutex);
+			if(!own.tasks.empty()) {
+				next = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				found = true;
+			}
+		}
+
+		// Otherwise steal the oldest job of another queue, starting past our own
+		// so that thieves spread over different victims
+		for(size_t i = 1; !found && i < m_queues.size(); ++i) {
+			queue&            victim = *m_queues[(home + i) % m_queues.size()];
+			const scoped_lock lock(victim.mutex);
+			if(!victim.tasks.empty()) {
+				next = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				found = true;
+			}
+		}
+
+		if(!found) { return false; }
+		m_queued.fetch_sub(1, memory_order_relaxed);
+		run(next);
+		return true;
+	}
+
+	void JobSystem::run(task& next) {
+		try {
+			next.work();
+		} catch(...) {
+			if(!next.counter) {
+				LOG(plog::error) << "unhandled exception in detached job";
+			} else if(!next.counter->m_failed.test_and_set()) {
+				next.counter->m_error = current_exception();
+			}
+		}
+		if(next.counter) {
+			next.counter->m_remaining.fetch_sub(1, memory_order_release);
+		}
+	}
+
+	void JobSystem::wait(JobCounter& counter) {
+		const size_t home = own_queue();
+		while(!counter.done()) {
+			if(!try_run(home)) { this_thread::yield(); }
+		}
+
+		if(counter.m_error) {
+			counter.m_failed.clear();
+			rethrow_exception(exchange(counter.m_error, nullptr));
+		}
+	}
+
+	void JobSystem::work(size_t index) {
+		t_owner = this;
+		t_index = index;
+
+		while(true) {
+			if(try_run(index)) { continue; }
+
+			unique_lock lock(m_sleep_mutex);
+			m_wake.wait(lock, [this] {
+				return m_stopping || m_queued.load(memory_order_acquire) > 0;
+			});
+			if(m_stopping && m_queued.load(memory_order_acquire) == 0) { return; }
+		}
+	}
+
+} // namespace PD
+
+TEST_CASE("waiting on a counter waits for every job submitted against it") {
+	PD::JobSystem  jobs(3);
+	PD::JobCounter counter;
+	atomic<int>    finished(0);
+	CHECK(counter.done());
+
+	for(int i = 0; i < 1000; ++i) {
+		jobs.submit([&] { finished.fetch_add(1); }, &counter);
+	}
+	jobs.wait(counter);
+	CHECK(counter.done());
+	CHECK(finished.load() == 1000);
+
+	SUBCASE("jobs may wait on jobs they spawned") {
+		// With a single worker, the outer job has to run the inner ones itself
+		PD::JobSystem  single(1);
+		PD::JobCounter outer;
+		atomic<int>    inner(0);
+		for(int i = 0; i < 4; ++i) {
+			single.submit(
+			  [&] {
+				  PD::JobCounter spawned;
+				  for(int j = 0; j < 8; ++j) {
+					  single.submit([&] { inner.fetch_add(1); }, &spawned);
+				  }
+				  single.wait(spawned);
+				  CHECK(spawned.done());
+			  },
+			  &outer);
+		}
+		single.wait(outer);
+		CHECK(inner.load() == 32);
+	}
+
+	SUBCASE("the first exception is rethrown once") {
+		PD::JobCounter failing;
+		for(int i = 0; i < 8; ++i) {
+			jobs.submit([] { throw runtime_error("job failed"); }, &failing);
+		}
+		jobs.submit([&] { finished.fetch_add(1); }, &failing);
+		CHECK_THROWS_AS(jobs.wait(failing), runtime_error);
+		CHECK(failing.done());
+		CHECK(finished.load() == 1001);
+
+		// The counter is clean for reuse
+		jobs.submit([] {}, &failing);
+		jobs.wait(failing);
+	}
+}
+
+TEST_CASE("parallel for visits every index once") {
+	PD::JobSystem       jobs(3);
+	vector<atomic<int>> visits(1000);
+	jobs.parallel_for(0, visits.size(), 64, [&](size_t first, size_t last) {
+		for(size_t i = first; i < last; ++i) { visits[i].fetch_add(1); }
+	});
+	CHECK(all_of(visits.begin(), visits.end(), [](const atomic<int>& count) {
+		return count.load() == 1;
+	}));
+}
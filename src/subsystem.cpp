@@ -0,0 +1,171 @@
+#include "subsystem.hpp"
+
+#include <atomic>
+#include <doctest/doctest.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace PD {
+
+	void FrameGraph::add(string name, task work, vector<string> after) {
+		for(const node& existing: m_nodes) {
+			if(existing.name == name) {
+				throw runtime_error("frame task " + name + " already exists");
+			}
+		}
+		m_nodes.push_back(
+		  {std::move(name), std::move(work), std::move(after), {}, 0});
+		m_resolved = false;
+	}
+
+	void FrameGraph::resolve() {
+		unordered_map<string, size_t> indices;
+		for(size_t i = 0; i < m_nodes.size(); ++i) {
+			m_nodes[i].successors.clear();
+			m_nodes[i].dependencies = 0;
+			indices.emplace(m_nodes[i].name, i);
+		}
+
+		for(size_t i = 0; i < m_nodes.size(); ++i) {
+			for(const string& before: m_nodes[i].after) {
+				const auto it = indices.find(before);
+				if(it == indices.end()) {
+					throw runtime_error("frame task " + m_nodes[i].name +
+					                    " runs after unknown task " + before);
+				}
+				m_nodes[it->second].successors.push_back(i);
+				++m_nodes[i].dependencies;
+			}
+		}
+
+		// Kahn's algorithm; anything left unvisited is on a cycle
+		vector<size_t> remaining(m_nodes.size());
+		vector<size_t> ready;
+		for(size_t i = 0; i < m_nodes.size(); ++i) {
+			remaining[i] = m_nodes[i].dependencies;
+			if(remaining[i] == 0) { ready.push_back(i); }
+		}
+		size_t visited = 0;
+		while(!ready.empty()) {
+			const size_t current = ready.back();
+			ready.pop_back();
+			++visited;
+			for(size_t successor: m_nodes[current].successors) {
+				if(--remaining[successor] == 0) { ready.push_back(successor); }
+			}
+		}
+		if(visited != m_nodes.size()) {
+			throw runtime_error("frame tasks have cyclic dependencies");
+		}
+
+		m_resolved = true;
+	}
+
+	void FrameGraph::run(JobSystem& jobs, double delta) {
+		if(!m_resolved) { resolve(); }
+
+		const frame_context context{delta, jobs};
+		const auto remaining = make_unique<atomic<size_t>[]>(m_nodes.size());
+		for(size_t i = 0; i < m_nodes.size(); ++i) {
+			remaining[i].store(m_nodes[i].dependencies, memory_order_relaxed);
+		}
+
+		// A finished task submits the successors it was the last dependency
+		// of. They are submitted before it completes, so the frame counter
+		// cannot drop to zero while work is still outstanding.
+		JobCounter             frame;
+		function<void(size_t)> launch;
+		launch = [&](size_t index) {
+			jobs.submit(
+			  [&, index] {
+				  m_nodes[index].work(context);
+				  for(size_t successor: m_nodes[index].successors) {
+					  if(remaining[successor].fetch_sub(1, memory_order_acq_rel) ==
+					     1) {
+						  launch(successor);
+					  }
+				  }
+			  },
+			  &frame);
+		};
+
+		for(size_t i = 0; i < m_nodes.size(); ++i) {
+			if(m_nodes[i].dependencies == 0) { launch(i); }
+		}
+		jobs.wait(frame);
+	}
+
+} // namespace PD
+
+TEST_CASE("frame tasks run after the tasks they depend on") {
+	PD::JobSystem  jobs(3);
+	PD::FrameGraph graph;
+	mutex          order_mutex;
+	vector<string> order;
+	const auto     record = [&](string name) {
+		return [&, name](const PD::frame_context&) {
+			const scoped_lock lock(order_mutex);
+			order.push_back(name);
+		};
+	};
+	const auto position = [&](const string& name) {
+		return find(order.begin(), order.end(), name) - order.begin();
+	};
+
+	// Dependencies may be named before they are added
+	graph.add("render", record("render"), {"physics", "animation"});
+	graph.add("input", record("input"));
+	graph.add("physics", record("physics"), {"input"});
+	graph.add("animation", record("animation"), {"input"});
+
+	for(int frame = 0; frame < 20; ++frame) {
+		order.clear();
+		graph.run(jobs, 1.0 / 60.0);
+		REQUIRE(order.size() == 4);
+		CHECK(position("input") == 0);
+		CHECK(position("physics") < position("render"));
+		CHECK(position("animation") < position("render"));
+	}
+
+	SUBCASE("a failed task skips the tasks after it") {
+		graph.add(
+		  "fails",
+		  [](const PD::frame_context&) { throw runtime_error("task failed"); },
+		  {"input"});
+		graph.add("present", record("present"), {"fails", "render"});
+
+		order.clear();
+		CHECK_THROWS_AS(graph.run(jobs, 0.0), runtime_error);
+		CHECK(position("render") < 4);
+		CHECK(position("present") == long(order.size()));
+	}
+}
+
+TEST_CASE("frame graphs reject cycles and unknown tasks") {
+	PD::JobSystem              jobs(1);
+	PD::FrameGraph             graph;
+	atomic<int>                runs(0);
+	const PD::FrameGraph::task count = [&](const PD::frame_context&) {
+		runs.fetch_add(1);
+	};
+
+	graph.add("a", count, {"c"});
+	graph.add("b", count, {"a"});
+	CHECK_THROWS_AS(graph.add("b", count), runtime_error);
+
+	SUBCASE("unknown tasks") {
+		CHECK_THROWS_AS(graph.run(jobs, 0.0), runtime_error);
+		CHECK(runs.load() == 0);
+	}
+
+	SUBCASE("cycles") {
+		graph.add("c", count, {"b"});
+		CHECK_THROWS_AS(graph.run(jobs, 0.0), runtime_error);
+		CHECK(runs.load() == 0);
+	}
+}
@@ -0,0 +1,109 @@
+// mdlcook rewrites PMDL files for faster rendering. Optionally a chain of
+// simplified levels of detail is generated. Triangles are then reordered for
+// the post-transform vertex cache and for overdraw, vertices are reordered for
+// fetch locality, and the result is written as a version 2 file.
+//
+// Usage: mdlcook [--quantize] [--lods N] [--v1] input.mdl [output.mdl]
+//
+// The output defaults to overwriting the input. Version 1 files have no
+// quantized format, so --quantize and --v1 exclude each other.
+
+#include "MeshOptimizer.hpp"
+#include "MeshSimplifier.hpp"
+#include "PMDL.hpp"
+
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+namespace {
+
+	// Statistics are for the finest level of detail
+	void report(const string& label, const PMDL::Body& body) {
+		const PMDL::Lod           finest = body.levels().front();
+		const auto                first  = body.indices.begin() + finest.indexOffset;
+		const vector<PMDL::Index> indices(first, first + finest.indexCount);
+
+		const PMDL::VertexCacheStatistics stats =
+		  PMDL::analyzeVertexCache(indices, body.vertices.size());
+		cout << label << ": " << indices.size() / 3 << " triangles, "
+		     << body.vertices.size() << " vertices, ACMR " << fixed
+		     << setprecision(3) << stats.acmr << ", ATVR " << stats.atvr << '\n';
+	}
+
+	void reportLods(const PMDL::Body& body) {
+		const vector<PMDL::Lod> levels = body.levels();
+		for(size_t level = 0; level < levels.size(); ++level) {
+			cout << "LOD " << level << ": " << levels[level].indexCount / 3
+			     << " triangles, error " << levels[level].error << '\n';
+		}
+	}
+
+	int usage() {
+		cerr << "usage: mdlcook [--quantize] [--lods N] [--v1] input.mdl "
+		        "[output.mdl]\n";
+		return EXIT_FAILURE;
+	}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	PMDL::VertexFormat format = PMDL::VertexFormat::Float32;
+	bool               legacy = false;
+	size_t             lods   = 0;
+	string             input;
+	string             output;
+
+	for(int i = 1; i < argc; ++i) {
+		const string argument = argv[i];
+		if(argument == "--quantize") {
+			format = PMDL::VertexFormat::Quantized;
+		} else if(argument == "--lods" && i + 1 < argc) {
+			try {
+				lods = stoul(argv[++i]);
+			} catch(const exception&) { return usage(); }
+		} else if(argument == "--v1") {
+			legacy = true;
+		} else if(input.empty()) {
+			input = argument;
+		} else if(output.empty()) {
+			output = argument;
+		} else {
+			return usage();
+		}
+	}
+	if(input.empty()) { return usage(); }
+	if(legacy && format == PMDL::VertexFormat::Quantized) {
+		cerr << "mdlcook: --quantize needs version 2 files, not --v1\n";
+		return EXIT_FAILURE;
+	}
+	if(output.empty()) { output = input; }
+
+	try {
+		PMDL::File file = PMDL::File::read(input);
+		report("before", file.body);
+
+		if(lods > 0) {
+			PMDL::generateLods(file.body, lods);
+			reportLods(file.body);
+		}
+
+		PMDL::optimize(file.body);
+		report("after ", file.body);
+
+		if(legacy) {
+			file.write(output);
+		} else {
+			file.writeMapped(output, format);
+		}
+	} catch(const exception& e) {
+		cerr << input << ": " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}